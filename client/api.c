@@ -33,6 +33,7 @@
 #include <client/remctl.h>
 #include <util/macros.h>
 #include <util/network.h>
+#include <util/protocol.h>
 
 
 /*
@@ -481,6 +482,8 @@ remctl_close(struct remctl *r)
 #endif
 
     /* Free remaining resources. */
+    internal_v2_discard(r);
+    token_buffer_free(&r->buffer);
     free(r->source);
     free(r->ccache);
     free(r->error);
@@ -500,9 +503,10 @@ remctl_close(struct remctl *r)
 
 /*
  * Internal function to reopen the connection if it was closed and verify that
- * we have an open connection, and reset the error message.  Used by
- * remctl_commandv and remctl_noop.  Returns true on success and false on
- * failure.
+ * we have an open connection, and reset the error message.  If the input of
+ * a filter command is still open, end it, since the server won't look at
+ * another command until then.  Used by remctl_commandv and remctl_noop.
+ * Returns true on success and false on failure.
  */
 static bool
 internal_reopen(struct remctl *r)
@@ -517,6 +521,8 @@ internal_reopen(struct remctl *r)
     }
     free(r->error);
     r->error = NULL;
+    if (r->filter && !internal_v2_send_input(r, NULL, 0))
+        return false;
     return true;
 }
 
@@ -560,17 +566,101 @@ remctl_command(struct remctl *r, const char **command)
 
 /*
  * Same as remctl_command, but take the command as an array of struct iovecs
- * instead.  Use this form for binary data.
+ * instead.  Use this form for binary data.  If we already know that the
+ * server supports request IDs, tag the command with one so that the server
+ * may compress its output, but don't wait to find out.
  */
 int
 remctl_commandv(struct remctl *r, const struct iovec *command, size_t count)
 {
+    bool tagged;
+
     if (!internal_reopen(r))
         return 0;
     if (r->protocol == 1)
         return internal_v1_commandv(r, command, count);
-    else
-        return internal_v2_commandv(r, command, count);
+    if (!internal_v2_capabilities(r, false))
+        return 0;
+    tagged = (r->capabilities & CAPABILITY_REQUEST_ID) != 0;
+    return internal_v2_commandv(r, command, count, tagged);
+}
+
+
+/*
+ * Send a command without waiting for the results of earlier commands.  The
+ * first time on each connection, wait for the server's reply to our
+ * capabilities to find out whether it supports request IDs.  Returns the ID
+ * of the command on success and 0 on failure.
+ */
+unsigned long
+remctl_pipeline(struct remctl *r, const struct iovec *command, size_t count)
+{
+    bool tagged;
+
+    if (!internal_reopen(r))
+        return 0;
+    if (r->protocol == 1) {
+        internal_set_error(r, "pipelining not supported");
+        return 0;
+    }
+    if (!internal_v2_capabilities(r, true))
+        return 0;
+    tagged = (r->capabilities & CAPABILITY_REQUEST_ID) != 0;
+    if (!internal_v2_commandv(r, command, count, tagged))
+        return 0;
+    return r->next_id - 1;
+}
+
+
+/*
+ * Start a filter command, whose standard input is then sent with
+ * remctl_send_input while it runs.  This requires protocol version four, so
+ * the first time on each connection, wait for the server's reply to our
+ * capabilities to find out whether it supports it.  Returns true on success,
+ * false on failure.  On failure, use remctl_error to get the error.
+ */
+int
+remctl_filter(struct remctl *r, const struct iovec *command, size_t count)
+{
+    if (!internal_reopen(r))
+        return 0;
+    if (r->protocol == 1) {
+        internal_set_error(r, "filter commands not supported");
+        return 0;
+    }
+    if (r->pending > 0) {
+        internal_set_error(r, "results of earlier commands still pending");
+        return 0;
+    }
+    if (!internal_v2_capabilities(r, true))
+        return 0;
+    if ((r->capabilities & CAPABILITY_FILTER) == 0) {
+        internal_set_error(r, "filter commands not supported by server");
+        return 0;
+    }
+    return internal_v2_filterv(r, command, count);
+}
+
+
+/*
+ * Send input to the running filter command, or end its input if length is 0.
+ * Returns true on success, false on failure.  On failure, use remctl_error to
+ * get the error.
+ */
+int
+remctl_send_input(struct remctl *r, const void *data, size_t length)
+{
+    if (r->fd == INVALID_SOCKET) {
+        internal_set_error(r, "no connection open");
+        return 0;
+    }
+    if (!r->filter) {
+        internal_set_error(r, "no filter command accepting input");
+        return 0;
+    }
+    free(r->error);
+    r->error = NULL;
+    return internal_v2_send_input(r, data, length);
 }
 
 
@@ -117,7 +117,7 @@ internal_v1_output(struct remctl *r)
     }
 
     /* Otherwise, we have to read the token from the server. */
-    status = token_recv_priv(r->fd, r->context, &flags, &token,
+    status = token_recv_priv(r->fd, &r->buffer, r->context, &flags, &token,
                              TOKEN_MAX_LENGTH, r->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         internal_token_error(r, "receiving token", status, major, minor);
@@ -22,13 +22,164 @@
 
 #include <client/internal.h>
 #include <client/remctl.h>
+#include <util/compress.h>
 #include <util/gss-tokens.h>
+#include <util/network.h>
 #include <util/protocol.h>
 
 
 /*
- * Send a command to the server using protocol v2.  Returns true on success,
- * false on failure.
+ * Receive a token from the server connection and store it in the provided
+ * buffer.  Return true on success and false on any failure.
+ */
+static bool
+internal_v2_recv_token(struct remctl *r, gss_buffer_t token)
+{
+    int status, flags;
+    OM_uint32 major, minor;
+    char *p;
+
+    status = token_recv_priv(r->fd, &r->buffer, r->context, &flags, token,
+                             TOKEN_MAX_LENGTH_FOR(r->token_max), r->timeout,
+                             &major, &minor);
+    if (status != TOKEN_OK) {
+        internal_token_error(r, "receiving token", status, major, minor);
+        if (status == TOKEN_FAIL_EOF || status == TOKEN_FAIL_TIMEOUT) {
+            gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+            socket_close(r->fd);
+            r->fd = INVALID_SOCKET;
+        }
+        return false;
+    }
+    if (flags != (TOKEN_DATA | TOKEN_PROTOCOL)) {
+        internal_set_error(r, "unexpected token from server");
+        goto fail;
+    }
+    if (token->length < 2) {
+        internal_set_error(r, "malformed result token from server");
+        goto fail;
+    }
+    p = token->value;
+    if (p[0] < 2 || p[0] > 4) {
+        internal_set_error(r, "unexpected protocol %d from server", p[0]);
+        goto fail;
+    }
+    return true;
+
+fail:
+    gss_release_buffer(&minor, token);
+    return false;
+}
+
+
+/*
+ * Add a token received from the server to the end of the queue of tokens
+ * read ahead of the caller.  On failure, frees the token and returns false.
+ */
+static bool
+internal_v2_queue(struct remctl *r, gss_buffer_t token)
+{
+    struct remctl_token *entry;
+    OM_uint32 minor;
+
+    entry = malloc(sizeof(struct remctl_token));
+    if (entry == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        gss_release_buffer(&minor, token);
+        return false;
+    }
+    entry->token = *token;
+    entry->next = NULL;
+    if (r->queue_tail == NULL)
+        r->queue = entry;
+    else
+        r->queue_tail->next = entry;
+    r->queue_tail = entry;
+    return true;
+}
+
+
+/*
+ * Read and queue every token the server has already sent, stopping as soon
+ * as reading another would mean waiting for the server.  Used while sending
+ * a command with the results of earlier commands still to come, since
+ * otherwise the server could block sending us those results while we block
+ * sending it the command.  The reply to our capabilities isn't queued but
+ * handled as soon as it arrives, since it may change the token size.
+ * Returns true on success and false on any failure.
+ */
+static bool
+internal_v2_drain(struct remctl *r)
+{
+    gss_buffer_desc token;
+
+    while (r->buffer.start < r->buffer.end || network_readable(r->fd)) {
+        if (r->capabilities_pending) {
+            if (!internal_v2_capabilities(r, true))
+                return false;
+            continue;
+        }
+        if (!internal_v2_recv_token(r, &token))
+            return false;
+        if (!internal_v2_queue(r, &token))
+            return false;
+    }
+    return true;
+}
+
+
+/*
+ * Discard any tokens that were read ahead of the caller and any compression
+ * state, for when the connection is closed or reopened.
+ */
+void
+internal_v2_discard(struct remctl *r)
+{
+    struct remctl_token *entry;
+    OM_uint32 minor;
+
+    while (r->queue != NULL) {
+        entry = r->queue;
+        r->queue = entry->next;
+        gss_release_buffer(&minor, &entry->token);
+        free(entry);
+    }
+    r->queue_tail = NULL;
+    decompressor_free(r->decompressor);
+    r->decompressor = NULL;
+    r->compression = 0;
+}
+
+
+/*
+ * Read the next token from the server, taking it from the queue of tokens
+ * read ahead if there are any, and store it in the provided buffer.  If the
+ * reply to our capabilities hasn't been read yet, it comes first.  Return
+ * true on success and false on any failure.
+ */
+static bool
+internal_v2_read_token(struct remctl *r, gss_buffer_t token)
+{
+    struct remctl_token *entry;
+
+    if (r->queue == NULL) {
+        if (!internal_v2_capabilities(r, true))
+            return false;
+        return internal_v2_recv_token(r, token);
+    }
+    entry = r->queue;
+    r->queue = entry->next;
+    if (r->queue == NULL)
+        r->queue_tail = NULL;
+    *token = entry->token;
+    free(entry);
+    return true;
+}
+
+
+/*
+ * Send a command to the server using protocol v2 with the given message type.
+ * Returns true on success, false on failure.
  *
  * All of the complexity in this function comes from implementing command
  * continuation.  The protocol specifies that commands can be continued by
@@ -36,19 +187,30 @@
  * desired, and putting the MESSAGE_COMMAND header on each piece with the
  * appropriate continue status.  We don't take full advantage of that (we
  * don't, for instance, ever split numbers across token boundaries), but we do
- * use this to handle commands where all the data is longer than
- * TOKEN_MAX_DATA.
+ * use this to handle commands where all the data is longer than the maximum
+ * token data size, which is TOKEN_MAX_DATA unless the server agreed to a
+ * larger size.
+ *
+ * If tagged is true, the command is sent using protocol version four, with
+ * the request ID of the command after the message type in every token.  If
+ * the results of earlier commands are still to come, we read whatever the
+ * server has sent before sending each token so that neither side blocks
+ * writing to the other.
  */
-bool
-internal_v2_commandv(struct remctl *r, const struct iovec *command,
-                     size_t count)
+static bool
+send_command(struct remctl *r, int type, const struct iovec *command,
+             size_t count, bool tagged)
 {
-    size_t length, iov, offset, sent, left, delta;
+    size_t length, iov, offset, sent, left, delta, header;
     gss_buffer_desc token;
+    struct iovec tokiov;
     char *p;
     OM_uint32 data, major, minor;
     int status;
 
+    /* The header is the version, type, request ID, and continue status. */
+    header = tagged ? 1 + 1 + 4 + 1 + 1 : 1 + 1 + 1 + 1;
+
     /* Determine the total length of the message. */
     length = 4;
     for (iov = 0; iov < count; iov++)
@@ -61,13 +223,13 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
      * command consists of pairs of argument length and argument data.
      *
      * If the entire message length plus the overhead for the header is less
-     * than TOKEN_MAX_DATA, we send it in one go.  Otherwise, each time
-     * through this loop, we pull off as much data as we can.  We break the
-     * tokens either in the middle of an argument or just before an argument
-     * length; we never send part of the argument length number and we always
-     * include at least one byte of the argument after the argument length.
-     * The protocol is more lenient, but those constraints make bookkeeping
-     * easier.
+     * than the maximum token data size, we send it in one go.  Otherwise,
+     * each time through this loop, we pull off as much data as we can.  We
+     * break the tokens either in the middle of an argument or just before an
+     * argument length; we never send part of the argument length number and
+     * we always include at least one byte of the argument after the argument
+     * length.  The protocol is more lenient, but those constraints make
+     * bookkeeping easier.
      *
      * iov is the index of the argument we're currently sending.  offset is
      * the amount of that argument data we've already sent.  sent holds the
@@ -77,30 +239,40 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
     offset = 0;
     sent = 0;
     while (sent < length) {
-        if (length - sent > TOKEN_MAX_DATA - 4)
-            token.length = TOKEN_MAX_DATA;
+        if (r->pending > 0 && !internal_v2_drain(r))
+            return false;
+        if (length - sent > r->token_max - header)
+            token.length = r->token_max;
         else
-            token.length = length - sent + 4;
+            token.length = length - sent + header;
         token.value = malloc(token.length);
         if (token.value == NULL) {
             internal_set_error(r, "cannot allocate memory: %s",
                                strerror(errno));
             return false;
         }
-        left = token.length - 4;
+        left = token.length - header;
 
-        /* Each token begins with the protocol version and message type. */
+        /*
+         * Each token begins with the protocol version and message type,
+         * followed for protocol version four by the request ID.
+         */
         p = token.value;
-        p[0] = 2;
-        p[1] = MESSAGE_COMMAND;
+        p[0] = tagged ? 4 : 2;
+        p[1] = type;
         p += 2;
+        if (tagged) {
+            data = htonl(r->next_id & 0xffffffffUL);
+            memcpy(p, &data, 4);
+            p += 4;
+        }
 
         /* Keep-alive flag.  Always set to true for now. */
         *p = 1;
         p++;
 
         /* Continue status. */
-        if (token.length == length - sent + 4)
+        if (token.length == length - sent + header)
             *p = (sent == 0) ? 0 : 3;
         else
             *p = (sent == 0) ? 1 : 2;
@@ -146,11 +318,16 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
             offset = 0;
         }
 
-        /* Send the result. */
+        /*
+         * Send the result.  We own the token buffer, so let it be encrypted
+         * in place rather than copied again.
+         */
         token.length -= left;
-        status = token_send_priv(r->fd, r->context,
-                                 TOKEN_DATA | TOKEN_PROTOCOL, &token,
-                                 r->timeout, &major, &minor);
+        tokiov.iov_base = token.value;
+        tokiov.iov_len = token.length;
+        status = token_sendv_priv(r->fd, r->context,
+                                  TOKEN_DATA | TOKEN_PROTOCOL, &tokiov, 1,
+                                  r->timeout, &major, &minor);
         if (status != TOKEN_OK) {
             internal_token_error(r, "sending token", status, major, minor);
             free(token.value);
@@ -158,11 +335,117 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
         }
         free(token.value);
     }
+    r->next_id++;
+    r->pending++;
     r->ready = true;
     return true;
 }
 
 
+/*
+ * Send a command to the server using protocol v2, or using protocol v4 and
+ * tagged with its request ID if tagged is true.  Returns true on success,
+ * false on failure.
+ */
+bool
+internal_v2_commandv(struct remctl *r, const struct iovec *command,
+                     size_t count, bool tagged)
+{
+    return send_command(r, MESSAGE_COMMAND, command, count, tagged);
+}
+
+
+/*
+ * Start a filter command using protocol v4, after which the client may send
+ * input to the command with internal_v2_send_input until it ends the input.
+ * Returns true on success, false on failure.
+ */
+bool
+internal_v2_filterv(struct remctl *r, const struct iovec *command,
+                    size_t count)
+{
+    if (!send_command(r, MESSAGE_COMMAND_STREAM, command, count, true))
+        return false;
+    r->filter = true;
+    return true;
+}
+
+
+/*
+ * Send input to the running filter command, split into as many
+ * MESSAGE_STREAM_DATA tokens as needed, or if length is 0, send
+ * MESSAGE_STREAM_END to end the input.  If the command has already finished,
+ * the server would only discard the input, so don't send it.  As when
+ * sending a command, read whatever the server has sent before sending each
+ * token so that neither side blocks writing to the other.  Returns true on
+ * success, false on failure.
+ */
+bool
+internal_v2_send_input(struct remctl *r, const void *data, size_t length)
+{
+    gss_buffer_desc token;
+    struct iovec tokiov;
+    size_t header, chunk;
+    OM_uint32 tmp, major, minor;
+    int status;
+    char *p;
+    bool end = (length == 0);
+
+    if (!end && !r->ready)
+        return true;
+    header = end ? 1 + 1 + 4 + 1 : 1 + 1 + 4 + 1 + 4;
+    chunk = r->token_max - header;
+    if (chunk > length)
+        chunk = length;
+    token.value = malloc(header + chunk);
+    if (token.value == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    do {
+        if (r->pending > 0 && !internal_v2_drain(r))
+            goto fail;
+        if (chunk > length)
+            chunk = length;
+
+        /* Version, type, request ID, stream, and for data, its length. */
+        p = token.value;
+        p[0] = 4;
+        p[1] = end ? MESSAGE_STREAM_END : MESSAGE_STREAM_DATA;
+        tmp = htonl((r->next_id - 1) & 0xffffffffUL);
+        memcpy(p + 2, &tmp, 4);
+        p[6] = 1;
+        if (!end) {
+            tmp = htonl(chunk);
+            memcpy(p + 7, &tmp, 4);
+            memcpy(p + header, data, chunk);
+        }
+
+        /* Send the token, which may be encrypted in place. */
+        token.length = header + chunk;
+        tokiov.iov_base = token.value;
+        tokiov.iov_len = token.length;
+        status = token_sendv_priv(r->fd, r->context,
+                                  TOKEN_DATA | TOKEN_PROTOCOL, &tokiov, 1,
+                                  r->timeout, &major, &minor);
+        if (status != TOKEN_OK) {
+            internal_token_error(r, "sending token", status, major, minor);
+            goto fail;
+        }
+        data = (const char *) data + chunk;
+        length -= chunk;
+    } while (length > 0);
+    if (end)
+        r->filter = false;
+    free(token.value);
+    return true;
+
+fail:
+    free(token.value);
+    return false;
+}
+
+
 /*
  * Send a quit command to the server using protocol v2.  Returns true on
  * success, false on failure.
@@ -188,55 +471,48 @@ internal_v2_quit(struct remctl *r)
 
 
 /*
- * Read a token from the server connection and store it in the provided
- * buffer.  Return true on success and false on any failure.
+ * Read a string from a server token, with its length starting at the given
+ * offset, and store it in newly allocated memory in the remctl struct.
+ * Returns true on success and false on any failure (also setting the error).
  */
 static bool
-internal_v2_read_token(struct remctl *r, gss_buffer_t token)
+internal_v2_read_string(struct remctl *r, gss_buffer_t token, size_t offset)
 {
-    int status, flags;
-    OM_uint32 major, minor;
-    char *p;
+    size_t size;
+    OM_uint32 data;
+    const char *p;
 
-    status = token_recv_priv(r->fd, r->context, &flags, token,
-                             TOKEN_MAX_LENGTH, r->timeout, &major, &minor);
-    if (status != TOKEN_OK) {
-        internal_token_error(r, "receiving token", status, major, minor);
-        if (status == TOKEN_FAIL_EOF || status == TOKEN_FAIL_TIMEOUT) {
-            gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
-            socket_close(r->fd);
-            r->fd = INVALID_SOCKET;
-        }
-        return false;
-    }
-    if (flags != (TOKEN_DATA | TOKEN_PROTOCOL)) {
-        internal_set_error(r, "unexpected token from server");
-        goto fail;
-    }
-    if (token->length < 2) {
+    p = (const char *) token->value + offset;
+    memcpy(&data, p, 4);
+    p += 4;
+    size = ntohl(data);
+    if (size != token->length - (p - (char *) token->value)) {
         internal_set_error(r, "malformed result token from server");
-        goto fail;
+        return false;
     }
-    p = token->value;
-    if (p[0] != 2 && p[0] != 3) {
-        internal_set_error(r, "unexpected protocol %d from server", p[0]);
-        goto fail;
+    r->output->data = malloc(size);
+    if (r->output->data == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return false;
     }
+    memcpy(r->output->data, p, size);
+    r->output->length = size;
     return true;
-
-fail:
-    gss_release_buffer(&minor, token);
-    return false;
 }
 
 
 /*
- * Read a string from a server token, with its length starting at the given
- * offset, and store it in newly allocated memory in the remctl struct.
- * Returns true on success and false on any failure (also setting the error).
+ * Read compressed output from a server token, with its length starting at
+ * the given offset, and store the decompressed output in newly allocated
+ * memory in the remctl struct.  The server never compresses more output at
+ * once than would fit in a token uncompressed, so reject anything that
+ * decompresses to more than that.  The output may be empty if this token
+ * doesn't complete a block of compressed data.  Returns true on success and
+ * false on any failure (also setting the error).
  */
 static bool
-internal_v2_read_string(struct remctl *r, gss_buffer_t token, size_t offset)
+internal_v2_read_compressed(struct remctl *r, gss_buffer_t token,
+                            size_t offset)
 {
     size_t size;
     OM_uint32 data;
@@ -250,13 +526,11 @@ internal_v2_read_string(struct remctl *r, gss_buffer_t token, size_t offset)
         internal_set_error(r, "malformed result token from server");
         return false;
     }
-    r->output->data = malloc(size);
-    if (r->output->data == NULL) {
-        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+    if (!decompressor_run(r->decompressor, p, size, r->token_max,
+                          &r->output->data, &r->output->length)) {
+        internal_set_error(r, "invalid compressed output from server");
         return false;
     }
-    memcpy(r->output->data, p, size);
-    r->output->length = size;
     return true;
 }
 
@@ -267,12 +541,24 @@ internal_v2_read_string(struct remctl *r, gss_buffer_t token, size_t offset)
  * the server was a REMCTL_OUT_STATUS or REMCTL_OUT_ERROR, we'll return
  * REMCTL_OUT_DONE from that point forward.  Returns a remctl output struct on
  * success and NULL on failure.
+ *
+ * If several commands were sent without waiting for their results, their
+ * results follow one another, and we return REMCTL_OUT_DONE only after the
+ * last of them.  Results of protocol version four commands are tagged with
+ * the request ID of the command, which must be the oldest command whose
+ * results haven't been returned, since the server runs commands in order.
+ *
+ * Compressed output is decompressed and returned like any other output.  The
+ * output of each command is compressed separately, so the decompressor is
+ * reset after the status or error that ends it.
  */
 struct remctl_output *
 internal_v2_output(struct remctl *r)
 {
     gss_buffer_desc token = GSS_C_EMPTY_BUFFER;
     OM_uint32 data, minor;
+    unsigned long id;
+    size_t header;
     char *p;
     int type;
 
@@ -297,46 +583,101 @@ internal_v2_output(struct remctl *r)
     if (!internal_v2_read_token(r, &token))
         return NULL;
 
-    /* Now, what we do depends on the message type. */
+    /* Check the request ID of a protocol version four token. */
     p = token.value;
+    id = r->next_id - r->pending;
+    header = 2;
+    if (p[0] == 4) {
+        if (token.length < 2 + 4) {
+            internal_set_error(r, "malformed result token from server");
+            goto fail;
+        }
+        memcpy(&data, p + 2, 4);
+        if (ntohl(data) != (id & 0xffffffffUL)) {
+            internal_set_error(r, "unexpected request ID %lu from server",
+                               (unsigned long) ntohl(data));
+            goto fail;
+        }
+        header += 4;
+    }
+    r->output->id = id;
+
+    /* Now, what we do depends on the message type. */
     type = p[1];
+    p += header;
     switch (type) {
     case MESSAGE_OUTPUT:
-        if (token.length < 2 + 5) {
+        if (token.length < header + 5) {
+            internal_set_error(r, "malformed result token from server");
+            goto fail;
+        }
+        r->output->type = REMCTL_OUT_OUTPUT;
+        if (p[0] != 1 && p[0] != 2) {
+            internal_set_error(r, "unexpected stream %d from server", p[0]);
+            goto fail;
+        }
+        r->output->stream = p[0];
+        if (!internal_v2_read_string(r, &token, header + 1))
+            goto fail;
+        break;
+
+    case MESSAGE_OUTPUT_COMPRESSED:
+        if (r->decompressor == NULL || header != 2 + 4) {
+            internal_set_error(r, "unexpected compressed output from server");
+            goto fail;
+        }
+        if (token.length < header + 5) {
             internal_set_error(r, "malformed result token from server");
             goto fail;
         }
         r->output->type = REMCTL_OUT_OUTPUT;
-        if (p[2] != 1 && p[2] != 2) {
+        if (p[0] != 1 && p[0] != 2) {
             internal_set_error(r, "unexpected stream %d from server", p[0]);
             goto fail;
         }
-        r->output->stream = p[2];
-        if (!internal_v2_read_string(r, &token, 3))
+        r->output->stream = p[0];
+        if (!internal_v2_read_compressed(r, &token, header + 1))
             goto fail;
+
+        /*
+         * If this token didn't complete any output, there's nothing to
+         * return yet, so move on to the next token.
+         */
+        if (r->output->length == 0) {
+            gss_release_buffer(&minor, &token);
+            return internal_v2_output(r);
+        }
         break;
 
     case MESSAGE_STATUS:
-        if (token.length != 2 + 1) {
+        if (token.length != header + 1) {
             internal_set_error(r, "malformed result token from server");
             goto fail;
         }
         r->output->type = REMCTL_OUT_STATUS;
-        r->output->status = p[2];
-        r->ready = 0;
+        r->output->status = p[0];
+        if (r->decompressor != NULL)
+            decompressor_reset(r->decompressor);
+        if (r->pending > 0)
+            r->pending--;
+        r->ready = (r->pending > 0);
         break;
 
     case MESSAGE_ERROR:
-        if (token.length < 2 + 8) {
+        if (token.length < header + 8) {
             internal_set_error(r, "malformed result token from server");
             goto fail;
         }
         r->output->type = REMCTL_OUT_ERROR;
-        memcpy(&data, p + 2, 4);
+        memcpy(&data, p, 4);
         r->output->error = ntohl(data);
-        if (!internal_v2_read_string(r, &token, 6))
+        if (!internal_v2_read_string(r, &token, header + 4))
             goto fail;
-        r->ready = 0;
+        if (r->decompressor != NULL)
+            decompressor_reset(r->decompressor);
+        if (r->pending > 0)
+            r->pending--;
+        r->ready = (r->pending > 0);
         break;
 
     default:
@@ -355,32 +696,60 @@ fail:
 
 
 /*
- * Send a NOOP command to the server using protocol v3 and read the response.
- * Returns true on success, false on failure.
+ * Send a NOOP command to the server using protocol v3 and read the response,
+ * which is stored in the provided buffer.  The reply to our capabilities and
+ * the results of any earlier commands still to come arrive first, and the
+ * results are queued.  Returns true on success, false on failure.
  */
-bool
-internal_noop(struct remctl *r)
+static bool
+internal_v2_noop(struct remctl *r, gss_buffer_t token)
 {
-    gss_buffer_desc token;
-    char buffer[2] = { 3, MESSAGE_NOOP };
+    char buffer[1 + 1];
     OM_uint32 major, minor;
-    int status;
-    char *p;
+    int status, type;
 
     /* Send the NOOP token. */
-    token.length = 1 + 1;
-    token.value = buffer;
+    buffer[0] = 3;
+    buffer[1] = MESSAGE_NOOP;
+    token->length = 1 + 1;
+    token->value = buffer;
     status = token_send_priv(r->fd, r->context, TOKEN_DATA | TOKEN_PROTOCOL,
-                             &token, r->timeout, &major, &minor);
+                             token, r->timeout, &major, &minor);
     if (status != TOKEN_OK) {
         internal_token_error(r, "sending NOOP token", status, major, minor);
         return false;
     }
 
-    /* Read the resulting NOOP token. */
-    token.length = 0;
-    token.value = GSS_C_NO_BUFFER;
-    if (!internal_v2_read_token(r, &token))
+    /*
+     * Read the response.  The results of earlier commands still to come
+     * arrive first, so queue those for internal_v2_output.
+     */
+    if (!internal_v2_capabilities(r, true))
+        return false;
+    while (internal_v2_recv_token(r, token)) {
+        type = ((char *) token->value)[1];
+        if (r->pending == 0 || type == MESSAGE_NOOP || type == MESSAGE_VERSION)
+            return true;
+        if (!internal_v2_queue(r, token))
+            return false;
+    }
+    return false;
+}
+
+
+/*
+ * Send a NOOP command to the server using protocol v3 and read the response.
+ * Returns true on success, false on failure.
+ */
+bool
+internal_noop(struct remctl *r)
+{
+    gss_buffer_desc token;
+    OM_uint32 minor;
+    char *p;
+
+    /* Send the NOOP token and read the response. */
+    if (!internal_v2_noop(r, &token))
         return false;
     p = token.value;
     if (p[1] != MESSAGE_NOOP) {
@@ -393,3 +762,108 @@ internal_noop(struct remctl *r)
     /* Everything looks good. */
     return true;
 }
+
+
+/*
+ * Send the optional features we support, the largest token data size we can
+ * handle, and the compression methods we can decompress to the server using
+ * protocol version four.  This is sent as soon as the context is established
+ * without waiting for the reply, which arrives before anything else from the
+ * server and is read by internal_v2_capabilities, so it costs no extra round
+ * trip.  Returns true on success, false on failure.
+ */
+bool
+internal_v2_send_capabilities(struct remctl *r)
+{
+    gss_buffer_desc token;
+    char buffer[1 + 1 + 4 + 4 + 1];
+    OM_uint32 data, major, minor;
+    int status;
+
+    buffer[0] = 4;
+    buffer[1] = MESSAGE_CAPABILITIES;
+    data = htonl(CAPABILITIES_ALL);
+    memcpy(buffer + 2, &data, 4);
+    data = htonl(TOKEN_MAX_DATA_LARGE);
+    memcpy(buffer + 6, &data, 4);
+    buffer[10] = COMPRESS_METHODS;
+    token.length = 1 + 1 + 4 + 4 + 1;
+    token.value = buffer;
+    status = token_send_priv(r->fd, r->context, TOKEN_DATA | TOKEN_PROTOCOL,
+                             &token, r->timeout, &major, &minor);
+    if (status != TOKEN_OK) {
+        internal_token_error(r, "sending capabilities token", status, major,
+                             minor);
+        return false;
+    }
+    r->capabilities_pending = true;
+    return true;
+}
+
+
+/*
+ * Read the server's reply to the capabilities we sent when opening the
+ * connection, if we haven't already, and store the optional features, token
+ * data size, and compression method the server agreed to in the remctl
+ * struct.  A server that doesn't support protocol version four replies with
+ * MESSAGE_VERSION instead, in which case we use none of them.  If wait is
+ * false, only read the reply if it has already arrived.  Returns true on
+ * success, false on failure.
+ */
+bool
+internal_v2_capabilities(struct remctl *r, bool wait)
+{
+    gss_buffer_desc token;
+    OM_uint32 data, minor;
+    unsigned long features, size;
+    int method;
+    char *p;
+    bool okay = false;
+
+    if (!r->capabilities_pending)
+        return true;
+    if (!wait && r->buffer.start == r->buffer.end && !network_readable(r->fd))
+        return true;
+    if (!internal_v2_recv_token(r, &token))
+        return false;
+    r->capabilities_pending = false;
+    p = token.value;
+    if (p[1] == MESSAGE_CAPABILITIES && token.length == 1 + 1 + 4 + 4 + 1) {
+        memcpy(&data, p + 2, 4);
+        features = ntohl(data);
+        memcpy(&data, p + 6, 4);
+        size = ntohl(data);
+        method = p[10];
+        if ((features & ~CAPABILITIES_ALL) != 0)
+            internal_set_error(r, "invalid capabilities 0x%lx from server",
+                               features);
+        else if (size < TOKEN_MAX_DATA || size > TOKEN_MAX_DATA_LARGE)
+            internal_set_error(r, "invalid token size %lu from server", size);
+        else if ((method & ~COMPRESS_METHODS) != 0)
+            internal_set_error(r, "invalid compression method %d from server",
+                               method);
+        else {
+            r->capabilities = features;
+            r->token_max = size;
+            okay = true;
+        }
+        if (okay && method != 0) {
+            r->decompressor = decompressor_new();
+            if (r->decompressor == NULL) {
+                internal_set_error(r, "cannot allocate memory: %s",
+                                   strerror(errno));
+                okay = false;
+            } else
+                r->compression = method;
+        }
+    } else if (p[1] == MESSAGE_CAPABILITIES)
+        internal_set_error(r, "malformed capabilities token from server");
+    else if (p[1] == MESSAGE_VERSION && token.length == 1 + 1 + 1)
+        okay = true;
+    else if (p[1] == MESSAGE_VERSION)
+        internal_set_error(r, "malformed version token from server");
+    else
+        internal_set_error(r, "unexpected message type %d from server", p[1]);
+    gss_release_buffer(&minor, &token);
+    return okay;
+}
@@ -22,9 +22,17 @@
 #include <portable/stdbool.h>
 #include <sys/types.h>
 
+#include <util/tokens.h>
+
 /* Forward declaration to avoid unnecessary includes. */
 struct iovec;
 
+/* A token read from the server before the caller asked for it. */
+struct remctl_token {
+    gss_buffer_desc token;
+    struct remctl_token *next;
+};
+
 /* Private structure that holds the details of an open remctl connection. */
 struct remctl {
     const char *host;           /* From remctl_open, stored here because */
@@ -35,11 +43,22 @@ struct remctl {
     time_t timeout;
     char *ccache;               /* Path to client ticket cache. */
     socket_type fd;
+    struct token_buffer buffer; /* Data read from fd but not yet used. */
     gss_ctx_id_t context;
     char *error;
     struct remctl_output *output;
     int status;
     bool ready;                 /* If true, we are expecting server output. */
+    bool capabilities_pending;  /* If true, server reply not yet read. */
+    unsigned long capabilities; /* Optional features agreed on. */
+    unsigned long next_id;      /* ID of the next command sent. */
+    unsigned long pending;      /* Commands whose results are still to come. */
+    size_t token_max;           /* Negotiated maximum token data size. */
+    int compression;            /* Negotiated compression method, if any. */
+    struct decompressor *decompressor;
+    bool filter;                /* If true, a filter command takes input. */
+    struct remctl_token *queue; /* Tokens read ahead while sending. */
+    struct remctl_token *queue_tail;
 
     /* Used to hold state for remctl_set_ccache. */
 #ifdef HAVE_KRB5
@@ -80,9 +99,29 @@ bool internal_v1_commandv(struct remctl *, const struct iovec *command,
 /* Read a protocol v1 response. */
 struct remctl_output *internal_v1_output(struct remctl *);
 
-/* Send a protocol v2 command. */
+/*
+ * Send a protocol v2 command, or a protocol v4 command tagged with its
+ * request ID if tagged is true.
+ */
 bool internal_v2_commandv(struct remctl *, const struct iovec *command,
-                          size_t count);
+                          size_t count, bool tagged);
+
+/* Start a protocol v4 filter command. */
+bool internal_v2_filterv(struct remctl *, const struct iovec *command,
+                         size_t count);
+
+/* Send input to a filter command, or end its input if length is 0. */
+bool internal_v2_send_input(struct remctl *, const void *data, size_t length);
+
+/*
+ * Send the optional features we support to the server, and read its reply,
+ * waiting for it if wait is true.
+ */
+bool internal_v2_send_capabilities(struct remctl *);
+bool internal_v2_capabilities(struct remctl *, bool wait);
+
+/* Discard any tokens read ahead from the server. */
+void internal_v2_discard(struct remctl *);
 
 /* Send a protocol v3 NOOP command. */
 bool internal_noop(struct remctl *);
@@ -190,6 +190,16 @@ internal_open(struct remctl *r, const char *host, const char *principal)
     static const OM_uint32 req_gss_flags
         = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
 
+    /* Discard anything buffered from a previous connection. */
+    token_buffer_reset(&r->buffer);
+    internal_v2_discard(r);
+    r->capabilities_pending = false;
+    r->capabilities = 0;
+    r->next_id = 1;
+    r->pending = 0;
+    r->filter = false;
+    r->token_max = TOKEN_MAX_DATA;
+
     /* Import the name. */
     if (!internal_import_name(r, host, principal, &name))
         goto fail;
@@ -264,8 +274,8 @@ internal_open(struct remctl *r, const char *host, const char *principal)
 
         /* If we're still expecting more, retrieve it. */
         if (major == GSS_S_CONTINUE_NEEDED) {
-            status = token_recv(r->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                                r->timeout);
+            status = token_recv(r->fd, &r->buffer, &flags, &recv_tok,
+                                TOKEN_MAX_LENGTH, r->timeout);
             if (status != TOKEN_OK) {
                 internal_token_error(r, "receiving token", status, major,
                                      minor);
@@ -295,6 +305,18 @@ internal_open(struct remctl *r, const char *host, const char *principal)
     gss_release_name(&minor, &name);
     if (gss_cred != GSS_C_NO_CREDENTIAL)
         gss_release_cred(&minor, &gss_cred);
+
+    /*
+     * Tell the server which optional features we support.  We don't wait for
+     * the reply, which is read along with whatever the server sends next, so
+     * this doesn't delay the first command.
+     */
+    if (r->protocol > 1 && !internal_v2_send_capabilities(r)) {
+        gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+        socket_close(r->fd);
+        r->fd = INVALID_SOCKET;
+        return false;
+    }
     return true;
 
 fail:
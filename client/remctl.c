@@ -17,8 +17,10 @@
 #include <portable/system.h>
 #include <portable/getopt.h>
 #include <portable/socket.h>
+#include <portable/uio.h>
 
 #include <ctype.h>
+#include <errno.h>
 
 #include <client/remctl.h>
 #include <util/messages.h>
@@ -32,6 +34,7 @@ Options:\n\
     -b <source>   Source IP used for outgoing connections\n\
     -d            Debugging level of output\n\
     -h            Display this help\n\
+    -i            Send standard input to the command as it runs\n\
     -p <port>     remctld port (default: 4373 falling back to 4444)\n\
     -s <service>  remctld service principal (default: host/<host>)\n\
     -v            Display the version of remctl\n";
@@ -108,6 +111,46 @@ process_response(struct remctl *r, int *errorcode)
 }
 
 
+/*
+ * Run the command as a filter, sending our standard input to it as we read
+ * it, and then end its input.  Output the server sends in the meantime is
+ * kept by the library for process_response.  Returns true on success and
+ * false on failure.
+ */
+static bool
+send_filter(struct remctl *r, char **command)
+{
+    struct iovec *vector;
+    size_t count, i;
+    char *buffer;
+    ssize_t status;
+    bool okay;
+
+    for (count = 0; command[count] != NULL; count++)
+        ;
+    vector = xcalloc(count, sizeof(struct iovec));
+    for (i = 0; i < count; i++) {
+        vector[i].iov_base = command[i];
+        vector[i].iov_len = strlen(command[i]);
+    }
+    okay = remctl_filter(r, vector, count);
+    free(vector);
+    if (!okay)
+        return false;
+    buffer = xmalloc(BUFSIZ * 8);
+    do {
+        status = read(STDIN_FILENO, buffer, BUFSIZ * 8);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0)
+            sysdie("cannot read standard input");
+        okay = remctl_send_input(r, buffer, status);
+    } while (okay && status > 0);
+    free(buffer);
+    return okay;
+}
+
+
 /*
  * Main routine.  Parse the arguments, open the remctl connection, send the
  * command, and then call process_response.
@@ -123,6 +166,7 @@ main(int argc, char *argv[])
     unsigned short port = 0;
     struct remctl *r;
     int errorcode = 0;
+    bool filter = false;
 
     /* Set up logging and identity. */
     message_program_name = "remctl";
@@ -136,7 +180,7 @@ main(int argc, char *argv[])
      * Non-GNU getopt will treat the + as a supported option, which is handled
      * below.
      */
-    while ((option = getopt(argc, argv, "+b:dhp:s:v")) != EOF) {
+    while ((option = getopt(argc, argv, "+b:dhip:s:v")) != EOF) {
         switch (option) {
         case 'b':
             source = optarg;
@@ -147,6 +191,9 @@ main(int argc, char *argv[])
         case 'h':
             usage(0);
             break;
+        case 'i':
+            filter = true;
+            break;
         case 'p':
             port = atoi(optarg);
             break;
@@ -221,7 +268,10 @@ main(int argc, char *argv[])
         die("%s", remctl_error(r));
 
     /* Do the work. */
-    if (!remctl_command(r, (const char **) argv))
+    if (filter) {
+        if (!send_filter(r, argv))
+            die("%s", remctl_error(r));
+    } else if (!remctl_command(r, (const char **) argv))
         die("%s", remctl_error(r));
     if (!process_response(r, &errorcode))
         die("%s", remctl_error(r));
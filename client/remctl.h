@@ -97,6 +97,7 @@ struct remctl_output {
     int stream;                 /* 1 == stdout, 2 == stderr */
     int status;                 /* Exit status of remote command. */
     int error;                  /* Remote error code. */
+    unsigned long id;           /* ID of the command from remctl_pipeline. */
 };
 
 /* Opaque struct representing an open remctl connection. */
@@ -209,6 +210,42 @@ int remctl_commandv(struct remctl *, const struct iovec *, size_t count);
  */
 int remctl_noop(struct remctl *);
 
+/*
+ * Send a command without waiting for the results of the commands sent before
+ * it, so that many commands can be in flight on one connection at once.  The
+ * results of each command are then returned by remctl_output in the order in
+ * which the commands were sent, with the id field of the remctl_output
+ * struct set to the ID returned by this function.  REMCTL_OUT_DONE is
+ * returned only after the results of the last command.  Returns the ID of
+ * the command on success and 0 on failure.  On failure, use remctl_error to
+ * get the error.
+ *
+ * Servers that support protocol version 4 tag each result with the ID of its
+ * command.  With older servers, the commands are still sent without waiting,
+ * but the results aren't tagged by the server.
+ */
+unsigned long remctl_pipeline(struct remctl *, const struct iovec *,
+                              size_t count);
+
+/*
+ * Start a command that runs as a filter, taking its standard input from the
+ * client while it runs.  All of the arguments are passed to the command as
+ * arguments.  Send its input with remctl_send_input, calling it with a length
+ * of 0 to signal the end of the input, and retrieve its output with
+ * remctl_output as usual, before or after the end of the input.  Returns
+ * true on success and false on failure.  On failure, use remctl_error to get
+ * the error.  Requires a server that supports protocol version 4.
+ */
+int remctl_filter(struct remctl *, const struct iovec *, size_t count);
+
+/*
+ * Send data to the standard input of the running filter command, or end its
+ * input if length is 0.  Output that the server sends in the meantime is
+ * kept for remctl_output.  Returns true on success and false on failure.  On
+ * failure, use remctl_error to get the error.
+ */
+int remctl_send_input(struct remctl *, const void *data, size_t length);
+
 /*
  * Retrieve output from the remote server.  Each call to this function on the
  * same connection invalidates the previous returned remctl_output struct, so
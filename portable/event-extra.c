@@ -83,6 +83,28 @@ evbuffer_drain_fixed(struct evbuffer *ev, size_t length)
 #endif /* evbuffer_drain without return code */
 
 
+#ifndef HAVE_EVBUFFER_PEEK
+/*
+ * Return pointers to the data in an evbuffer without copying it.  Old
+ * versions of libevent store all the data in one contiguous block, so we
+ * only ever need one iovec.  Returns the number of iovecs needed.
+ */
+int
+evbuffer_peek(struct evbuffer *buf, ssize_t len UNUSED,
+              struct evbuffer_ptr *start_at UNUSED,
+              struct evbuffer_iovec *vec_out, int n_vec)
+{
+    if (EVBUFFER_LENGTH(buf) == 0)
+        return 0;
+    if (n_vec > 0) {
+        vec_out[0].iov_base = EVBUFFER_DATA(buf);
+        vec_out[0].iov_len = EVBUFFER_LENGTH(buf);
+    }
+    return 1;
+}
+#endif /* !HAVE_EVBUFFER_PEEK */
+
+
 #ifndef HAVE_EVENT_NEW
 /*
  * Allocate a new event struct and initialize it.  This uses the form that
@@ -109,6 +109,21 @@ struct bufferevent *bufferevent_socket_new(struct event_base *,
 # define evbuffer_get_length(buf) EVBUFFER_LENGTH(buf)
 #endif
 
+/*
+ * Introduced in 2.0.2-alpha.  The replacement ignores len and start_at and
+ * always returns the whole buffer, which older versions of libevent keep in
+ * one contiguous block of memory.
+ */
+#ifndef HAVE_EVBUFFER_PEEK
+struct evbuffer_ptr;
+struct evbuffer_iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+int evbuffer_peek(struct evbuffer *, ssize_t len, struct evbuffer_ptr *,
+                  struct evbuffer_iovec *, int n_vec);
+#endif
+
 /* Introduced in 2.0.1-alpha. */
 #ifndef HAVE_EVENT_FREE
 # define event_free(event) free(event)
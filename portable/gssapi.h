@@ -32,6 +32,9 @@
 #ifdef HAVE_GSSAPI_GSSAPI_KRB5_H
 # include <gssapi/gssapi_krb5.h>
 #endif
+#ifdef HAVE_GSSAPI_GSSAPI_EXT_H
+# include <gssapi/gssapi_ext.h>
+#endif
 
 /* Handle compatibility to older versions of MIT Kerberos. */
 #ifndef HAVE_GSS_RFC_OIDS
@@ -20,8 +20,10 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include <server/internal.h>
+#include <util/compress.h>
 #include <util/fdflag.h>
 #include <util/macros.h>
 #include <util/messages.h>
@@ -29,51 +31,248 @@
 #include <util/xmalloc.h>
 
 
+/* The most summary programs that will be run at the same time. */
+#define SUMMARY_MAX_PARALLEL 8
+
+/* The default number of seconds to cache summary output. */
+#define SUMMARY_TTL_DEFAULT 60
+
+/* The output and wait status of a summary program. */
+struct summary_output {
+    char *data;                 /* Output, in the form for the protocol. */
+    size_t length;              /* Length of data. */
+    int status;                 /* Wait status of the program. */
+};
+
 /*
- * Given a configuration rule, a command, and a subcommand, return true if
- * that command and subcommand match that configuration rule and false
- * otherwise.  Handles the ALL and NULL special cases.
- *
- * Empty commands are not yet supported by the rest of the code, but this
- * function copes in case that changes later.
+ * Cached output of a summary program, keyed by the program, the summary
+ * argument, the user it runs as, and whether the output is in the form used
+ * by protocol version one (both streams combined) or later versions.  The
+ * program also sees the identity and address of the client in its
+ * environment and may return different output for each, so those are part
+ * of the key as well.
+ */
+struct summary_entry {
+    char *program;
+    char *summary;
+    char *user;
+    char *remuser;
+    char *address;
+    char *hostname;
+    bool v1;
+    struct summary_output output;
+    time_t fetched;             /* When the output was generated. */
+    struct summary_entry *next;
+};
+
+/* The summary output cache and how long entries are valid, in seconds. */
+static struct summary_entry *summaries = NULL;
+static time_t summary_ttl = SUMMARY_TTL_DEFAULT;
+
+
+/*
+ * Check whether the client's user may run the command for a rule,
+ * remembering the decision for the rest of the connection.  The user can't
+ * change during a connection, so the decision only has to be made again if
+ * the configuration is reloaded or a compiled ACL file changes.  Failed
+ * checks aren't remembered, so that they're retried and their errors
+ * reported again on the next command.
  */
 static bool
-line_matches(struct rule *rule, const char *command, const char *subcommand)
+acl_permit(struct client *client, const struct config *config,
+           const struct rule *rule)
 {
-    bool okay = false;
-
-    if (strcmp(rule->command, "ALL") == 0)
-        okay = true;
-    if (command != NULL && strcmp(rule->command, command) == 0)
-        okay = true;
-    if (command == NULL && strcmp(rule->command, "EMPTY") == 0)
-        okay = true;
-    if (okay) {
-        if (strcmp(rule->subcommand, "ALL") == 0)
-            return true;
-        if (subcommand != NULL && strcmp(rule->subcommand, subcommand) == 0)
-            return true;
-        if (subcommand == NULL && strcmp(rule->subcommand, "EMPTY") == 0)
-            return true;
+    enum acl_decision *decision;
+    unsigned long epoch = server_config_acl_epoch();
+
+    if (client->acl_decisions == NULL
+        || client->acl_generation != config->generation
+        || client->acl_epoch != epoch) {
+        free(client->acl_decisions);
+        client->acl_decisions
+            = xcalloc(config->count, sizeof(enum acl_decision));
+        client->acl_generation = config->generation;
+        client->acl_epoch = epoch;
     }
-    return false;
+    decision = &client->acl_decisions[rule->index];
+    if (*decision == ACL_UNDECIDED)
+        *decision = server_config_acl_decide(rule, client->user);
+    return (*decision == ACL_PERMIT);
 }
 
 
 /*
- * Look up the matching configuration rule for a command and subcommand.
- * Takes the configuration, a command, and a subcommand to match against
- * Returns the matching config line or NULL if none match.
+ * Compare two strings, either of which may be NULL.
  */
-static struct rule *
-find_config_line(struct config *config, char *command, char *subcommand)
+static bool
+summary_string_equal(const char *a, const char *b)
 {
-    size_t i;
+    if (a == NULL || b == NULL)
+        return (a == NULL && b == NULL);
+    return (strcmp(a, b) == 0);
+}
+
+
+/*
+ * Check whether a cache entry holds the summary output for a rule, as run
+ * for the given client, in the form used by the protocol of that client.
+ */
+static bool
+summary_matches(const struct summary_entry *entry,
+                const struct client *client, const struct rule *rule)
+{
+    if (entry->v1 != (client->protocol == 1))
+        return false;
+    if (strcmp(entry->program, rule->program) != 0)
+        return false;
+    if (strcmp(entry->summary, rule->summary) != 0)
+        return false;
+    if (!summary_string_equal(entry->user, rule->user))
+        return false;
+    if (strcmp(entry->remuser, client->user) != 0)
+        return false;
+    if (strcmp(entry->address, client->ipaddress) != 0)
+        return false;
+    return summary_string_equal(entry->hostname, client->hostname);
+}
+
+
+/*
+ * Free a summary cache entry.
+ */
+static void
+summary_entry_free(struct summary_entry *entry)
+{
+    free(entry->program);
+    free(entry->summary);
+    free(entry->user);
+    free(entry->remuser);
+    free(entry->address);
+    free(entry->hostname);
+    free(entry->output.data);
+    free(entry);
+}
+
+
+/*
+ * Look up cached summary output for a rule run for a client.  If there is any
+ * and it hasn't expired, store a copy of it in result and return true.
+ * Otherwise, return false.
+ */
+static bool
+summary_cache_get(const struct client *client, const struct rule *rule,
+                  struct summary_output *result)
+{
+    struct summary_entry *entry;
+
+    if (summary_ttl <= 0)
+        return false;
+    for (entry = summaries; entry != NULL; entry = entry->next)
+        if (summary_matches(entry, client, rule))
+            break;
+    if (entry == NULL || server_now() - entry->fetched >= summary_ttl)
+        return false;
+    result->length = entry->output.length;
+    result->status = 0;
+    if (result->length > 0) {
+        result->data = xmalloc(result->length);
+        memcpy(result->data, entry->output.data, result->length);
+    }
+    return true;
+}
 
-    for (i = 0; i < config->count; i++)
-        if (line_matches(config->rules[i], command, subcommand))
-            return config->rules[i];
-    return NULL;
+
+/*
+ * Cache the summary output for a rule run for a client, replacing any
+ * existing entry for it and dropping any other expired entries.  Output from
+ * summary programs that failed isn't cached so that they're run again for
+ * the next request.
+ */
+static void
+summary_cache_put(const struct client *client, const struct rule *rule,
+                  const struct summary_output *result)
+{
+    struct summary_entry *entry, **prev;
+    time_t now;
+
+    if (summary_ttl <= 0 || result->status != 0)
+        return;
+    now = server_now();
+    prev = &summaries;
+    while (*prev != NULL) {
+        entry = *prev;
+        if (summary_matches(entry, client, rule)
+            || now - entry->fetched >= summary_ttl) {
+            *prev = entry->next;
+            summary_entry_free(entry);
+        } else
+            prev = &entry->next;
+    }
+    entry = xcalloc(1, sizeof(struct summary_entry));
+    entry->program = xstrdup(rule->program);
+    entry->summary = xstrdup(rule->summary);
+    if (rule->user != NULL)
+        entry->user = xstrdup(rule->user);
+    entry->remuser = xstrdup(client->user);
+    entry->address = xstrdup(client->ipaddress);
+    if (client->hostname != NULL)
+        entry->hostname = xstrdup(client->hostname);
+    entry->v1 = (client->protocol == 1);
+    entry->output.length = result->length;
+    if (result->length > 0) {
+        entry->output.data = xmalloc(result->length);
+        memcpy(entry->output.data, result->data, result->length);
+    }
+    entry->fetched = now;
+    entry->next = summaries;
+    summaries = entry;
+}
+
+
+/*
+ * Set up a process to run the summary program for a rule, capturing its
+ * output.  The real program name is used as the first argument in argv,
+ * followed by the summary command.  The caller is responsible for freeing
+ * process->argv.
+ */
+static void
+summary_process_init(struct process *process, struct client *client,
+                     struct rule *rule)
+{
+    char *program;
+
+    memset(process, 0, sizeof(*process));
+    process->client = client;
+    program = strrchr(rule->program, '/');
+    if (program == NULL)
+        program = rule->program;
+    else
+        program++;
+    process->argv = xcalloc(3, sizeof(char *));
+    process->argv[0] = program;
+    process->argv[1] = rule->summary;
+    process->argv[2] = NULL;
+    process->command = rule->summary;
+    process->rule = rule;
+    process->capture = true;
+}
+
+
+/*
+ * Move the output and exit status of a summary process into a result.
+ */
+static void
+summary_take_output(struct process *process, struct summary_output *result)
+{
+    result->status = process->status;
+    if (process->output == NULL)
+        return;
+    result->length = evbuffer_get_length(process->output);
+    if (result->length == 0)
+        return;
+    result->data = xmalloc(result->length);
+    if (evbuffer_remove(process->output, result->data, result->length) < 0)
+        die("internal error: cannot read data from output buffer");
 }
 
 
@@ -83,95 +282,122 @@ find_config_line(struct config *config, char *command, char *subcommand)
  * provide a summary setup that the user can access, then running that
  * line's command with the given summary sub-command.
  *
+ * The summary programs are run concurrently, up to SUMMARY_MAX_PARALLEL at a
+ * time, and their output is collected and then sent in the order of the
+ * configuration.  Successful output is cached, since summaries are normally
+ * static text.
+ *
  * Takes a client object, the user requesting access, and the list of all
  * valid configurations.
  */
 static void
 server_send_summary(struct client *client, struct config *config)
 {
-    char *path = NULL;
-    char *program;
-    struct rule *rule = NULL;
-    size_t i;
-    char **req_argv = NULL;
-    bool ok_any = false;
+    struct rule *rule;
+    struct rule **rules;
+    struct summary_output *results;
+    struct process *processes = NULL;
+    size_t i, j, count, pending, batch;
+    size_t *waiting = NULL;
+    bool v1 = (client->protocol == 1);
+    bool okay = true;
     int status_all = 0;
-    struct process process;
     struct evbuffer *output = NULL;
 
-    /* Create a buffer to hold all the output for protocol version one. */
-    if (client->protocol == 1) {
-        output = evbuffer_new();
-        if (output == NULL)
-            die("internal error: cannot create output buffer");
-    }
-
     /*
      * Check each line in the config to find any that are "<command> ALL"
      * lines, the user is authorized to run, and which have a summary field
      * given.
      */
+    rules = xcalloc(config->count, sizeof(struct rule *));
+    count = 0;
     for (i = 0; i < config->count; i++) {
-        memset(&process, 0, sizeof(process));
-        process.client = client;
         rule = config->rules[i];
         if (strcmp(rule->subcommand, "ALL") != 0)
             continue;
-        if (!server_config_acl_permit(rule, client->user))
-            continue;
         if (rule->summary == NULL)
             continue;
-        ok_any = true;
-
-        /*
-         * Get the real program name, and use it as the first argument in
-         * argv passed to the command.  Then add the summary command to the
-         * argv and pass off to be executed.
-         */
-        path = rule->program;
-        req_argv = xcalloc(3, sizeof(char *));
-        program = strrchr(path, '/');
-        if (program == NULL)
-            program = path;
-        else
-            program++;
-        req_argv[0] = program;
-        req_argv[1] = rule->summary;
-        req_argv[2] = NULL;
-        process.command = rule->summary;
-        process.argv = req_argv;
-        process.rule = rule;
-        if (server_process_run(&process)) {
-            if (client->protocol == 1)
-                if (evbuffer_add_buffer(output, process.output) < 0)
-                    die("internal error: cannot copy data from output buffer");
-            if (process.status != 0)
-                status_all = process.status;
-        }
-        free(req_argv);
+        if (!acl_permit(client, config, rule))
+            continue;
+        rules[count++] = rule;
+    }
+    if (count == 0) {
+        notice("summary request from user %s, but no defined summaries",
+               client->user);
+        server_send_error(client, ERROR_UNKNOWN_COMMAND, "Unknown command");
+        free(rules);
+        return;
     }
 
+    /* Use cached output where we can and collect the rest to run. */
+    results = xcalloc(count, sizeof(struct summary_output));
+    waiting = xcalloc(count, sizeof(size_t));
+    pending = 0;
+    for (i = 0; i < count; i++)
+        if (!summary_cache_get(client, rules[i], &results[i]))
+            waiting[pending++] = i;
+
+    /* Run the remaining summary programs, a batch at a time. */
+    if (pending > 0)
+        processes = xcalloc(SUMMARY_MAX_PARALLEL, sizeof(struct process));
+    for (i = 0; okay && i < pending; i += batch) {
+        batch = pending - i;
+        if (batch > SUMMARY_MAX_PARALLEL)
+            batch = SUMMARY_MAX_PARALLEL;
+        for (j = 0; j < batch; j++)
+            summary_process_init(&processes[j], client,
+                                 rules[waiting[i + j]]);
+        okay = server_process_run_all(processes, batch);
+        for (j = 0; j < batch; j++) {
+            if (okay) {
+                summary_take_output(&processes[j], &results[waiting[i + j]]);
+                summary_cache_put(client, rules[waiting[i + j]],
+                                  &results[waiting[i + j]]);
+            }
+            free(processes[j].argv);
+            server_process_reset(&processes[j]);
+        }
+    }
     /*
-     * Sets the last process status to 0 if all succeeded, or the last failed
-     * exit status if any commands gave non-zero.  Return that we had output
-     * successfully if any command gave it.
+     * If running any of the programs failed, an error has already been sent
+     * to the client.  Otherwise, send the output in the order of the
+     * configuration, followed by the last non-zero exit status, or 0 if all
+     * of the programs succeeded.
      */
-    if (WIFEXITED(status_all))
-        status_all = (int) WEXITSTATUS(process.status);
-    else
-        status_all = -1;
-    if (ok_any) {
-        if (client->protocol == 1)
-            server_v1_send_output(client, output, status_all);
+    if (okay) {
+        if (v1) {
+            output = evbuffer_new();
+            if (output == NULL)
+                die("internal error: cannot create output buffer");
+        }
+        for (i = 0; okay && i < count; i++) {
+            if (results[i].status != 0)
+                status_all = results[i].status;
+            if (v1) {
+                if (evbuffer_add(output, results[i].data, results[i].length)
+                    < 0)
+                    die("internal error: cannot copy data to output buffer");
+            } else
+                okay = server_process_send_captured(client, results[i].data,
+                                                    results[i].length);
+        }
+        if (WIFEXITED(status_all))
+            status_all = (int) WEXITSTATUS(status_all);
         else
+            status_all = -1;
+        if (v1)
+            server_v1_send_output(client, output, status_all);
+        else if (okay)
             server_v2_send_status(client, status_all);
-    } else {
-        notice("summary request from user %s, but no defined summaries",
-               client->user);
-        server_send_error(client, ERROR_UNKNOWN_COMMAND, "Unknown command");
     }
+    for (i = 0; i < count; i++)
+        free(results[i].data);
     if (output != NULL)
         evbuffer_free(output);
+    free(processes);
+    free(results);
+    free(waiting);
+    free(rules);
 }
 
 
@@ -183,6 +409,10 @@ server_send_summary(struct client *client, struct config *config)
  * Takes the command and optional sub-command to run, the config line for this
  * command, the process, and the existing argv from remctl client.  Returns
  * a newly-allocated argv array that the caller is responsible for freeing.
+ *
+ * A filter command gets its standard input from the client as the command
+ * runs, so all of its arguments are passed in argv and it starts with no
+ * input.
  */
 static char **
 create_argv_command(struct rule *rule, struct process *process,
@@ -208,7 +438,12 @@ create_argv_command(struct rule *rule, struct process *process,
     else
         program++;
     req_argv[0] = xstrdup(program);
-    if (rule->stdin_arg == -1)
+    if (process->client->filter) {
+        stdin_arg = 0;
+        process->input = evbuffer_new();
+        if (process->input == NULL)
+            die("internal error: cannot create input buffer");
+    } else if (rule->stdin_arg == -1)
         stdin_arg = count - 1;
     else
         stdin_arg = (size_t) rule->stdin_arg;
@@ -305,6 +540,7 @@ server_run_command(struct client *client, struct config *config,
     bool help = false;
     const char *user = client->user;
     struct process process;
+    long slot = -1;
 
     /* Start with an empty process. */
     memset(&process, 0, sizeof(process));
@@ -343,7 +579,7 @@ server_run_command(struct client *client, struct config *config,
      * specific help command was listed, check for that in the configuration
      * instead.
      */
-    rule = find_config_line(config, command, subcommand);
+    rule = server_config_find(config, command, subcommand);
     if (rule == NULL && strcmp(command, "help") == 0) {
 
         /* Error if we have more than a command and possible subcommand. */
@@ -362,16 +598,16 @@ server_run_command(struct client *client, struct config *config,
             if (argv[2] != NULL)
                 helpsubcommand = xstrndup(argv[2]->iov_base,
                                           argv[2]->iov_len);
-            rule = find_config_line(config, subcommand, helpsubcommand);
+            rule = server_config_find(config, subcommand, helpsubcommand);
         }
     }
 
     /*
      * Arguments may only contain nuls if they're the argument being passed on
-     * standard input.
+     * standard input, which filter commands don't have.
      */
     for (i = 1; argv[i] != NULL; i++) {
-        if (rule != NULL) {
+        if (rule != NULL && !client->filter) {
             if (help == false && (long) i == rule->stdin_arg)
                 continue;
             if (argv[i + 1] == NULL && rule->stdin_arg == -1)
@@ -400,7 +636,7 @@ server_run_command(struct client *client, struct config *config,
         server_send_error(client, ERROR_UNKNOWN_COMMAND, "Unknown command");
         goto done;
     }
-    if (!server_config_acl_permit(rule, user)) {
+    if (!acl_permit(client, config, rule)) {
         notice("access denied: user %s, command %s%s%s", user, command,
                (subcommand == NULL) ? "" : " ",
                (subcommand == NULL) ? "" : subcommand);
@@ -425,12 +661,51 @@ server_run_command(struct client *client, struct config *config,
         }
     }
 
+    /*
+     * Wait for our turn if the rule or the user is limited in how many
+     * commands may run at once.
+     */
+    if (!server_limit_acquire(rule, user, &slot)) {
+        notice("too many commands running: user %s, command %s%s%s", user,
+               command, (subcommand == NULL) ? "" : " ",
+               (subcommand == NULL) ? "" : subcommand);
+        server_send_error(client, ERROR_TOOMANY_RUNNING,
+                          "Too many commands running");
+        goto done;
+    }
+
     /* Assemble the argv for the command we're about to run. */
     if (help)
         req_argv = create_argv_help(rule->program, subcommand, helpsubcommand);
     else
         req_argv = create_argv_command(rule, &process, argv);
 
+    /*
+     * A FastCGI backend takes all of its input in the request, so for a
+     * filter command, collect all of the input from the client first.
+     */
+    if (client->filter && rule->fastcgi != NULL && process.input != NULL)
+        while (client->streaming) {
+            if (!server_v2_read_input(client, process.input))
+                goto done;
+            if (evbuffer_get_length(process.input) > COMMAND_MAX_DATA) {
+                warn("input for command %s exceeds %lu", command,
+                     COMMAND_MAX_DATA);
+                server_send_error(client, ERROR_TOOMUCH_DATA,
+                                  "Too much data");
+                goto done;
+            }
+        }
+
+    /*
+     * Compress the output if the rule asks for it and the client agreed to
+     * a compression method, which requires protocol version four.  If we
+     * can't create a compressor, just send the output uncompressed.
+     */
+    if (!help && rule->compress > 0 && client->compression != 0
+        && client->tagged)
+        process.compressor = compressor_new(rule->compress);
+
     /* Now actually execute the program. */
     process.command = command;
     process.argv = req_argv;
@@ -448,6 +723,7 @@ server_run_command(struct client *client, struct config *config,
     }
 
  done:
+    server_limit_release(slot);
     free(command);
     free(subcommand);
     free(helpsubcommand);
@@ -460,6 +736,7 @@ server_run_command(struct client *client, struct config *config,
         evbuffer_free(process.input);
     if (process.output != NULL)
         evbuffer_free(process.output);
+    compressor_free(process.compressor);
 }
 
 
@@ -479,3 +756,14 @@ server_free_command(struct iovec **command)
     }
     free(command);
 }
+
+
+/*
+ * Set how long summary output is cached, in seconds.  A value of 0 disables
+ * caching.
+ */
+void
+server_set_summary_ttl(time_t ttl)
+{
+    summary_ttl = ttl;
+}
@@ -32,8 +32,10 @@
 # include <regex.h>
 #endif
 #include <sys/stat.h>
+#include <time.h>
 
 #include <server/internal.h>
+#include <util/compress.h>
 #include <util/macros.h>
 #include <util/messages.h>
 #ifdef HAVE_KRB5
@@ -61,6 +63,12 @@ static char *acl_gput_file = NULL;
                                       ? 256 \
                                       : sysconf(_SC_LOGIN_NAME_MAX)
 
+/* Initial value for hashes computed with hash_string. */
+#define HASH_INIT 2166136261U
+
+/* Default number of seconds to cache information for localgroup ACLs. */
+#define LOCALGROUP_TTL_DEFAULT 60
+
 /* Return codes for configuration and ACL parsing. */
 enum config_status {
     CONFIG_SUCCESS = 0,
@@ -76,6 +84,17 @@ struct config_option {
                                 size_t lineno);
 };
 
+/*
+ * State passed through handle_include while reading configuration files.
+ * When reloading, old is the previous configuration and reused records which
+ * of its rules have been moved into the new configuration.
+ */
+struct conf_parse {
+    struct config *config;
+    struct config *old;
+    bool *reused;
+};
+
 /* Holds information about ACL schemes */
 struct acl_scheme {
     const char *name;
@@ -83,6 +102,134 @@ struct acl_scheme {
                                 const char *file, int lineno);
 };
 
+/* The types of entries in a compiled ACL file. */
+enum acl_entry_type {
+    ACL_ENTRY_ALLOW,            /* Set of principals to allow. */
+    ACL_ENTRY_DENY,             /* Set of principals to deny. */
+    ACL_ENTRY_CHECK,            /* Entry to pass to acl_check. */
+    ACL_ENTRY_ERROR             /* Parse error that ends the file. */
+};
+
+/* A set of principals, stored as an open addressing hash table. */
+struct acl_set {
+    char **slots;
+    size_t size;
+    size_t count;
+};
+
+/* An entry in a compiled ACL file. */
+struct acl_entry {
+    enum acl_entry_type type;
+    int lineno;                 /* Line number of the (first) entry. */
+    int def_index;              /* Default scheme for ACL_ENTRY_CHECK. */
+    char *data;                 /* ACL entry or parse error message. */
+    struct acl_set set;         /* Principals for ALLOW and DENY. */
+};
+
+/*
+ * An ACL file compiled into a list of entries, along with the information
+ * from stat used to tell whether the file has changed since it was read.
+ */
+struct acl_file {
+    char *path;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    struct acl_entry *entries;
+    size_t count;
+    unsigned int refs;          /* Checks currently using this file. */
+    bool stale;                 /* Removed from the cache, free when unused. */
+    struct acl_file *next;      /* Next file in the same hash bucket. */
+};
+
+/* The cache of compiled ACL files, a chained hash table keyed by path. */
+struct acl_cache {
+    struct acl_file **buckets;
+    size_t size;
+    size_t count;
+};
+static struct acl_cache acl_cache = { NULL, 0, 0 };
+
+/*
+ * Incremented whenever a compiled ACL file in the cache is replaced or
+ * dropped, so that remembered ACL decisions can tell that they may be stale.
+ */
+static unsigned long acl_epoch = 0;
+
+/*
+ * A compiled regular expression for the pcre or regex ACL schemes.  If the
+ * expression failed to compile, error holds the message to report.
+ */
+struct acl_pattern {
+    char *pattern;
+    bool is_pcre;               /* Whether this is a PCRE expression. */
+    char *error;
+#ifdef HAVE_PCRE
+    pcre *pcre_regex;
+    pcre_extra *pcre_extra;
+#endif
+#ifdef HAVE_REGCOMP
+    regex_t regex;
+#endif
+    struct acl_pattern *next;   /* Next pattern in the same hash bucket. */
+};
+
+/*
+ * The compiled regular expressions, a chained hash table keyed by scheme and
+ * expression, so that each expression is compiled only once no matter how
+ * many rules and ACL files use it.
+ */
+struct acl_patterns {
+    struct acl_pattern **buckets;
+    size_t size;
+    size_t count;
+};
+#if defined(HAVE_PCRE) || defined(HAVE_REGCOMP)
+static struct acl_patterns acl_patterns = { NULL, 0, 0 };
+#endif
+
+/*
+ * Cached membership of a local group for the localgroup ACL scheme, looked
+ * up at the time given by fetched.  Groups that don't exist are cached too,
+ * with found set to false.
+ */
+struct localgroup {
+    char *name;
+    bool found;
+    gid_t gid;
+    struct acl_set members;
+    time_t fetched;
+    struct localgroup *next;
+};
+
+/*
+ * The cached local user corresponding to the most recently checked
+ * principal, for the localgroup ACL scheme.  A process handles one principal
+ * per connection, so this avoids converting the principal and looking up the
+ * user again for each localgroup ACL checked for that connection.
+ */
+struct localuser {
+    char *principal;
+    char *localname;            /* NULL if there is no local equivalent. */
+    bool found;                 /* Whether localname is in the passwd file. */
+    gid_t gid;                  /* Primary group of localname. */
+    time_t fetched;
+};
+
+#if defined(HAVE_KRB5) && defined(HAVE_GETGRNAM_R)
+static struct localgroup *localgroups = NULL;
+static struct localuser localuser = { NULL, NULL, false, 0, 0 };
+static time_t localgroup_ttl = LOCALGROUP_TTL_DEFAULT;
+#endif
+
+/* The compiled snapshot to try before parsing the configuration, if any. */
+static const char *config_snapshot = NULL;
+
+/* The generation of the most recently loaded configuration. */
+static unsigned long config_generation = 0;
+
 /*
  * The following must match the indexes of these schemes in schemes[].
  * They're used to implement default ACL schemes in particular contexts.
@@ -94,6 +241,7 @@ struct acl_scheme {
 static enum config_status acl_check(const char *user, const char *entry,
                                     int def_index, const char *file,
                                     int lineno);
+static void acl_preload_entry(const char *entry, int def_index);
 
 /*
  * Check a filename for acceptable characters.  Returns true if the file
@@ -194,8 +342,9 @@ handle_include(const char *included, const char *file, int lineno,
 
 /*
  * Check whether a given string is an option setting.  An option setting must
- * start with a letter and consists of one or more alphanumerics or hyphen (-)
- * followed by an equal sign (=) and at least one additional character.
+ * start with a letter and consists of one or more alphanumerics, hyphens (-),
+ * or underscores (_) followed by an equal sign (=) and at least one
+ * additional character.
  */
 static bool
 is_option(const char *option)
@@ -207,7 +356,7 @@ is_option(const char *option)
     for (p = option; *p != '\0'; p++) {
         if (*p == '=' && p > option && p[1] != '\0')
             return true;
-        if (!isalnum((unsigned int) *p) && *p != '-')
+        if (!isalnum((unsigned int) *p) && *p != '-' && *p != '_')
             return false;
     }
     return false;
@@ -284,6 +433,63 @@ option_stdin(struct rule *rule, char *value, const char *name, size_t lineno)
 }
 
 
+/*
+ * Parse the compress configuration option.  Verifies that the value is a
+ * compression level between 1 and COMPRESS_MAX_LEVEL, stores it in the
+ * configuration rule struct, and returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.  The option is accepted even if remctld was built
+ * without compression support, in which case it has no effect.
+ */
+static enum config_status
+option_compress(struct rule *rule, char *value, const char *name,
+                size_t lineno)
+{
+    if (!convert_number(value, &rule->compress)
+        || rule->compress > COMPRESS_MAX_LEVEL) {
+        warn("%s:%lu: invalid compress value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the max_concurrent configuration option.  Verifies that the value is
+ * a positive number, stores it in the configuration rule struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_max_concurrent(struct rule *rule, char *value, const char *name,
+                      size_t lineno)
+{
+    if (!convert_number(value, &rule->max_concurrent)) {
+        warn("%s:%lu: invalid max_concurrent value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the timeout configuration option.  Verifies that the value is a
+ * positive number of seconds, stores it in the configuration rule struct, and
+ * returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_timeout(struct rule *rule, char *value, const char *name,
+               size_t lineno)
+{
+    if (!convert_number(value, &rule->timeout)) {
+        warn("%s:%lu: invalid timeout value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * Parse the user configuration option.  Verifies that the value is either a
  * UID or a username, stores the user in the configuration rule struct, and
@@ -313,6 +519,26 @@ option_user(struct rule *rule, char *value, const char *name, size_t lineno)
 }
 
 
+/*
+ * Parse the fastcgi configuration option.  Verifies that the value is an
+ * absolute path and stores it in the configuration rule struct as the UNIX
+ * domain socket of the backend.  Returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.
+ */
+static enum config_status
+option_fastcgi(struct rule *rule, char *value, const char *name,
+               size_t lineno)
+{
+    if (value[0] != '/') {
+        warn("%s:%lu: invalid fastcgi value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    rule->fastcgi = value;
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * Parse the summary configuration option.  Stores the summary option in the
  * configuration rule struct.  Returns CONFIG_SUCCESS on success and
@@ -345,12 +571,16 @@ option_help(struct rule *rule, char *value, const char *name UNUSED,
  * The table relating configuration option names to functions.
  */
 static const struct config_option options[] = {
-    { "help",    option_help    },
-    { "logmask", option_logmask },
-    { "stdin",   option_stdin   },
-    { "summary", option_summary },
-    { "user",    option_user    },
-    { NULL,      NULL           }
+    { "compress",       option_compress       },
+    { "fastcgi",        option_fastcgi        },
+    { "help",           option_help           },
+    { "logmask",        option_logmask        },
+    { "max_concurrent", option_max_concurrent },
+    { "stdin",          option_stdin          },
+    { "summary",        option_summary        },
+    { "timeout",        option_timeout        },
+    { "user",           option_user           },
+    { NULL,             NULL                  }
 };
 
 
@@ -388,17 +618,102 @@ parse_conf_option(struct rule *rule, char *option, const char *name,
 }
 
 
+/*
+ * Make sure there's space in the config struct for the given number of
+ * additional rules.
+ */
+static void
+rules_reserve(struct config *config, size_t count)
+{
+    size_t n;
+
+    if (config->allocated - config->count >= count)
+        return;
+    n = (config->allocated < 4) ? 4 : config->allocated * 2;
+    while (n - config->count < count)
+        n *= 2;
+    config->rules = xreallocarray(config->rules, n, sizeof(struct rule *));
+    config->allocated = n;
+}
+
+
+/*
+ * Return whether the results of stat for a file or directory match those
+ * recorded for a configuration source.
+ */
+static bool
+source_matches(const struct config_source *source, const struct stat *st)
+{
+    return (st->st_dev == source->device && st->st_ino == source->inode
+            && st->st_size == source->size && st->st_mtime == source->mtime
+            && ST_MTIME_NSEC(*st) == source->mtime_nsec);
+}
+
+
+/*
+ * When reloading, reuse the rules from a configuration file that hasn't
+ * changed since the previous configuration was loaded instead of parsing it
+ * again.  This is only done for files that don't include anything, since an
+ * included file may have changed even if the file including it hasn't, and
+ * only once for each file, since the rules can only be moved once.  Takes
+ * the parse state, the file name, and the results of stat for the file.
+ * Returns true if the rules were reused.
+ */
+static bool
+reuse_rules(struct conf_parse *parse, const char *name, const struct stat *st)
+{
+    struct config *config = parse->config;
+    const struct config *old = parse->old;
+    const struct config_source *source = NULL;
+    struct config_source *added;
+    struct rule *rule;
+    size_t i;
+
+    if (old == NULL)
+        return false;
+    for (i = 0; i < old->nsources; i++)
+        if (strcmp(old->sources[i].path, name) == 0) {
+            source = &old->sources[i];
+            break;
+        }
+    if (source == NULL || source->includes || !source_matches(source, st))
+        return false;
+    if (source->first > old->count
+        || source->count > old->count - source->first)
+        return false;
+    for (i = source->first; i < source->first + source->count; i++)
+        if (parse->reused[i] || strcmp(old->rules[i]->file, name) != 0)
+            return false;
+
+    /* Move the rules into the new configuration. */
+    server_config_add_source(config, name, st);
+    added = &config->sources[config->nsources - 1];
+    added->first = config->count;
+    added->count = source->count;
+    rules_reserve(config, source->count);
+    for (i = source->first; i < source->first + source->count; i++) {
+        rule = old->rules[i];
+        rule->index = config->count;
+        config->rules[config->count] = rule;
+        config->count++;
+        parse->reused[i] = true;
+    }
+    return true;
+}
+
+
 /*
  * Reads the configuration file and parses every line, populating a data
  * structure that will be traversed on each request to translate a command
  * into an executable path and ACL file.
  *
- * config is populated with the parsed configuration file.  Empty lines and
- * lines beginning with # are ignored.  Each line is divided into fields,
- * separated by spaces.  The fields are defined by struct rule.  Lines
- * ending in backslash are continued on the next line.  config is passed in as
- * a void * so that read_conf_file and acl_check_file can use common include
- * handling code.
+ * The config in the parse state is populated with the parsed configuration
+ * file.  Empty lines and lines beginning with # are ignored.  Each line is
+ * divided into fields, separated by spaces.  The fields are defined by struct
+ * rule.  Lines ending in backslash are continued on the next line.  The parse
+ * state is passed in as a void * so that read_conf_file and acl_check_file
+ * can use common include handling code.  When reloading, the rules of an
+ * unchanged file are taken from the previous configuration instead.
  *
  * As a special case, include <file> will call read_conf_file recursively to
  * parse an included file (or, if <file> is a directory, every file in that
@@ -410,15 +725,18 @@ parse_conf_option(struct rule *rule, char *option, const char *name,
 static enum config_status
 read_conf_file(void *data, const char *name)
 {
-    struct config *config = data;
+    struct conf_parse *parse = data;
+    struct config *config = parse->config;
     FILE *file;
     char *buffer, *p, *option;
-    size_t bufsize, length, count, i, arg_i;
+    size_t bufsize, length, count, i, arg_i, first;
+    size_t source = SIZE_MAX;
     enum config_status s;
     struct vector *line = NULL;
     struct rule *rule = NULL;
     size_t lineno = 0;
     DIR *dir = NULL;
+    struct stat st;
 
     bufsize = 1024;
     buffer = xmalloc(bufsize);
@@ -428,6 +746,16 @@ read_conf_file(void *data, const char *name)
         syswarn("cannot open config file %s", name);
         return CONFIG_ERROR;
     }
+    if (fstat(fileno(file), &st) == 0) {
+        if (reuse_rules(parse, name, &st)) {
+            free(buffer);
+            fclose(file);
+            return CONFIG_SUCCESS;
+        }
+        server_config_add_source(config, name, &st);
+        source = config->nsources - 1;
+    }
+    first = config->count;
     while (fgets(buffer, bufsize, file) != NULL) {
         length = strlen(buffer);
         if (length == 2 && buffer[length - 1] != '\n') {
@@ -482,8 +810,12 @@ read_conf_file(void *data, const char *name)
          */
         line = vector_split_space(buffer, NULL);
         if (line->count == 2 && strcmp(line->strings[0], "include") == 0) {
+            if (source != SIZE_MAX)
+                config->sources[source].includes = true;
+            if (stat(line->strings[1], &st) == 0 && S_ISDIR(st.st_mode))
+                server_config_add_source(config, line->strings[1], &st);
             s = handle_include(line->strings[1], name, lineno, read_conf_file,
-                               config);
+                               parse);
             if (s < -1)
                 goto fail;
             vector_free(line);
@@ -498,14 +830,7 @@ read_conf_file(void *data, const char *name)
          * Okay, we have a regular configuration line.  Make sure there's
          * space for it in the config struct and stuff the vector into place.
          */
-        if (config->count == config->allocated) {
-            size_t size, n;
-
-            n = (config->allocated < 4) ? 4 : config->allocated * 2;
-            size = sizeof(struct rule *);
-            config->rules = xreallocarray(config->rules, n, size);
-            config->allocated = n;
-        }
+        rules_reserve(config, 1);
         rule = xcalloc(1, sizeof(struct rule));
         rule->line       = line;
         rule->command    = line->strings[0];
@@ -543,13 +868,18 @@ read_conf_file(void *data, const char *name)
         rule->acls[i] = NULL;
 
         /* Success.  Put the configuration line in place. */
+        rule->index = config->count;
         config->rules[config->count] = rule;
         config->count++;
         rule = NULL;
         line = NULL;
     }
 
-    /* Free allocated memory and return success. */
+    /* Record the rules from this file, free allocated memory, and return. */
+    if (source != SIZE_MAX) {
+        config->sources[source].first = first;
+        config->sources[source].count = config->count - first;
+    }
     free(buffer);
     fclose(file);
     return 0;
@@ -570,42 +900,195 @@ fail:
 
 
 /*
- * Check to see if a principal is authorized by a given ACL file.
- *
- * This function is used to handle included ACL files and only does a simple
- * check to prevent infinite recursion, so be careful.  The first argument is
- * the user to check, which is passed in as a void * so that acl_check_file
- * and read_conf_file can share common include-handling code.
- *
- * Returns the result of the first check that returns a result other than
- * CONFIG_NOMATCH, or CONFIG_NOMATCH if no check returns some other value.
- * Also returns CONFIG_ERROR on some sort of failure (such as failure to read
- * a file or a syntax error).
+ * Hash a string with FNV-1a, continuing from the given hash value.  Start
+ * with HASH_INIT for a new hash.
  */
-static enum config_status
-acl_check_file_internal(void *data, const char *aclfile)
+static uint32_t
+hash_string(uint32_t hash, const char *string)
 {
-    const char *user = data;
-    FILE *file = NULL;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *) string; *p != '\0'; p++)
+        hash = (hash ^ *p) * 16777619U;
+    return hash;
+}
+
+
+/*
+ * Add a principal to a set of principals, growing the set if needed.  The
+ * set is an open addressing hash table whose size is always a power of two
+ * and at least twice the number of principals in it.  Takes ownership of the
+ * principal.
+ */
+static void
+acl_set_add(struct acl_set *set, char *principal)
+{
+    char **old = set->slots;
+    size_t old_size = set->size;
+    size_t i, slot;
+
+    if ((set->count + 1) * 2 > set->size) {
+        set->size = (set->size == 0) ? 16 : set->size * 2;
+        set->slots = xcalloc(set->size, sizeof(char *));
+        set->count = 0;
+        for (i = 0; i < old_size; i++)
+            if (old[i] != NULL)
+                acl_set_add(set, old[i]);
+        free(old);
+    }
+    slot = hash_string(HASH_INIT, principal) & (set->size - 1);
+    while (set->slots[slot] != NULL) {
+        if (strcmp(set->slots[slot], principal) == 0) {
+            free(principal);
+            return;
+        }
+        slot = (slot + 1) & (set->size - 1);
+    }
+    set->slots[slot] = principal;
+    set->count++;
+}
+
+
+/*
+ * Return true if the principal is in the set and false otherwise.
+ */
+static bool
+acl_set_contains(const struct acl_set *set, const char *principal)
+{
+    size_t slot;
+
+    if (set->size == 0)
+        return false;
+    slot = hash_string(HASH_INIT, principal) & (set->size - 1);
+    while (set->slots[slot] != NULL) {
+        if (strcmp(set->slots[slot], principal) == 0)
+            return true;
+        slot = (slot + 1) & (set->size - 1);
+    }
+    return false;
+}
+
+
+/*
+ * Free the contents of a set of principals, leaving it empty.
+ */
+static void
+acl_set_free(struct acl_set *set)
+{
+    size_t i;
+
+    for (i = 0; i < set->size; i++)
+        free(set->slots[i]);
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+
+/*
+ * Free a compiled ACL file.  Callers must have removed it from the cache.
+ */
+static void
+acl_file_free(struct acl_file *acl)
+{
+    size_t i;
+
+    for (i = 0; i < acl->count; i++) {
+        free(acl->entries[i].data);
+        acl_set_free(&acl->entries[i].set);
+    }
+    free(acl->entries);
+    free(acl->path);
+    free(acl);
+}
+
+
+/*
+ * Add an entry from an ACL file to its compiled form.  A principal, whether
+ * given bare or with the princ scheme, is added to the set of principals
+ * allowed by the preceding entry if that entry is also a set of allowed
+ * principals, and similarly for principals given with the deny scheme.
+ * Since a principal check can only match or not match, a run of them is
+ * equivalent to a single lookup in a set of those principals.  Anything
+ * else is kept as-is to be passed to acl_check.
+ */
+static void
+acl_file_add(struct acl_file *acl, enum acl_entry_type type, int def_index,
+             const char *data, int lineno)
+{
+    struct acl_entry *entry;
+    const char *principal = data;
+
+    if (type == ACL_ENTRY_CHECK && def_index == ACL_SCHEME_PRINC) {
+        if (strncmp(principal, "deny:", strlen("deny:")) == 0) {
+            type = ACL_ENTRY_DENY;
+            principal += strlen("deny:");
+        } else
+            type = ACL_ENTRY_ALLOW;
+        if (strncmp(principal, "princ:", strlen("princ:")) == 0)
+            principal += strlen("princ:");
+        else if (strchr(principal, ':') != NULL)
+            type = ACL_ENTRY_CHECK;
+    }
+    if (type == ACL_ENTRY_ALLOW || type == ACL_ENTRY_DENY)
+        if (acl->count > 0 && acl->entries[acl->count - 1].type == type) {
+            acl_set_add(&acl->entries[acl->count - 1].set,
+                        xstrdup(principal));
+            return;
+        }
+    acl->entries = xreallocarray(acl->entries, acl->count + 1,
+                                 sizeof(struct acl_entry));
+    entry = &acl->entries[acl->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->type = type;
+    entry->lineno = lineno;
+    entry->def_index = def_index;
+    if (type == ACL_ENTRY_ALLOW || type == ACL_ENTRY_DENY)
+        acl_set_add(&entry->set, xstrdup(principal));
+    else
+        entry->data = xstrdup(data);
+    acl->count++;
+}
+
+
+/*
+ * Read and compile an ACL file.  Parse errors are recorded as an error entry
+ * that ends the compiled file, so that the error is reported when a check
+ * reaches it just as if the file were being read at that point.  Returns the
+ * compiled file, or NULL if the file could not be read.  The error is only
+ * reported if quiet is false.
+ */
+static struct acl_file *
+acl_file_compile(const char *aclfile, const struct stat *st, bool quiet)
+{
+    FILE *file;
     char buffer[BUFSIZ];
     char *p;
     int lineno;
-    enum config_status s;
     size_t length;
-    struct vector *line = NULL;
+    struct vector *line;
+    struct acl_file *acl;
 
     file = fopen(aclfile, "r");
     if (file == NULL) {
-        syswarn("cannot open ACL file %s", aclfile);
-        return CONFIG_ERROR;
+        if (!quiet)
+            syswarn("cannot open ACL file %s", aclfile);
+        return NULL;
     }
+    acl = xcalloc(1, sizeof(struct acl_file));
+    acl->path = xstrdup(aclfile);
+    acl->device = st->st_dev;
+    acl->inode = st->st_ino;
+    acl->size = st->st_size;
+    acl->mtime = st->st_mtime;
+    acl->mtime_nsec = ST_MTIME_NSEC(*st);
     lineno = 0;
     while (fgets(buffer, sizeof(buffer), file) != NULL) {
         lineno++;
         length = strlen(buffer);
         if (length >= sizeof(buffer) - 1) {
-            warn("%s:%d: ACL file line too long", aclfile, lineno);
-            goto fail;
+            acl_file_add(acl, ACL_ENTRY_ERROR, 0, "ACL file line too long",
+                         lineno);
+            break;
         }
 
         /*
@@ -624,77 +1107,234 @@ acl_check_file_internal(void *data, const char *aclfile)
 
         /* Parse the line. */
         if (strchr(p, ' ') == NULL)
-            s = acl_check(user, p, ACL_SCHEME_PRINC, aclfile, lineno);
+            acl_file_add(acl, ACL_ENTRY_CHECK, ACL_SCHEME_PRINC, p, lineno);
         else {
             line = vector_split_space(buffer, NULL);
             if (line->count == 2 && strcmp(line->strings[0], "include") == 0) {
-                s = acl_check(data, line->strings[1], ACL_SCHEME_FILE,
-                              aclfile, lineno);
+                acl_file_add(acl, ACL_ENTRY_CHECK, ACL_SCHEME_FILE,
+                             line->strings[1], lineno);
                 vector_free(line);
-                line = NULL;
             } else {
-                warn("%s:%d: parse error", aclfile, lineno);
-                goto fail;
+                vector_free(line);
+                acl_file_add(acl, ACL_ENTRY_ERROR, 0, "parse error", lineno);
+                break;
             }
         }
-        if (s != CONFIG_NOMATCH) {
-            fclose(file);
-            return s;
-        }
     }
     fclose(file);
-    return CONFIG_NOMATCH;
-
-fail:
-    vector_free(line);
-    if (file != NULL)
-        fclose(file);
-    return CONFIG_ERROR;
+    return acl;
 }
 
 
 /*
- * The ACL check operation for the file method.  Takes the user to check, the
- * ACL file or directory name, and the referencing file name and line number.
- *
- * Conceptually, this returns CONFIG_SUCCESS if the user is authorized,
- * CONFIG_NOMATCH if they aren't, CONFIG_ERROR on some sort of failure, and
- * CONFIG_DENY for an explicit deny.  What actually happens is the result of
- * the interplay between handle_include and acl_check_file_internal:
- *
- * - For each file, return the first result other than CONFIG_NOMATCH
- *   (indicating no match), or CONFIG_NOMATCH if there is no other result.
- *
- * - Return the first result from any file less than CONFIG_NOMATCH,
- *   indicating a failure or an explicit deny.
- *
- * - If there is no result less than CONFIG_NOMATCH, return the largest
- *   remaining result, which should be CONFIG_SUCCESS or CONFIG_NOMATCH.
+ * Grow the ACL cache hash table, rehashing all of the cached files.
  */
-static enum config_status
-acl_check_file(const char *user, const char *aclfile, const char *file,
-               int lineno)
+static void
+acl_cache_resize(void)
 {
-    return handle_include(aclfile, file, lineno, acl_check_file_internal,
-                          (void *) user);
+    struct acl_file **old = acl_cache.buckets;
+    size_t old_size = acl_cache.size;
+    struct acl_file *acl, *next;
+    size_t i, bucket;
+
+    acl_cache.size = (old_size == 0) ? 64 : old_size * 2;
+    acl_cache.buckets = xcalloc(acl_cache.size, sizeof(struct acl_file *));
+    for (i = 0; i < old_size; i++)
+        for (acl = old[i]; acl != NULL; acl = next) {
+            next = acl->next;
+            bucket = hash_string(HASH_INIT, acl->path) & (acl_cache.size - 1);
+            acl->next = acl_cache.buckets[bucket];
+            acl_cache.buckets[bucket] = acl;
+        }
+    free(old);
 }
 
 
 /*
- * The ACL check operation for the princ method.  Takes the user to check, the
- * principal name we are checking against, and the referencing file name and
- * line number.
+ * Return the compiled form of an ACL file, reading and compiling it if it
+ * isn't cached or if stat shows that the file has changed since it was
+ * cached.  Returns NULL if the file could not be read, reporting an error
+ * unless quiet is true.
  *
- * Returns CONFIG_SUCCESS if the user is authorized, or CONFIG_NOMATCH if they
- * aren't.
+ * A stale compiled file may still be in use by a check that is currently
+ * walking it (through an include), so it is only freed once nothing holds a
+ * reference to it.  A cached file that has changed or disappeared bumps the
+ * ACL epoch.
  */
-static enum config_status
-acl_check_princ(const char *user, const char *data, const char *file UNUSED,
-                int lineno UNUSED)
+static struct acl_file *
+acl_cache_get(const char *aclfile, bool quiet)
 {
-    return (strcmp(user, data) == 0) ? CONFIG_SUCCESS : CONFIG_NOMATCH;
-}
-
+    struct stat st;
+    struct acl_file **link, *acl;
+    size_t bucket;
+    bool found;
+
+    found = (stat(aclfile, &st) == 0);
+    if (!found && !quiet)
+        syswarn("cannot open ACL file %s", aclfile);
+    if (acl_cache.count >= acl_cache.size)
+        acl_cache_resize();
+    bucket = hash_string(HASH_INIT, aclfile) & (acl_cache.size - 1);
+    for (link = &acl_cache.buckets[bucket]; *link != NULL; link = &acl->next) {
+        acl = *link;
+        if (strcmp(acl->path, aclfile) != 0)
+            continue;
+        if (found && acl->device == st.st_dev && acl->inode == st.st_ino
+            && acl->size == st.st_size && acl->mtime == st.st_mtime
+            && acl->mtime_nsec == ST_MTIME_NSEC(st))
+            return acl;
+        *link = acl->next;
+        acl_cache.count--;
+        acl_epoch++;
+        acl->stale = true;
+        if (acl->refs == 0)
+            acl_file_free(acl);
+        break;
+    }
+    if (!found)
+        return NULL;
+    acl = acl_file_compile(aclfile, &st, quiet);
+    if (acl == NULL)
+        return NULL;
+    acl->next = acl_cache.buckets[bucket];
+    acl_cache.buckets[bucket] = acl;
+    acl_cache.count++;
+    return acl;
+}
+
+
+/*
+ * Load an ACL file into the ACL cache without reporting any errors, along
+ * with the ACL files it includes and the regular expressions it uses.  This
+ * is done when the configuration is loaded, so that in the common case ACL
+ * files have already been read before the process forks to handle a
+ * connection and each connection doesn't have to parse them again.
+ * Directories are left to be loaded when first used.
+ */
+static void
+acl_cache_preload(const char *aclfile)
+{
+    struct stat st;
+    struct acl_file *acl;
+    const struct acl_entry *entry;
+    size_t i;
+
+    if (stat(aclfile, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+    acl = acl_cache_get(aclfile, true);
+    if (acl == NULL || acl->refs > 0)
+        return;
+    acl->refs++;
+    for (i = 0; i < acl->count; i++) {
+        entry = &acl->entries[i];
+        if (entry->type == ACL_ENTRY_CHECK)
+            acl_preload_entry(entry->data, entry->def_index);
+    }
+    acl->refs--;
+    if (acl->stale && acl->refs == 0)
+        acl_file_free(acl);
+}
+
+
+/*
+ * Check to see if a principal is authorized by a given ACL file.
+ *
+ * This function is used to handle included ACL files and only does a simple
+ * check to prevent infinite recursion, so be careful.  The first argument is
+ * the user to check, which is passed in as a void * so that acl_check_file
+ * and read_conf_file can share common include-handling code.
+ *
+ * The file is checked using its cached compiled form, which is read again
+ * only if the file has changed.
+ *
+ * Returns the result of the first check that returns a result other than
+ * CONFIG_NOMATCH, or CONFIG_NOMATCH if no check returns some other value.
+ * Also returns CONFIG_ERROR on some sort of failure (such as failure to read
+ * a file or a syntax error).
+ */
+static enum config_status
+acl_check_file_internal(void *data, const char *aclfile)
+{
+    const char *user = data;
+    struct acl_file *acl;
+    const struct acl_entry *entry;
+    enum config_status s = CONFIG_NOMATCH;
+    size_t i;
+
+    acl = acl_cache_get(aclfile, false);
+    if (acl == NULL)
+        return CONFIG_ERROR;
+    acl->refs++;
+    for (i = 0; i < acl->count && s == CONFIG_NOMATCH; i++) {
+        entry = &acl->entries[i];
+        switch (entry->type) {
+        case ACL_ENTRY_ALLOW:
+            if (acl_set_contains(&entry->set, user))
+                s = CONFIG_SUCCESS;
+            break;
+        case ACL_ENTRY_DENY:
+            if (acl_set_contains(&entry->set, user))
+                s = CONFIG_DENY;
+            break;
+        case ACL_ENTRY_CHECK:
+            s = acl_check(user, entry->data, entry->def_index, aclfile,
+                          entry->lineno);
+            break;
+        case ACL_ENTRY_ERROR:
+            warn("%s:%d: %s", aclfile, entry->lineno, entry->data);
+            s = CONFIG_ERROR;
+            break;
+        }
+    }
+    acl->refs--;
+    if (acl->stale && acl->refs == 0)
+        acl_file_free(acl);
+    return s;
+}
+
+
+/*
+ * The ACL check operation for the file method.  Takes the user to check, the
+ * ACL file or directory name, and the referencing file name and line number.
+ *
+ * Conceptually, this returns CONFIG_SUCCESS if the user is authorized,
+ * CONFIG_NOMATCH if they aren't, CONFIG_ERROR on some sort of failure, and
+ * CONFIG_DENY for an explicit deny.  What actually happens is the result of
+ * the interplay between handle_include and acl_check_file_internal:
+ *
+ * - For each file, return the first result other than CONFIG_NOMATCH
+ *   (indicating no match), or CONFIG_NOMATCH if there is no other result.
+ *
+ * - Return the first result from any file less than CONFIG_NOMATCH,
+ *   indicating a failure or an explicit deny.
+ *
+ * - If there is no result less than CONFIG_NOMATCH, return the largest
+ *   remaining result, which should be CONFIG_SUCCESS or CONFIG_NOMATCH.
+ */
+static enum config_status
+acl_check_file(const char *user, const char *aclfile, const char *file,
+               int lineno)
+{
+    return handle_include(aclfile, file, lineno, acl_check_file_internal,
+                          (void *) user);
+}
+
+
+/*
+ * The ACL check operation for the princ method.  Takes the user to check, the
+ * principal name we are checking against, and the referencing file name and
+ * line number.
+ *
+ * Returns CONFIG_SUCCESS if the user is authorized, or CONFIG_NOMATCH if they
+ * aren't.
+ */
+static enum config_status
+acl_check_princ(const char *user, const char *data, const char *file UNUSED,
+                int lineno UNUSED)
+{
+    return (strcmp(user, data) == 0) ? CONFIG_SUCCESS : CONFIG_NOMATCH;
+}
+
 
 /*
  * The ACL check operation for the deny method.  Takes the user to check, the
@@ -820,6 +1460,122 @@ acl_check_gput(const char *user, const char *data, const char *file,
 #endif /* HAVE_GPUT */
 
 
+#if defined(HAVE_PCRE) || defined(HAVE_REGCOMP)
+/*
+ * Compile a regular expression for the pcre or regex ACL schemes, storing
+ * the compiled form in the pattern struct or, if compilation fails, the
+ * error message to report when the pattern is used.  PCRE expressions are
+ * also studied, using the JIT compiler if the PCRE library has one.
+ */
+static void
+acl_pattern_compile(struct acl_pattern *pattern)
+{
+#ifdef HAVE_PCRE
+    const char *error;
+    int offset, study;
+#endif
+#ifdef HAVE_REGCOMP
+    char message[BUFSIZ];
+    int status;
+#endif
+
+#ifdef HAVE_PCRE
+    if (pattern->is_pcre) {
+        pattern->pcre_regex = pcre_compile(pattern->pattern,
+                                           PCRE_NO_AUTO_CAPTURE, &error,
+                                           &offset, NULL);
+        if (pattern->pcre_regex == NULL) {
+            xasprintf(&pattern->error,
+                      "compilation of regex '%s' failed around %d",
+                      pattern->pattern, offset);
+            return;
+        }
+# ifdef PCRE_STUDY_JIT_COMPILE
+        study = PCRE_STUDY_JIT_COMPILE;
+# else
+        study = 0;
+# endif
+        pattern->pcre_extra = pcre_study(pattern->pcre_regex, study,
+                                         &error);
+        return;
+    }
+#endif
+#ifdef HAVE_REGCOMP
+    if (!pattern->is_pcre) {
+        status = regcomp(&pattern->regex, pattern->pattern,
+                         REG_EXTENDED | REG_NOSUB);
+        if (status != 0) {
+            regerror(status, &pattern->regex, message, sizeof(message));
+            xasprintf(&pattern->error,
+                      "compilation of regex '%s' failed: %s",
+                      pattern->pattern, message);
+        }
+    }
+#endif
+}
+
+
+/*
+ * Grow the hash table of compiled regular expressions, rehashing all of the
+ * existing entries.
+ */
+static void
+acl_pattern_resize(void)
+{
+    struct acl_pattern **old = acl_patterns.buckets;
+    size_t old_size = acl_patterns.size;
+    struct acl_pattern *pattern, *next;
+    uint32_t hash;
+    size_t i;
+
+    acl_patterns.size = (old_size == 0) ? 64 : old_size * 2;
+    acl_patterns.buckets = xcalloc(acl_patterns.size,
+                                   sizeof(struct acl_pattern *));
+    for (i = 0; i < old_size; i++)
+        for (pattern = old[i]; pattern != NULL; pattern = next) {
+            next = pattern->next;
+            hash = hash_string(HASH_INIT, pattern->pattern);
+            hash = (hash + pattern->is_pcre) & (acl_patterns.size - 1);
+            pattern->next = acl_patterns.buckets[hash];
+            acl_patterns.buckets[hash] = pattern;
+        }
+    free(old);
+}
+
+
+/*
+ * Return the compiled form of a regular expression for the pcre ACL scheme
+ * if is_pcre is true or the regex ACL scheme otherwise, compiling it the
+ * first time it is seen.  Compiled expressions are kept for the life of the
+ * process and shared by every rule and ACL file that uses them.
+ */
+static const struct acl_pattern *
+acl_pattern_get(const char *data, bool is_pcre)
+{
+    struct acl_pattern *pattern;
+    uint32_t hash;
+
+    if (acl_patterns.count >= acl_patterns.size)
+        acl_pattern_resize();
+    hash = hash_string(HASH_INIT, data);
+    hash = (hash + is_pcre) & (acl_patterns.size - 1);
+    for (pattern = acl_patterns.buckets[hash]; pattern != NULL;
+         pattern = pattern->next)
+        if (pattern->is_pcre == is_pcre
+            && strcmp(pattern->pattern, data) == 0)
+            return pattern;
+    pattern = xcalloc(1, sizeof(struct acl_pattern));
+    pattern->pattern = xstrdup(data);
+    pattern->is_pcre = is_pcre;
+    acl_pattern_compile(pattern);
+    pattern->next = acl_patterns.buckets[hash];
+    acl_patterns.buckets[hash] = pattern;
+    acl_patterns.count++;
+    return pattern;
+}
+#endif /* HAVE_PCRE || HAVE_REGCOMP */
+
+
 /*
  * The ACL check operation for PCRE matches.  Takes the user to check, the
  * regular expression, and the referencing file name and line number.  This
@@ -831,18 +1587,16 @@ static enum config_status
 acl_check_pcre(const char *user, const char *data, const char *file,
                int lineno)
 {
-    pcre *regex;
-    const char *error;
-    int offset, status;
+    const struct acl_pattern *pattern;
+    int status;
 
-    regex = pcre_compile(data, PCRE_NO_AUTO_CAPTURE, &error, &offset, NULL);
-    if (regex == NULL) {
-        warn("%s:%d: compilation of regex '%s' failed around %d", file,
-             lineno, data, offset);
+    pattern = acl_pattern_get(data, true);
+    if (pattern->error != NULL) {
+        warn("%s:%d: %s", file, lineno, pattern->error);
         return CONFIG_ERROR;
     }
-    status = pcre_exec(regex, NULL, user, strlen(user), 0, 0, NULL, 0);
-    pcre_free(regex);
+    status = pcre_exec(pattern->pcre_regex, pattern->pcre_extra, user,
+                       strlen(user), 0, 0, NULL, 0);
     switch (status) {
     case 0:
         return CONFIG_SUCCESS;
@@ -868,36 +1622,27 @@ static enum config_status
 acl_check_regex(const char *user, const char *data, const char *file,
                 int lineno)
 {
-    regex_t regex;
+    const struct acl_pattern *pattern;
     char error[BUFSIZ];
     int status;
-    enum config_status result;
 
-    memset(&regex, 0, sizeof(regex));
-    status = regcomp(&regex, data, REG_EXTENDED | REG_NOSUB);
-    if (status != 0) {
-        regerror(status, &regex, error, sizeof(error));
-        warn("%s:%d: compilation of regex '%s' failed: %s", file, lineno,
-             data, error);
+    pattern = acl_pattern_get(data, false);
+    if (pattern->error != NULL) {
+        warn("%s:%d: %s", file, lineno, pattern->error);
         return CONFIG_ERROR;
     }
-    status = regexec(&regex, user, 0, NULL, 0);
+    status = regexec(&pattern->regex, user, 0, NULL, 0);
     switch (status) {
     case 0:
-        result = CONFIG_SUCCESS;
-        break;
+        return CONFIG_SUCCESS;
     case REG_NOMATCH:
-        result = CONFIG_NOMATCH;
-        break;
+        return CONFIG_NOMATCH;
     default:
-        regerror(status, &regex, error, sizeof(error));
+        regerror(status, &pattern->regex, error, sizeof(error));
         warn("%s:%d: matching with regex '%s' failed: %s", file, lineno,
              data, error);
-        result = CONFIG_ERROR;
-        break;
+        return CONFIG_ERROR;
     }
-    regfree(&regex);
-    return result;
 }
 #endif /* HAVE_REGCOMP */
 
@@ -1025,74 +1770,153 @@ fail:
 }
 
 
+/*
+ * Look up the membership of a local group, using the cached membership if it
+ * hasn't expired.  Returns CONFIG_SUCCESS and sets the group pointer on
+ * success, even if the group wasn't found.  On error, returns CONFIG_ERROR
+ * with errno set; errors aren't cached.
+ */
+static enum config_status
+localgroup_lookup(const char *name, struct localgroup **group)
+{
+    struct localgroup *lg;
+    struct group *gr;
+    char *buffer;
+    time_t now;
+    size_t i;
+
+    now = server_now();
+    for (lg = localgroups; lg != NULL; lg = lg->next)
+        if (strcmp(lg->name, name) == 0)
+            break;
+    if (lg != NULL && now - lg->fetched < localgroup_ttl) {
+        *group = lg;
+        return CONFIG_SUCCESS;
+    }
+    if (acl_getgrnam(name, &gr, &buffer) != CONFIG_SUCCESS)
+        return CONFIG_ERROR;
+    if (lg == NULL) {
+        lg = xcalloc(1, sizeof(struct localgroup));
+        lg->name = xstrdup(name);
+        lg->next = localgroups;
+        localgroups = lg;
+    } else
+        acl_set_free(&lg->members);
+    lg->found = (gr != NULL);
+    if (gr != NULL) {
+        lg->gid = gr->gr_gid;
+        for (i = 0; gr->gr_mem[i] != NULL; i++)
+            acl_set_add(&lg->members, xstrdup(gr->gr_mem[i]));
+    }
+    lg->fetched = now;
+    free(gr);
+    free(buffer);
+    *group = lg;
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Look up the local user corresponding to a principal, reusing the previous
+ * result if it was for the same principal and hasn't expired.  Returns the
+ * local user information on success and NULL on error; errors aren't cached.
+ */
+static const struct localuser *
+localuser_lookup(const char *user)
+{
+    struct passwd *pw;
+    char *localname;
+    time_t now;
+
+    now = server_now();
+    if (localuser.principal != NULL && strcmp(localuser.principal, user) == 0
+        && now - localuser.fetched < localgroup_ttl)
+        return &localuser;
+    if (!user_to_localname(user, &localname))
+        return NULL;
+    free(localuser.principal);
+    free(localuser.localname);
+    localuser.principal = xstrdup(user);
+    localuser.localname = localname;
+    localuser.found = false;
+    if (localname != NULL) {
+        pw = getpwnam(localname);
+        if (pw != NULL) {
+            localuser.found = true;
+            localuser.gid = pw->pw_gid;
+        }
+    }
+    localuser.fetched = now;
+    return &localuser;
+}
+
+
 /*
  * The ACL check operation for UNIX local group membership.  Takes the user to
  * check, the group of which they have to be a member, and the referencing
  * file name and line number.
+ *
+ * Group membership and the local user corresponding to the principal are
+ * cached for localgroup_ttl seconds, since looking them up can be expensive
+ * with large groups or network-backed name services.
  */
 static enum config_status
 acl_check_localgroup(const char *user, const char *group,
                      const char *file, int lineno)
 {
-    struct passwd *pw;
-    struct group *gr = NULL;
-    char *grbuffer = NULL;
-    size_t i;
-    char *localname = NULL;
-    enum config_status result;
+    struct localgroup *lg;
+    const struct localuser *lu;
 
     /* Look up the group membership. */
-    result = acl_getgrnam(group, &gr, &grbuffer);
-    if (result != CONFIG_SUCCESS) {
+    if (localgroup_lookup(group, &lg) != CONFIG_SUCCESS) {
         syswarn("%s:%d: retrieving membership of localgroup %s failed", file,
                 lineno, group);
-        return result;
+        return CONFIG_ERROR;
     }
-    if (gr == NULL)
+    if (!lg->found)
         return CONFIG_NOMATCH;
 
     /*
-     * Convert the principal to a local name.  Return no match if it doesn't
-     * convert.
+     * Convert the principal to a local user.  Return no match if it doesn't
+     * convert or if the local user doesn't exist.
      */
-    if (!user_to_localname(user, &localname)) {
-        result = CONFIG_ERROR;
-        goto done;
-    }
-    if (localname == NULL) {
-        result = CONFIG_NOMATCH;
-        goto done;
-    }
+    lu = localuser_lookup(user);
+    if (lu == NULL)
+        return CONFIG_ERROR;
+    if (lu->localname == NULL || !lu->found)
+        return CONFIG_NOMATCH;
 
-    /* Look up the local user.  If they don't exist, return no match. */
-    pw = getpwnam(localname);
-    if (pw == NULL) {
-        result = CONFIG_NOMATCH;
-        goto done;
-    }
+    /*
+     * The user is in the group if it's their primary group or if they're one
+     * of the other group members.
+     */
+    if (lg->gid == lu->gid)
+        return CONFIG_SUCCESS;
+    if (acl_set_contains(&lg->members, lu->localname))
+        return CONFIG_SUCCESS;
+    return CONFIG_NOMATCH;
+}
 
-    /* Check if the user's primary group is the desired group. */
-    if (gr->gr_gid == pw->pw_gid) {
-        result = CONFIG_SUCCESS;
-        goto done;
-    }
+#endif /* HAVE_KRB5 && HAVE_GETGRNAM_R */
 
-    /* Otherwise, check if the user is one of the other group members. */
-    result = CONFIG_NOMATCH;
-    for (i = 0; gr->gr_mem[i] != NULL; i++)
-        if (strcmp(localname, gr->gr_mem[i]) == 0) {
-            result = CONFIG_SUCCESS;
-            break;
-        }
 
-done:
-    free(gr);
-    free(grbuffer);
-    free(localname);
-    return result;
+/*
+ * Sets the number of seconds for which information used by localgroup ACLs
+ * is cached.  Zero disables caching.
+ */
+#if defined(HAVE_KRB5) && defined(HAVE_GETGRNAM_R)
+void
+server_config_set_localgroup_ttl(time_t ttl)
+{
+    localgroup_ttl = ttl;
 }
-
-#endif /* HAVE_KRB5 && HAVE_GETGRNAM_R */
+#else
+void
+server_config_set_localgroup_ttl(time_t ttl UNUSED)
+{
+    return;
+}
+#endif
 
 
 /*
@@ -1172,68 +1996,452 @@ acl_check(const char *user, const char *entry, int def_index,
 
 
 /*
- * Load a configuration file.  Returns a newly allocated config struct if
+ * Hash a command and subcommand pair for the rule index.  This is the hash
+ * of the command, a nul byte, and the subcommand.
+ */
+static size_t
+index_hash(const char *command, const char *subcommand)
+{
+    uint32_t hash;
+
+    hash = hash_string(HASH_INIT, command);
+    hash *= 16777619U;
+    return hash_string(hash, subcommand);
+}
+
+
+/*
+ * Find the slot in the rule index for a command and subcommand.  Returns the
+ * slot holding the rule with that command and subcommand, or the empty slot
+ * where such a rule would go if there is none.  The index is never full, so
+ * this always terminates.
+ */
+static size_t
+index_slot(const struct config *config, const char *command,
+           const char *subcommand)
+{
+    size_t mask = config->index_size - 1;
+    size_t slot = index_hash(command, subcommand) & mask;
+    const struct rule *rule;
+
+    while (config->index[slot] != 0) {
+        rule = config->rules[config->index[slot] - 1];
+        if (strcmp(rule->command, command) == 0
+            && strcmp(rule->subcommand, subcommand) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+
+/*
+ * Build the rule index for a newly loaded configuration.  The table is sized
+ * to at least twice the number of rules so that probe sequences stay short.
+ * Rules are added in order and a key is only set by the first rule that has
+ * it, so the index records the rule that a linear scan would find first.
+ */
+static void
+index_build(struct config *config)
+{
+    const struct rule *rule;
+    size_t i, slot;
+
+    config->index_size = 16;
+    while (config->index_size < config->count * 2)
+        config->index_size *= 2;
+    config->index = xcalloc(config->index_size, sizeof(size_t));
+    for (i = 0; i < config->count; i++) {
+        rule = config->rules[i];
+        slot = index_slot(config, rule->command, rule->subcommand);
+        if (config->index[slot] == 0)
+            config->index[slot] = i + 1;
+    }
+}
+
+
+/*
+ * Look up a key in the rule index, returning one plus the position of the
+ * first rule with that command and subcommand or 0 if there is none.
+ */
+static size_t
+index_find(const struct config *config, const char *command,
+           const char *subcommand)
+{
+    return config->index[index_slot(config, command, subcommand)];
+}
+
+
+/*
+ * Find the first configuration rule matching a command and subcommand, or
+ * NULL if no rule matches.  A rule matches if its command is ALL or is equal
+ * to the command, and its subcommand is ALL or is equal to the subcommand,
+ * with a NULL command or subcommand matched by EMPTY.
+ *
+ * Any matching rule therefore has one of four keys in the index: the command
+ * and subcommand themselves, either of them replaced with ALL, or ALL ALL.
+ * The index holds the first rule with each key, so the first matching rule
+ * is the earliest of those four.
+ */
+struct rule *
+server_config_find(const struct config *config, const char *command,
+                   const char *subcommand)
+{
+    size_t found = 0;
+    size_t candidate[4];
+    size_t i;
+
+    if (config->count == 0)
+        return NULL;
+    if (command == NULL)
+        command = "EMPTY";
+    if (subcommand == NULL)
+        subcommand = "EMPTY";
+    candidate[0] = index_find(config, command, subcommand);
+    candidate[1] = index_find(config, command, "ALL");
+    candidate[2] = index_find(config, "ALL", subcommand);
+    candidate[3] = index_find(config, "ALL", "ALL");
+    for (i = 0; i < ARRAY_SIZE(candidate); i++)
+        if (candidate[i] != 0 && (found == 0 || candidate[i] < found))
+            found = candidate[i];
+    return (found == 0) ? NULL : config->rules[found - 1];
+}
+
+
+/*
+ * Do whatever work can be done ahead of time for an ACL entry without
+ * checking a user against it: load the ACL files it names into the ACL cache
+ * and compile the regular expressions it uses.  Takes the entry and the
+ * default scheme index.  Nothing is reported for entries that can't be
+ * loaded; that happens when they're checked.
+ */
+static void
+acl_preload_entry(const char *entry, int def_index)
+{
+    while (strncmp(entry, "deny:", strlen("deny:")) == 0) {
+        entry += strlen("deny:");
+        def_index = ACL_SCHEME_PRINC;
+    }
+    if (strncmp(entry, "file:", strlen("file:")) == 0)
+        acl_cache_preload(entry + strlen("file:"));
+    else if (def_index == ACL_SCHEME_FILE && strchr(entry, ':') == NULL)
+        acl_cache_preload(entry);
+#ifdef HAVE_PCRE
+    else if (strncmp(entry, "pcre:", strlen("pcre:")) == 0)
+        acl_pattern_get(entry + strlen("pcre:"), true);
+#endif
+#ifdef HAVE_REGCOMP
+    else if (strncmp(entry, "regex:", strlen("regex:")) == 0)
+        acl_pattern_get(entry + strlen("regex:"), false);
+#endif
+}
+
+
+/*
+ * Record a file or directory read while loading the configuration, along with
+ * the results of stat for it.
+ */
+void
+server_config_add_source(struct config *config, const char *path,
+                         const struct stat *st)
+{
+    struct config_source *source;
+
+    config->sources = xreallocarray(config->sources, config->nsources + 1,
+                                    sizeof(struct config_source));
+    source = &config->sources[config->nsources];
+    source->path = xstrdup(path);
+    source->device = st->st_dev;
+    source->inode = st->st_ino;
+    source->size = st->st_size;
+    source->mtime = st->st_mtime;
+    source->mtime_nsec = ST_MTIME_NSEC(*st);
+    source->includes = false;
+    source->first = 0;
+    source->count = 0;
+    config->nsources++;
+}
+
+
+/*
+ * Set a compiled snapshot of the configuration to load in place of parsing
+ * the configuration file whenever it's up to date.  The string is not
+ * copied.  Pass NULL to always parse the configuration file.
+ */
+void
+server_config_set_snapshot(const char *file)
+{
+    config_snapshot = file;
+}
+
+
+/*
+ * Return whether a configuration source is unchanged since it was read,
+ * according to stat.
+ */
+bool
+server_config_source_current(const struct config_source *source)
+{
+    struct stat st;
+
+    if (stat(source->path, &st) < 0)
+        return false;
+    return source_matches(source, &st);
+}
+
+
+/*
+ * Finish loading a configuration: give it a new generation and index the
+ * rules by command and subcommand for dispatch.  The ACL files and regular
+ * expressions used by the rules are compiled separately by config_preload.
+ */
+static void
+config_finish(struct config *config)
+{
+    config->generation = ++config_generation;
+    free(config->index);
+    config->index = NULL;
+    config->index_size = 0;
+    if (config->count > 0)
+        index_build(config);
+}
+
+
+/*
+ * Load the ACL files and regular expressions used by the rules into their
+ * caches.  This is also done when a reload finds that the configuration
+ * hasn't changed, since an ACL file may have.
+ */
+static void
+config_preload(const struct config *config)
+{
+    char **acls;
+    size_t i, j;
+
+    for (i = 0; i < config->count; i++) {
+        acls = config->rules[i]->acls;
+        for (j = 0; acls[j] != NULL; j++)
+            acl_preload_entry(acls[j], ACL_SCHEME_FILE);
+    }
+}
+
+
+/*
+ * Load a configuration file, or the compiled snapshot of it if one was set
+ * and is still current.  Returns a newly allocated config struct if
  * successful or NULL on failure, logging an appropriate error message.
  */
 struct config *
 server_config_load(const char *file)
 {
-    struct config *config;
-
-    /* Read the configuration file. */
-    config = xcalloc(1, sizeof(struct config));
-    if (read_conf_file(config, file) != 0) {
-        server_config_free(config);
-        return NULL;
+    struct config *config = NULL;
+    struct conf_parse parse;
+
+    /* Read the snapshot or, failing that, the configuration file. */
+    if (config_snapshot != NULL)
+        config = server_snapshot_load(config_snapshot, file);
+    if (config == NULL) {
+        config = xcalloc(1, sizeof(struct config));
+        memset(&parse, 0, sizeof(parse));
+        parse.config = config;
+        if (read_conf_file(&parse, file) != 0) {
+            server_config_free(config);
+            return NULL;
+        }
     }
+    config_finish(config);
+    config_preload(config);
     return config;
 }
 
 
 /*
- * Free the config structure created by calling server_config_load.
+ * Free a single configuration rule.
  */
-void
-server_config_free(struct config *config)
+static void
+rule_free(struct rule *rule)
 {
+    free(rule->logmask);
+    free(rule->user);
+    free(rule->acls);
+    vector_free(rule->line);
+    free(rule->file);
+    free(rule);
+}
+
+
+/*
+ * Free the rules of a configuration other than those marked in skip, if
+ * skip isn't NULL, along with everything else it holds except the struct
+ * itself.
+ */
+static void
+config_clear(struct config *config, const bool *skip)
+{
+    size_t i;
+
+    for (i = 0; i < config->count; i++)
+        if (skip == NULL || !skip[i])
+            rule_free(config->rules[i]);
+    for (i = 0; i < config->nsources; i++)
+        free(config->sources[i].path);
+    free(config->sources);
+    free(config->rules);
+    free(config->index);
+}
+
+
+/*
+ * Reload a configuration in place from the given configuration file, so that
+ * anything holding a pointer to the config struct sees the new rules.  If no
+ * configuration file or included directory has changed, nothing is reloaded.
+ * Otherwise, the compiled snapshot is used if set and current, and if not,
+ * only the configuration files that have changed (and those that include
+ * other files) are parsed again.  The rules of the other files are moved
+ * over from the previous configuration.
+ *
+ * The configuration gets a new generation only if it was reloaded.  Returns
+ * false if the new configuration could not be loaded, in which case the
+ * error has been reported and the previous configuration is left alone.
+ */
+bool
+server_config_reload(struct config *config, const char *file)
+{
+    struct config *fresh = NULL;
+    struct conf_parse parse;
     struct rule *rule;
     size_t i;
 
-    for (i = 0; i < config->count; i++) {
-        rule = config->rules[i];
-        free(rule->logmask);
-        free(rule->user);
-        free(rule->acls);
-        vector_free(rule->line);
-        free(rule->file);
-        free(rule);
+    /* Check whether anything has changed. */
+    for (i = 0; i < config->nsources; i++)
+        if (!server_config_source_current(&config->sources[i]))
+            break;
+    if (config->nsources > 0 && i == config->nsources) {
+        config_preload(config);
+        return true;
     }
-    free(config->rules);
+
+    /* Build the new configuration, reusing unchanged rules if possible. */
+    memset(&parse, 0, sizeof(parse));
+    parse.reused = xcalloc(config->count + 1, sizeof(bool));
+    if (config_snapshot != NULL)
+        fresh = server_snapshot_load(config_snapshot, file);
+    if (fresh == NULL) {
+        fresh = xcalloc(1, sizeof(struct config));
+        parse.config = fresh;
+        parse.old = config;
+        if (read_conf_file(&parse, file) != 0) {
+            for (i = 0; i < config->count; i++)
+                config->rules[i]->index = i;
+            for (i = 0; i < fresh->count; i++) {
+                rule = fresh->rules[i];
+                if (rule->index < config->count
+                    && config->rules[rule->index] == rule)
+                    fresh->rules[i] = NULL;
+            }
+            for (i = 0; i < fresh->count; i++)
+                if (fresh->rules[i] != NULL)
+                    rule_free(fresh->rules[i]);
+            fresh->count = 0;
+            server_config_free(fresh);
+            free(parse.reused);
+            return false;
+        }
+    }
+
+    /* Replace the previous configuration with the new one. */
+    config_clear(config, parse.reused);
+    free(parse.reused);
+    *config = *fresh;
+    free(fresh);
+    config_finish(config);
+    config_preload(config);
+    return true;
+}
+
+
+/*
+ * Free the config structure created by calling server_config_load.
+ */
+void
+server_config_free(struct config *config)
+{
+    config_clear(config, NULL);
     free(config);
 }
 
 
 /*
- * Given the rule corresponding to the command and the principal
- * requesting access, see if the command is allowed.  Return true if so, false
- * otherwise.
+ * Return a newly allocated vector of the files and directories whose changes
+ * affect the configuration: the configuration files and included directories
+ * that were read to load it and the ACL files that have been loaded into the
+ * ACL cache.
  */
-bool
-server_config_acl_permit(const struct rule *rule, const char *user)
+struct vector *
+server_config_paths(const struct config *config)
+{
+    struct vector *paths;
+    const struct acl_file *acl;
+    size_t i;
+
+    paths = vector_new();
+    for (i = 0; i < config->nsources; i++)
+        vector_add(paths, config->sources[i].path);
+    for (i = 0; i < acl_cache.size; i++)
+        for (acl = acl_cache.buckets[i]; acl != NULL; acl = acl->next)
+            vector_add(paths, acl->path);
+    return paths;
+}
+
+
+/*
+ * Return the current ACL epoch, which changes whenever a compiled ACL file
+ * is replaced or dropped from the cache.  ACL decisions made under an
+ * earlier epoch may be stale.
+ */
+unsigned long
+server_config_acl_epoch(void)
+{
+    return acl_epoch;
+}
+
+
+/*
+ * Given the rule corresponding to the command and the principal requesting
+ * access, see if the command is allowed.  Returns ACL_PERMIT if so,
+ * ACL_REFUSE if not, and ACL_UNDECIDED if there was an error checking the
+ * ACLs (which should also be taken as a refusal).
+ */
+enum acl_decision
+server_config_acl_decide(const struct rule *rule, const char *user)
 {
     char **acls = rule->acls;
     size_t i;
     enum config_status status;
 
     if (strcmp(acls[0], "ANYUSER") == 0)
-        return true;
+        return ACL_PERMIT;
     for (i = 0; acls[i] != NULL; i++) {
         status = acl_check(user, acls[i], ACL_SCHEME_FILE, rule->file,
                            rule->lineno);
-        if (status == 0)
-            return true;
-        else if (status < -1)
-            return false;
+        if (status == CONFIG_SUCCESS)
+            return ACL_PERMIT;
+        else if (status == CONFIG_DENY)
+            return ACL_REFUSE;
+        else if (status < CONFIG_NOMATCH)
+            return ACL_UNDECIDED;
     }
-    return false;
+    return ACL_REFUSE;
+}
+
+
+/*
+ * Given the rule corresponding to the command and the principal
+ * requesting access, see if the command is allowed.  Return true if so, false
+ * otherwise.
+ */
+bool
+server_config_acl_permit(const struct rule *rule, const char *user)
+{
+    return server_config_acl_decide(rule, user) == ACL_PERMIT;
 }
@@ -0,0 +1,933 @@
+/*
+ * Event-driven connection handling for the remctld server.
+ *
+ * Normally, standalone remctld forks a child for every connection, and that
+ * child blocks reading from the client for as long as the connection is
+ * open.  This file provides an alternative in which a single process uses
+ * libevent to accept connections, negotiate GSS-API contexts, and read
+ * protocol messages for all of its clients at once.  A child process is
+ * forked only when a command has to be run.
+ *
+ * The child handles the command with the normal synchronous code, since it
+ * has the socket to itself while the command is running, and then hands the
+ * GSS-API context back to the parent over a pipe with
+ * gss_export_sec_context so that the parent's sequence state stays in sync
+ * with the client.  The ACL decisions the child made are passed back along
+ * with the context so that later commands on the same connection can reuse
+ * them.  The parent reads exactly one token at a time from each client so
+ * that it never consumes data (such as command continuation tokens) that the
+ * child needs to read.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/protocol.h>
+#include <util/tokens.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+/* The states a client connection can be in. */
+enum connection_state {
+    STATE_INITIAL,              /* Waiting for the initial token. */
+    STATE_CONTEXT,              /* Negotiating the GSS-API context. */
+    STATE_MESSAGES,             /* Reading protocol messages. */
+    STATE_RUNNING               /* A child is handling a command. */
+};
+
+/* Overall state of the event-driven server. */
+struct engine {
+    struct event_base *base;    /* The shared event base. */
+    struct config *config;      /* The current server configuration. */
+    const char *config_path;    /* Path to reload the configuration from. */
+    gss_cred_id_t creds;        /* Server credentials for accepting. */
+    socket_type *fds;           /* Listening sockets. */
+    unsigned int nfds;          /* Count of listening sockets. */
+    struct event **listeners;   /* Accept events for each listening socket. */
+    struct event *sigchld;      /* Reap children. */
+    struct event *sighup;       /* Re-read the configuration. */
+    struct event *sigio;        /* The configuration has changed. */
+    struct event *sigint;       /* Exit. */
+    struct event *sigterm;      /* Exit. */
+    struct connection *connections;
+};
+
+/* A single client connection. */
+struct connection {
+    struct engine *engine;      /* Back pointer to the overall state. */
+    struct client *client;      /* Client information and GSS-API context. */
+    enum connection_state state;
+    gss_name_t name;            /* Client name during negotiation. */
+
+    /* The token currently being read. */
+    unsigned char header[5];    /* Token flags and length. */
+    size_t length;              /* Length of the token data. */
+    size_t have;                /* Bytes of header and data read so far. */
+    char *data;                 /* Token data. */
+
+    /* Output and pending work. */
+    struct event *read_event;   /* Data available from the client. */
+    struct event *write_event;  /* Client ready for more output. */
+    struct evbuffer *output;    /* Queued output to the client. */
+    bool closing;               /* Close once the output is flushed. */
+    bool launch;                /* Fork a child once the output is flushed. */
+    gss_buffer_desc command;    /* Command token for the child. */
+
+    /* Running a command. */
+    pid_t child;                /* Child handling the current command. */
+    socket_type pipe_fd;        /* Pipe from the child for the context. */
+    struct event *pipe_event;   /* Data available from the child. */
+    struct evbuffer *context;   /* Exported context from the child. */
+
+    struct connection *prev;
+    struct connection *next;
+};
+
+/*
+ * The header of the state a child passes back to the parent.  It's followed
+ * by count ACL decisions and then the exported GSS-API context.  Both ends
+ * are the same program, so this is sent in native byte order.
+ */
+struct child_state {
+    unsigned long acl_generation;
+    unsigned long acl_epoch;
+    size_t count;
+};
+
+/* Idle timeout for client connections. */
+static const struct timeval timeout = { TIMEOUT, 0 };
+
+
+/*
+ * Free a connection, closing the socket and removing it from the list of
+ * active connections.  If a child is currently handling a command for the
+ * connection, it keeps its own copy of the socket and will finish normally.
+ */
+static void
+connection_free(struct connection *conn)
+{
+    OM_uint32 minor;
+
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        conn->engine->connections = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    event_free(conn->read_event);
+    event_free(conn->write_event);
+    if (conn->pipe_event != NULL)
+        event_free(conn->pipe_event);
+    if (conn->pipe_fd != INVALID_SOCKET)
+        close(conn->pipe_fd);
+    evbuffer_free(conn->output);
+    if (conn->context != NULL)
+        evbuffer_free(conn->context);
+    if (conn->name != GSS_C_NO_NAME)
+        gss_release_name(&minor, &conn->name);
+    gss_release_buffer(&minor, &conn->command);
+    free(conn->data);
+    server_free_client(conn->client);
+    free(conn);
+}
+
+
+/*
+ * Queue a token to be sent to the client.  Reading from the client is
+ * suspended until the output has been flushed, which keeps a client that
+ * doesn't read its replies from making us buffer unbounded amounts of data.
+ * The same idle timeout applies while waiting to write, so a client that
+ * stops reading entirely is eventually dropped.
+ */
+static void
+connection_queue(struct connection *conn, int flags, gss_buffer_t token)
+{
+    unsigned char flag = flags;
+    OM_uint32 length;
+
+    length = htonl(token->length);
+    if (evbuffer_add(conn->output, &flag, 1) < 0
+        || evbuffer_add(conn->output, &length, 4) < 0
+        || evbuffer_add(conn->output, token->value, token->length) < 0)
+        die("internal error: cannot queue output for client");
+    event_del(conn->read_event);
+    if (event_add(conn->write_event, &timeout) < 0)
+        die("internal error: cannot add client write event");
+}
+
+
+/*
+ * Wrap a protocol message and queue it to be sent to the client.  Returns
+ * true on success and false on failure, logging an error message.
+ */
+static bool
+connection_send_priv(struct connection *conn, void *data, size_t length)
+{
+    gss_buffer_desc in, out;
+    OM_uint32 major, minor;
+    int state;
+
+    in.value = data;
+    in.length = length;
+    major = gss_wrap(&minor, conn->client->context, 1, GSS_C_QOP_DEFAULT,
+                     &in, &state, &out);
+    if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while wrapping token", major, minor);
+        return false;
+    }
+    connection_queue(conn, TOKEN_DATA | TOKEN_PROTOCOL, &out);
+    gss_release_buffer(&minor, &out);
+    return true;
+}
+
+
+/*
+ * Queue a protocol v2 error token.  This is the equivalent of
+ * server_v2_send_error.
+ */
+static bool
+connection_send_error(struct connection *conn, enum error_codes code,
+                      const char *message)
+{
+    char *buffer, *p;
+    size_t length;
+    OM_uint32 tmp;
+    bool result;
+
+    length = 1 + 1 + 4 + 4 + strlen(message);
+    buffer = xmalloc(length);
+    p = buffer;
+    *p++ = 2;
+    *p++ = MESSAGE_ERROR;
+    tmp = htonl(code);
+    memcpy(p, &tmp, 4);
+    p += 4;
+    tmp = htonl(strlen(message));
+    memcpy(p, &tmp, 4);
+    p += 4;
+    memcpy(p, message, strlen(message));
+    result = connection_send_priv(conn, buffer, length);
+    free(buffer);
+    return result;
+}
+
+
+/*
+ * Read more of the current token from the client.  We never read past the
+ * end of the current token, since the rest of the data may belong to a child
+ * handling a command.  Returns 1 if a complete token has been read, 0 if more
+ * data is needed, and -1 on end of file or error.
+ */
+static int
+connection_read(struct connection *conn)
+{
+    char *p;
+    size_t want;
+    ssize_t status;
+    OM_uint32 length;
+
+    if (conn->have < 5) {
+        p = (char *) conn->header + conn->have;
+        want = 5 - conn->have;
+    } else {
+        p = conn->data + (conn->have - 5);
+        want = 5 + conn->length - conn->have;
+    }
+    status = socket_read(conn->client->fd, p, want);
+    if (status < 0) {
+        if (socket_errno == EINTR || socket_errno == EAGAIN)
+            return 0;
+        syswarn("error reading from client %s", conn->client->ipaddress);
+        return -1;
+    } else if (status == 0) {
+        debug("connection from %s closed", conn->client->ipaddress);
+        return -1;
+    }
+    conn->have += status;
+    if (conn->have == 5 && conn->data == NULL) {
+        memcpy(&length, conn->header + 1, 4);
+        conn->length = ntohl(length);
+        if (conn->length > TOKEN_MAX_LENGTH_FOR(conn->client->token_max)) {
+            warn("token of length %lu from %s is too large",
+                 (unsigned long) conn->length, conn->client->ipaddress);
+            return -1;
+        }
+        conn->data = xmalloc(conn->length > 0 ? conn->length : 1);
+    }
+    return (conn->have == 5 + conn->length && conn->data != NULL) ? 1 : 0;
+}
+
+
+/*
+ * The child side of running a command.  Release everything that belongs to
+ * the parent's event loop and other connections, handle the command with the
+ * normal synchronous protocol code, and then, if the client wants to send
+ * more commands, export the GSS-API context and write it to the pipe so that
+ * the parent can pick up where we left off.
+ */
+static void
+connection_child(struct connection *conn, socket_type pipe_fd)
+{
+    struct engine *engine = conn->engine;
+    struct client *client = conn->client;
+    struct connection *other;
+    struct sigaction sa;
+    struct child_state state;
+    struct iovec iov[3];
+    gss_buffer_desc exported;
+    OM_uint32 major, minor;
+    unsigned int i;
+    bool keepalive;
+
+    /*
+     * The event base shares its kernel state with the parent, so reinitialize
+     * it before freeing it to avoid removing the parent's events.
+     */
+    if (event_reinit(engine->base) < 0)
+        die("internal error: cannot reinitialize event base");
+    event_base_free(engine->base);
+    for (i = 0; i < engine->nfds; i++)
+        close(engine->fds[i]);
+    for (other = engine->connections; other != NULL; other = other->next) {
+        if (other == conn)
+            continue;
+        close(other->client->fd);
+        if (other->pipe_fd != INVALID_SOCKET)
+            close(other->pipe_fd);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    if (sigaction(SIGCHLD, &sa, NULL) < 0)
+        syswarn("cannot reset SIGCHLD handler");
+    server_process_restore_affinity();
+
+    /* Look up the hostname here, since it may block. */
+    server_client_resolve(client);
+
+    /*
+     * Handle the command.  We go back to reading from the client in the
+     * parent afterwards, so don't read past the end of the tokens that are
+     * part of this command.
+     */
+    client->unbuffered = true;
+    if (client->protocol == 1) {
+        server_v1_handle_messages(client, engine->config);
+        keepalive = false;
+    } else {
+        keepalive = server_v2_handle_token(client, engine->config,
+                                           &conn->command);
+        keepalive = keepalive && client->keepalive;
+    }
+
+    /*
+     * Pass the ACL decisions and the context back to the parent if the
+     * connection continues.
+     */
+    if (keepalive) {
+        major = gss_export_sec_context(&minor, &client->context, &exported);
+        if (major != GSS_S_COMPLETE)
+            warn_gssapi("while exporting context", major, minor);
+        else {
+            memset(&state, 0, sizeof(state));
+            if (client->acl_decisions != NULL) {
+                state.acl_generation = client->acl_generation;
+                state.acl_epoch = client->acl_epoch;
+                state.count = engine->config->count;
+            }
+            iov[0].iov_base = &state;
+            iov[0].iov_len = sizeof(state);
+            iov[1].iov_base = client->acl_decisions;
+            iov[1].iov_len = state.count * sizeof(enum acl_decision);
+            iov[2].iov_base = exported.value;
+            iov[2].iov_len = exported.length;
+            if (xwritev(pipe_fd, iov, 3) < 0)
+                syswarn("cannot pass context to parent");
+            gss_release_buffer(&minor, &exported);
+        }
+    }
+    close(pipe_fd);
+    server_config_free(engine->config);
+    exit(0);
+}
+
+
+/*
+ * Take the ACL decisions a child passed back from the start of the data it
+ * sent, replacing ours.  Decisions made against a configuration other than
+ * the current one are dropped.  Returns false if the data is malformed.
+ */
+static bool
+connection_take_decisions(struct connection *conn)
+{
+    struct client *client = conn->client;
+    struct child_state state;
+    size_t length;
+
+    if (evbuffer_remove(conn->context, &state, sizeof(state))
+        != (int) sizeof(state))
+        return false;
+    length = state.count * sizeof(enum acl_decision);
+    if (state.count > conn->engine->config->count
+        || evbuffer_get_length(conn->context) < length)
+        return false;
+    free(client->acl_decisions);
+    client->acl_decisions = NULL;
+    if (state.count == 0)
+        return true;
+    if (state.count != conn->engine->config->count
+        || state.acl_generation != conn->engine->config->generation) {
+        if (evbuffer_drain(conn->context, length) < 0)
+            die("internal error: cannot drain context buffer");
+        return true;
+    }
+    client->acl_decisions = xmalloc(length);
+    if (evbuffer_remove(conn->context, client->acl_decisions, length) < 0)
+        die("internal error: cannot move data from context buffer");
+    client->acl_generation = state.acl_generation;
+    client->acl_epoch = state.acl_epoch;
+    return true;
+}
+
+
+/*
+ * Called when there is data from a child on the pipe that returns its ACL
+ * decisions and the exported context.  Accumulate the data until end of
+ * file, and then import the context and go back to reading messages from the
+ * client.  If the child sent nothing, the connection is over.
+ */
+static void
+handle_pipe(evutil_socket_t fd, short what UNUSED, void *data)
+{
+    struct connection *conn = data;
+    struct client *client = conn->client;
+    gss_buffer_desc exported;
+    OM_uint32 major, minor;
+    int status;
+
+    status = evbuffer_read(conn->context, fd, 4096);
+    if (status < 0 && (socket_errno == EINTR || socket_errno == EAGAIN))
+        return;
+    if (status > 0)
+        return;
+    if (status < 0)
+        syswarn("cannot read context from child");
+    event_free(conn->pipe_event);
+    conn->pipe_event = NULL;
+    close(conn->pipe_fd);
+    conn->pipe_fd = INVALID_SOCKET;
+    conn->child = 0;
+    if (status < 0 || evbuffer_get_length(conn->context) == 0) {
+        connection_free(conn);
+        return;
+    }
+    if (!connection_take_decisions(conn)) {
+        warn("malformed state from child");
+        connection_free(conn);
+        return;
+    }
+    exported.length = evbuffer_get_length(conn->context);
+
+    /* Replace our stale copy of the context with the child's. */
+    exported.value = xmalloc(exported.length);
+    if (evbuffer_remove(conn->context, exported.value, exported.length) < 0)
+        die("internal error: cannot move data from context buffer");
+    gss_delete_sec_context(&minor, &client->context, GSS_C_NO_BUFFER);
+    major = gss_import_sec_context(&minor, &exported, &client->context);
+    free(exported.value);
+    if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while importing context", major, minor);
+        connection_free(conn);
+        return;
+    }
+
+    /* The child's network code may have changed the socket flags. */
+    fdflag_nonblocking(client->fd, true);
+    conn->state = STATE_MESSAGES;
+    if (event_add(conn->read_event, &timeout) < 0)
+        die("internal error: cannot add client read event");
+}
+
+
+/*
+ * Fork a child to handle a command (or, for protocol version one, the rest
+ * of the connection).  Reading from the client stops until the child is
+ * done, and the parent's copy of the command token is released.  Returns
+ * false on failure, in which case the caller should close the connection.
+ */
+static bool
+connection_launch(struct connection *conn)
+{
+    socket_type fds[2];
+    OM_uint32 minor;
+
+    conn->launch = false;
+    if (pipe(fds) < 0) {
+        syswarn("cannot create pipe for child");
+        return false;
+    }
+    fflush(stdout);
+    conn->child = fork();
+    if (conn->child < 0) {
+        syswarn("cannot fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    } else if (conn->child == 0) {
+        close(fds[0]);
+        fdflag_close_exec(fds[1], true);
+        connection_child(conn, fds[1]);
+    }
+    close(fds[1]);
+    debug("child %lu for %s", (unsigned long) conn->child,
+          conn->client->ipaddress);
+    gss_release_buffer(&minor, &conn->command);
+    conn->state = STATE_RUNNING;
+    event_del(conn->read_event);
+
+    /* Set up to receive the context back from the child. */
+    conn->pipe_fd = fds[0];
+    fdflag_close_exec(conn->pipe_fd, true);
+    fdflag_nonblocking(conn->pipe_fd, true);
+    if (conn->context == NULL) {
+        conn->context = evbuffer_new();
+        if (conn->context == NULL)
+            die("internal error: cannot create context buffer");
+    }
+    conn->pipe_event = event_new(conn->engine->base, conn->pipe_fd,
+                                 EV_READ | EV_PERSIST, handle_pipe, conn);
+    if (conn->pipe_event == NULL)
+        die("internal error: cannot create child pipe event");
+    if (event_add(conn->pipe_event, NULL) < 0)
+        die("internal error: cannot add child pipe event");
+    return true;
+}
+
+
+/*
+ * Launch a child once all pending output has been sent, so that our output
+ * and the child's can't be interleaved.  Returns false if launching the child
+ * failed.
+ */
+static bool
+connection_schedule_launch(struct connection *conn)
+{
+    if (evbuffer_get_length(conn->output) == 0)
+        return connection_launch(conn);
+    conn->launch = true;
+    event_del(conn->read_event);
+    return true;
+}
+
+
+/*
+ * Handle the initial token from the client, which only tells us which
+ * protocol version the client wants.
+ */
+static bool
+handle_initial_token(struct connection *conn, int flags)
+{
+    if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL))
+        conn->client->protocol = 2;
+    else if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT))
+        conn->client->protocol = 1;
+    else {
+        warn("bad token flags %d in initial token", flags);
+        return false;
+    }
+    conn->state = STATE_CONTEXT;
+    return true;
+}
+
+
+/*
+ * Handle a context negotiation token from the client.  This is the
+ * event-driven equivalent of the loop in server_new_client.
+ */
+static bool
+handle_context_token(struct connection *conn, int flags, gss_buffer_t token)
+{
+    struct client *client = conn->client;
+    gss_buffer_desc send_tok;
+    gss_OID doid;
+    OM_uint32 major, minor, acc_minor;
+
+    if (flags == TOKEN_CONTEXT)
+        client->protocol = 1;
+    else if (flags != (TOKEN_CONTEXT | TOKEN_PROTOCOL)) {
+        warn("bad token flags %d in context token", flags);
+        return false;
+    }
+    debug("received context token (size=%lu)", (unsigned long) token->length);
+    major = gss_accept_sec_context(&acc_minor, &client->context,
+                conn->engine->creds, token, GSS_C_NO_CHANNEL_BINDINGS,
+                &conn->name, &doid, &send_tok, &client->flags, NULL, NULL);
+    if (send_tok.length != 0) {
+        debug("sending context token (size=%lu)",
+              (unsigned long) send_tok.length);
+        flags = TOKEN_CONTEXT;
+        if (client->protocol > 1)
+            flags |= TOKEN_PROTOCOL;
+        connection_queue(conn, flags, &send_tok);
+        gss_release_buffer(&minor, &send_tok);
+    }
+    if (major == GSS_S_CONTINUE_NEEDED) {
+        debug("continue needed while accepting context");
+        return true;
+    } else if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while accepting context", major, acc_minor);
+        conn->closing = true;
+        return true;
+    }
+
+    /* The context is complete. */
+    if (!server_client_accepted(client, conn->name)) {
+        conn->closing = true;
+        return true;
+    }
+    gss_release_name(&minor, &conn->name);
+    debug("accepted connection from %s (protocol %d)", client->user,
+          client->protocol);
+    conn->state = STATE_MESSAGES;
+    if (client->protocol == 1)
+        return connection_schedule_launch(conn);
+    return true;
+}
+
+
+/*
+ * Handle a protocol message from the client.  Commands are passed off to a
+ * child; everything else is handled here.  This is the event-driven
+ * equivalent of server_v2_handle_token.
+ */
+static bool
+handle_message_token(struct connection *conn, gss_buffer_t token)
+{
+    gss_buffer_desc message;
+    OM_uint32 major, minor;
+    char reply[1 + 1 + 4 + 4 + 1];
+    size_t length;
+    char *p;
+    int state;
+
+    major = gss_unwrap(&minor, conn->client->context, token, &message,
+                       &state, NULL);
+    if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while unwrapping token", major, minor);
+        return connection_send_error(conn, ERROR_BAD_TOKEN, "Invalid token");
+    }
+    if (message.length < 2) {
+        gss_release_buffer(&minor, &message);
+        warn("short message from client");
+        return connection_send_error(conn, ERROR_BAD_TOKEN, "Invalid token");
+    }
+    p = message.value;
+    if (p[0] < 2 || p[0] > 4) {
+        gss_release_buffer(&minor, &message);
+        reply[0] = 2;
+        reply[1] = MESSAGE_VERSION;
+        reply[2] = 4;
+        return connection_send_priv(conn, reply, 3);
+    }
+    switch (p[1]) {
+    case MESSAGE_COMMAND:
+    case MESSAGE_COMMAND_STREAM:
+        conn->command = message;
+        return connection_schedule_launch(conn);
+    case MESSAGE_NOOP:
+        debug("replying to no-op message");
+        gss_release_buffer(&minor, &message);
+        reply[0] = 3;
+        reply[1] = MESSAGE_NOOP;
+        return connection_send_priv(conn, reply, 2);
+    case MESSAGE_CAPABILITIES:
+        debug("replying to capabilities message");
+        length = server_v2_capabilities_reply(conn->client, &message, reply);
+        gss_release_buffer(&minor, &message);
+        if (length == 0) {
+            warn("invalid capabilities message from client");
+            return connection_send_error(conn, ERROR_BAD_TOKEN,
+                                         "Invalid token");
+        }
+        return connection_send_priv(conn, reply, length);
+    case MESSAGE_QUIT:
+        debug("quit received, closing connection");
+        gss_release_buffer(&minor, &message);
+        return false;
+    default:
+        warn("unknown message type %d from client", (int) p[1]);
+        gss_release_buffer(&minor, &message);
+        return connection_send_error(conn, ERROR_UNKNOWN_MESSAGE,
+                                     "Unknown message");
+    }
+}
+
+
+/*
+ * Called when the client socket is readable or has been idle for too long.
+ * Read more of the current token and, once it's complete, dispatch it based
+ * on the state of the connection.
+ */
+static void
+handle_read(evutil_socket_t fd UNUSED, short what, void *data)
+{
+    struct connection *conn = data;
+    gss_buffer_desc token;
+    int flags, status;
+    bool okay = false;
+
+    if (what & EV_TIMEOUT) {
+        warn("timeout waiting for client %s", conn->client->ipaddress);
+        connection_free(conn);
+        return;
+    }
+    status = connection_read(conn);
+    if (status == 0)
+        return;
+    if (status < 0) {
+        connection_free(conn);
+        return;
+    }
+
+    /* We have a complete token.  Reset the read state and dispatch it. */
+    flags = conn->header[0];
+    token.value = conn->data;
+    token.length = conn->length;
+    conn->data = NULL;
+    conn->have = 0;
+    switch (conn->state) {
+    case STATE_INITIAL:
+        okay = handle_initial_token(conn, flags);
+        break;
+    case STATE_CONTEXT:
+        okay = handle_context_token(conn, flags, &token);
+        break;
+    case STATE_MESSAGES:
+        okay = handle_message_token(conn, &token);
+        break;
+    case STATE_RUNNING:
+        warn("internal error: read from client while running command");
+        break;
+    }
+    free(token.value);
+    if (!okay)
+        connection_free(conn);
+    else if (conn->closing && evbuffer_get_length(conn->output) == 0)
+        connection_free(conn);
+}
+
+
+/*
+ * Called when the client socket is writable and we have output queued, or
+ * when the client hasn't accepted any output for too long.  Send as much as
+ * we can.  Once all output is flushed, either close the connection, launch a
+ * pending command, or go back to reading.
+ */
+static void
+handle_write(evutil_socket_t fd, short what, void *data)
+{
+    struct connection *conn = data;
+
+    if (what & EV_TIMEOUT) {
+        warn("timeout writing to client %s", conn->client->ipaddress);
+        connection_free(conn);
+        return;
+    }
+    if (evbuffer_write(conn->output, fd) < 0) {
+        if (socket_errno == EINTR || socket_errno == EAGAIN)
+            return;
+        syswarn("error writing to client %s", conn->client->ipaddress);
+        connection_free(conn);
+        return;
+    }
+    if (evbuffer_get_length(conn->output) > 0)
+        return;
+    event_del(conn->write_event);
+    if (conn->closing)
+        connection_free(conn);
+    else if (conn->launch) {
+        if (!connection_launch(conn))
+            connection_free(conn);
+    } else if (event_add(conn->read_event, &timeout) < 0)
+        die("internal error: cannot add client read event");
+}
+
+
+/*
+ * Called when one of the listening sockets has a new connection.  Accept it
+ * and set up a new connection struct to read the initial token.
+ */
+static void
+handle_accept(evutil_socket_t fd, short what UNUSED, void *data)
+{
+    struct engine *engine = data;
+    struct connection *conn;
+    struct client *client;
+    socket_type s;
+
+    s = accept(fd, NULL, NULL);
+    if (s == INVALID_SOCKET) {
+        if (socket_errno != EINTR && socket_errno != EAGAIN
+            && socket_errno != ECONNABORTED)
+            syswarn("error accepting incoming connection");
+        return;
+    }
+    fdflag_close_exec(s, true);
+    fdflag_nonblocking(s, true);
+    client = server_client_create(s);
+    if (client == NULL) {
+        close(s);
+        return;
+    }
+    debug("connection from %s", client->ipaddress);
+
+    /* Create the connection and add it to the list. */
+    conn = xcalloc(1, sizeof(struct connection));
+    conn->engine = engine;
+    conn->client = client;
+    conn->state = STATE_INITIAL;
+    conn->name = GSS_C_NO_NAME;
+    conn->pipe_fd = INVALID_SOCKET;
+    conn->output = evbuffer_new();
+    if (conn->output == NULL)
+        die("internal error: cannot create client output buffer");
+    conn->read_event = event_new(engine->base, s, EV_READ | EV_PERSIST,
+                                 handle_read, conn);
+    conn->write_event = event_new(engine->base, s, EV_WRITE | EV_PERSIST,
+                                  handle_write, conn);
+    if (conn->read_event == NULL || conn->write_event == NULL)
+        die("internal error: cannot create client events");
+    if (event_add(conn->read_event, &timeout) < 0)
+        die("internal error: cannot add client read event");
+    conn->next = engine->connections;
+    if (conn->next != NULL)
+        conn->next->prev = conn;
+    engine->connections = conn;
+}
+
+
+/*
+ * Signal handlers, run from the event loop.  Reap children on SIGCHLD,
+ * reload the configuration on SIGHUP or on SIGIO (sent when watching the
+ * configuration for changes), and exit on SIGINT or SIGTERM.
+ */
+static void
+handle_sigchld(evutil_socket_t sig UNUSED, short what UNUSED,
+               void *data UNUSED)
+{
+    pid_t child;
+    int status;
+
+    while ((child = waitpid(-1, &status, WNOHANG)) > 0)
+        server_log_child(child, status);
+}
+
+static void
+handle_sighup(evutil_socket_t sig UNUSED, short what UNUSED, void *data)
+{
+    struct engine *engine = data;
+
+    server_watch_reload(engine->config, engine->config_path);
+}
+
+static void
+handle_exit(evutil_socket_t sig UNUSED, short what UNUSED, void *data)
+{
+    struct engine *engine = data;
+
+    notice("signal received, exiting");
+    event_base_loopexit(engine->base, NULL);
+}
+
+
+/*
+ * Create and add a signal event, dying on failure.
+ */
+static struct event *
+add_signal(struct engine *engine, int sig, event_callback_fn callback)
+{
+    struct event *event;
+
+    event = evsignal_new(engine->base, sig, callback, engine);
+    if (event == NULL)
+        die("internal error: cannot create signal event");
+    if (event_add(event, NULL) < 0)
+        die("internal error: cannot add signal event");
+    return event;
+}
+
+
+/*
+ * Run the event-driven server on the given listening sockets until told to
+ * exit.  Takes the listening sockets, the configuration and the path from
+ * which to reload it, and the server credentials.  Any connections still
+ * open on exit are closed, but children running commands are left to finish
+ * on their own.
+ */
+void
+server_engine_run(socket_type fds[], unsigned int nfds, struct config *config,
+                  const char *config_path, gss_cred_id_t creds)
+{
+    struct engine engine;
+    unsigned int i;
+
+    memset(&engine, 0, sizeof(engine));
+    engine.base = event_base_new();
+    if (engine.base == NULL)
+        die("internal error: cannot create event base");
+    engine.config = config;
+    engine.config_path = config_path;
+    engine.creds = creds;
+    engine.fds = fds;
+    engine.nfds = nfds;
+
+    /* Set up the listening sockets. */
+    engine.listeners = xcalloc(nfds, sizeof(struct event *));
+    for (i = 0; i < nfds; i++) {
+        if (!fdflag_nonblocking(fds[i], true))
+            sysdie("cannot make listening socket non-blocking");
+        engine.listeners[i] = event_new(engine.base, fds[i],
+                                        EV_READ | EV_PERSIST, handle_accept,
+                                        &engine);
+        if (engine.listeners[i] == NULL)
+            die("internal error: cannot create accept event");
+        if (event_add(engine.listeners[i], NULL) < 0)
+            die("internal error: cannot add accept event");
+    }
+
+    /* Set up signal handling. */
+    engine.sigchld = add_signal(&engine, SIGCHLD, handle_sigchld);
+    engine.sighup  = add_signal(&engine, SIGHUP, handle_sighup);
+    engine.sigio   = add_signal(&engine, SIGIO, handle_sighup);
+    engine.sigint  = add_signal(&engine, SIGINT, handle_exit);
+    engine.sigterm = add_signal(&engine, SIGTERM, handle_exit);
+
+    /* Run until told to exit. */
+    if (event_base_dispatch(engine.base) < 0)
+        die("internal error: event loop failed");
+
+    /* Clean up. */
+    while (engine.connections != NULL)
+        connection_free(engine.connections);
+    for (i = 0; i < nfds; i++)
+        event_free(engine.listeners[i]);
+    free(engine.listeners);
+    event_free(engine.sigchld);
+    event_free(engine.sighup);
+    event_free(engine.sigio);
+    event_free(engine.sigint);
+    event_free(engine.sigterm);
+    event_base_free(engine.base);
+}
@@ -0,0 +1,496 @@
+/*
+ * Running a command through a persistent FastCGI backend.
+ *
+ * Rules with the fastcgi option, rather than running a program for each
+ * command, send the command to a pool of long-running worker processes that
+ * accept connections on a UNIX domain socket.  This avoids the cost of
+ * starting a new process (and, for backends written in Perl or Python, a new
+ * interpreter) for every command.
+ *
+ * remctld plays the role of the web server in the FastCGI protocol and sends
+ * one request per connection in the responder role.  The command is passed in
+ * the parameters:
+ *
+ *     REMUSER, REMOTE_USER, REMOTE_ADDR, REMOTE_HOST, REMCTL_COMMAND
+ *         The same values as are set in the environment of a command.
+ *     SCRIPT_FILENAME
+ *         The executable from the configuration rule.
+ *     REMCTL_ARGC, REMCTL_ARG_1 ... REMCTL_ARG_<n>
+ *         The arguments that would otherwise have been passed on the command
+ *         line, starting with the subcommand.
+ *
+ * and the argument passed on standard input, if any, is sent on the FastCGI
+ * stdin stream.  Data the worker sends on its stdout and stderr streams is
+ * returned to the client as output, and the application status of the end
+ * request record is the exit status of the command.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/protocol.h>
+#include <util/xmalloc.h>
+
+/* Same portability glue as in process.c. */
+#ifndef HAVE_EVENT_BASE_LOOPBREAK
+# define event_base_loopbreak(base) /* empty */
+#endif
+
+/* Not defined everywhere, but this is the traditional encoding. */
+#ifndef W_EXITCODE
+# define W_EXITCODE(ret, sig) ((ret) << 8 | (sig))
+#endif
+
+/* FastCGI protocol constants. */
+#define FCGI_VERSION_1          1
+#define FCGI_HEADER_LEN         8
+#define FCGI_MAX_CONTENT        65535
+#define FCGI_REQUEST_ID         1
+#define FCGI_RESPONDER          1
+#define FCGI_REQUEST_COMPLETE   0
+
+/* FastCGI record types that we send or handle. */
+enum fcgi_type {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_END_REQUEST   = 3,
+    FCGI_PARAMS        = 4,
+    FCGI_STDIN         = 5,
+    FCGI_STDOUT        = 6,
+    FCGI_STDERR        = 7
+};
+
+/* State for reading the response from the backend. */
+struct backend {
+    struct process *process;    /* The command being run. */
+    unsigned char header[FCGI_HEADER_LEN]; /* Header of current record. */
+    bool have_header;           /* Whether header has been read. */
+    unsigned char *content;     /* Scratch space for record content. */
+    struct evbuffer *stream;    /* Output to pass to server_process_output. */
+};
+
+
+/*
+ * Add a single record with the given type and content to a buffer.  The
+ * content must be no longer than FCGI_MAX_CONTENT.
+ */
+static void
+add_record(struct evbuffer *buf, enum fcgi_type type, const void *data,
+           size_t length)
+{
+    unsigned char header[FCGI_HEADER_LEN];
+
+    header[0] = FCGI_VERSION_1;
+    header[1] = type;
+    header[2] = (FCGI_REQUEST_ID >> 8) & 0xff;
+    header[3] = FCGI_REQUEST_ID & 0xff;
+    header[4] = (length >> 8) & 0xff;
+    header[5] = length & 0xff;
+    header[6] = 0;
+    header[7] = 0;
+    if (evbuffer_add(buf, header, sizeof(header)) < 0)
+        die("internal error: cannot queue FastCGI record");
+    if (length > 0 && evbuffer_add(buf, data, length) < 0)
+        die("internal error: cannot queue FastCGI record");
+}
+
+
+/*
+ * Add the contents of an evbuffer (which may be NULL) to the request as a
+ * FastCGI stream of the given type, followed by the empty record that ends
+ * the stream.  The source buffer is drained.  Takes scratch space of at least
+ * FCGI_MAX_CONTENT bytes.
+ */
+static void
+add_stream(struct evbuffer *buf, enum fcgi_type type, struct evbuffer *data,
+           unsigned char *scratch)
+{
+    int length;
+
+    if (data != NULL)
+        while ((length = evbuffer_remove(data, scratch, FCGI_MAX_CONTENT)) > 0)
+            add_record(buf, type, scratch, length);
+    add_record(buf, type, NULL, 0);
+}
+
+
+/*
+ * Add a name-value pair to a buffer of FastCGI parameters.  Lengths under 128
+ * are encoded in one byte and longer lengths in four.
+ */
+static void
+add_param(struct evbuffer *params, const char *name, const char *value,
+          size_t length)
+{
+    unsigned char lengths[8];
+    size_t lens[2], i, n;
+
+    lens[0] = strlen(name);
+    lens[1] = length;
+    for (n = 0, i = 0; i < ARRAY_SIZE(lens); i++)
+        if (lens[i] < 128)
+            lengths[n++] = lens[i];
+        else {
+            lengths[n++] = ((lens[i] >> 24) & 0x7f) | 0x80;
+            lengths[n++] = (lens[i] >> 16) & 0xff;
+            lengths[n++] = (lens[i] >> 8) & 0xff;
+            lengths[n++] = lens[i] & 0xff;
+        }
+    if (evbuffer_add(params, lengths, n) < 0
+        || evbuffer_add(params, name, lens[0]) < 0
+        || evbuffer_add(params, value, length) < 0)
+        die("internal error: cannot queue FastCGI parameter");
+}
+
+
+/*
+ * Build the complete FastCGI request for a process.  Returns a newly
+ * allocated evbuffer.  The input buffer of the process, if any, is drained.
+ */
+static struct evbuffer *
+build_request(struct process *process, unsigned char *scratch)
+{
+    struct client *client = process->client;
+    struct evbuffer *request, *params;
+    unsigned char begin[8] = { 0, FCGI_RESPONDER, 0, 0, 0, 0, 0, 0 };
+    char name[32], argc[32];
+    size_t count;
+
+    request = evbuffer_new();
+    params = evbuffer_new();
+    if (request == NULL || params == NULL)
+        die("internal error: cannot create FastCGI request buffer");
+    add_record(request, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+
+    /* The environment a program would get, plus the arguments. */
+    add_param(params, "REMUSER", client->user, strlen(client->user));
+    add_param(params, "REMOTE_USER", client->user, strlen(client->user));
+    add_param(params, "REMOTE_ADDR", client->ipaddress,
+              strlen(client->ipaddress));
+    if (client->hostname != NULL)
+        add_param(params, "REMOTE_HOST", client->hostname,
+                  strlen(client->hostname));
+    add_param(params, "REMCTL_COMMAND", process->command,
+              strlen(process->command));
+    add_param(params, "SCRIPT_FILENAME", process->rule->program,
+              strlen(process->rule->program));
+    for (count = 0; process->argv[count + 1] != NULL; count++) {
+        snprintf(name, sizeof(name), "REMCTL_ARG_%lu",
+                 (unsigned long) count + 1);
+        add_param(params, name, process->argv[count + 1],
+                  strlen(process->argv[count + 1]));
+    }
+    snprintf(argc, sizeof(argc), "%lu", (unsigned long) count);
+    add_param(params, "REMCTL_ARGC", argc, strlen(argc));
+    add_stream(request, FCGI_PARAMS, params, scratch);
+    evbuffer_free(params);
+
+    /* Standard input, if any, and then the end of the request. */
+    add_stream(request, FCGI_STDIN, process->input, scratch);
+    return request;
+}
+
+
+/*
+ * Abort the request after an error, sending an error to the client and
+ * breaking out of the event loop.
+ */
+static void
+backend_fail(struct backend *backend)
+{
+    struct process *process = backend->process;
+
+    server_send_error(process->client, ERROR_INTERNAL, "Internal failure");
+    process->saw_error = true;
+    event_base_loopbreak(process->loop);
+}
+
+
+/*
+ * Called when a FastCGI command has run past its timeout.  There's no process
+ * group to kill, so just abandon the request by breaking out of the event
+ * loop.  server_fastcgi_run then closes the connection to the backend and
+ * reports the timeout to the client.
+ */
+static void
+handle_backend_timeout(evutil_socket_t junk UNUSED, short what UNUSED,
+                       void *data)
+{
+    struct backend *backend = data;
+    struct process *process = backend->process;
+
+    warn("command %s from user %s timed out after %ld seconds",
+         process->command, process->client->user,
+         server_process_timeout(process));
+    process->timed_out = true;
+    bufferevent_disable(process->inout, EV_READ | EV_WRITE);
+    event_base_loopbreak(process->loop);
+}
+
+
+/*
+ * Handle the content of a single record from the backend, which has been
+ * read into backend->content.  Returns false if the request is finished,
+ * either successfully or with an error.
+ */
+static bool
+handle_record(struct backend *backend, size_t length)
+{
+    struct process *process = backend->process;
+    struct client *client = process->client;
+    const unsigned char *p = backend->content;
+    size_t space;
+    unsigned long status;
+    int stream;
+
+    switch (backend->header[1]) {
+    case FCGI_STDOUT:
+    case FCGI_STDERR:
+        if (length == 0)
+            return true;
+
+        /*
+         * For protocol version one, keep as much output as we can return and
+         * discard the rest, as with a normal process.
+         */
+        if (client->protocol == 1) {
+            space = TOKEN_MAX_OUTPUT_V1 - evbuffer_get_length(process->output);
+            if (length > space)
+                length = space;
+            if (evbuffer_add(process->output, p, length) < 0)
+                die("internal error: cannot store FastCGI output");
+            return true;
+        }
+        stream = (backend->header[1] == FCGI_STDOUT) ? 1 : 2;
+        if (evbuffer_add(backend->stream, p, length) < 0)
+            die("internal error: cannot store FastCGI output");
+        if (!server_process_output(process, stream, backend->stream)) {
+            process->saw_error = true;
+            event_base_loopbreak(process->loop);
+            return false;
+        }
+        return true;
+
+    case FCGI_END_REQUEST:
+        if (length < 8) {
+            warn("invalid FastCGI end request record from %s",
+                 process->rule->fastcgi);
+            backend_fail(backend);
+            return false;
+        }
+        if (p[4] != FCGI_REQUEST_COMPLETE) {
+            warn("FastCGI backend %s rejected request (status %d)",
+                 process->rule->fastcgi, p[4]);
+            backend_fail(backend);
+            return false;
+        }
+        status = ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16)
+               | ((unsigned long) p[2] << 8) | p[3];
+        process->status = W_EXITCODE((int) (status & 0xff), 0);
+        process->reaped = true;
+        event_base_loopexit(process->loop, NULL);
+        return false;
+
+    /* Ignore anything else, such as management records. */
+    default:
+        return true;
+    }
+}
+
+
+/*
+ * Called when data is available from the backend.  Process each complete
+ * record.
+ */
+static void
+handle_backend_read(struct bufferevent *bev, void *data)
+{
+    struct backend *backend = data;
+    struct evbuffer *buf;
+    size_t length, padding;
+
+    buf = bufferevent_get_input(bev);
+    while (!backend->process->reaped) {
+        if (!backend->have_header) {
+            if (evbuffer_get_length(buf) < FCGI_HEADER_LEN)
+                return;
+            if (evbuffer_remove(buf, backend->header, FCGI_HEADER_LEN) < 0)
+                die("internal error: cannot read FastCGI record header");
+            if (backend->header[0] != FCGI_VERSION_1) {
+                warn("invalid FastCGI record from %s",
+                     backend->process->rule->fastcgi);
+                bufferevent_disable(bev, EV_READ | EV_WRITE);
+                backend_fail(backend);
+                return;
+            }
+            backend->have_header = true;
+        }
+        length = (backend->header[4] << 8) | backend->header[5];
+        padding = backend->header[6];
+        if (evbuffer_get_length(buf) < length + padding)
+            return;
+        if (length > 0)
+            if (evbuffer_remove(buf, backend->content, length) < 0)
+                die("internal error: cannot read FastCGI record");
+        if (padding > 0 && evbuffer_drain(buf, padding) < 0)
+            die("internal error: cannot read FastCGI record");
+        backend->have_header = false;
+        if (!handle_record(backend, length)) {
+            bufferevent_disable(bev, EV_READ | EV_WRITE);
+            return;
+        }
+    }
+}
+
+
+/*
+ * Called on EOF or an error from the backend.  Either means the backend went
+ * away before finishing the request.
+ */
+static void
+handle_backend_event(struct bufferevent *bev, short events, void *data)
+{
+    struct backend *backend = data;
+    struct process *process = backend->process;
+
+    if (events & BEV_EVENT_EOF)
+        warn("FastCGI backend %s closed connection before end of request",
+             process->rule->fastcgi);
+    else
+        syswarn("error talking to FastCGI backend %s",
+                process->rule->fastcgi);
+    bufferevent_disable(bev, EV_READ | EV_WRITE);
+    backend_fail(backend);
+}
+
+
+/*
+ * Connect to the FastCGI backend listening on the given UNIX domain socket.
+ * Returns the connected socket or INVALID_SOCKET on failure, after logging
+ * a warning.
+ */
+static socket_type
+backend_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    socket_type fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        warn("FastCGI socket path %s too long", path);
+        return INVALID_SOCKET;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET) {
+        syswarn("cannot create socket for FastCGI backend");
+        return INVALID_SOCKET;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        syswarn("cannot connect to FastCGI backend %s", path);
+        close(fd);
+        return INVALID_SOCKET;
+    }
+    fdflag_close_exec(fd, true);
+    return fd;
+}
+
+
+/*
+ * Run a command through the FastCGI backend for its rule.  Called by
+ * server_process_run_all with the event loop already set up in the process.
+ * Sends the request and relays the output to the client as it arrives,
+ * storing the exit status in the process.  Returns true on success and false
+ * on failure, after sending an error to the client.
+ */
+bool
+server_fastcgi_run(struct process *process)
+{
+    struct client *client = process->client;
+    struct backend backend;
+    struct evbuffer *request;
+    struct timeval tv;
+    socket_type fd;
+    long timeout;
+
+    fd = backend_connect(process->rule->fastcgi);
+    if (fd == INVALID_SOCKET) {
+        server_send_error(client, ERROR_INTERNAL, "Internal failure");
+        return false;
+    }
+    memset(&backend, 0, sizeof(backend));
+    backend.process = process;
+    backend.content = xmalloc(FCGI_MAX_CONTENT);
+    backend.stream = evbuffer_new();
+    if (backend.stream == NULL)
+        die("internal error: cannot create FastCGI output buffer");
+    if (client->protocol == 1) {
+        process->output = evbuffer_new();
+        if (process->output == NULL)
+            die("internal error: cannot create output buffer");
+    }
+
+    /* Queue the whole request and then relay the response. */
+    request = build_request(process, backend.content);
+    fdflag_nonblocking(fd, true);
+    process->stdinout_fd = fd;
+    process->inout = bufferevent_socket_new(process->loop, fd, 0);
+    if (process->inout == NULL)
+        die("internal error: cannot create FastCGI bufferevent");
+    bufferevent_setcb(process->inout, handle_backend_read, NULL,
+                      handle_backend_event, &backend);
+    bufferevent_enable(process->inout, EV_READ | EV_WRITE);
+    if (bufferevent_write_buffer(process->inout, request) < 0)
+        die("internal error: cannot queue FastCGI request");
+    evbuffer_free(request);
+    timeout = server_process_timeout(process);
+    if (timeout > 0) {
+        tv.tv_sec = timeout;
+        tv.tv_usec = 0;
+        process->timer = evtimer_new(process->loop, handle_backend_timeout,
+                                     &backend);
+        if (process->timer == NULL || evtimer_add(process->timer, &tv) < 0)
+            die("internal error: cannot create FastCGI timeout event");
+    }
+    if (event_base_dispatch(process->loop) < 0)
+        die("internal error: FastCGI event loop failed");
+
+    /* Clean up.  The event base may have pending events after an error. */
+    if (process->timer != NULL)
+        event_free(process->timer);
+    process->timer = NULL;
+    bufferevent_free(process->inout);
+    process->inout = NULL;
+    close(fd);
+    process->stdinout_fd = INVALID_SOCKET;
+    free(backend.content);
+    evbuffer_free(backend.stream);
+
+    /*
+     * As with a forked command, report a timeout instead of an exit status
+     * after any output the backend already sent.
+     */
+    if (process->timed_out) {
+        server_send_error(client, ERROR_TIMEOUT, "Command timed out");
+        server_process_free_loop(client);
+        return false;
+    }
+    if (process->saw_error || !process->reaped) {
+        if (!process->saw_error)
+            backend_fail(&backend);
+        server_process_free_loop(client);
+        return false;
+    }
+    return true;
+}
@@ -19,6 +19,8 @@
 #include <portable/system.h>
 #include <portable/uio.h>
 
+#include <time.h>
+
 #include <server/internal.h>
 #include <util/messages.h>
 #include <util/protocol.h>
@@ -27,62 +29,139 @@
 
 
 /*
- * Create a new client struct from a file descriptor and establish a GSS-API
- * context as a specified service with an incoming client and fills out the
- * client struct.  Returns a new client struct on success and NULL on failure,
- * logging an appropriate error message.
+ * Create a new client struct for a file descriptor and fill in the IP address
+ * of the remote host.  The hostname is filled in separately by
+ * server_client_resolve, since that may block on DNS.  Returns the new client
+ * struct on success and NULL on failure, logging an appropriate error
+ * message.  The file descriptor is not closed on failure.
  */
 struct client *
-server_new_client(int fd, gss_cred_id_t creds)
+server_client_create(int fd)
 {
     struct client *client;
     struct sockaddr_storage ss;
     socklen_t socklen;
-    size_t length;
-    char *buffer;
-    gss_buffer_desc send_tok, recv_tok, name_buf;
-    gss_name_t name = GSS_C_NO_NAME;
-    gss_OID doid;
-    OM_uint32 major = 0;
-    OM_uint32 minor = 0;
-    OM_uint32 acc_minor;
-    int flags, status;
-    static const OM_uint32 req_gss_flags
-        = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
+    int status;
 
     /* Create and initialize a new client struct. */
     client = xcalloc(1, sizeof(struct client));
     client->fd = fd;
     client->context = GSS_C_NO_CONTEXT;
+    client->token_max = TOKEN_MAX_DATA;
 
-    /* Fill in hostname and IP address. */
+    /* Fill in the IP address. */
     socklen = sizeof(ss);
     if (getpeername(fd, (struct sockaddr *) &ss, &socklen) != 0) {
         syswarn("cannot get peer address");
         goto fail;
     }
-    length = INET6_ADDRSTRLEN;
-    buffer = xmalloc(length);
-    client->ipaddress = buffer;
-    status = getnameinfo((struct sockaddr *) &ss, socklen, buffer, length,
-                         NULL, 0, NI_NUMERICHOST);
+    client->ipaddress = xmalloc(INET6_ADDRSTRLEN);
+    status = getnameinfo((struct sockaddr *) &ss, socklen, client->ipaddress,
+                         INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST);
     if (status != 0) {
         syswarn("cannot translate IP address of client: %s",
                 gai_strerror(status));
         goto fail;
     }
-    length = NI_MAXHOST;
-    buffer = xmalloc(length);
-    status = getnameinfo((struct sockaddr *) &ss, socklen, buffer, length,
+    return client;
+
+fail:
+    free(client->ipaddress);
+    free(client);
+    return NULL;
+}
+
+
+/*
+ * Look up the hostname of the remote host and store it in the client struct.
+ * Failure is not an error; the hostname is just left as NULL.
+ */
+void
+server_client_resolve(struct client *client)
+{
+    struct sockaddr_storage ss;
+    socklen_t socklen;
+    char *buffer;
+    int status;
+
+    if (client->hostname != NULL)
+        return;
+    socklen = sizeof(ss);
+    if (getpeername(client->fd, (struct sockaddr *) &ss, &socklen) != 0)
+        return;
+    buffer = xmalloc(NI_MAXHOST);
+    status = getnameinfo((struct sockaddr *) &ss, socklen, buffer, NI_MAXHOST,
                          NULL, 0, NI_NAMEREQD);
     if (status == 0)
         client->hostname = buffer;
     else
         free(buffer);
+}
+
+
+/*
+ * Finish setting up a client once the GSS-API context has been established.
+ * Takes the client and the client name returned by gss_accept_sec_context,
+ * checks that the right context flags were negotiated, and stores the display
+ * form of the name as the client user.  Returns true on success and false on
+ * failure, logging an appropriate error message.
+ */
+bool
+server_client_accepted(struct client *client, gss_name_t name)
+{
+    gss_buffer_desc name_buf;
+    gss_OID doid;
+    OM_uint32 major, minor;
+    static const OM_uint32 req_gss_flags
+        = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
+
+    /* Make sure that the appropriate context flags are set. */
+    if (client->protocol > 1) {
+        if ((client->flags & req_gss_flags) != req_gss_flags) {
+            warn("client did not negotiate appropriate GSS-API flags");
+            return false;
+        }
+    }
+
+    /* Get the display version of the client name and store it. */
+    major = gss_display_name(&minor, name, &name_buf, &doid);
+    if (major != GSS_S_COMPLETE) {
+        warn_gssapi("while displaying client name", major, minor);
+        return false;
+    }
+    client->user = xstrndup(name_buf.value, name_buf.length);
+    gss_release_buffer(&minor, &name_buf);
+    return true;
+}
+
+
+/*
+ * Create a new client struct from a file descriptor and establish a GSS-API
+ * context as a specified service with an incoming client and fills out the
+ * client struct.  Returns a new client struct on success and NULL on failure,
+ * logging an appropriate error message.
+ */
+struct client *
+server_new_client(int fd, gss_cred_id_t creds)
+{
+    struct client *client;
+    gss_buffer_desc send_tok, recv_tok;
+    gss_name_t name = GSS_C_NO_NAME;
+    gss_OID doid;
+    OM_uint32 major = 0;
+    OM_uint32 minor = 0;
+    OM_uint32 acc_minor;
+    int flags, status;
+
+    /* Create a new client struct and fill in hostname and IP address. */
+    client = server_client_create(fd);
+    if (client == NULL)
+        return NULL;
+    server_client_resolve(client);
 
     /* Accept the initial (worthless) token. */
-    status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                        TIMEOUT);
+    status = token_recv(client->fd, &client->buffer, &flags, &recv_tok,
+                        TOKEN_MAX_LENGTH, TIMEOUT);
     if (status != TOKEN_OK) {
         warn_token("receiving initial token", status, major, minor);
         goto fail;
@@ -99,8 +178,8 @@ server_new_client(int fd, gss_cred_id_t creds)
 
     /* Now, do the real work of negotiating the context. */
     do {
-        status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                            TIMEOUT);
+        status = token_recv(client->fd, &client->buffer, &flags, &recv_tok,
+                            TOKEN_MAX_LENGTH, TIMEOUT);
         if (status != TOKEN_OK) {
             warn_token("receiving context token", status, major, minor);
             goto fail;
@@ -144,23 +223,10 @@ server_new_client(int fd, gss_cred_id_t creds)
             debug("continue needed while accepting context");
     } while (major == GSS_S_CONTINUE_NEEDED);
 
-    /* Make sure that the appropriate context flags are set. */
-    if (client->protocol > 1) {
-        if ((client->flags & req_gss_flags) != req_gss_flags) {
-            warn("client did not negotiate appropriate GSS-API flags");
-            goto fail;
-        }
-    }
-
-    /* Get the display version of the client name and store it. */
-    major = gss_display_name(&minor, name, &name_buf, &doid);
-    if (major != GSS_S_COMPLETE) {
-        warn_gssapi("while displaying client name", major, minor);
+    /* Check the context flags and store the client identity. */
+    if (!server_client_accepted(client, name))
         goto fail;
-    }
     gss_release_name(&minor, &name);
-    client->user = xstrndup(name_buf.value, name_buf.length);
-    gss_release_buffer(&minor, &name_buf);
     return client;
 
 fail:
@@ -190,11 +256,14 @@ server_free_client(struct client *client)
         if (major != GSS_S_COMPLETE)
             warn_gssapi("while deleting context", major, minor);
     }
+    server_process_free_loop(client);
     if (client->fd >= 0)
         close(client->fd);
+    token_buffer_free(&client->buffer);
     free(client->user);
     free(client->hostname);
     free(client->ipaddress);
+    free(client->acl_decisions);
     free(client);
 }
 
@@ -309,3 +378,21 @@ server_send_error(struct client *client, enum error_codes error,
         return result;
     }
 }
+
+
+/*
+ * Return the current time in seconds for measuring how long something has
+ * been cached or has waited.  Use a monotonic clock if one is available so
+ * that changes to the system time don't affect the result.
+ */
+time_t
+server_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ts.tv_sec;
+#endif
+    return time(NULL);
+}
@@ -20,13 +20,17 @@
 #include <sys/types.h>
 
 #include <util/protocol.h>
+#include <util/tokens.h>
 
 /* Forward declarations to avoid extra includes. */
 struct bufferevent;
+struct compressor;
 struct evbuffer;
 struct event;
 struct event_base;
 struct iovec;
+struct stat;
+struct vector;
 
 /*
  * The maximum size of argc passed to the server (4K arguments), and the
@@ -43,9 +47,28 @@ struct iovec;
  */
 #define TIMEOUT (60 * 60)
 
+/* The nanosecond part of a file modification time, if available. */
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+# define ST_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#else
+# define ST_MTIME_NSEC(st) 0
+#endif
+
+/*
+ * The result of checking a user against the ACLs for a rule.  ACL_UNDECIDED
+ * is returned if the check failed with an error, which denies access but
+ * shouldn't be remembered.
+ */
+enum acl_decision {
+    ACL_UNDECIDED = 0,
+    ACL_PERMIT,
+    ACL_REFUSE
+};
+
 /* Holds the information about a client connection. */
 struct client {
     int fd;                     /* File descriptor of client connection. */
+    struct token_buffer buffer; /* Data read from fd but not yet used. */
     char *hostname;             /* Hostname of client (if available). */
     char *ipaddress;            /* IP address of client as a string. */
     int protocol;               /* Protocol version number. */
@@ -54,6 +77,42 @@ struct client {
     OM_uint32 flags;            /* Connection flags. */
     bool keepalive;             /* Whether keep-alive was set. */
     bool fatal;                 /* Whether a fatal error has occurred. */
+    bool tagged;                /* Whether the command is protocol v4. */
+    uint32_t request_id;        /* Request ID of a protocol v4 command. */
+    size_t token_max;           /* Negotiated maximum token data size. */
+    int compression;            /* Negotiated compression method, if any. */
+
+    /*
+     * Set while the last argument of a command, which is being passed to it
+     * on standard input, is still arriving in continuation tokens, or for a
+     * filter command, until the client ends its input.
+     */
+    bool streaming;             /* Whether standard input is still arriving. */
+    size_t stream_left;         /* Bytes of standard input still to come. */
+    bool filter;                /* Whether the command is a filter (v4). */
+
+    /*
+     * Set if another process will read from the connection after us, so we
+     * must not read past the end of each token.
+     */
+    bool unbuffered;
+
+    /*
+     * Used by the process loop, created when the first command is run and
+     * kept for the life of the connection.
+     */
+    struct event_base *loop;    /* Event base for running commands. */
+    struct event *sigchld;      /* Handle the SIGCHLD signal for exit. */
+    struct process *processes;  /* Commands currently running, if any. */
+    size_t nprocesses;          /* Count of commands currently running. */
+
+    /*
+     * ACL decisions for user, indexed by rule position, and the generation
+     * of the configuration and the ACL epoch they were made against.
+     */
+    enum acl_decision *acl_decisions;
+    unsigned long acl_generation;
+    unsigned long acl_epoch;
 };
 
 /* Holds the configuration for a single command. */
@@ -66,19 +125,54 @@ struct rule {
     char *program;              /* Full file name of executable. */
     unsigned int *logmask;      /* Zero-terminated list of args to mask. */
     long stdin_arg;             /* Arg to pass on stdin, -1 for last. */
+    long timeout;               /* Seconds to allow, 0 for the default. */
+    long max_concurrent;        /* Most copies running at once, 0 for any. */
+    long compress;              /* Output compression level, 0 for none. */
     char *user;                 /* Run executable as user. */
     uid_t uid;                  /* Run executable with this UID. */
     gid_t gid;                  /* Run executable with this GID. */
     char *summary;              /* Argument that gives a command summary. */
     char *help;                 /* Argument that gives help for a command. */
+    char *fastcgi;              /* UNIX socket of FastCGI backend, if any. */
     char **acls;                /* Full file names of ACL files. */
+    size_t index;               /* Position of this rule in the config. */
+};
+
+/*
+ * A file or directory read while loading the configuration, along with the
+ * information from stat used to tell whether it has changed since.  For a
+ * file that doesn't include anything, first and count give the range of
+ * rules that came from it, so that they can be reused on reload if it hasn't
+ * changed.
+ */
+struct config_source {
+    char *path;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    bool includes;              /* Whether the file has include lines. */
+    size_t first;               /* Position of the first rule from the file. */
+    size_t count;               /* Number of rules from the file. */
 };
 
-/* Holds the complete parsed configuration for remctld. */
+/*
+ * Holds the complete parsed configuration for remctld.  index is an open
+ * addressing hash table of index_size slots, keyed by the command and
+ * subcommand of each rule and holding one plus the position in rules of the
+ * first rule with that key, or 0 for an empty slot.  sources lists every
+ * configuration file and included directory that was read.
+ */
 struct config {
     struct rule **rules;
     size_t count;
     size_t allocated;
+    size_t *index;
+    size_t index_size;
+    unsigned long generation;   /* Unique to each loaded configuration. */
+    struct config_source *sources;
+    size_t nsources;
 };
 
 /*
@@ -95,11 +189,15 @@ struct process {
     char **argv;                /* argv for running the command. */
     struct rule *rule;          /* Configuration rule for the command. */
     struct evbuffer *input;     /* Buffer of input to process. */
+    bool capture;               /* Collect version two output in output. */
 
     /* Command output. */
     struct evbuffer *output;    /* Buffer of output from process. */
     int status;                 /* Exit status. */
 
+    /* Compresses output sent to the client as it arrives, if set. */
+    struct compressor *compressor;
+
     /* Everything below this point is used internally by the process loop. */
 
     /* Process data. */
@@ -107,16 +205,19 @@ struct process {
     socket_type stderr_fd;      /* File descriptor for standard error. */
     pid_t pid;                  /* Process ID of child. */
 
-    /* Event loop. */
+    /* Event loop, shared with the client except for the bufferevents. */
     struct event_base *loop;    /* Event base for the process event loop. */
     struct bufferevent *inout;  /* Input and output from process. */
     struct bufferevent *err;    /* Standard error from process. */
     struct event *sigchld;      /* Handle the SIGCHLD signal for exit. */
+    struct event *timer;        /* Kill the child if it runs too long. */
+    struct event *stream;       /* Read input still arriving from client. */
 
     /* State flags. */
     bool reaped;                /* Whether we've reaped the process. */
     bool saw_error;             /* Whether we encountered some error. */
     bool saw_output;            /* Whether we saw process output. */
+    bool timed_out;             /* Whether we had to kill the child. */
 };
 
 BEGIN_DECLS
@@ -125,27 +226,75 @@ BEGIN_DECLS
 void warn_gssapi(const char *, OM_uint32 major, OM_uint32 minor);
 void warn_token(const char *, int status, OM_uint32 major, OM_uint32 minor);
 void server_log_command(struct iovec **, struct rule *, const char *user);
+void server_log_child(pid_t, int status);
 
 /* Configuration file functions. */
 struct config *server_config_load(const char *file);
+bool server_config_reload(struct config *, const char *file);
 void server_config_free(struct config *);
+struct rule *server_config_find(const struct config *, const char *command,
+                                const char *subcommand);
 bool server_config_acl_permit(const struct rule *, const char *user);
+enum acl_decision server_config_acl_decide(const struct rule *,
+                                           const char *user);
+unsigned long server_config_acl_epoch(void);
 void server_config_set_gput_file(char *file);
+void server_config_set_localgroup_ttl(time_t ttl);
+void server_config_set_snapshot(const char *file);
+void server_config_add_source(struct config *, const char *path,
+                              const struct stat *);
+bool server_config_source_current(const struct config_source *);
+struct vector *server_config_paths(const struct config *);
+
+/* Compiled configuration snapshots. */
+bool server_snapshot_write(const struct config *, const char *file,
+                           const char *snapshot);
+struct config *server_snapshot_load(const char *snapshot, const char *file);
+
+/* Watching the configuration for changes. */
+bool server_watch_init(const struct config *);
+bool server_watch_reload(struct config *, const char *file);
+void server_watch_free(void);
 
 /* Running commands. */
 void server_run_command(struct client *, struct config *, struct iovec **);
+void server_set_summary_ttl(time_t ttl);
 
 /* Freeing the command structure. */
 void server_free_command(struct iovec **);
 
+/* Limits on the number of commands running at once. */
+void server_limit_init(void);
+bool server_limit_acquire(const struct rule *, const char *user, long *slot);
+void server_limit_release(long slot);
+void server_limit_set_user(unsigned long max);
+void server_limit_set_wait(time_t wait);
+
 /* Running processes. */
 bool server_process_run(struct process *process);
+bool server_process_run_all(struct process *processes, size_t count);
+bool server_process_output(struct process *, int stream, struct evbuffer *);
+bool server_process_send_captured(struct client *, const char *data,
+                                  size_t length);
+void server_process_reset(struct process *process);
+void server_process_free_loop(struct client *);
+void server_process_set_timeout(long timeout);
+long server_process_timeout(const struct process *);
+void server_process_save_affinity(void);
+void server_process_restore_affinity(void);
+
+/* Running commands through a FastCGI backend. */
+bool server_fastcgi_run(struct process *process);
 
 /* Generic protocol functions. */
 struct client *server_new_client(int fd, gss_cred_id_t creds);
+struct client *server_client_create(int fd);
+void server_client_resolve(struct client *);
+bool server_client_accepted(struct client *, gss_name_t);
 void server_free_client(struct client *);
 struct iovec **server_parse_command(struct client *, const char *, size_t);
 bool server_send_error(struct client *, enum error_codes, const char *);
+time_t server_now(void);
 
 /* Protocol v1 functions. */
 bool server_v1_send_output(struct client *, struct evbuffer *, int status);
@@ -153,10 +302,22 @@ void server_v1_handle_messages(struct client *, struct config *);
 
 /* Protocol v2 functions. */
 bool server_v2_send_output(struct client *, int stream, struct evbuffer *);
+bool server_v2_send_compressed(struct client *, int stream, struct evbuffer *,
+                               struct compressor *);
+size_t server_v2_max_output(const struct client *);
 bool server_v2_send_status(struct client *, int);
 bool server_v2_send_error(struct client *, enum error_codes, const char *);
+bool server_v2_handle_token(struct client *, struct config *, gss_buffer_t);
+bool server_v2_read_input(struct client *, struct evbuffer *);
+size_t server_v2_capabilities_reply(struct client *, gss_buffer_t,
+                                    char *reply);
 void server_v2_handle_messages(struct client *, struct config *);
 
+/* Event-driven connection handling. */
+void server_engine_run(socket_type fds[], unsigned int nfds,
+                       struct config *, const char *config_path,
+                       gss_cred_id_t creds);
+
 END_DECLS
 
 #endif /* !SERVER_INTERNAL_H */
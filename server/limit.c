@@ -0,0 +1,432 @@
+/*
+ * Limits on how many commands may run at the same time.
+ *
+ * A configuration rule may limit how many copies of its command run at once
+ * with the max_concurrent option, and the -U option to remctld limits how
+ * many commands each principal may run at once.  Since each connection is
+ * normally handled by its own process, the commands that are running are
+ * tracked in a table in shared memory, created before remctld starts
+ * handling connections so that every process it forks shares it.  Each
+ * running command takes a slot in the table, recording the process that
+ * owns it and hashes identifying the rule and the principal.
+ *
+ * A command over a limit may wait in a queue for the time set with the -Q
+ * option, in the order in which commands arrived, and is rejected if it
+ * still can't run after that.  Earlier waiting commands only hold back a
+ * later one for the limits they share, so a command under all of its own
+ * limits doesn't wait behind commands waiting for a different rule.  The
+ * queue for each limit holds at most as many commands as the limit itself.
+ * Waiting is done by checking the table again every LIMIT_POLL_MSEC
+ * milliseconds, since there's no cheap way to be notified across processes
+ * when a slot is freed, and is measured with a monotonic clock.
+ *
+ * Slots owned by processes that have exited without freeing them, such as
+ * a process that was killed, are reclaimed when they would otherwise cause
+ * a command to be rejected.  The table is protected by a lock holding the
+ * PID of the process that has it, which is taken over if that process no
+ * longer exists.  On platforms without the compiler atomic builtins or
+ * anonymous shared memory, the table is private to each process, which
+ * still enforces limits between the commands of one process.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+#if defined(HAVE_SYNC_BOOL_COMPARE_AND_SWAP) && defined(MAP_ANONYMOUS)
+# define LIMIT_SHARED 1
+#endif
+
+/* The number of commands with limits that can be tracked at once. */
+#define LIMIT_SLOTS 4096
+
+/* How often to check the table while waiting, in milliseconds. */
+#define LIMIT_POLL_MSEC 50
+
+/* A command that is running or waiting to run. */
+struct limit_slot {
+    pid_t pid;                  /* Owning process, or 0 if free. */
+    bool waiting;               /* Whether the command is queued. */
+    unsigned long ticket;       /* Order of arrival of queued commands. */
+    uint64_t rule;              /* Hash of the rule, or 0 if no limit. */
+    uint64_t user;              /* Hash of the principal. */
+};
+
+/* The table of commands, shared between all remctld processes. */
+struct limit_table {
+    volatile pid_t lock;        /* PID of the process with the lock. */
+    unsigned long next_ticket;  /* Ticket for the next queued command. */
+    struct limit_slot slots[LIMIT_SLOTS];
+};
+
+/* The result of checking whether a command may run. */
+enum limit_status {
+    LIMIT_RUN,
+    LIMIT_WAIT,
+    LIMIT_REJECT
+};
+
+/*
+ * The number of a command's slots of each kind that share its limits.  The
+ * ahead counts are the waiting commands that arrived before it, which get
+ * their turn at the shared limits first.
+ */
+struct limit_count {
+    unsigned long rule_running;
+    unsigned long rule_waiting;
+    unsigned long rule_ahead;
+    unsigned long user_running;
+    unsigned long user_waiting;
+    unsigned long user_ahead;
+};
+
+/* The table, the per-principal limit, and how long to wait in the queue. */
+static struct limit_table *table = NULL;
+static unsigned long user_max = 0;
+static time_t queue_wait = 0;
+
+
+/*
+ * Return a 64-bit FNV-1a hash of a string, continuing from a previous hash
+ * so that several strings can be combined.  The terminating nul is included
+ * so that the boundaries between strings matter.  The result is never 0,
+ * which is used for no limit.
+ */
+static uint64_t
+hash_string(uint64_t hash, const char *string)
+{
+    const unsigned char *p = (const unsigned char *) string;
+
+    do {
+        hash ^= *p;
+        hash *= UINT64_C(1099511628211);
+    } while (*p++ != '\0');
+    return (hash == 0) ? 1 : hash;
+}
+
+
+/*
+ * Create the table, in shared memory if possible.  Called before remctld
+ * forks any processes so that they all share it, but also called on first
+ * use in case it wasn't.
+ */
+void
+server_limit_init(void)
+{
+    if (table != NULL)
+        return;
+#ifdef LIMIT_SHARED
+    table = mmap(NULL, sizeof(struct limit_table), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table != MAP_FAILED)
+        return;
+    syswarn("cannot create shared table of running commands");
+#endif
+    table = xcalloc(1, sizeof(struct limit_table));
+}
+
+
+/*
+ * Return true if the process owning a slot still exists.  If it doesn't,
+ * free the slot.
+ */
+static bool
+slot_alive(struct limit_slot *slot)
+{
+    if (slot->pid == getpid())
+        return true;
+    if (kill(slot->pid, 0) == 0 || errno != ESRCH)
+        return true;
+    slot->pid = 0;
+    return false;
+}
+
+
+#ifdef LIMIT_SHARED
+
+/*
+ * Lock the table.  The critical sections are short, so just pause briefly
+ * until we get the lock, taking it over if the process holding it has exited.
+ */
+static void
+table_lock(void)
+{
+    pid_t self = getpid();
+    pid_t holder;
+    const struct timespec pause = { 0, 1000 };
+
+    while (!__sync_bool_compare_and_swap(&table->lock, 0, self)) {
+        holder = table->lock;
+        if (holder != 0 && kill(holder, 0) < 0 && errno == ESRCH)
+            __sync_bool_compare_and_swap(&table->lock, holder, 0);
+        else
+            nanosleep(&pause, NULL);
+    }
+}
+
+
+/*
+ * Unlock the table.
+ */
+static void
+table_unlock(void)
+{
+    __sync_lock_release(&table->lock);
+}
+
+#else /* !LIMIT_SHARED */
+
+/* The table is private to this process, so there's nothing to lock. */
+static void
+table_lock(void)
+{
+}
+
+static void
+table_unlock(void)
+{
+}
+
+#endif /* !LIMIT_SHARED */
+
+
+/*
+ * Count the slots that share a limit with a command, not including the slot
+ * of the command itself if it's queued, optionally freeing those whose
+ * processes have exited.  Must be called with the table locked.
+ */
+static void
+count_slots(const struct limit_slot *key, const struct limit_slot *self,
+            struct limit_count *count, bool reclaim)
+{
+    struct limit_slot *slot;
+    bool rule, user;
+    size_t i;
+
+    memset(count, 0, sizeof(*count));
+    for (i = 0; i < LIMIT_SLOTS; i++) {
+        slot = &table->slots[i];
+        if (slot == self || slot->pid == 0)
+            continue;
+        rule = (key->rule != 0 && slot->rule == key->rule);
+        user = (user_max > 0 && slot->user == key->user);
+        if (!rule && !user)
+            continue;
+        if (reclaim && !slot_alive(slot))
+            continue;
+        if (slot->waiting) {
+            if (rule)
+                count->rule_waiting++;
+            if (user)
+                count->user_waiting++;
+            if (self == NULL || slot->ticket < self->ticket) {
+                if (rule)
+                    count->rule_ahead++;
+                if (user)
+                    count->user_ahead++;
+            }
+        } else {
+            if (rule)
+                count->rule_running++;
+            if (user)
+                count->user_running++;
+        }
+    }
+}
+
+
+/*
+ * Return true if a command may run now, given the counts of the other
+ * commands that share its limits.  Commands that arrived earlier and are
+ * still waiting go first, so they count against each limit they share with
+ * this command, but only that limit.
+ */
+static bool
+may_run(const struct limit_slot *key, const struct limit_count *count,
+        long rule_max)
+{
+    unsigned long rule_used, user_used;
+
+    rule_used = count->rule_running + count->rule_ahead;
+    user_used = count->user_running + count->user_ahead;
+    if (key->rule != 0 && rule_used >= (unsigned long) rule_max)
+        return false;
+    if (user_max > 0 && user_used >= user_max)
+        return false;
+    return true;
+}
+
+
+/*
+ * Return true if there's room in the queue for a command.
+ */
+static bool
+may_wait(const struct limit_slot *key, const struct limit_count *count,
+         long rule_max)
+{
+    if (key->rule != 0 && count->rule_waiting >= (unsigned long) rule_max)
+        return false;
+    if (user_max > 0 && count->user_waiting >= user_max)
+        return false;
+    return true;
+}
+
+
+/*
+ * Find a free slot in the table and fill it in from key, or return NULL if
+ * the table is full.  Must be called with the table locked.
+ */
+static struct limit_slot *
+take_slot(const struct limit_slot *key)
+{
+    size_t i;
+
+    for (i = 0; i < LIMIT_SLOTS; i++)
+        if (table->slots[i].pid == 0) {
+            table->slots[i] = *key;
+            return &table->slots[i];
+        }
+    warn("too many commands running to enforce limits");
+    return NULL;
+}
+
+
+/*
+ * Check whether a command may run, taking a slot for it if so.  If not, and
+ * may_queue is set, queue it if it isn't queued already and there's room.
+ * Takes the key describing the command and its slot, which is NULL if it
+ * isn't in the table yet and is updated if it's given a slot.  Must be
+ * called with the table locked.
+ */
+static enum limit_status
+check_slot(const struct limit_slot *key, struct limit_slot **slot,
+           long rule_max, bool may_queue)
+{
+    struct limit_count count;
+
+    count_slots(key, *slot, &count, false);
+    if (!may_run(key, &count, rule_max))
+        count_slots(key, *slot, &count, true);
+    if (may_run(key, &count, rule_max)) {
+        if (*slot == NULL)
+            *slot = take_slot(key);
+        if (*slot == NULL)
+            return LIMIT_REJECT;
+        (*slot)->waiting = false;
+        return LIMIT_RUN;
+    }
+    if (*slot != NULL)
+        return LIMIT_WAIT;
+    if (!may_queue || !may_wait(key, &count, rule_max))
+        return LIMIT_REJECT;
+    *slot = take_slot(key);
+    if (*slot == NULL)
+        return LIMIT_REJECT;
+    (*slot)->waiting = true;
+    (*slot)->ticket = table->next_ticket++;
+    return LIMIT_WAIT;
+}
+
+
+/*
+ * Wait until the given command for the given user may run under the limits
+ * of its rule and the per-principal limit, queuing it for up to the
+ * configured time if necessary.  On success, returns true and stores in slot
+ * the slot to pass to server_limit_release once the command has finished,
+ * which is -1 if no limits apply.  Returns false if the command is over a
+ * limit and couldn't be queued or waited too long.
+ */
+bool
+server_limit_acquire(const struct rule *rule, const char *user, long *slot)
+{
+    struct limit_slot key;
+    struct limit_slot *self = NULL;
+    enum limit_status status;
+    const struct timespec pause = {
+        LIMIT_POLL_MSEC / 1000, (LIMIT_POLL_MSEC % 1000) * 1000 * 1000
+    };
+    time_t deadline;
+
+    *slot = -1;
+    if (rule->max_concurrent <= 0 && user_max == 0)
+        return true;
+    server_limit_init();
+    memset(&key, 0, sizeof(key));
+    key.pid = getpid();
+    if (rule->max_concurrent > 0) {
+        key.rule = hash_string(UINT64_C(14695981039346656037), rule->command);
+        key.rule = hash_string(key.rule, rule->subcommand);
+        key.rule = hash_string(key.rule, rule->program);
+    }
+    key.user = hash_string(UINT64_C(14695981039346656037), user);
+
+    /* Check periodically until the command may run or we give up. */
+    deadline = server_now() + queue_wait;
+    do {
+        table_lock();
+        status = check_slot(&key, &self, rule->max_concurrent,
+                            server_now() < deadline);
+        if (status == LIMIT_WAIT && server_now() >= deadline) {
+            self->pid = 0;
+            status = LIMIT_REJECT;
+        }
+        table_unlock();
+        if (status == LIMIT_WAIT)
+            nanosleep(&pause, NULL);
+    } while (status == LIMIT_WAIT);
+    if (status == LIMIT_REJECT)
+        return false;
+    *slot = self - table->slots;
+    return true;
+}
+
+
+/*
+ * Free the slot of a command that has finished.  Does nothing if the slot is
+ * -1, meaning that no limits applied to the command.
+ */
+void
+server_limit_release(long slot)
+{
+    if (slot < 0 || slot >= LIMIT_SLOTS)
+        return;
+    table_lock();
+    if (table->slots[slot].pid == getpid())
+        table->slots[slot].pid = 0;
+    table_unlock();
+}
+
+
+/*
+ * Set the most commands that each principal may run at the same time, or 0
+ * for no limit.
+ */
+void
+server_limit_set_user(unsigned long max)
+{
+    user_max = max;
+}
+
+
+/*
+ * Set how long, in seconds, a command over a limit may wait for its turn
+ * before it's rejected.  0 rejects such commands immediately.
+ */
+void
+server_limit_set_wait(time_t wait)
+{
+    queue_wait = wait;
+}
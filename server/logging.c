@@ -19,6 +19,7 @@
 #include <portable/uio.h>
 
 #include <errno.h>
+#include <sys/wait.h>
 
 #include <server/internal.h>
 #include <util/gss-errors.h>
@@ -124,3 +125,26 @@ server_log_command(struct iovec **argv, struct rule *rule, const char *user)
     notice("COMMAND from %s: %s", user, command);
     free(command);
 }
+
+
+/*
+ * Gather information about an exited child and log an appropriate message.
+ * We keep the log level to debug unless something interesting happened, like
+ * a non-zero exit status.
+ */
+void
+server_log_child(pid_t pid, int status)
+{
+    if (WIFEXITED(status)) {
+        if (WEXITSTATUS(status) != 0)
+            warn("child %lu exited with %d", (unsigned long) pid,
+                 WEXITSTATUS(status));
+        else
+            debug("child %lu done", (unsigned long) pid);
+    } else if (WIFSIGNALED(status)) {
+        warn("child %lu died on signal %d", (unsigned long) pid,
+             WTERMSIG(status));
+    } else {
+        warn("child %lu died", (unsigned long) pid);
+    }
+}
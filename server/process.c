@@ -18,34 +18,77 @@
 
 #include <fcntl.h>
 #include <grp.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+# include <sched.h>
+#endif
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
 
 #include <server/internal.h>
+#include <util/compress.h>
 #include <util/fdflag.h>
 #include <util/macros.h>
 #include <util/messages.h>
 #include <util/protocol.h>
+#include <util/xmalloc.h>
+
+#if defined(HAVE_POSIX_SPAWN) && !HAVE_DECL_ENVIRON
+extern char **environ;
+#endif
 
 /*
  * We would like to use event_base_loopbreak and event_base_got_break, but the
- * latter was introduced in libevent 2.x.  For right now, until we can rely on
- * libevent 2.x, set a flag in the process struct instead.  We still call
- * event_base_loopbreak where we can, to keep from processing more data than
- * we have to.
- *
- * This portability glue is specific to this file and assumes that the process
- * variable is in scope to replace the event_base_got_break functionality.
+ * latter was introduced in libevent 2.x and only says whether the loop was
+ * broken, not which of several processes sharing it failed.  Instead, set a
+ * flag in the process struct and check the flags of all running processes.
+ * We still call event_base_loopbreak where we can, to keep from processing
+ * more data than we have to.
  */
 #ifndef HAVE_EVENT_BASE_LOOPBREAK
 # define event_base_loopbreak(base) /* empty */
 #endif
-#ifndef HAVE_EVENT_BASE_GOT_BREAK
-# define event_base_got_break(base) process->saw_error
+
+/*
+ * How long, in seconds, to give a command that has run past its timeout to
+ * exit after SIGTERM before killing it with SIGKILL.
+ */
+#define PROCESS_KILL_GRACE 5
+
+/*
+ * How much input from the client to hold for a filter command before we stop
+ * reading from the client until the command has consumed it.
+ */
+#define FILTER_MAX_PENDING (1024 * 1024)
+
+/* The timeout for commands whose rule doesn't set one, or 0 for none. */
+static long default_timeout = 0;
+
+/* The CPU affinity to restore before running commands, if saved. */
+#ifdef HAVE_SCHED_SETAFFINITY
+static cpu_set_t saved_affinity;
+static bool affinity_saved = false;
 #endif
 
 
+/*
+ * Return the timeout in seconds for a process, or 0 if it may run for as long
+ * as it wants.  Commands with a timeout are run in their own process group so
+ * that anything they start can be killed along with them.  Also used for
+ * FastCGI commands, which are abandoned instead.
+ */
+long
+server_process_timeout(const struct process *process)
+{
+    if (process->rule->timeout > 0)
+        return process->rule->timeout;
+    return default_timeout;
+}
+
+
 /*
  * Callback for events in input or output handling.  This means either an
  * error or EOF.  On EOF or an EPIPE or ECONNRESET error, just deactivate the
@@ -89,13 +132,25 @@ handle_io_event(struct bufferevent *bev, short events, void *data)
 /*
  * Callback when all stdin data has been sent.  We only have a callback to
  * shut down our end of the socketpair so that the process gets EOF on its
- * next read.
+ * next read.  If more of the input is still arriving from the client, we've
+ * only caught up with it, so do nothing except resume reading from the
+ * client if we stopped because a filter command had too much input pending.
  */
 static void
 handle_input_end(struct bufferevent *bev, void *data)
 {
     struct process *process = data;
+    struct client *client = process->client;
 
+    if (process->stream != NULL && client->streaming) {
+        if (client->filter) {
+            if (event_add(process->stream, NULL) < 0)
+                die("internal error: cannot add client input event");
+            if (client->buffer.start < client->buffer.end)
+                event_active(process->stream, EV_READ, 0);
+        }
+        return;
+    }
     bufferevent_disable(bev, EV_WRITE);
     if (shutdown(process->stdinout_fd, SHUT_WR) < 0)
         sysdie("cannot shut down input side of process socket pair");
@@ -120,7 +175,7 @@ handle_output(struct bufferevent *bev, void *data)
     process->saw_output = true;
     stream = (bev == process->inout) ? 1 : 2;
     buf = bufferevent_get_input(bev);
-    if (!server_v2_send_output(process->client, stream, buf)) {
+    if (!server_process_output(process, stream, buf)) {
         process->saw_error = true;
         event_base_loopbreak(process->loop);
     }
@@ -181,19 +236,137 @@ handle_output_full(struct bufferevent *bev, void *data)
 
 
 /*
- * Called when the process has exited.  Here we reap the status and then tell
- * the event loop to complete.  Ignore SIGCHLD if our child process wasn't the
- * one that exited.
+ * Called once all of the standard input of a process has arrived from the
+ * client.  Stop watching the client, shut down the input side of the process
+ * if all of the input has already been sent to it, and start passing along
+ * its output.
  */
 static void
-handle_exit(evutil_socket_t sig UNUSED, short what UNUSED, void *data)
+stream_end(struct process *process)
+{
+    struct evbuffer *pending;
+
+    event_del(process->stream);
+    pending = bufferevent_get_output(process->inout);
+    if (evbuffer_get_length(pending) == 0)
+        handle_input_end(process->inout, process);
+    bufferevent_enable(process->inout, EV_READ);
+    bufferevent_enable(process->err, EV_READ);
+}
+
+
+/*
+ * Called when the client has sent more of the standard input of a process
+ * that is being passed to it as it arrives.  Read everything the client has
+ * sent so far and queue it for the process.  We don't stop reading from the
+ * client if the process is slow to consume its input, since the client may
+ * be blocked sending to us, but we do refuse to hold more than
+ * COMMAND_MAX_DATA bytes for the process at a time.
+ *
+ * The client of a filter command reads our output while it sends input, so
+ * there we instead stop reading from the client once FILTER_MAX_PENDING
+ * bytes are waiting for the process and resume when it has taken them.
+ */
+static void
+handle_stream(evutil_socket_t fd UNUSED, short what UNUSED, void *data)
+{
+    struct process *process = data;
+    struct client *client = process->client;
+    struct evbuffer *pending;
+
+    do {
+        if (!server_v2_read_input(client, process->input))
+            goto fail;
+    } while (client->streaming && client->buffer.start < client->buffer.end);
+    if (bufferevent_write_buffer(process->inout, process->input) < 0)
+        die("internal error: cannot queue input for process");
+    pending = bufferevent_get_output(process->inout);
+    if (client->filter && client->streaming
+        && evbuffer_get_length(pending) > FILTER_MAX_PENDING)
+        event_del(process->stream);
+    else if (evbuffer_get_length(pending) > COMMAND_MAX_DATA) {
+        warn("pending input for command %s exceeds %lu", process->command,
+             COMMAND_MAX_DATA);
+        server_send_error(client, ERROR_TOOMUCH_DATA, "Too much data");
+        goto fail;
+    }
+    if (!client->streaming)
+        stream_end(process);
+    return;
+
+fail:
+    process->saw_error = true;
+    event_base_loopbreak(process->loop);
+}
+
+
+/*
+ * Called when a process has run past its timeout.  The first time, send
+ * SIGTERM to its process group and give it PROCESS_KILL_GRACE seconds to
+ * exit.  If it's still running after that, send SIGKILL.  Either way, the
+ * process is reaped as normal by handle_exit, and run_children then reports
+ * the timeout to the client.
+ */
+static void
+handle_timeout(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
 {
     struct process *process = data;
+    const struct timeval grace = { PROCESS_KILL_GRACE, 0 };
+    int sig;
 
-    if (waitpid(process->pid, &process->status, WNOHANG) > 0) {
-        process->reaped = true;
-        event_del(process->sigchld);
-        event_base_loopexit(process->loop, NULL);
+    if (process->reaped)
+        return;
+    if (!process->timed_out) {
+        warn("command %s from user %s timed out after %ld seconds",
+             process->command, process->client->user,
+             server_process_timeout(process));
+        process->timed_out = true;
+        sig = SIGTERM;
+        if (evtimer_add(process->timer, &grace) < 0)
+            die("internal error: cannot add process timeout event");
+    } else {
+        warn("command %s did not exit after SIGTERM, sending SIGKILL",
+             process->command);
+        sig = SIGKILL;
+    }
+    if (kill(-process->pid, sig) < 0 && errno != ESRCH)
+        syswarn("cannot signal process group %lu",
+                (unsigned long) process->pid);
+}
+
+
+/*
+ * Called when a process has exited.  Here we reap the status of any of the
+ * running processes that have exited and, once all of them have, tell the
+ * event loop to complete.  The SIGCHLD event belongs to the client, so find
+ * the running processes from there.  Commands handled by a FastCGI backend
+ * have no child process and are run separately, so skip them.
+ */
+static void
+handle_exit(evutil_socket_t sig UNUSED, short what UNUSED, void *data)
+{
+    struct client *client = data;
+    struct process *process;
+    size_t i;
+    bool done = true;
+
+    if (client->nprocesses == 0)
+        return;
+    for (i = 0; i < client->nprocesses; i++) {
+        process = &client->processes[i];
+        if (process->rule->fastcgi != NULL || process->reaped)
+            continue;
+        if (process->pid > 0
+            && waitpid(process->pid, &process->status, WNOHANG) > 0) {
+            process->reaped = true;
+            if (process->timer != NULL)
+                event_del(process->timer);
+        } else
+            done = false;
+    }
+    if (done) {
+        event_del(client->sigchld);
+        event_base_loopexit(client->loop, NULL);
     }
 }
 
@@ -210,10 +383,270 @@ child_die_handler(void)
 }
 
 
+/*
+ * Set up the environment and file descriptors of a forked child and then
+ * execute the command.  Used when the child has to change its user and group
+ * (which posix_spawn can't do), when posix_spawn isn't available, or when it
+ * failed.  Takes the child sides of the socket pairs (stderr_fd may be
+ * INVALID_SOCKET for protocol version one).  Never returns.
+ */
+static void
+exec_child(struct process *process, socket_type stdinout_fd,
+           socket_type stderr_fd)
+{
+    struct client *client = process->client;
+    socket_type fd;
+    struct sigaction sa;
+
+    message_fatal_cleanup = child_die_handler;
+
+    /* Commands with a timeout get their own process group. */
+    if (server_process_timeout(process) > 0 && setpgid(0, 0) < 0)
+        sysdie("cannot create process group");
+
+    /*
+     * Set up stdin if we have input data.  If we don't have input data,
+     * reopen on /dev/null instead so that the process gets immediate EOF.
+     * Ignore failure here, since it probably won't matter and worst case is
+     * that we leave stdin closed.
+     */
+    if (process->input != NULL)
+        dup2(stdinout_fd, 0);
+    else {
+        close(0);
+        fd = open("/dev/null", O_RDONLY);
+        if (fd > 0) {
+            dup2(fd, 0);
+            close(fd);
+        }
+    }
+
+    /* Set up stdout and stderr. */
+    dup2(stdinout_fd, 1);
+    if (client->protocol == 1)
+        dup2(stdinout_fd, 2);
+    else {
+        dup2(stderr_fd, 2);
+        close(stderr_fd);
+    }
+    close(stdinout_fd);
+
+    /*
+     * Older versions of MIT Kerberos left the replay cache file open across
+     * exec.  Newer versions correctly set it close-on-exec, but close our
+     * low-numbered file descriptors anyway for older versions.  We're just
+     * trying to get the replay cache, so we don't have to go very high.
+     */
+    for (fd = 3; fd < 16; fd++)
+        close(fd);
+
+    /*
+     * Restore the default SIGPIPE handler.  The server sets it to SIG_IGN,
+     * which is inherited by children.  We want the child to have a default
+     * set of signal handlers.
+     */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    if (sigaction(SIGPIPE, &sa, NULL) < 0)
+        sysdie("cannot clear SIGPIPE handler");
+
+    /*
+     * Put the authenticated principal and other connection and command
+     * information in the environment.  REMUSER is for backwards compatibility
+     * with earlier versions of remctl.
+     */
+    if (setenv("REMUSER", client->user, 1) < 0)
+        sysdie("cannot set REMUSER in environment");
+    if (setenv("REMOTE_USER", client->user, 1) < 0)
+        sysdie("cannot set REMOTE_USER in environment");
+    if (setenv("REMOTE_ADDR", client->ipaddress, 1) < 0)
+        sysdie("cannot set REMOTE_ADDR in environment");
+    if (client->hostname != NULL)
+        if (setenv("REMOTE_HOST", client->hostname, 1) < 0)
+            sysdie("cannot set REMOTE_HOST in environment");
+    if (setenv("REMCTL_COMMAND", process->command, 1) < 0)
+        sysdie("cannot set REMCTL_COMMAND in environment");
+
+    /* Drop privileges if requested. */
+    if (process->rule->user != NULL && process->rule->uid > 0) {
+        if (initgroups(process->rule->user, process->rule->gid) != 0)
+            sysdie("cannot initgroups for %s\n", process->rule->user);
+        if (setgid(process->rule->gid) != 0)
+            sysdie("cannot setgid to %d\n", process->rule->gid);
+        if (setuid(process->rule->uid) != 0)
+            sysdie("cannot setuid to %d\n", process->rule->uid);
+    }
+
+    /*
+     * Run the command.  On error, we intentionally don't reveal information
+     * about the command we ran.
+     */
+    if (execv(process->rule->program, process->argv) < 0)
+        sysdie("cannot execute command");
+}
+
+
+#ifdef HAVE_POSIX_SPAWN
+/*
+ * Build the environment for a spawned child: a copy of our environment with
+ * the connection and command information that exec_child would set with
+ * setenv added, replacing any existing values.  Only the added strings are
+ * newly allocated, and their count is returned in added so that the caller
+ * can free them from the end of the array.
+ */
+static char **
+spawn_environment(struct process *process, size_t *added)
+{
+    struct client *client = process->client;
+    char *vars[5];
+    char **env;
+    size_t count, i, j, n, length;
+    bool replaced;
+
+    n = 0;
+    xasprintf(&vars[n++], "REMUSER=%s", client->user);
+    xasprintf(&vars[n++], "REMOTE_USER=%s", client->user);
+    xasprintf(&vars[n++], "REMOTE_ADDR=%s", client->ipaddress);
+    if (client->hostname != NULL)
+        xasprintf(&vars[n++], "REMOTE_HOST=%s", client->hostname);
+    xasprintf(&vars[n++], "REMCTL_COMMAND=%s", process->command);
+
+    /* Copy over everything in our environment that we aren't replacing. */
+    for (count = 0; environ[count] != NULL; count++)
+        ;
+    env = xcalloc(count + n + 1, sizeof(char *));
+    for (count = 0, i = 0; environ[i] != NULL; i++) {
+        replaced = false;
+        for (j = 0; j < n && !replaced; j++) {
+            length = strchr(vars[j], '=') - vars[j] + 1;
+            replaced = (strncmp(environ[i], vars[j], length) == 0);
+        }
+        if (!replaced)
+            env[count++] = environ[i];
+    }
+    for (j = 0; j < n; j++)
+        env[count++] = vars[j];
+    env[count] = NULL;
+    *added = n;
+    return env;
+}
+
+
+/*
+ * Start the child process with posix_spawn, which avoids copying the page
+ * tables of a potentially large server process only to replace them with
+ * exec.  Does the same work as exec_child except for dropping privileges, so
+ * must only be used when the rule doesn't change user.  Returns the PID of
+ * the child or -1 on failure, after logging a warning.
+ */
+static pid_t
+spawn_child(struct process *process, socket_type stdinout_fd,
+            socket_type stderr_fd)
+{
+    struct client *client = process->client;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault;
+    char **env;
+    size_t added, count, i;
+    pid_t pid = -1;
+    int fd, flags, status;
+    short spawnflags;
+
+    if ((status = posix_spawn_file_actions_init(&actions)) != 0) {
+        errno = status;
+        syswarn("cannot initialize spawn file actions");
+        return -1;
+    }
+    if ((status = posix_spawnattr_init(&attr)) != 0) {
+        errno = status;
+        syswarn("cannot initialize spawn attributes");
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    /* Set up stdin, stdout, and stderr the same as exec_child. */
+    if (process->input != NULL)
+        status = posix_spawn_file_actions_adddup2(&actions, stdinout_fd, 0);
+    else
+        status = posix_spawn_file_actions_addopen(&actions, 0, "/dev/null",
+                                                  O_RDONLY, 0);
+    if (status == 0)
+        status = posix_spawn_file_actions_adddup2(&actions, stdinout_fd, 1);
+    if (status == 0) {
+        fd = (client->protocol == 1) ? stdinout_fd : stderr_fd;
+        status = posix_spawn_file_actions_adddup2(&actions, fd, 2);
+    }
+
+    /*
+     * Close the same low-numbered file descriptors as exec_child, but only
+     * those that are open and wouldn't be closed on exec anyway, since
+     * closing a descriptor that isn't open may make the spawn fail.  Both
+     * sides of the socket pairs are close-on-exec.
+     */
+    for (fd = 3; fd < 16 && status == 0; fd++) {
+        flags = fcntl(fd, F_GETFD);
+        if (flags >= 0 && !(flags & FD_CLOEXEC))
+            status = posix_spawn_file_actions_addclose(&actions, fd);
+    }
+    if (status != 0) {
+        errno = status;
+        syswarn("cannot set up spawn file actions");
+        goto done;
+    }
+
+    /*
+     * Restore the default SIGPIPE handler in the child and, if the command
+     * has a timeout, put it in its own process group.
+     */
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+    spawnflags = POSIX_SPAWN_SETSIGDEF;
+    status = posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    if (status == 0 && server_process_timeout(process) > 0) {
+        spawnflags |= POSIX_SPAWN_SETPGROUP;
+        status = posix_spawnattr_setpgroup(&attr, 0);
+    }
+    if (status == 0)
+        status = posix_spawnattr_setflags(&attr, spawnflags);
+    if (status != 0) {
+        errno = status;
+        syswarn("cannot set up spawn attributes");
+        goto done;
+    }
+
+    /* Run the command. */
+    env = spawn_environment(process, &added);
+    status = posix_spawn(&pid, process->rule->program, &actions, &attr,
+                         process->argv, env);
+    if (status != 0) {
+        errno = status;
+        syswarn("cannot spawn %s", process->rule->program);
+        pid = -1;
+    }
+    for (count = 0; env[count] != NULL; count++)
+        ;
+    for (i = count - added; i < count; i++)
+        free(env[i]);
+    free(env);
+
+done:
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+#endif /* HAVE_POSIX_SPAWN */
+
+
 /*
  * Start the child process.  This runs as a one-time event inside the event
- * loop, forks off the child process, and sets up the events that process
- * output from the child and send it back to the remctl client.
+ * loop, starts the child process, and sets up the events that process output
+ * from the child and send it back to the remctl client.
+ *
+ * The child is started with posix_spawn where possible.  If the command has
+ * to run as a different user, or if posix_spawn fails, fall back on fork and
+ * doing the setup in the child, which also reports exec failures to the
+ * remctl client the way it always has.
  */
 static void
 start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
@@ -224,8 +657,9 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
     bufferevent_data_cb writecb = NULL;
     socket_type stdinout_fds[2] = { INVALID_SOCKET, INVALID_SOCKET };
     socket_type stderr_fds[2]   = { INVALID_SOCKET, INVALID_SOCKET };
-    socket_type fd;
-    struct sigaction sa;
+    struct timeval tv;
+    long timeout;
+    bool streaming, hold;
 
     /*
      * Socket pairs are used for communication with the child process that
@@ -237,132 +671,73 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
      * we use one socket pair for standard intput and standard output, and a
      * separate read-only one for standard error so that we can keep the
      * stream separate.
+     *
+     * All sides are close-on-exec.  The child's copies of its sides on
+     * standard input, output, and error are not.
      */
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, stdinout_fds) < 0) {
         syswarn("cannot create stdin and stdout socket pair");
         goto fail;
     }
-    if (client->protocol > 1)
+    fdflag_close_exec(stdinout_fds[0], true);
+    fdflag_close_exec(stdinout_fds[1], true);
+    if (client->protocol > 1) {
         if (socketpair(AF_UNIX, SOCK_STREAM, 0, stderr_fds) < 0) {
             syswarn("cannot create stderr socket pair");
             goto fail;
         }
+        fdflag_close_exec(stderr_fds[0], true);
+        fdflag_close_exec(stderr_fds[1], true);
+    }
 
     /*
-     * Flush output before forking, mostly in case -S was given and we've
-     * therefore been writing log messages to standard output that may not
-     * have been flushed yet.
+     * Flush output before starting the child, mostly in case -S was given
+     * and we've therefore been writing log messages to standard output that
+     * may not have been flushed yet.
      */
     fflush(stdout);
-    process->pid = fork();
-    switch (process->pid) {
-    case -1:
-        syswarn("cannot fork");
-        goto fail;
-
-    /* In the child. */
-    case 0:
-        message_fatal_cleanup = child_die_handler;
-
-        /* Close the server sides of the sockets. */
-        close(stdinout_fds[0]);
-        stdinout_fds[0] = INVALID_SOCKET;
-        if (stderr_fds[0] != INVALID_SOCKET) {
-            close(stderr_fds[0]);
-            stderr_fds[0] = INVALID_SOCKET;
-        }
-
-        /*
-         * Set up stdin if we have input data.  If we don't have input data,
-         * reopen on /dev/null instead so that the process gets immediate EOF.
-         * Ignore failure here, since it probably won't matter and worst case
-         * is that we leave stdin closed.
-         */
-        if (process->input != NULL)
-            dup2(stdinout_fds[1], 0);
-        else {
-            close(0);
-            fd = open("/dev/null", O_RDONLY);
-            if (fd > 0) {
-                dup2(fd, 0);
-                close(fd);
-            }
-        }
-
-        /* Set up stdout and stderr. */
-        dup2(stdinout_fds[1], 1);
-        if (client->protocol == 1)
-            dup2(stdinout_fds[1], 2);
-        else {
-            dup2(stderr_fds[1], 2);
-            close(stderr_fds[1]);
-        }
-        close(stdinout_fds[1]);
-
-        /*
-         * Older versions of MIT Kerberos left the replay cache file open
-         * across exec.  Newer versions correctly set it close-on-exec, but
-         * close our low-numbered file descriptors anyway for older versions.
-         * We're just trying to get the replay cache, so we don't have to go
-         * very high.
-         */
-        for (fd = 3; fd < 16; fd++)
-            close(fd);
-
-        /*
-         * Restore the default SIGPIPE handler.  The server sets it to
-         * SIG_IGN, which is inherited by children.  We want the child to have
-         * a default set of signal handlers.
-         */
-        memset(&sa, 0, sizeof(sa));
-        sa.sa_handler = SIG_DFL;
-        if (sigaction(SIGPIPE, &sa, NULL) < 0)
-            sysdie("cannot clear SIGPIPE handler");
-
-        /*
-         * Put the authenticated principal and other connection and command
-         * information in the environment.  REMUSER is for backwards
-         * compatibility with earlier versions of remctl.
-         */
-        if (setenv("REMUSER", client->user, 1) < 0)
-            sysdie("cannot set REMUSER in environment");
-        if (setenv("REMOTE_USER", client->user, 1) < 0)
-            sysdie("cannot set REMOTE_USER in environment");
-        if (setenv("REMOTE_ADDR", client->ipaddress, 1) < 0)
-            sysdie("cannot set REMOTE_ADDR in environment");
-        if (client->hostname != NULL)
-            if (setenv("REMOTE_HOST", client->hostname, 1) < 0)
-                sysdie("cannot set REMOTE_HOST in environment");
-        if (setenv("REMCTL_COMMAND", process->command, 1) < 0)
-            sysdie("cannot set REMCTL_COMMAND in environment");
-
-        /* Drop privileges if requested. */
-        if (process->rule->user != NULL && process->rule->uid > 0) {
-            if (initgroups(process->rule->user, process->rule->gid) != 0)
-                sysdie("cannot initgroups for %s\n", process->rule->user);
-            if (setgid(process->rule->gid) != 0)
-                sysdie("cannot setgid to %d\n", process->rule->gid);
-            if (setuid(process->rule->uid) != 0)
-                sysdie("cannot setuid to %d\n", process->rule->uid);
+    process->pid = -1;
+#ifdef HAVE_POSIX_SPAWN
+    if (process->rule->user == NULL || process->rule->uid == 0)
+        process->pid = spawn_child(process, stdinout_fds[1], stderr_fds[1]);
+#endif
+    if (process->pid < 0) {
+        process->pid = fork();
+        if (process->pid < 0) {
+            syswarn("cannot fork");
+            goto fail;
+        } else if (process->pid == 0) {
+            close(stdinout_fds[0]);
+            if (stderr_fds[0] != INVALID_SOCKET)
+                close(stderr_fds[0]);
+            exec_child(process, stdinout_fds[1], stderr_fds[1]);
         }
+    }
 
-        /*
-         * Run the command.  On error, we intentionally don't reveal
-         * information about the command we ran.
-         */
-        if (execv(process->rule->program, process->argv) < 0)
-            sysdie("cannot execute command");
+    /*
+     * In the parent.  If the command has a timeout, also put a forked child
+     * in its own process group here so that it's there before the timer can
+     * fire.  This fails harmlessly if the child already did it and ran exec.
+     * Then start the timer.
+     */
+    timeout = server_process_timeout(process);
+    if (timeout > 0) {
+        setpgid(process->pid, process->pid);
+        tv.tv_sec = timeout;
+        tv.tv_usec = 0;
+        process->timer = evtimer_new(loop, handle_timeout, process);
+        if (process->timer == NULL || evtimer_add(process->timer, &tv) < 0)
+            die("internal error: cannot create process timeout event");
+    }
 
-    /* In the parent.  Close the other sides of the socket pairs. */
-    default:
-        close(stdinout_fds[1]);
-        stdinout_fds[1] = INVALID_SOCKET;
-        process->stdinout_fd = stdinout_fds[0];
-        if (client->protocol > 1) {
-            close(stderr_fds[1]);
-            stderr_fds[1] = INVALID_SOCKET;
-            process->stderr_fd = stderr_fds[0];
-        }
+    /* Close the other sides of the socket pairs. */
+    close(stdinout_fds[1]);
+    stdinout_fds[1] = INVALID_SOCKET;
+    process->stdinout_fd = stdinout_fds[0];
+    if (client->protocol > 1) {
+        close(stderr_fds[1]);
+        stderr_fds[1] = INVALID_SOCKET;
+        process->stderr_fd = stderr_fds[0];
     }
 
     /*
@@ -381,11 +756,16 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
     process->inout = bufferevent_socket_new(loop, process->stdinout_fd, 0);
     if (process->inout == NULL)
         die("internal error: cannot create stdin/stdout bufferevent");
+    streaming = (process->input != NULL && client->streaming);
+    hold = (streaming && !client->filter);
     if (process->input == NULL)
         bufferevent_enable(process->inout, EV_READ);
     else {
         writecb = handle_input_end;
-        bufferevent_enable(process->inout, EV_READ | EV_WRITE);
+        if (hold)
+            bufferevent_enable(process->inout, EV_WRITE);
+        else
+            bufferevent_enable(process->inout, EV_READ | EV_WRITE);
         if (bufferevent_write_buffer(process->inout, process->input) < 0)
             die("internal error: cannot queue input for process");
     }
@@ -397,15 +777,51 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
     } else {
         bufferevent_setcb(process->inout, handle_output, writecb,
                           handle_io_event, process);
-        bufferevent_setwatermark(process->inout, EV_READ, 0, TOKEN_MAX_OUTPUT);
+        bufferevent_setwatermark(process->inout, EV_READ, 0,
+                                 server_v2_max_output(client));
         fdflag_nonblocking(stderr_fds[0], true);
         process->err = bufferevent_socket_new(loop, process->stderr_fd, 0);
         if (process->err == NULL)
             die("internal error: cannot create stderr bufferevent");
-        bufferevent_enable(process->err, EV_READ);
+        if (!hold)
+            bufferevent_enable(process->err, EV_READ);
         bufferevent_setcb(process->err, handle_output, NULL,
                           handle_io_event, process);
-        bufferevent_setwatermark(process->err, EV_READ, 0, TOKEN_MAX_OUTPUT);
+        bufferevent_setwatermark(process->err, EV_READ, 0,
+                                 server_v2_max_output(client));
+
+        /*
+         * libevent reads at most 16KB at a time by default, which would turn
+         * a busy command's output into many small tokens even if the client
+         * agreed to larger ones, so let it read as much as fits in a token.
+         */
+#ifdef HAVE_BUFFEREVENT_SET_MAX_SINGLE_READ
+        if (client->token_max > TOKEN_MAX_DATA) {
+            size_t max = server_v2_max_output(client);
+
+            if (bufferevent_set_max_single_read(process->inout, max) < 0
+                || bufferevent_set_max_single_read(process->err, max) < 0)
+                die("internal error: cannot set process read size");
+        }
+#endif
+    }
+
+    /*
+     * If the rest of standard input is still arriving from the client, watch
+     * the client for it and, unless this is a filter command, hold off on
+     * reading output from the process until all of it has arrived.  The
+     * client doesn't read our replies until it has sent the whole command,
+     * so sending output before then could deadlock.  Data the client sent
+     * that's already in our read buffer won't trigger the event, so check
+     * for that right away.
+     */
+    if (streaming) {
+        process->stream = event_new(loop, client->fd, EV_READ | EV_PERSIST,
+                                    handle_stream, process);
+        if (process->stream == NULL || event_add(process->stream, NULL) < 0)
+            die("internal error: cannot create client input event");
+        if (client->buffer.start < client->buffer.end)
+            event_active(process->stream, EV_READ, 0);
     }
     return;
 
@@ -425,112 +841,459 @@ fail:
 
 
 /*
- * Runs a process as a child to completion, capturing its output and
- * processing it according to the negotiated remctl client protocol.
- *
- * Takes the client, the short name for the command, an argument list, the
- * configuration line for that command, and the process.  Returns true on
- * success and false on failure.
+ * Free the event base and SIGCHLD event used to run processes for a client.
+ * They are created on first use by server_process_run and otherwise kept for
+ * the life of the connection.  Safe to call if they were never created.
  */
-bool
-server_process_run(struct process *process)
+void
+server_process_free_loop(struct client *client)
+{
+    if (client->sigchld != NULL) {
+        event_free(client->sigchld);
+        client->sigchld = NULL;
+    }
+    if (client->loop != NULL) {
+        event_base_free(client->loop);
+        client->loop = NULL;
+    }
+}
+
+
+/*
+ * Reset a process struct so that it can be used to run another command for
+ * the same client.  Frees the input and output buffers and the compressor
+ * from the previous command, if any, and clears everything except the
+ * client.
+ */
+void
+server_process_reset(struct process *process)
 {
-    bool success;
-    struct event_base *loop;
     struct client *client = process->client;
+
+    if (process->input != NULL)
+        evbuffer_free(process->input);
+    if (process->output != NULL)
+        evbuffer_free(process->output);
+    compressor_free(process->compressor);
+    memset(process, 0, sizeof(*process));
+    process->client = client;
+}
+
+
+/*
+ * Create the event base that we use for the event loop and the event to
+ * handle SIGCHLD when child processes exit, if this is the first command on
+ * this connection or the previous event base was discarded after an error.
+ */
+static void
+create_loop(struct client *client)
+{
+    if (client->loop != NULL)
+        return;
+    client->loop = event_base_new();
+    if (client->loop == NULL)
+        die("internal error: cannot create process event base");
+    client->sigchld = evsignal_new(client->loop, SIGCHLD, handle_exit, client);
+    if (client->sigchld == NULL)
+        die("internal error: cannot create SIGCHLD processing event");
+}
+
+
+/*
+ * Check whether any of a set of processes broke out of the event loop with
+ * an error.
+ */
+static bool
+saw_error(const struct process *processes, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        if (processes[i].saw_error)
+            return true;
+    return false;
+}
+
+
+/*
+ * Run all of the given processes that need a child process at the same time
+ * in the client's event loop, returning once all of them have exited and all
+ * of their output has been processed.  Processes handled by a FastCGI backend
+ * are skipped.  Returns true on success and false on failure.
+ */
+static bool
+run_children(struct client *client, struct process *processes, size_t count)
+{
+    struct event_base *loop = client->loop;
+    struct process *process;
     const struct timeval immediate = { 0, 0 };
+    size_t i, children = 0;
+    bool output;
 
-    /* Create the event base that we use for the event loop. */
-    loop = event_base_new();
-    process->loop = loop;
+    for (i = 0; i < count; i++)
+        if (processes[i].rule->fastcgi == NULL)
+            children++;
+    if (children == 0)
+        return true;
+    client->processes = processes;
+    client->nprocesses = count;
 
     /*
-     * Create the event to handle SIGCHLD when the child process exits.  We
-     * have to register this event first and then make sure that we create the
-     * child process inside the event loop, since otherwise we race the child
-     * process in setting up the event loop and may miss SIGCHLD and not
-     * realize the child has already exited.
+     * Register the SIGCHLD event.  We have to register this event first and
+     * then make sure that we create the child processes inside the event
+     * loop, since otherwise we race the child processes in setting up the
+     * event loop and may miss SIGCHLD and not realize a child has already
+     * exited.
      */
-    process->sigchld = evsignal_new(loop, SIGCHLD, handle_exit, process);
-    if (process->sigchld == NULL)
-        die("internal error: cannot create SIGCHLD processing event");
-    if (event_add(process->sigchld, NULL) < 0)
+    if (event_add(client->sigchld, NULL) < 0)
         die("internal error: cannot add SIGCHLD processing event");
 
     /*
-     * Prepare to spawn the process itself via a one-time event.  This event
-     * will run once, immediately, and create and add further bufferevents to
-     * handle the output from the process.  It will then self-destruct.
+     * Prepare to spawn each process itself via a one-time event.  These
+     * events will run once, immediately, and create and add further
+     * bufferevents to handle the output from the process.  They will then
+     * self-destruct.
      */
-    if (event_base_once(loop, -1, EV_TIMEOUT, start, process, &immediate) < 0)
-        die("internal error: cannot create event to spawn the process");
+    for (i = 0; i < count; i++) {
+        process = &processes[i];
+        if (process->rule->fastcgi != NULL)
+            continue;
+        if (event_base_once(loop, -1, EV_TIMEOUT, start, process, &immediate)
+            < 0)
+            die("internal error: cannot create event to spawn the process");
+    }
 
     /*
-     * Run the event loop.  This will continue until handle_exit is called or
-     * we encounter some fatal error, in which case we'll break out of the
-     * loop.
+     * Run the event loop.  This will continue until handle_exit has seen all
+     * of the processes exit or we encounter some fatal error, in which case
+     * we'll break out of the loop.
      */
     if (event_base_dispatch(loop) < 0)
         die("internal error: process event loop failed");
 
     /*
-     * We have some more work to do after client exit since there may still be
-     * output from the child sitting in system buffers.  Therefore, we now
+     * If a process exited before all of the standard input being passed to
+     * it arrived, read and discard the rest so that we stay in sync with the
+     * client, and then collect the rest of its output.  The output of a
+     * filter command has already been passed along, and its client may be
+     * waiting for the exit status before ending its input, so the rest of
+     * its input is discarded after the status has been sent.
+     */
+    for (i = 0; i < count; i++) {
+        process = &processes[i];
+        if (process->stream == NULL || !client->streaming || client->filter)
+            continue;
+        if (saw_error(processes, count))
+            continue;
+        while (client->streaming)
+            if (!server_v2_read_input(client, NULL))
+                process->saw_error = true;
+        if (!process->saw_error)
+            stream_end(process);
+    }
+
+    /*
+     * We have some more work to do after the children exit since there may
+     * still be output from them sitting in system buffers.  Therefore, we now
      * repeatedly run the event loop in EVLOOP_NONBLOCK mode, only continuing
-     * if process->saw_output remains true and we didn't break out of the loop
-     * (indicating an error).  The saw_output flag will be set by the event
-     * handlers if we see any output from the process.
+     * if some process saw output and no process saw an error.  The
+     * saw_output flag will be set by the event handlers if we see any output
+     * from a process.
      */
-    process->saw_output = true;
-    while (process->saw_output && !event_base_got_break(loop)) {
-        process->saw_output = false;
+    output = true;
+    while (output && !saw_error(processes, count)) {
+        for (i = 0; i < count; i++)
+            processes[i].saw_output = false;
         if (event_base_loop(loop, EVLOOP_NONBLOCK) < 0)
             die("internal error: process event loop failed");
+        output = false;
+        for (i = 0; i < count; i++)
+            if (processes[i].saw_output)
+                output = true;
     }
 
     /* Close down the file descriptors now that we have all the data. */
-    close(process->stdinout_fd);
-    if (client->protocol > 1)
-        close(process->stderr_fd);
+    for (i = 0; i < count; i++) {
+        process = &processes[i];
+        if (process->stdinout_fd != INVALID_SOCKET)
+            close(process->stdinout_fd);
+        if (process->stderr_fd != INVALID_SOCKET)
+            close(process->stderr_fd);
+        process->stdinout_fd = INVALID_SOCKET;
+        process->stderr_fd = INVALID_SOCKET;
+        if (process->timer != NULL)
+            event_free(process->timer);
+        if (process->stream != NULL)
+            event_free(process->stream);
+        process->timer = NULL;
+        process->stream = NULL;
+    }
+    event_del(client->sigchld);
+    client->processes = NULL;
+    client->nprocesses = 0;
 
     /*
-     * If we aborted on error, still wait for the child process to exit.  We
-     * don't want to just exit and orphan the process since, if spawned from
+     * If we aborted on error, still wait for the child processes to exit.  We
+     * don't want to just exit and orphan the processes since, if spawned from
      * something like xinetd, the lifetime of the remctld process controls the
-     * rate limiting.  We shouldn't deadlock here since client will get broken
-     * pipe errors or EOF when trying to talk to the now-closed sockets.
+     * rate limiting.  We shouldn't deadlock here since children will get
+     * broken pipe errors or EOF when trying to talk to the now-closed
+     * sockets.
      *
-     * An alternative would be to kill the child, but that could cause other
-     * problems if the child is doing something that shouldn't be arbitrarily
-     * interrupted.  This approach seems safer, although has the disadvantage
-     * of keeping the remctld process around until the child completes.
+     * An alternative would be to kill the children, but that could cause
+     * other problems if a child is doing something that shouldn't be
+     * arbitrarily interrupted.  This approach seems safer, although has the
+     * disadvantage of keeping the remctld process around until the children
+     * complete.
+     *
+     * The event base may still have pending events in this case (such as the
+     * loop exit scheduled by handle_exit), so discard it rather than reusing
+     * it for the next command.
      */
-    if (event_base_got_break(loop)) {
-        if (!process->reaped)
-            waitpid(process->pid, &process->status, 0);
+    if (saw_error(processes, count)) {
+        for (i = 0; i < count; i++) {
+            process = &processes[i];
+            if (process->rule->fastcgi != NULL)
+                continue;
+            if (!process->reaped && process->pid > 0)
+                waitpid(process->pid, &process->status, 0);
+            if (process->inout != NULL)
+                bufferevent_free(process->inout);
+            if (process->err != NULL)
+                bufferevent_free(process->err);
+            process->inout = NULL;
+            process->err = NULL;
+        }
+        server_process_free_loop(client);
         return false;
     }
 
     /*
-     * For protocol version one, if the process sent more than the max output,
+     * For protocol version one, if a process sent more than the max output,
      * we already pulled out the output we care about into process->output.
      * Otherwise, we need to pull the output from the bufferevent before we
      * free it.
      */
-    if (client->protocol == 1 && process->output == NULL) {
+    for (i = 0; i < count; i++) {
+        process = &processes[i];
+        if (process->rule->fastcgi != NULL)
+            continue;
+        if (client->protocol == 1 && process->output == NULL) {
+            process->output = evbuffer_new();
+            if (process->output == NULL)
+                die("internal error: cannot create output buffer");
+            if (bufferevent_read_buffer(process->inout, process->output) < 0)
+                die("internal error: cannot read data from output buffer");
+        }
+
+        /* Free the per-command resources. */
+        bufferevent_free(process->inout);
+        if (process->err != NULL)
+            bufferevent_free(process->err);
+        process->inout = NULL;
+        process->err = NULL;
+    }
+
+    /*
+     * If we had to kill any of the processes, report that instead of their
+     * exit status.  Any output they sent before they were killed has already
+     * been passed along for protocol version two.
+     */
+    for (i = 0; i < count; i++)
+        if (processes[i].timed_out) {
+            server_send_error(client, ERROR_TIMEOUT, "Command timed out");
+            return false;
+        }
+    return true;
+}
+
+
+/*
+ * Runs a process as a child to completion, capturing its output and
+ * processing it according to the negotiated remctl client protocol.
+ *
+ * Takes the process, which must have the client, command, argv, and rule
+ * (and optionally the input) filled in.  The event base and SIGCHLD event
+ * are kept in the client struct and reused for later commands on the same
+ * connection.  Returns true on success and false on failure.
+ */
+bool
+server_process_run(struct process *process)
+{
+    return server_process_run_all(process, 1);
+}
+
+
+/*
+ * Runs a set of processes for the same client to completion.  The child
+ * processes are all started at once and run concurrently, and then any
+ * commands handled by a FastCGI backend are run one at a time.  Each process
+ * must be filled in as for server_process_run.  Unless capture is set in the
+ * process, output for protocol version two is sent to the client as it
+ * arrives, so the caller will normally want to set capture when running more
+ * than one process.
+ *
+ * Returns true on success and false on failure, in which case an error has
+ * already been sent to the client and the exit status of some processes may
+ * not be set.
+ */
+bool
+server_process_run_all(struct process *processes, size_t count)
+{
+    struct client *client;
+    struct process *process;
+    size_t i;
+
+    if (count == 0)
+        return true;
+    client = processes[0].client;
+    create_loop(client);
+    for (i = 0; i < count; i++) {
+        process = &processes[i];
+        process->loop = client->loop;
+        process->sigchld = client->sigchld;
+        process->stdinout_fd = INVALID_SOCKET;
+        process->stderr_fd = INVALID_SOCKET;
+    }
+
+    /* Run the child processes first and then any FastCGI commands. */
+    if (!run_children(client, processes, count))
+        return false;
+    for (i = 0; i < count; i++) {
+        process = &processes[i];
+        if (process->rule->fastcgi != NULL)
+            if (!server_fastcgi_run(process))
+                return false;
+    }
+    return true;
+}
+
+
+/*
+ * Save the CPU affinity of the current process so that it can be restored
+ * with server_process_restore_affinity.  Called before an acceptor pins
+ * itself to a single CPU, since commands shouldn't inherit that.
+ */
+#ifdef HAVE_SCHED_SETAFFINITY
+void
+server_process_save_affinity(void)
+{
+    if (sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity) < 0)
+        syswarn("cannot get CPU affinity");
+    else
+        affinity_saved = true;
+}
+#else
+void
+server_process_save_affinity(void)
+{
+}
+#endif
+
+
+/*
+ * Restore the CPU affinity saved by server_process_save_affinity, if any.
+ * Called in the child that handles a connection before it runs any commands.
+ * Failure is not fatal; the command just runs on the CPU of the acceptor.
+ */
+#ifdef HAVE_SCHED_SETAFFINITY
+void
+server_process_restore_affinity(void)
+{
+    if (!affinity_saved)
+        return;
+    if (sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity) < 0)
+        syswarn("cannot restore CPU affinity");
+}
+#else
+void
+server_process_restore_affinity(void)
+{
+}
+#endif
+
+
+/*
+ * Set the timeout in seconds for commands whose configuration rule doesn't
+ * set one.  A value of 0 lets commands run for as long as they want.
+ */
+void
+server_process_set_timeout(long timeout)
+{
+    default_timeout = timeout;
+}
+
+
+/*
+ * Handle a chunk of output from a process for protocol version two.  By
+ * default, it's sent to the client as a MESSAGE_OUTPUT token, or compressed
+ * if the process has a compressor.  If capture is set in the process, it's
+ * instead added to process->output, preceded by the stream number in one
+ * byte and the length as a four-byte integer in network byte order, to be
+ * sent later with server_process_send_captured.  Returns true on success and
+ * false if sending the output failed.
+ */
+bool
+server_process_output(struct process *process, int stream,
+                      struct evbuffer *buf)
+{
+    unsigned char header[1 + 4];
+    uint32_t length;
+
+    if (!process->capture && process->compressor != NULL)
+        return server_v2_send_compressed(process->client, stream, buf,
+                                         process->compressor);
+    if (!process->capture)
+        return server_v2_send_output(process->client, stream, buf);
+    if (process->output == NULL) {
         process->output = evbuffer_new();
         if (process->output == NULL)
             die("internal error: cannot create output buffer");
-        if (bufferevent_read_buffer(process->inout, process->output) < 0)
-            die("internal error: cannot read data from output buffer");
-    }
-
-    /* Free resources and return. */
-    success = !event_base_got_break(loop);
-    bufferevent_free(process->inout);
-    if (process->err != NULL)
-        bufferevent_free(process->err);
-    event_free(process->sigchld);
-    event_base_free(loop);
-    return success;
+    }
+    header[0] = stream;
+    length = htonl(evbuffer_get_length(buf));
+    memcpy(header + 1, &length, 4);
+    if (evbuffer_add(process->output, header, sizeof(header)) < 0)
+        die("internal error: cannot capture process output");
+    if (evbuffer_add_buffer(process->output, buf) < 0)
+        die("internal error: cannot capture process output");
+    return true;
+}
+
+
+/*
+ * Send output captured by server_process_output to the client, as the same
+ * sequence of MESSAGE_OUTPUT tokens that would have been sent without
+ * capturing it.  Takes the captured data as a flat buffer so that it can be
+ * sent more than once.  Returns true on success and false if sending the
+ * output failed.
+ */
+bool
+server_process_send_captured(struct client *client, const char *data,
+                             size_t length)
+{
+    struct evbuffer *buf;
+    uint32_t size;
+    int stream;
+    bool okay = true;
+
+    buf = evbuffer_new();
+    if (buf == NULL)
+        die("internal error: cannot create output buffer");
+    while (okay && length >= 1 + 4) {
+        stream = (unsigned char) data[0];
+        memcpy(&size, data + 1, 4);
+        size = ntohl(size);
+        data += 1 + 4;
+        length -= 1 + 4;
+        if (size > length)
+            die("internal error: captured output is truncated");
+        if (evbuffer_add(buf, data, size) < 0)
+            die("internal error: cannot copy captured output");
+        okay = server_v2_send_output(client, stream, buf);
+        data += size;
+        length -= size;
+    }
+    evbuffer_free(buf);
+    return okay;
 }
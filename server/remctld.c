@@ -20,6 +20,9 @@
 #include <portable/socket.h>
 #include <portable/system.h>
 
+#ifdef HAVE_SCHED_SETAFFINITY
+# include <sched.h>
+#endif
 #include <signal.h>
 #include <syslog.h>
 #include <sys/wait.h>
@@ -56,35 +59,66 @@ static const char usage_message[] = "\
 Usage: remctld <options>\n\
 \n\
 Options:\n\
+    -A            Pin each acceptor process to its own CPU\n\
+    -a <count>    Number of acceptor processes with their own sockets\n\
     -b <addr>     Bind to a specific address (may be given multiple times)\n\
+    -C <file>     Write a compiled snapshot of the config file and exit\n\
+    -c <count>    Connections each pre-forked worker handles before exiting\n\
     -d            Log verbose debugging information\n\
+    -E            Handle all connections in one event-driven process\n\
     -F            Run in the foreground instead of forking and exiting\n\
     -f <file>     Config file (default: " CONFIG_FILE ")\n\
+    -g <seconds>  Seconds to cache localgroup ACL lookups (default: 60)\n\
+    -H <seconds>  Seconds to cache help summary output (default: 60)\n\
     -h            Display this help\n\
+    -L <file>     Load the config from a compiled snapshot when current\n\
     -m            Stand-alone daemon mode, meant mostly for testing\n\
     -P <file>     Write PID to file, only useful with -m\n\
     -p <port>     Port to use, only for standalone mode (default: 4373)\n\
+    -Q <seconds>  Seconds a command over a limit waits to run (default: 0)\n\
     -S            Log to standard output/error rather than syslog\n\
     -s <service>  Service principal to use (default: host/<host>)\n\
+    -T <seconds>  Default seconds a command may run (default: no limit)\n\
+    -U <count>    Commands each user may run at once (default: no limit)\n\
     -v            Display the version of remctld\n\
+    -W            Reload the config automatically when it changes\n\
+    -w <count>    Number of pre-forked workers, only useful with -m\n\
     -Z            Raise SIGSTOP once ready for connections\n\
 \n\
 Supported ACL methods: file, princ, deny";
 
 /* Structure used to store program options. */
 struct options {
+    bool pin_cpus;              /* -A: pin each acceptor to a CPU */
     bool debug;                 /* -d: log verbose debugging information */
+    bool event_driven;          /* -E: handle connections in one process */
     bool foreground;            /* -F: run in the foreground */
     bool log_stdout;            /* -S: log to standard output and error */
     bool standalone;            /* -m: run in stand-alone daemon mode */
     bool suspend;               /* -Z: raise SIGSTOP when ready */
+    bool watch;                 /* -W: reload the config when it changes */
     unsigned short port;        /* -p: port on which to listen */
+    unsigned long acceptors;    /* -a: number of acceptor processes */
+    unsigned long workers;      /* -w: number of pre-forked workers */
+    unsigned long max_requests; /* -c: connections per worker, 0 for no max */
     char *service;              /* -s: service principal to use */
     const char *config_path;    /* -f: path to the configuration file */
+    const char *compile_path;   /* -C: write a configuration snapshot */
+    const char *snapshot_path;  /* -L: load a configuration snapshot */
     const char *pid_path;       /* -P: path to the PID file to write */
     struct vector *bindaddrs;   /* -b: bind to a specific address */
 };
 
+/*
+ * A set of listening sockets.  Each acceptor process has its own set, bound
+ * with SO_REUSEPORT so that the kernel spreads connections between them,
+ * while pre-forked workers all share the same set.
+ */
+struct listener {
+    socket_type *fds;
+    unsigned int nfds;
+};
+
 
 /*
  * Display the usage message for remctld.
@@ -115,6 +149,24 @@ usage(int status)
 }
 
 
+/*
+ * Parse a non-negative count given as the argument to a command-line option,
+ * dying with an error message mentioning the option if it isn't valid.
+ */
+static unsigned long
+parse_count(const char *string, int option)
+{
+    unsigned long count;
+    char *end;
+
+    errno = 0;
+    count = strtoul(string, &end, 10);
+    if (errno != 0 || *end != '\0' || string[0] == '\0' || string[0] == '-')
+        die("invalid count for -%c: %s", option, string);
+    return count;
+}
+
+
 /*
  * Signal handler for child processes forked when running in standalone mode.
  * Just set the child_signaled global so that we know to reap the processes
@@ -257,29 +309,6 @@ handle_connection(int fd, struct config *config, gss_cred_id_t creds)
 }
 
 
-/*
- * Gather information about an exited child and log an appropriate message.
- * We keep the log level to debug unless something interesting happened, like
- * a non-zero exit status.
- */
-static void
-log_child(pid_t pid, int status)
-{
-    if (WIFEXITED(status)) {
-        if (WEXITSTATUS(status) != 0)
-            warn("child %lu exited with %d", (unsigned long) pid,
-                 WEXITSTATUS(status));
-        else
-            debug("child %lu done", (unsigned long) pid);
-    } else if (WIFSIGNALED(status)) {
-        warn("child %lu died on signal %d", (unsigned long) pid,
-             WTERMSIG(status));
-    } else {
-        warn("child %lu died", (unsigned long) pid);
-    }
-}
-
-
 /*
  * Given a bind address, return true if it's an IPv6 address.  Otherwise, it's
  * assumed to be an IPv4 address.
@@ -394,92 +423,63 @@ write_pidfile(pid_t pid, const char *path)
 
 
 /*
- * Run as a daemon.  This is the main dispatch loop, which listens for network
- * connections, forks a child to process each connection, and reaps the
- * children when they're done.  This is only used in standalone mode; when run
- * from inetd or tcpserver, remctld processes one connection and then exits.
+ * Clean up resources in a child process and exit.  This is shared by the
+ * children forked for each connection and by pre-forked workers.  Freeing
+ * everything is not strictly necessary, but it helps valgrind testing.
  */
 static void
-server_daemon(struct options *options, struct config *config,
-              gss_cred_id_t creds)
+child_exit(struct options *options, struct config *config,
+           gss_cred_id_t creds)
+{
+    OM_uint32 minor;
+
+    if (creds != GSS_C_NO_CREDENTIAL)
+        gss_release_cred(&minor, &creds);
+    if (options->log_stdout)
+        fflush(stdout);
+    server_config_free(config);
+    vector_free(options->bindaddrs);
+    libevent_global_shutdown();
+    message_handlers_reset();
+    exit(0);
+}
+
+
+/*
+ * The default standalone processing loop.  Each time through the loop, check
+ * to see if we need to reap children, check to see if we should re-read our
+ * configuration, and check to see if we're exiting.  Then see if we have a
+ * new connection, and if so, fork a child to handle it.
+ *
+ * Note that there are no limits here on the number of simultaneous
+ * connections, and commands are only limited if the configuration or -U
+ * says so, so you may want to set system resource limits to prevent an
+ * attacker from consuming all available processes.
+ */
+static void
+server_fork_loop(struct options *options, struct config *config,
+                 gss_cred_id_t creds, socket_type fds[], unsigned int nfds,
+                 const struct sigaction *oldsa)
 {
     socket_type s;
-    unsigned int nfds, i;
-    socket_type *fds;
+    unsigned int i;
     pid_t child;
     int status;
-    struct sigaction sa, oldsa;
     struct sockaddr_storage ss;
     socklen_t sslen;
     char ip[INET6_ADDRSTRLEN];
-    OM_uint32 minor;
-
-    /* Set up a SIGCHLD handler so that we know when to reap children. */
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = child_handler;
-    if (sigaction(SIGCHLD, &sa, &oldsa) < 0)
-        sysdie("cannot set SIGCHLD handler");
-
-    /* Set up exit handlers for signals that call for a clean shutdown. */
-    sa.sa_handler = exit_handler;
-    if (sigaction(SIGINT, &sa, NULL) < 0)
-        sysdie("cannot set SIGINT handler");
-    if (sigaction(SIGTERM, &sa, NULL) < 0)
-        sysdie("cannot set SIGTERM handler");
-
-    /* Set up a SIGHUP handler so that we know when to re-read our config. */
-    sa.sa_handler = config_handler;
-    if (sigaction(SIGHUP, &sa, NULL) < 0)
-        sysdie("cannot set SIGHUP handler");
-
-    /* Bind to the network sockets and configure listening addresses. */
-    bind_sockets(options, &fds, &nfds);
-
-    /*
-     * Set up our PID file now that we're ready to accept connections, so that
-     * the PID file isn't created until clients can connect.
-     */
-    if (options->pid_path != NULL)
-        write_pidfile(getpid(), options->pid_path);
-
-    /* Log a starting message. */
-    notice("starting");
-
-    /* Indicate to systemd that we're ready to answer requests. */
-    status = sd_notify(true, "READY=1");
-    if (status < 0)
-        warn("cannot notify systemd of startup: %s", strerror(-status));
-
-    /* Indicate to upstart that we're ready to answer requests. */
-    if (options->suspend)
-        if (raise(SIGSTOP) < 0)
-            syswarn("cannot notify upstart of startup");
 
-    /*
-     * The main processing loop.  Each time through the loop, check to see if
-     * we need to reap children, check to see if we should re-read our
-     * configuration, and check to see if we're exiting.  Then see if we have
-     * a new connection, and if so, fork a child to handle it.
-     *
-     * Note that there are no limits here on the number of simultaneous
-     * processes, so you may want to set system resource limits to prevent an
-     * attacker from consuming all available processes.
-     */
     while (1) {
         if (child_signaled) {
             child_signaled = 0;
             while ((child = waitpid(0, &status, WNOHANG)) > 0)
-                log_child(child, status);
+                server_log_child(child, status);
             if (child < 0 && errno != ECHILD)
                 sysdie("waitpid failed");
         }
         if (config_signaled) {
             config_signaled = 0;
-            notice("re-reading configuration");
-            server_config_free(config);
-            config = server_config_load(options->config_path);
-            if (config == NULL)
-                die("cannot load configuration file %s", options->config_path);
+            server_watch_reload(config, options->config_path);
         }
         if (exit_signaled) {
             notice("signal received, exiting");
@@ -499,27 +499,402 @@ server_daemon(struct options *options, struct config *config,
             warn("sleeping ten seconds in the hope we recover...");
             sleep(10);
         } else if (child == 0) {
+            server_watch_free();
             for (i = 0; i < nfds; i++)
                 close(fds[i]);
             network_bind_all_free(fds);
-            if (sigaction(SIGCHLD, &oldsa, NULL) < 0)
+            if (sigaction(SIGCHLD, oldsa, NULL) < 0)
                 syswarn("cannot reset SIGCHLD handler");
+            server_process_restore_affinity();
             handle_connection(s, config, creds);
-            if (creds != GSS_C_NO_CREDENTIAL)
-                gss_release_cred(&minor, &creds);
-            if (options->log_stdout)
-                fflush(stdout);
-            server_config_free(config);
-            vector_free(options->bindaddrs);
-            libevent_global_shutdown();
-            message_handlers_reset();
-            exit(0);
+            child_exit(options, config, creds);
         } else {
             close(s);
             network_sockaddr_sprint(ip, sizeof(ip), (struct sockaddr *) &ss);
             debug("child %lu for %s", (unsigned long) child, ip);
         }
     }
+}
+
+
+/*
+ * The processing loop of a pre-forked worker.  Accept connections on the
+ * listening sockets shared with the other workers and handle each one in
+ * turn, exactly as a per-connection child would, until we've handled the
+ * maximum number of connections or the parent asks us to exit.
+ *
+ * The listening sockets are non-blocking in this mode, since every idle
+ * worker is woken for each new connection and all but one of them will lose
+ * the race to accept it.
+ */
+static void
+server_worker(struct options *options, struct config *config,
+              gss_cred_id_t creds, socket_type fds[], unsigned int nfds)
+{
+    socket_type s;
+    unsigned long handled = 0;
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    char ip[INET6_ADDRSTRLEN];
+
+    while (!exit_signaled && !config_signaled) {
+        if (options->max_requests > 0 && handled >= options->max_requests)
+            break;
+        sslen = sizeof(ss);
+        s = network_accept_any(fds, nfds, (struct sockaddr *) &ss, &sslen);
+        if (s == INVALID_SOCKET) {
+            if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED)
+                continue;
+            sysdie("error accepting incoming connection");
+        }
+        if (!fdflag_nonblocking(s, false)) {
+            syswarn("cannot make connection blocking");
+            close(s);
+            continue;
+        }
+        fdflag_close_exec(s, true);
+        network_sockaddr_sprint(ip, sizeof(ip), (struct sockaddr *) &ss);
+        debug("worker %lu handling connection from %s",
+              (unsigned long) getpid(), ip);
+        handle_connection(s, config, creds);
+        handled++;
+    }
+    debug("worker %lu exiting after %lu connections",
+          (unsigned long) getpid(), handled);
+}
+
+
+/*
+ * Close a set of listening sockets and free the array that holds them.
+ */
+static void
+listener_close(struct listener *listener)
+{
+    unsigned int i;
+
+    for (i = 0; i < listener->nfds; i++)
+        close(listener->fds[i]);
+    network_bind_all_free(listener->fds);
+    listener->fds = NULL;
+    listener->nfds = 0;
+}
+
+
+/*
+ * Pin the current process to one of the CPUs it's allowed to run on,
+ * choosing the CPU based on the acceptor slot so that acceptors are spread
+ * evenly across the available CPUs.  Failure is not fatal; the acceptor just
+ * runs wherever the scheduler puts it.  The original affinity is saved first
+ * so that the children handling connections can go back to it.
+ */
+#ifdef HAVE_SCHED_SETAFFINITY
+static void
+pin_cpu(unsigned long slot)
+{
+    cpu_set_t allowed, set;
+    int cpu, count;
+    unsigned long n;
+
+    server_process_save_affinity();
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        syswarn("cannot get CPU affinity");
+        return;
+    }
+    count = CPU_COUNT(&allowed);
+    if (count == 0)
+        return;
+    n = slot % (unsigned long) count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed)) {
+            if (n == 0)
+                break;
+            n--;
+        }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        syswarn("cannot pin acceptor to CPU %d", cpu);
+    else
+        debug("acceptor %lu pinned to CPU %d", slot, cpu);
+}
+#else
+static void
+pin_cpu(unsigned long slot UNUSED)
+{
+}
+#endif
+
+
+/*
+ * Fork a new pre-forked worker or acceptor for the given slot.  Returns the
+ * PID of the child in the parent or -1 if the fork failed.  The child
+ * restores the signal mask that the parent changed, runs the appropriate
+ * processing loop, and then exits.
+ *
+ * An acceptor is a complete standalone server on its own set of listening
+ * sockets, so it keeps our SIGCHLD handler and runs either the normal fork
+ * loop or the event-driven engine.  A worker instead handles connections
+ * itself and restores the original SIGCHLD disposition.
+ */
+static pid_t
+start_worker(struct options *options, struct config *config,
+             gss_cred_id_t creds, struct listener slots[],
+             unsigned long nslots, unsigned long slot,
+             const struct sigaction *oldsa, const sigset_t *oldmask)
+{
+    pid_t child;
+    unsigned long i;
+    struct listener *listener = &slots[slot];
+
+    child = fork();
+    if (child < 0)
+        syswarn("forking a new worker failed");
+    else if (child == 0) {
+        server_watch_free();
+        if (sigprocmask(SIG_SETMASK, oldmask, NULL) < 0)
+            syswarn("cannot reset signal mask");
+        if (options->acceptors > 0) {
+            for (i = 0; i < nslots; i++)
+                if (i != slot)
+                    listener_close(&slots[i]);
+            if (options->pin_cpus)
+                pin_cpu(slot);
+            if (options->event_driven)
+                server_engine_run(listener->fds, listener->nfds, config,
+                                  options->config_path, creds);
+            else
+                server_fork_loop(options, config, creds, listener->fds,
+                                 listener->nfds, oldsa);
+        } else {
+            if (sigaction(SIGCHLD, oldsa, NULL) < 0)
+                syswarn("cannot reset SIGCHLD handler");
+            server_worker(options, config, creds, listener->fds,
+                          listener->nfds);
+        }
+        listener_close(listener);
+        free(slots);
+        child_exit(options, config, creds);
+    }
+    return child;
+}
+
+
+/*
+ * The supervisor loop, used instead of server_fork_loop if -w or -a was
+ * given.  Takes one set of listening sockets per slot.  Keep a worker or
+ * acceptor running in each slot, replacing any that exit (either because
+ * they reached their connection limit or because they died), and otherwise
+ * sleep until we get a signal.
+ *
+ * On SIGHUP (or SIGIO if watching the configuration), reload the
+ * configuration.  If it changed, workers are then asked to exit after their
+ * current connection and their slots are refilled immediately with workers
+ * using the new configuration, so there may briefly be more than the
+ * configured number of workers.  Acceptors hold no connections of their own,
+ * so they're instead sent SIGHUP to reload the configuration themselves.
+ *
+ * The signals we care about are blocked except inside sigsuspend so that a
+ * signal can't arrive between checking the flags and going to sleep.
+ */
+static void
+server_prefork(struct options *options, struct config *config,
+               gss_cred_id_t creds, struct listener slots[],
+               unsigned long nslots, const struct sigaction *oldsa)
+{
+    pid_t *workers;
+    pid_t child;
+    unsigned long i;
+    int status;
+    bool changed;
+    sigset_t mask, oldmask;
+
+    if (options->acceptors == 0)
+        for (i = 0; i < slots[0].nfds; i++)
+            if (!fdflag_nonblocking(slots[0].fds[i], true))
+                sysdie("cannot make listening socket non-blocking");
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGIO);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0)
+        sysdie("cannot block signals");
+    workers = xcalloc(nslots, sizeof(pid_t));
+
+    while (1) {
+        if (child_signaled) {
+            child_signaled = 0;
+            while ((child = waitpid(0, &status, WNOHANG)) > 0) {
+                server_log_child(child, status);
+                for (i = 0; i < nslots; i++)
+                    if (workers[i] == child)
+                        workers[i] = 0;
+            }
+            if (child < 0 && errno != ECHILD)
+                sysdie("waitpid failed");
+        }
+        if (config_signaled) {
+            config_signaled = 0;
+            changed = server_watch_reload(config, options->config_path);
+            for (i = 0; changed && i < nslots; i++)
+                if (workers[i] > 0) {
+                    if (options->acceptors > 0) {
+                        if (kill(workers[i], SIGHUP) < 0)
+                            syswarn("cannot signal acceptor %lu",
+                                    (unsigned long) workers[i]);
+                        continue;
+                    }
+                    if (kill(workers[i], SIGTERM) < 0)
+                        syswarn("cannot signal worker %lu",
+                                (unsigned long) workers[i]);
+                    workers[i] = 0;
+                }
+        }
+        if (exit_signaled) {
+            notice("signal received, exiting");
+            break;
+        }
+        for (i = 0; i < nslots; i++) {
+            if (workers[i] > 0)
+                continue;
+            child = start_worker(options, config, creds, slots, nslots, i,
+                                 oldsa, &oldmask);
+            if (child < 0)
+                break;
+            debug("started %s %lu",
+                  options->acceptors > 0 ? "acceptor" : "worker",
+                  (unsigned long) child);
+            workers[i] = child;
+        }
+        if (i < nslots) {
+            warn("sleeping ten seconds in the hope we recover...");
+            sleep(10);
+            continue;
+        }
+        while (!child_signaled && !config_signaled && !exit_signaled)
+            sigsuspend(&oldmask);
+    }
+
+    /* Ask the children to exit and wait for all of them to do so. */
+    for (i = 0; i < nslots; i++)
+        if (workers[i] > 0)
+            if (kill(workers[i], SIGTERM) < 0)
+                syswarn("cannot signal worker %lu",
+                        (unsigned long) workers[i]);
+    while ((child = waitpid(0, &status, 0)) > 0)
+        server_log_child(child, status);
+    if (sigprocmask(SIG_SETMASK, &oldmask, NULL) < 0)
+        syswarn("cannot reset signal mask");
+    free(workers);
+}
+
+
+/*
+ * Run as a daemon.  This is the main dispatch loop, which listens for network
+ * connections and hands them off to a new child per connection, to a pool of
+ * pre-forked workers, to a set of acceptor processes, or to the event-driven
+ * engine, reaping the children when they're done.  This is only used in
+ * standalone mode; when run from inetd or tcpserver, remctld processes one
+ * connection and then exits.
+ *
+ * With acceptors, every set of listening sockets is bound here before the
+ * PID file is written, so that clients can connect as soon as it exists and
+ * a replacement acceptor inherits the sockets of the one it replaces without
+ * dropping queued connections.
+ */
+static void
+server_daemon(struct options *options, struct config *config,
+              gss_cred_id_t creds)
+{
+    unsigned int nfds = 0;
+    unsigned int i;
+    unsigned long slot;
+    socket_type *fds = NULL;
+    struct listener *slots;
+    int status;
+    struct sigaction sa, oldsa;
+
+    /* Set up a SIGCHLD handler so that we know when to reap children. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = child_handler;
+    if (sigaction(SIGCHLD, &sa, &oldsa) < 0)
+        sysdie("cannot set SIGCHLD handler");
+
+    /* Set up exit handlers for signals that call for a clean shutdown. */
+    sa.sa_handler = exit_handler;
+    if (sigaction(SIGINT, &sa, NULL) < 0)
+        sysdie("cannot set SIGINT handler");
+    if (sigaction(SIGTERM, &sa, NULL) < 0)
+        sysdie("cannot set SIGTERM handler");
+
+    /* Set up a SIGHUP handler so that we know when to re-read our config. */
+    sa.sa_handler = config_handler;
+    if (sigaction(SIGHUP, &sa, NULL) < 0)
+        sysdie("cannot set SIGHUP handler");
+
+    /*
+     * If asked to watch the configuration, SIGIO means that it has changed
+     * and is handled the same as SIGHUP.  If watching isn't possible, carry
+     * on with only SIGHUP.
+     */
+    if (options->watch) {
+        if (sigaction(SIGIO, &sa, NULL) < 0)
+            sysdie("cannot set SIGIO handler");
+        server_watch_init(config);
+    }
+
+    /*
+     * Bind to the network sockets and configure listening addresses.  Each
+     * acceptor gets its own sockets, which requires SO_REUSEPORT and can't
+     * work with sockets passed in by systemd.
+     */
+    if (options->acceptors > 0) {
+        if (sd_listen_fds(false) > 0)
+            die("-a cannot be used with systemd socket activation");
+        slots = xcalloc(options->acceptors, sizeof(struct listener));
+        for (slot = 0; slot < options->acceptors; slot++)
+            bind_sockets(options, &slots[slot].fds, &slots[slot].nfds);
+    } else {
+        bind_sockets(options, &fds, &nfds);
+        slots = xcalloc(options->workers, sizeof(struct listener));
+        for (slot = 0; slot < options->workers; slot++) {
+            slots[slot].fds = fds;
+            slots[slot].nfds = nfds;
+        }
+    }
+
+    /*
+     * Set up our PID file now that we're ready to accept connections, so that
+     * the PID file isn't created until clients can connect.
+     */
+    if (options->pid_path != NULL)
+        write_pidfile(getpid(), options->pid_path);
+
+    /* Log a starting message. */
+    notice("starting");
+
+    /* Indicate to systemd that we're ready to answer requests. */
+    status = sd_notify(true, "READY=1");
+    if (status < 0)
+        warn("cannot notify systemd of startup: %s", strerror(-status));
+
+    /* Indicate to upstart that we're ready to answer requests. */
+    if (options->suspend)
+        if (raise(SIGSTOP) < 0)
+            syswarn("cannot notify upstart of startup");
+
+    /* Process connections until we're told to exit. */
+    if (options->acceptors > 0)
+        server_prefork(options, config, creds, slots, options->acceptors,
+                       &oldsa);
+    else if (options->event_driven)
+        server_engine_run(fds, nfds, config, options->config_path, creds);
+    else if (options->workers > 0)
+        server_prefork(options, config, creds, slots, options->workers,
+                       &oldsa);
+    else
+        server_fork_loop(options, config, creds, fds, nfds, &oldsa);
 
     /*
      * Clean up resources at the end of the loop.  This is not strictly
@@ -527,9 +902,13 @@ server_daemon(struct options *options, struct config *config,
      */
     if (options->pid_path != NULL)
         unlink(options->pid_path);
+    for (slot = 0; slot < options->acceptors; slot++)
+        listener_close(&slots[slot]);
     for (i = 0; i < nfds; i++)
         close(fds[i]);
     network_bind_all_free(fds);
+    free(slots);
+    server_watch_free();
 }
 
 
@@ -569,20 +948,45 @@ main(int argc, char *argv[])
     options.bindaddrs = vector_new();
 
     /* Parse options. */
-    while ((option = getopt(argc, argv, "b:dFf:hk:mP:p:Ss:vZ")) != EOF) {
+    while ((option = getopt(argc, argv,
+                            "Aa:b:C:c:dEFf:g:H:hk:L:mP:p:Q:Ss:T:U:vWw:Z"))
+           != EOF) {
         switch (option) {
+        case 'A':
+            options.pin_cpus = true;
+            break;
+        case 'a':
+            options.acceptors = parse_count(optarg, 'a');
+            if (options.acceptors == 0)
+                die("-a must be at least 1");
+            break;
         case 'b':
             vector_add(options.bindaddrs, optarg);
             break;
+        case 'C':
+            options.compile_path = optarg;
+            break;
+        case 'c':
+            options.max_requests = parse_count(optarg, 'c');
+            break;
         case 'd':
             options.debug = true;
             break;
+        case 'E':
+            options.event_driven = true;
+            break;
         case 'F':
             options.foreground = true;
             break;
         case 'f':
             options.config_path = optarg;
             break;
+        case 'g':
+            server_config_set_localgroup_ttl(parse_count(optarg, 'g'));
+            break;
+        case 'H':
+            server_set_summary_ttl(parse_count(optarg, 'H'));
+            break;
         case 'h':
             usage(0);
             break;
@@ -590,6 +994,9 @@ main(int argc, char *argv[])
             if (setenv("KRB5_KTNAME", optarg, 1) < 0)
                 sysdie("cannot set KRB5_KTNAME");
             break;
+        case 'L':
+            options.snapshot_path = optarg;
+            break;
         case 'm':
             options.standalone = true;
             break;
@@ -599,16 +1006,33 @@ main(int argc, char *argv[])
         case 'p':
             options.port = atoi(optarg);
             break;
+        case 'Q':
+            server_limit_set_wait(parse_count(optarg, 'Q'));
+            break;
         case 'S':
             options.log_stdout = true;
             break;
         case 's':
             options.service = optarg;
             break;
+        case 'T':
+            server_process_set_timeout(parse_count(optarg, 'T'));
+            break;
+        case 'U':
+            server_limit_set_user(parse_count(optarg, 'U'));
+            break;
         case 'v':
             printf("remctld %s\n", PACKAGE_VERSION);
             exit(0);
             break;
+        case 'W':
+            options.watch = true;
+            break;
+        case 'w':
+            options.workers = parse_count(optarg, 'w');
+            if (options.workers == 0)
+                die("-w must be at least 1");
+            break;
         case 'Z':
             options.suspend = true;
             break;
@@ -623,6 +1047,49 @@ main(int argc, char *argv[])
         die("-b only makes sense in combination with -m");
     if (options.suspend && !options.standalone)
         die("-Z only makes sense in combination with -m");
+    if (options.watch && !options.standalone)
+        die("-W only makes sense in combination with -m");
+    if (options.event_driven && !options.standalone)
+        die("-E only makes sense in combination with -m");
+    if (options.event_driven && options.workers > 0)
+        die("-E and -w cannot be used together");
+    if (options.workers > 0 && !options.standalone)
+        die("-w only makes sense in combination with -m");
+    if (options.max_requests > 0 && options.workers == 0)
+        die("-c only makes sense in combination with -w");
+    if (options.acceptors > 0 && !options.standalone)
+        die("-a only makes sense in combination with -m");
+    if (options.acceptors > 0 && options.workers > 0)
+        die("-a and -w cannot be used together");
+    if (options.pin_cpus && options.acceptors == 0)
+        die("-A only makes sense in combination with -a");
+#ifndef HAVE_SCHED_SETAFFINITY
+    if (options.pin_cpus)
+        die("-A is not supported on this platform");
+#endif
+    if (options.acceptors > 0 && !network_bind_set_reuseport(true))
+        die("-a is not supported on this platform (no SO_REUSEPORT)");
+
+    /*
+     * If asked to compile the configuration, parse it, write the snapshot,
+     * and exit.  Otherwise, use the snapshot in place of parsing the
+     * configuration whenever it's current.
+     */
+    if (options.compile_path != NULL) {
+        config = server_config_load(options.config_path);
+        if (config == NULL)
+            die("cannot read configuration file %s", options.config_path);
+        if (!server_snapshot_write(config, options.config_path,
+                                   options.compile_path))
+            die("cannot write configuration snapshot %s",
+                options.compile_path);
+        server_config_free(config);
+        vector_free(options.bindaddrs);
+        message_handlers_reset();
+        return 0;
+    }
+    if (options.snapshot_path != NULL)
+        server_config_set_snapshot(options.snapshot_path);
 
     /* Daemonize if told to do so. */
     if (options.standalone && !options.foreground)
@@ -650,6 +1117,9 @@ main(int argc, char *argv[])
     if (config == NULL)
         die("cannot read configuration file %s", options.config_path);
 
+    /* Create the table of running commands shared by all our processes. */
+    server_limit_init();
+
     /*
      * If a service was specified, we should load only those credentials since
      * those are the only ones we're allowed to use.  Otherwise, creds will
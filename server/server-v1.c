@@ -86,8 +86,9 @@ server_v1_handle_messages(struct client *client, struct config *config)
     int status, flags;
 
     /* Receive the message. */
-    status = token_recv_priv(client->fd, client->context, &flags, &token,
-                             TOKEN_MAX_LENGTH, TIMEOUT, &major, &minor);
+    status = token_recv_priv(client->fd, &client->buffer, client->context,
+                             &flags, &token, TOKEN_MAX_LENGTH, TIMEOUT,
+                             &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("receiving command token", status, major, minor);
         if (status == TOKEN_FAIL_LARGE)
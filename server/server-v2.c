@@ -19,63 +19,195 @@
 #include <portable/uio.h>
 
 #include <server/internal.h>
+#include <util/compress.h>
 #include <util/gss-tokens.h>
 #include <util/messages.h>
 #include <util/xmalloc.h>
 
 
+/*
+ * Store the start of a reply to the current command in buffer, which must
+ * have room for six octets: the protocol version and message type, followed
+ * for a protocol version four command by its request ID.  Returns the length
+ * of the header.
+ */
+static size_t
+reply_header(const struct client *client, char *buffer, int type)
+{
+    OM_uint32 tmp;
+
+    buffer[0] = client->tagged ? 4 : 2;
+    buffer[1] = type;
+    if (!client->tagged)
+        return 1 + 1;
+    tmp = htonl(client->request_id);
+    memcpy(buffer + 2, &tmp, 4);
+    return 1 + 1 + 4;
+}
+
+
+/*
+ * Return the most output that fits in a single MESSAGE_OUTPUT token in reply
+ * to the current command, given the maximum token size agreed with the
+ * client.
+ */
+size_t
+server_v2_max_output(const struct client *client)
+{
+    if (client->tagged)
+        return client->token_max - (TOKEN_MAX_DATA - TOKEN_MAX_OUTPUT_V4);
+    return client->token_max - (TOKEN_MAX_DATA - TOKEN_MAX_OUTPUT);
+}
+
+
+/*
+ * Given the client struct, the message type, and the stream number the data
+ * is from, send the data in the evbuffer to the client as tokens of that
+ * type.  The data is sent directly from the memory of the evbuffer (and may
+ * be encrypted in place there) and then drained.  Output that doesn't fit in
+ * one token is sent as several.  Returns true on success, false on failure
+ * (and logs a message on failure).
+ */
+static bool
+send_output(struct client *client, int type, int stream,
+            struct evbuffer *output)
+{
+    char header[1 + 1 + 4 + 1 + 4];
+    struct evbuffer_iovec *chunks;
+    struct iovec *iov;
+    size_t length, outlen;
+    OM_uint32 tmp, major, minor;
+    int i, nchunks, status;
+
+    do {
+        /* Build the header (version, type, stream, and length). */
+        outlen = evbuffer_get_length(output);
+        if (outlen > server_v2_max_output(client))
+            outlen = server_v2_max_output(client);
+        length = reply_header(client, header, type);
+        header[length] = stream;
+        tmp = htonl(outlen);
+        memcpy(header + length + 1, &tmp, 4);
+        length += 1 + 4;
+
+        /*
+         * Point the remaining iovecs at the data in the output buffer,
+         * trimming the last one to the amount of data we're sending.
+         */
+        nchunks = evbuffer_peek(output, outlen, NULL, NULL, 0);
+        if (nchunks < 0)
+            die("internal error: cannot get data from output buffer");
+        chunks = xcalloc(nchunks + 1, sizeof(struct evbuffer_iovec));
+        iov = xcalloc(nchunks + 1, sizeof(struct iovec));
+        if (evbuffer_peek(output, outlen, NULL, chunks, nchunks) != nchunks)
+            die("internal error: cannot get data from output buffer");
+        iov[0].iov_base = header;
+        iov[0].iov_len = length;
+        for (length = 0, i = 0; i < nchunks; i++) {
+            iov[i + 1].iov_base = chunks[i].iov_base;
+            iov[i + 1].iov_len = chunks[i].iov_len;
+            if (iov[i + 1].iov_len > outlen - length)
+                iov[i + 1].iov_len = outlen - length;
+            length += iov[i + 1].iov_len;
+        }
+
+        /* Send the token and discard the data. */
+        status = token_sendv_priv(client->fd, client->context,
+                                  TOKEN_DATA | TOKEN_PROTOCOL, iov,
+                                  nchunks + 1, TIMEOUT, &major, &minor);
+        free(chunks);
+        free(iov);
+        if (evbuffer_drain(output, outlen) < 0)
+            die("internal error: cannot drain output buffer");
+        if (status != TOKEN_OK) {
+            warn_token("sending output token", status, major, minor);
+            client->fatal = true;
+            return false;
+        }
+    } while (evbuffer_get_length(output) > 0);
+    return true;
+}
+
+
 /*
  * Given the client struct and the stream number the data is from, send a
  * protocol v2 output token to the client containing the data stored in the
- * buffer in the client struct.  Returns true on success, false on failure
- * (and logs a message on failure).
+ * buffer in the client struct.  Output that doesn't fit in one token, such
+ * as cached output captured for an earlier command, is sent as several.
+ * Returns true on success, false on failure (and logs a message on failure).
  */
 bool
 server_v2_send_output(struct client *client, int stream,
                       struct evbuffer *output)
 {
-    gss_buffer_desc token;
-    size_t outlen;
-    char *p;
-    OM_uint32 tmp, major, minor;
-    int status;
-
-    /* Allocate room for the total message. */
-    outlen = evbuffer_get_length(output);
-    if (outlen >= SIZE_MAX - 1 - 1 - 1 - 4)
-        die("internal error: memory allocation too large");
-    token.length = 1 + 1 + 1 + 4 + outlen;
-    token.value = xmalloc(token.length);
+    return send_output(client, MESSAGE_OUTPUT, stream, output);
+}
 
-    /*
-     * Fill in the header (version, type, stream, length, and data) and then
-     * the data.
-     */
-    p = token.value;
-    *p = 2;
-    p++;
-    *p = MESSAGE_OUTPUT;
-    p++;
-    *p = stream;
-    p++;
-    tmp = htonl(outlen);
-    memcpy(p, &tmp, 4);
-    p += 4;
-    if (evbuffer_remove(output, p, outlen) < 0)
-        die("internal error: cannot move data from output buffer");
 
-    /* Send the token. */
-    status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
-    if (status != TOKEN_OK) {
-        warn_token("sending output token", status, major, minor);
-        free(token.value);
-        client->fatal = true;
-        return false;
+/*
+ * Given the client struct, the stream number the data is from, and the
+ * compressor for the current command, compress the data stored in the buffer
+ * and send it to the client as protocol v4 compressed output tokens.  The
+ * data is compressed a token's worth at a time and flushed after each, so
+ * that no token decompresses to more output than the client would accept
+ * uncompressed.  If compression fails, an internal error is sent to the
+ * client.  Returns true on success, false on failure (and logs a message on
+ * failure).
+ */
+bool
+server_v2_send_compressed(struct client *client, int stream,
+                          struct evbuffer *output,
+                          struct compressor *compressor)
+{
+    struct evbuffer *compressed;
+    struct evbuffer_iovec *chunks;
+    struct iovec *iov;
+    char *data;
+    size_t length, outlen;
+    int i, nchunks;
+    bool okay = true;
+
+    compressed = evbuffer_new();
+    if (compressed == NULL)
+        die("internal error: cannot create output buffer");
+    while (okay && evbuffer_get_length(output) > 0) {
+        outlen = evbuffer_get_length(output);
+        if (outlen > server_v2_max_output(client))
+            outlen = server_v2_max_output(client);
+        nchunks = evbuffer_peek(output, outlen, NULL, NULL, 0);
+        if (nchunks < 0)
+            die("internal error: cannot get data from output buffer");
+        chunks = xcalloc(nchunks, sizeof(struct evbuffer_iovec));
+        iov = xcalloc(nchunks, sizeof(struct iovec));
+        if (evbuffer_peek(output, outlen, NULL, chunks, nchunks) != nchunks)
+            die("internal error: cannot get data from output buffer");
+        for (length = 0, i = 0; i < nchunks; i++) {
+            iov[i].iov_base = chunks[i].iov_base;
+            iov[i].iov_len = chunks[i].iov_len;
+            if (iov[i].iov_len > outlen - length)
+                iov[i].iov_len = outlen - length;
+            length += iov[i].iov_len;
+        }
+        okay = compressor_run(compressor, iov, nchunks, &data, &length);
+        free(chunks);
+        free(iov);
+        if (evbuffer_drain(output, outlen) < 0)
+            die("internal error: cannot drain output buffer");
+        if (!okay) {
+            warn("cannot compress output");
+            server_send_error(client, ERROR_INTERNAL, "Internal failure");
+            break;
+        }
+        if (length > 0) {
+            if (evbuffer_add(compressed, data, length) < 0)
+                die("internal error: cannot copy compressed output");
+            okay = send_output(client, MESSAGE_OUTPUT_COMPRESSED, stream,
+                               compressed);
+        }
+        free(data);
     }
-    free(token.value);
-    return true;
+    evbuffer_free(compressed);
+    return okay;
 }
 
 
@@ -88,16 +220,15 @@ bool
 server_v2_send_status(struct client *client, int exit_status)
 {
     gss_buffer_desc token;
-    char buffer[1 + 1 + 1];
+    char buffer[1 + 1 + 4 + 1];
     OM_uint32 major, minor;
     int status;
 
     /* Build the status token. */
-    token.length = 1 + 1 + 1;
+    token.length = reply_header(client, buffer, MESSAGE_STATUS);
     token.value = &buffer;
-    buffer[0] = 2;
-    buffer[1] = MESSAGE_STATUS;
-    buffer[2] = exit_status;
+    buffer[token.length] = exit_status;
+    token.length++;
 
     /* Send the token. */
     status = token_send_priv(client->fd, client->context,
@@ -127,15 +258,12 @@ server_v2_send_error(struct client *client, enum error_codes code,
     int status;
 
     /* Build the error token. */
-    if (strlen(message) >= SIZE_MAX - 1 - 1 - 4 - 4)
+    if (strlen(message) >= SIZE_MAX - 1 - 1 - 4 - 4 - 4)
         die("internal error: memory allocation too large");
-    token.length = 1 + 1 + 4 + 4 + strlen(message);
+    token.length = 1 + 1 + 4 + 4 + 4 + strlen(message);
     token.value = xmalloc(token.length);
     p = token.value;
-    *p = 2;
-    p++;
-    *p = MESSAGE_ERROR;
-    p++;
+    p += reply_header(client, p, MESSAGE_ERROR);
     tmp = htonl(code);
     memcpy(p, &tmp, 4);
     p += 4;
@@ -143,6 +271,7 @@ server_v2_send_error(struct client *client, enum error_codes code,
     memcpy(p, &tmp, 4);
     p += 4;
     memcpy(p, message, strlen(message));
+    token.length = p + strlen(message) - (char *) token.value;
 
     /* Send the token. */
     status = token_send_priv(client->fd, client->context,
@@ -177,7 +306,7 @@ server_v2_send_version(struct client *client)
     token.value = &buffer;
     buffer[0] = 2;
     buffer[1] = MESSAGE_VERSION;
-    buffer[2] = 3;
+    buffer[2] = 4;
 
     /* Send the token. */
     status = token_send_priv(client->fd, client->context,
@@ -192,6 +321,94 @@ server_v2_send_version(struct client *client)
 }
 
 
+/*
+ * Given the client struct and a capabilities message from the client, build
+ * the reply in the provided buffer, which must hold 1 + 1 + 4 + 4 + 1 octets,
+ * and return its length, or 0 if the message is invalid.  The client offers
+ * the optional features it supports, the largest token data size it is
+ * willing to handle, and the compression methods it can decompress.  We
+ * reply with the features we also support, the smaller of the two token data
+ * sizes, and a compression method we also support, if any, and use those for
+ * the rest of the connection.  Shared with the event-driven engine, which
+ * handles capabilities messages itself.
+ */
+size_t
+server_v2_capabilities_reply(struct client *client, gss_buffer_t token,
+                             char *reply)
+{
+    const char *p = token->value;
+    OM_uint32 tmp;
+    unsigned long features;
+    size_t size;
+
+    if (p[0] != 4 || token->length != 1 + 1 + 4 + 4 + 1)
+        return 0;
+    memcpy(&tmp, p + 2, 4);
+    features = ntohl(tmp) & CAPABILITIES_ALL;
+    memcpy(&tmp, p + 6, 4);
+    size = ntohl(tmp);
+    if (size > TOKEN_MAX_DATA_LARGE)
+        size = TOKEN_MAX_DATA_LARGE;
+    else if (size < TOKEN_MAX_DATA)
+        size = TOKEN_MAX_DATA;
+    debug("using capabilities 0x%lx and maximum token data size of %lu",
+          features, (unsigned long) size);
+    client->token_max = size;
+
+    /*
+     * There is only one compression method so far, so agree on it if we
+     * can.
+     */
+    client->compression = p[10] & COMPRESS_METHODS;
+    if (client->compression != 0)
+        debug("using compression method %d", client->compression);
+
+    /* Build the reply, which has the same format. */
+    reply[0] = 4;
+    reply[1] = MESSAGE_CAPABILITIES;
+    tmp = htonl(features);
+    memcpy(reply + 2, &tmp, 4);
+    tmp = htonl(size);
+    memcpy(reply + 6, &tmp, 4);
+    reply[10] = client->compression;
+    return 1 + 1 + 4 + 4 + 1;
+}
+
+
+/*
+ * Given the client struct and a capabilities token from the client, send our
+ * reply.  Returns true on success, false on failure (and logs a message on
+ * failure).
+ */
+static bool
+server_v4_send_capabilities(struct client *client, gss_buffer_t message)
+{
+    gss_buffer_desc token;
+    char buffer[1 + 1 + 4 + 4 + 1];
+    OM_uint32 major, minor;
+    int status;
+
+    /* Build the capabilities token. */
+    token.length = server_v2_capabilities_reply(client, message, buffer);
+    token.value = &buffer;
+    if (token.length == 0) {
+        warn("invalid capabilities message from client");
+        return server_send_error(client, ERROR_BAD_TOKEN, "Invalid token");
+    }
+
+    /* Send the token. */
+    status = token_send_priv(client->fd, client->context,
+                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
+                             &major, &minor);
+    if (status != TOKEN_OK) {
+        warn_token("sending capabilities token", status, major, minor);
+        client->fatal = true;
+        return false;
+    }
+    return true;
+}
+
+
 /*
  * Given the client struct, send a protocol v3 no-op token to the client.
  * This is the response to a no-op token.  Returns true on success, false on
@@ -205,7 +422,7 @@ server_v3_send_noop(struct client *client)
     OM_uint32 major, minor;
     int status;
 
-    /* Build the version token. */
+    /* Build the no-op token. */
     token.length = 1 + 1;
     token.value = &buffer;
     buffer[0] = 3;
@@ -235,9 +452,12 @@ server_v2_read_token(struct client *client, gss_buffer_t token)
 {
     OM_uint32 major, minor;
     int status, flags;
-    
-    status = token_recv_priv(client->fd, client->context, &flags, token,
-                             TOKEN_MAX_LENGTH, TIMEOUT, &major, &minor);
+    struct token_buffer *buffer;
+
+    buffer = client->unbuffered ? NULL : &client->buffer;
+    status = token_recv_priv(client->fd, buffer, client->context, &flags,
+                             token, TOKEN_MAX_LENGTH_FOR(client->token_max),
+                             TIMEOUT, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("receiving token", status, major, minor);
         if (status != TOKEN_FAIL_EOF && status != TOKEN_FAIL_SOCKET)
@@ -247,6 +467,21 @@ server_v2_read_token(struct client *client, gss_buffer_t token)
 }
 
 
+/*
+ * Return the length of the header of a command token from the client before
+ * the keep-alive flag, which for protocol version four includes the request
+ * ID, or 0 if the token is too short to be a command token.
+ */
+static size_t
+command_header(gss_buffer_t token)
+{
+    size_t length;
+
+    length = (((char *) token->value)[0] == 4) ? 1 + 1 + 4 : 1 + 1;
+    return (token->length < length + 1 + 1) ? 0 : length;
+}
+
+
 /*
  * Read a continuation token for a command.  This handles checking the message
  * version, verifying that it's a command token, handling MESSAGE_QUIT, and so
@@ -254,13 +489,17 @@ server_v2_read_token(struct client *client, gss_buffer_t token)
  * server_v2_handle_token.  Stores the token in the provided token argument
  * and returns true if a valid token was received.  Returns false if an
  * invalid token was received or if some other error occurred, or if
- * MESSAGE_QUIT was received.  False should result in aborting the pending
- * command.
+ * MESSAGE_QUIT was received, in which case the token has been freed.  False
+ * should result in aborting the pending command.
+ *
+ * The continuation must use the same protocol version and message type as the
+ * start of the command, and for protocol version four, the same request ID.
  */
 static bool
 server_v2_read_continuation(struct client *client, gss_buffer_t token)
 {
-    int status;
+    OM_uint32 tmp, minor;
+    int status, type;
     char *p;
 
     status = server_v2_read_token(client, token);
@@ -269,20 +508,267 @@ server_v2_read_continuation(struct client *client, gss_buffer_t token)
         return false;
     }
     p = token->value;
-    if (p[0] != 2 && p[0] != 3) {
+    type = client->filter ? MESSAGE_COMMAND_STREAM : MESSAGE_COMMAND;
+    if (p[0] < 2 || p[0] > 4) {
         server_v2_send_version(client);
-        return false;
+        goto fail;
     } else if (p[1] == MESSAGE_QUIT) {
         debug("quit received, aborting command and closing connection");
         client->keepalive = false;
-        return false;
-    } else if (p[1] != MESSAGE_COMMAND) {
+        client->streaming = false;
+        goto fail;
+    } else if (p[1] != type) {
         warn("unexpected message type %d from client", (int) p[1]);
         server_send_error(client, ERROR_UNEXPECTED_MESSAGE,
                           "Unexpected message");
+        goto fail;
+    }
+    if (command_header(token) == 0 || (p[0] == 4) != client->tagged) {
+        warn("invalid continuation of command");
+        server_send_error(client, ERROR_BAD_COMMAND, "Invalid command token");
+        goto fail;
+    }
+    if (client->tagged) {
+        memcpy(&tmp, p + 2, 4);
+        if (ntohl(tmp) != client->request_id) {
+            warn("continuation of command %lu has request ID %lu",
+                 (unsigned long) client->request_id,
+                 (unsigned long) ntohl(tmp));
+            server_send_error(client, ERROR_BAD_COMMAND,
+                              "Invalid command token");
+            goto fail;
+        }
+    }
+    return true;
+
+fail:
+    gss_release_buffer(&minor, token);
+    return false;
+}
+
+
+/*
+ * Check whether a command that is continued in further tokens can be started
+ * before all of it has arrived, passing the rest of its last argument to the
+ * command on standard input as it arrives.  This is possible once everything
+ * but the rest of the last argument has been received, if the configuration
+ * rule for the command passes that argument on standard input to a child
+ * process.  Takes the command data received so far, which may be modified.
+ *
+ * If the command can be started, returns it as server_parse_command would,
+ * with the part of the last argument received so far, and sets up the client
+ * to read the rest with server_v2_read_input.  Otherwise, returns NULL, and
+ * also sets stream to false if the command will never be able to be started
+ * early so that the caller can stop checking.
+ */
+static struct iovec **
+stream_command(struct client *client, struct config *config, char *buffer,
+               size_t length, bool *stream)
+{
+    OM_uint32 tmp;
+    size_t argc, arglen, received, i;
+    size_t offset = 4;
+    char *command = NULL;
+    char *subcommand = NULL;
+    struct rule *rule;
+    struct iovec **argv;
+
+    /* Find the start of the last argument, if we've seen it. */
+    if (length < 4)
+        return NULL;
+    memcpy(&tmp, buffer, 4);
+    argc = ntohl(tmp);
+    if (argc < 3 || argc > COMMAND_MAX_ARGS) {
+        *stream = false;
+        return NULL;
+    }
+    for (i = 0; i < argc; i++) {
+        if (length - offset < 4)
+            return NULL;
+        memcpy(&tmp, buffer + offset, 4);
+        arglen = ntohl(tmp);
+        if (i == argc - 1)
+            break;
+        if (length - offset - 4 < arglen)
+            return NULL;
+        if (i == 0)
+            command = buffer + offset;
+        else if (i == 1)
+            subcommand = buffer + offset;
+        offset += 4 + arglen;
+    }
+
+    /*
+     * If all of the last argument is already here, or the command is
+     * malformed, leave it to the normal parsing.  Otherwise, check whether
+     * the rule for the command passes the last argument on standard input.
+     */
+    *stream = false;
+    received = length - offset - 4;
+    if (received >= arglen)
+        return NULL;
+    memcpy(&tmp, command, 4);
+    command = xstrndup(command + 4, ntohl(tmp));
+    memcpy(&tmp, subcommand, 4);
+    subcommand = xstrndup(subcommand + 4, ntohl(tmp));
+    rule = server_config_find(config, command, subcommand);
+    free(command);
+    free(subcommand);
+    if (rule == NULL || rule->fastcgi != NULL)
+        return NULL;
+    if (rule->stdin_arg != -1 && rule->stdin_arg != (long) argc - 1)
+        return NULL;
+
+    /*
+     * Shorten the last argument to what we have so far and parse the
+     * command, which will then pass.  The rest of the argument is read as
+     * the command runs.
+     */
+    tmp = htonl(received);
+    memcpy(buffer + offset, &tmp, 4);
+    argv = server_parse_command(client, buffer, length);
+    if (argv == NULL)
+        return NULL;
+    client->streaming = true;
+    client->stream_left = arglen - received;
+    return argv;
+}
+
+
+/*
+ * Read the next input token for a filter command, which is either
+ * MESSAGE_STREAM_DATA with more input for the command or MESSAGE_STREAM_END,
+ * after which the client sends no more input.  Add the data to input, or
+ * discard it if input is NULL.  Returns true on success and false on
+ * failure, in which case an error has been sent to the client if possible.
+ * There is no way to find the end of the input after a bad token, so any
+ * failure also ends the connection once the command has finished.
+ */
+static bool
+server_v2_read_stream(struct client *client, struct evbuffer *input)
+{
+    gss_buffer_desc token;
+    OM_uint32 tmp, minor;
+    size_t length;
+    char *p;
+
+    if (server_v2_read_token(client, &token) != TOKEN_OK) {
+        client->fatal = true;
+        client->streaming = false;
         return false;
     }
+    p = token.value;
+    if (p[0] == 4 && p[1] == MESSAGE_QUIT) {
+        debug("quit received, aborting command and closing connection");
+        goto done;
+    } else if (p[0] != 4 || token.length < 1 + 1 + 4 + 1) {
+        warn("invalid input token for filter command");
+        server_send_error(client, ERROR_BAD_TOKEN, "Invalid token");
+        goto done;
+    } else if (p[1] != MESSAGE_STREAM_DATA && p[1] != MESSAGE_STREAM_END) {
+        warn("unexpected message type %d from client", (int) p[1]);
+        server_send_error(client, ERROR_UNEXPECTED_MESSAGE,
+                          "Unexpected message");
+        goto done;
+    }
+    memcpy(&tmp, p + 2, 4);
+    if (ntohl(tmp) != client->request_id || p[6] != 1) {
+        warn("input for command %lu has request ID %lu and stream %d",
+             (unsigned long) client->request_id, (unsigned long) ntohl(tmp),
+             (int) p[6]);
+        server_send_error(client, ERROR_BAD_TOKEN, "Invalid token");
+        goto done;
+    }
+    p += 1 + 1 + 4 + 1;
+    length = token.length - (1 + 1 + 4 + 1);
+
+    /* MESSAGE_STREAM_END has only the stream. */
+    if (((char *) token.value)[1] == MESSAGE_STREAM_END) {
+        if (length != 0) {
+            warn("invalid end of input for filter command");
+            server_send_error(client, ERROR_BAD_TOKEN, "Invalid token");
+            goto done;
+        }
+        debug("end of input for filter command");
+        client->streaming = false;
+        gss_release_buffer(&minor, &token);
+        return true;
+    }
+
+    /* MESSAGE_STREAM_DATA has the length of the data and then the data. */
+    if (length < 4) {
+        warn("invalid input token for filter command");
+        server_send_error(client, ERROR_BAD_TOKEN, "Invalid token");
+        goto done;
+    }
+    memcpy(&tmp, p, 4);
+    if (ntohl(tmp) != length - 4) {
+        warn("input data length %lu does not match token length %lu",
+             (unsigned long) ntohl(tmp), (unsigned long) (length - 4));
+        server_send_error(client, ERROR_BAD_TOKEN, "Invalid token");
+        goto done;
+    }
+    if (input != NULL && evbuffer_add(input, p + 4, length - 4) < 0)
+        die("internal error: cannot add data to input buffer");
+    gss_release_buffer(&minor, &token);
     return true;
+
+done:
+    client->keepalive = false;
+    client->streaming = false;
+    gss_release_buffer(&minor, &token);
+    return false;
+}
+
+
+/*
+ * Read the next continuation token of a command whose last argument is being
+ * passed to it on standard input as it arrives, and add its data to input,
+ * or discard the data if input is NULL.  Returns true on success and false
+ * on failure, in which case an error has been sent to the client if possible
+ * and the rest of the argument is abandoned.  For a filter command, reads
+ * the next input token instead.
+ */
+bool
+server_v2_read_input(struct client *client, struct evbuffer *input)
+{
+    gss_buffer_desc token;
+    OM_uint32 minor;
+    size_t header, length;
+    char *p;
+    bool okay = false;
+
+    if (client->filter)
+        return server_v2_read_stream(client, input);
+    if (!server_v2_read_continuation(client, &token)) {
+        client->streaming = false;
+        return false;
+    }
+    header = command_header(&token);
+    p = (char *) token.value + header;
+    client->keepalive = p[0] ? true : false;
+    length = token.length - header - 2;
+    if (token.length > client->token_max) {
+        warn("command data length %lu exceeds %lu",
+             (unsigned long) token.length, (unsigned long) client->token_max);
+        server_send_error(client, ERROR_TOOMUCH_DATA, "Too much data");
+    } else if (p[1] != 2 && p[1] != 3) {
+        warn("bad continue status %d", (int) p[1]);
+        server_send_error(client, ERROR_BAD_COMMAND, "Invalid command token");
+    } else if (length > client->stream_left
+               || (p[1] == 3 && length != client->stream_left)) {
+        warn("command data invalid");
+        server_send_error(client, ERROR_BAD_COMMAND, "Invalid command token");
+    } else {
+        if (input != NULL && evbuffer_add(input, p + 2, length) < 0)
+            die("internal error: cannot add data to input buffer");
+        client->stream_left -= length;
+        okay = true;
+    }
+    if (!okay || p[1] == 3)
+        client->streaming = false;
+    gss_release_buffer(&minor, &token);
+    return okay;
 }
 
 
@@ -304,42 +790,45 @@ server_v2_handle_command(struct client *client, struct config *config,
     bool result = false;
     bool allocated = false;
     bool continued = false;
+    bool stream = !client->filter;
 
     /*
      * Loop on tokens until we have a complete command, allowing for continued
      * commands.  We're going to accumulate the full command in buffer until
-     * we've seen all of it.  If the command isn't continued, we can use the
-     * token as the buffer.
+     * we've seen all of it, or until we've seen enough to start it and pass
+     * the rest to it on standard input.  If the command isn't continued, we
+     * can use the token as the buffer.
      */
     total = 0;
     do {
-        p = token->value;
-        client->keepalive = p[2] ? true : false;
+        p = (char *) token->value + command_header(token);
+        client->keepalive = p[0] ? true : false;
 
         /* Check the data size. */
-        if (token->length > TOKEN_MAX_DATA) {
-            warn("command data length %lu exceeds 64KB",
-                 (unsigned long) token->length);
+        if (token->length > client->token_max) {
+            warn("command data length %lu exceeds %lu",
+                 (unsigned long) token->length,
+                 (unsigned long) client->token_max);
             result = server_send_error(client, ERROR_TOOMUCH_DATA,
                                        "Too much data");
             goto fail;
         }
 
         /* Make sure the continuation is sane. */
-        if ((p[3] == 1 && continued) || (p[3] > 1 && !continued) || p[3] > 3) {
-            warn("bad continue status %d", (int) p[3]);
+        if ((p[1] == 1 && continued) || (p[1] > 1 && !continued) || p[1] > 3) {
+            warn("bad continue status %d", (int) p[1]);
             result = server_send_error(client, ERROR_BAD_COMMAND,
                                        "Invalid command token");
             goto fail;
         }
-        continued = (p[3] == 1 || p[3] == 2);
+        continued = (p[1] == 1 || p[1] == 2);
 
         /*
          * Read the token data.  If the command is continued *or* if buffer is
          * non-NULL (meaning the command was previously continued), we copy
          * the data into the buffer.
          */
-        p += 4;
+        p += 2;
         length = token->length - (p - (char *) token->value);
         if (length >= COMMAND_MAX_DATA - total) {
             warn("total command length %lu exceeds %lu", length + total,
@@ -359,11 +848,16 @@ server_v2_handle_command(struct client *client, struct config *config,
         }
 
         /*
-         * If the command was continued, we have to read the next token.
-         * Otherwise, if buffer is NULL (no continuation), we just use this
-         * token as the complete buffer.
+         * If the command was continued, we have to read the next token unless
+         * we can start the command now.  Otherwise, if buffer is NULL (no
+         * continuation), we just use this token as the complete buffer.
          */
         if (continued) {
+            if (stream) {
+                argv = stream_command(client, config, buffer, total, &stream);
+                if (argv != NULL)
+                    break;
+            }
             gss_release_buffer(&minor, token);
             if (!server_v2_read_continuation(client, token))
                 goto fail;
@@ -375,9 +869,10 @@ server_v2_handle_command(struct client *client, struct config *config,
 
     /*
      * Okay, we now have a complete command that was possibly spread over
-     * multiple tokens.  Now we can parse it.
+     * multiple tokens, or enough of one to start it.  Now we can parse it.
      */
-    argv = server_parse_command(client, buffer, total);
+    if (argv == NULL)
+        argv = server_parse_command(client, buffer, total);
     if (allocated)
         free(buffer);
     if (argv == NULL)
@@ -401,24 +896,69 @@ fail:
  * without keep-alive, or QUIT was received and we should stop processing
  * tokens.
  */
-static bool
+bool
 server_v2_handle_token(struct client *client, struct config *config,
                        gss_buffer_t token)
 {
+    OM_uint32 tmp;
     char *p;
     bool result = true;
 
     p = token->value;
-    if (p[0] != 2 && p[0] != 3)
+    if (p[0] < 2 || p[0] > 4)
         return server_v2_send_version(client);
     switch (p[1]) {
+    case MESSAGE_COMMAND_STREAM:
+        if (p[0] != 4) {
+            warn("filter command without protocol version 4");
+            result = server_send_error(client, ERROR_UNKNOWN_MESSAGE,
+                                       "Unknown message");
+            break;
+        }
+        client->filter = true;
+        client->streaming = true;
+        /* Fall through. */
     case MESSAGE_COMMAND:
-        result = server_v2_handle_command(client, config, token);
+        if (p[0] == 4 && token->length >= 1 + 1 + 4) {
+            memcpy(&tmp, p + 2, 4);
+            client->tagged = true;
+            client->request_id = ntohl(tmp);
+        }
+        if (command_header(token) == 0) {
+            warn("command token too short");
+            result = server_send_error(client, ERROR_BAD_COMMAND,
+                                       "Invalid command token");
+        } else
+            result = server_v2_handle_command(client, config, token);
+
+        /*
+         * If the command didn't take all of its standard input, such as when
+         * it was rejected or exited early, discard the rest so that we don't
+         * lose our place.  The status of a filter command has already been
+         * sent, so this is where we wait for the end of its input.
+         */
+        while (client->streaming && !client->fatal)
+            if (!server_v2_read_input(client, NULL))
+                break;
+        result = result && !client->fatal;
+        client->tagged = false;
+        client->filter = false;
+        client->streaming = false;
         break;
     case MESSAGE_NOOP:
         debug("replying to no-op message");
         result = server_v3_send_noop(client);
         break;
+    case MESSAGE_CAPABILITIES:
+        debug("replying to capabilities message");
+        result = server_v4_send_capabilities(client, token);
+        break;
+    case MESSAGE_STREAM_DATA:
+    case MESSAGE_STREAM_END:
+        warn("input from client outside of a filter command");
+        result = server_send_error(client, ERROR_UNEXPECTED_MESSAGE,
+                                   "Unexpected message");
+        break;
     case MESSAGE_QUIT:
         debug("quit received, closing connection");
         client->keepalive = false;
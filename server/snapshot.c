@@ -0,0 +1,563 @@
+/*
+ * Compiled configuration snapshots.
+ *
+ * Parsing the configuration means reading every configuration file and
+ * included directory and looking up the users that commands run as, which
+ * can take a noticeable amount of time for large configurations and has to
+ * be done by every remctld started from inetd.  This file writes a parsed
+ * configuration to a snapshot file that can be loaded again without doing
+ * any of that work.
+ *
+ * The snapshot records the results of stat for every file and directory read
+ * while parsing the configuration, and a snapshot is only used if none of
+ * them have changed.  Otherwise, the caller falls back on parsing the
+ * configuration.  The snapshot is only meant to be read by remctld on the
+ * host that wrote it, so integers are stored in native byte order and the
+ * header records enough to reject a snapshot from an incompatible system.
+ *
+ * The snapshot consists of the header, the configuration file name, the
+ * sources, and then the rules, each in the order of the configuration.  All
+ * integers are 32 or 64 bits and strings are stored as a 32-bit length
+ * followed by the bytes of the string, with a length of SNAPSHOT_NULL for a
+ * NULL string.  Options and ACLs that point into the split configuration line
+ * are stored as the index of the string in the line and an offset into it.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+/*
+ * The header of a snapshot: a magic string, the format version, and a value
+ * that detects a difference in byte order.  Change the version whenever the
+ * format or struct rule changes.
+ */
+#define SNAPSHOT_MAGIC   "remctlC\n"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_ORDER   0x01020304UL
+
+/* The length stored for a NULL string or reference. */
+#define SNAPSHOT_NULL 0xffffffffUL
+
+/* A growing buffer used to build a snapshot before writing it. */
+struct writer {
+    char *data;
+    size_t used;
+    size_t size;
+};
+
+/*
+ * The unread part of a snapshot being loaded.  error is set on any attempt to
+ * read past the end of the data, after which all reads return zero or NULL.
+ */
+struct reader {
+    const char *data;
+    size_t left;
+    bool error;
+};
+
+
+/*
+ * Append data to a snapshot being built.
+ */
+static void
+put_bytes(struct writer *writer, const void *data, size_t length)
+{
+    if (writer->size - writer->used < length) {
+        writer->size = (writer->size + length) * 2;
+        writer->data = xrealloc(writer->data, writer->size);
+    }
+    memcpy(writer->data + writer->used, data, length);
+    writer->used += length;
+}
+
+
+/*
+ * Append integers and strings to a snapshot being built.
+ */
+static void
+put_u32(struct writer *writer, uint32_t value)
+{
+    put_bytes(writer, &value, sizeof(value));
+}
+
+static void
+put_u64(struct writer *writer, uint64_t value)
+{
+    put_bytes(writer, &value, sizeof(value));
+}
+
+static void
+put_string(struct writer *writer, const char *string)
+{
+    if (string == NULL) {
+        put_u32(writer, SNAPSHOT_NULL);
+        return;
+    }
+    put_u32(writer, strlen(string));
+    put_bytes(writer, string, strlen(string));
+}
+
+
+/*
+ * Append a pointer into one of the strings of a split configuration line,
+ * stored as the index of the string and the offset of the pointer in it.
+ */
+static void
+put_ref(struct writer *writer, const struct vector *line, const char *ref)
+{
+    size_t i, length;
+
+    if (ref != NULL)
+        for (i = 0; i < line->count; i++) {
+            length = strlen(line->strings[i]);
+            if (ref >= line->strings[i] && ref <= line->strings[i] + length) {
+                put_u32(writer, i);
+                put_u32(writer, ref - line->strings[i]);
+                return;
+            }
+        }
+    put_u32(writer, SNAPSHOT_NULL);
+    put_u32(writer, 0);
+}
+
+
+/*
+ * Append one configuration rule to a snapshot being built.
+ */
+static void
+put_rule(struct writer *writer, const struct rule *rule)
+{
+    const struct vector *line = rule->line;
+    size_t i, count;
+
+    put_string(writer, rule->file);
+    put_u32(writer, rule->lineno);
+    put_u32(writer, line->count);
+    for (i = 0; i < line->count; i++)
+        put_string(writer, line->strings[i]);
+    put_ref(writer, line, rule->command);
+    put_ref(writer, line, rule->subcommand);
+    put_ref(writer, line, rule->program);
+    put_ref(writer, line, rule->summary);
+    put_ref(writer, line, rule->help);
+    put_ref(writer, line, rule->fastcgi);
+    count = 0;
+    if (rule->logmask != NULL)
+        while (rule->logmask[count] != 0)
+            count++;
+    put_u32(writer, count);
+    for (i = 0; i < count; i++)
+        put_u32(writer, rule->logmask[i]);
+    put_u64(writer, (uint64_t) rule->stdin_arg);
+    put_u64(writer, (uint64_t) rule->timeout);
+    put_u64(writer, (uint64_t) rule->max_concurrent);
+    put_u64(writer, (uint64_t) rule->compress);
+    put_string(writer, rule->user);
+    put_u64(writer, rule->uid);
+    put_u64(writer, rule->gid);
+    for (count = 0; rule->acls[count] != NULL; count++)
+        ;
+    put_u32(writer, count);
+    for (i = 0; i < count; i++)
+        put_ref(writer, line, rule->acls[i]);
+}
+
+
+/*
+ * Write a snapshot of a loaded configuration to the given file.  Takes the
+ * configuration, the path of the configuration file it was loaded from, and
+ * the path of the snapshot.  The snapshot is written to a temporary file and
+ * then renamed into place so that a running remctld never sees a partial
+ * snapshot.  Returns true on success and false on failure, reporting an
+ * error.
+ */
+bool
+server_snapshot_write(const struct config *config, const char *file,
+                      const char *snapshot)
+{
+    struct writer writer = { NULL, 0, 0 };
+    const struct config_source *source;
+    char *template;
+    size_t i;
+    int fd;
+    bool okay = false;
+
+    /* Build the snapshot in memory. */
+    put_bytes(&writer, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+    put_u32(&writer, SNAPSHOT_VERSION);
+    put_u32(&writer, SNAPSHOT_ORDER);
+    put_string(&writer, file);
+    put_u32(&writer, config->nsources);
+    for (i = 0; i < config->nsources; i++) {
+        source = &config->sources[i];
+        put_string(&writer, source->path);
+        put_u64(&writer, source->device);
+        put_u64(&writer, source->inode);
+        put_u64(&writer, (uint64_t) source->size);
+        put_u64(&writer, (uint64_t) source->mtime);
+        put_u64(&writer, (uint64_t) source->mtime_nsec);
+        put_u32(&writer, source->includes ? 1 : 0);
+        put_u64(&writer, source->first);
+        put_u64(&writer, source->count);
+    }
+    put_u32(&writer, config->count);
+    for (i = 0; i < config->count; i++)
+        put_rule(&writer, config->rules[i]);
+
+    /* Write it to a temporary file and move that into place. */
+    xasprintf(&template, "%s.XXXXXX", snapshot);
+    fd = mkstemp(template);
+    if (fd < 0) {
+        syswarn("cannot create temporary snapshot %s", template);
+        goto done;
+    }
+    if (xwrite(fd, writer.data, writer.used) < 0) {
+        syswarn("cannot write to temporary snapshot %s", template);
+        close(fd);
+        unlink(template);
+        goto done;
+    }
+    if (close(fd) < 0) {
+        syswarn("cannot write to temporary snapshot %s", template);
+        unlink(template);
+        goto done;
+    }
+    if (rename(template, snapshot) < 0) {
+        syswarn("cannot rename temporary snapshot to %s", snapshot);
+        unlink(template);
+        goto done;
+    }
+    okay = true;
+
+done:
+    free(template);
+    free(writer.data);
+    return okay;
+}
+
+
+/*
+ * Read data from a snapshot being loaded.  Returns a pointer to the data, or
+ * NULL and sets the error flag if there isn't enough data left.
+ */
+static const char *
+get_bytes(struct reader *reader, size_t length)
+{
+    const char *data;
+
+    if (reader->error || reader->left < length) {
+        reader->error = true;
+        return NULL;
+    }
+    data = reader->data;
+    reader->data += length;
+    reader->left -= length;
+    return data;
+}
+
+
+/*
+ * Read integers from a snapshot being loaded, returning 0 on error.
+ */
+static uint32_t
+get_u32(struct reader *reader)
+{
+    const char *data;
+    uint32_t value;
+
+    data = get_bytes(reader, sizeof(value));
+    if (data == NULL)
+        return 0;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint64_t
+get_u64(struct reader *reader)
+{
+    const char *data;
+    uint64_t value;
+
+    data = get_bytes(reader, sizeof(value));
+    if (data == NULL)
+        return 0;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+
+/*
+ * Read a string from a snapshot being loaded, returning a pointer to it in
+ * the snapshot and storing its length.  Returns NULL for a NULL string and on
+ * error.
+ */
+static const char *
+get_string(struct reader *reader, size_t *length)
+{
+    uint32_t size;
+
+    size = get_u32(reader);
+    *length = 0;
+    if (reader->error || size == SNAPSHOT_NULL)
+        return NULL;
+    *length = size;
+    return get_bytes(reader, size);
+}
+
+
+/*
+ * Read a string from a snapshot being loaded and return a newly allocated
+ * copy of it, or NULL for a NULL string and on error.
+ */
+static char *
+get_string_copy(struct reader *reader)
+{
+    const char *string;
+    size_t length;
+
+    string = get_string(reader, &length);
+    if (string == NULL)
+        return NULL;
+    return xstrndup(string, length);
+}
+
+
+/*
+ * Read a pointer into a split configuration line.  Returns NULL for a NULL
+ * pointer and sets the error flag if the pointer isn't inside the line.
+ */
+static char *
+get_ref(struct reader *reader, const struct vector *line)
+{
+    uint32_t index, offset;
+
+    index = get_u32(reader);
+    offset = get_u32(reader);
+    if (reader->error || index == SNAPSHOT_NULL)
+        return NULL;
+    if (index >= line->count || offset > strlen(line->strings[index])) {
+        reader->error = true;
+        return NULL;
+    }
+    return line->strings[index] + offset;
+}
+
+
+/*
+ * Read one configuration rule from a snapshot being loaded.  Returns the
+ * newly allocated rule or NULL on error.
+ */
+static struct rule *
+get_rule(struct reader *reader)
+{
+    struct rule *rule;
+    const char *string;
+    size_t i, count, length;
+
+    rule = xcalloc(1, sizeof(struct rule));
+    rule->file = get_string_copy(reader);
+    rule->lineno = get_u32(reader);
+    count = get_u32(reader);
+    rule->line = vector_new();
+    for (i = 0; i < count && !reader->error; i++) {
+        string = get_string(reader, &length);
+        if (string != NULL)
+            vector_addn(rule->line, string, length);
+        else
+            reader->error = true;
+    }
+    rule->command = get_ref(reader, rule->line);
+    rule->subcommand = get_ref(reader, rule->line);
+    rule->program = get_ref(reader, rule->line);
+    rule->summary = get_ref(reader, rule->line);
+    rule->help = get_ref(reader, rule->line);
+    rule->fastcgi = get_ref(reader, rule->line);
+    count = get_u32(reader);
+    if (count > reader->left / sizeof(uint32_t))
+        reader->error = true;
+    else if (count > 0) {
+        rule->logmask = xcalloc(count + 1, sizeof(unsigned int));
+        for (i = 0; i < count; i++)
+            rule->logmask[i] = get_u32(reader);
+    }
+    rule->stdin_arg = (long) get_u64(reader);
+    rule->timeout = (long) get_u64(reader);
+    rule->max_concurrent = (long) get_u64(reader);
+    rule->compress = (long) get_u64(reader);
+    rule->user = get_string_copy(reader);
+    rule->uid = get_u64(reader);
+    rule->gid = get_u64(reader);
+    count = get_u32(reader);
+    if (count > reader->left / (2 * sizeof(uint32_t)))
+        reader->error = true;
+    else {
+        rule->acls = xcalloc(count + 1, sizeof(char *));
+        for (i = 0; i < count; i++)
+            rule->acls[i] = get_ref(reader, rule->line);
+    }
+    if (reader->error || rule->file == NULL || rule->command == NULL
+        || rule->subcommand == NULL || rule->program == NULL
+        || rule->acls == NULL || rule->acls[0] == NULL) {
+        free(rule->file);
+        free(rule->logmask);
+        free(rule->user);
+        free(rule->acls);
+        vector_free(rule->line);
+        free(rule);
+        reader->error = true;
+        return NULL;
+    }
+    return rule;
+}
+
+
+/*
+ * Parse a snapshot into a new configuration, checking along the way that it
+ * was compiled from the given configuration file and that none of its
+ * sources have changed.  Returns the configuration, or NULL if the snapshot
+ * is stale or invalid, in which case stale is set to distinguish the two.
+ */
+static struct config *
+parse_snapshot(struct reader *reader, const char *file, bool *stale)
+{
+    struct config *config;
+    struct config_source *source;
+    struct rule *rule;
+    const char *data;
+    size_t i, count, length;
+
+    /* Check the header and the configuration file name. */
+    *stale = false;
+    data = get_bytes(reader, strlen(SNAPSHOT_MAGIC));
+    if (data == NULL
+        || memcmp(data, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0)
+        return NULL;
+    if (get_u32(reader) != SNAPSHOT_VERSION)
+        return NULL;
+    if (get_u32(reader) != SNAPSHOT_ORDER)
+        return NULL;
+    data = get_string(reader, &length);
+    if (data == NULL)
+        return NULL;
+    if (length != strlen(file) || memcmp(data, file, length) != 0) {
+        *stale = true;
+        return NULL;
+    }
+
+    /* Read the sources and check that each one is unchanged. */
+    config = xcalloc(1, sizeof(struct config));
+    count = get_u32(reader);
+    if (count > reader->left)
+        goto fail;
+    for (i = 0; i < count; i++) {
+        config->sources = xreallocarray(config->sources, i + 1,
+                                        sizeof(struct config_source));
+        source = &config->sources[i];
+        source->path = get_string_copy(reader);
+        config->nsources++;
+        source->device = get_u64(reader);
+        source->inode = get_u64(reader);
+        source->size = (off_t) get_u64(reader);
+        source->mtime = (time_t) get_u64(reader);
+        source->mtime_nsec = (long) get_u64(reader);
+        source->includes = (get_u32(reader) != 0);
+        source->first = get_u64(reader);
+        source->count = get_u64(reader);
+        if (reader->error || source->path == NULL)
+            goto fail;
+        if (!server_config_source_current(source)) {
+            *stale = true;
+            goto fail;
+        }
+    }
+
+    /* Read the rules. */
+    count = get_u32(reader);
+    if (count > reader->left)
+        goto fail;
+    if (count > 0)
+        config->rules = xcalloc(count, sizeof(struct rule *));
+    config->allocated = count;
+    for (i = 0; i < count; i++) {
+        rule = get_rule(reader);
+        if (rule == NULL)
+            goto fail;
+        rule->index = i;
+        config->rules[i] = rule;
+        config->count++;
+    }
+    if (reader->error || reader->left > 0)
+        goto fail;
+    return config;
+
+fail:
+    server_config_free(config);
+    return NULL;
+}
+
+
+/*
+ * Load a snapshot written by server_snapshot_write, checking that it was
+ * compiled from the given configuration file and that none of the files and
+ * directories read to build it have changed.  Returns the configuration, or
+ * NULL if the snapshot can't be used, in which case the caller should parse
+ * the configuration file instead.  The configuration is returned without
+ * its index or generation, which are set by server_config_load.
+ */
+struct config *
+server_snapshot_load(const char *snapshot, const char *file)
+{
+    struct config *config;
+    struct reader reader;
+    struct stat st;
+    void *data;
+    int fd;
+    bool stale;
+
+    fd = open(snapshot, O_RDONLY);
+    if (fd < 0) {
+        syswarn("cannot open configuration snapshot %s", snapshot);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        syswarn("cannot stat configuration snapshot %s", snapshot);
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        warn("configuration snapshot %s is invalid", snapshot);
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        syswarn("cannot map configuration snapshot %s", snapshot);
+        return NULL;
+    }
+    reader.data = data;
+    reader.left = st.st_size;
+    reader.error = false;
+    config = parse_snapshot(&reader, file, &stale);
+    munmap(data, st.st_size);
+    if (config == NULL) {
+        if (stale)
+            notice("configuration snapshot %s is out of date, reading %s",
+                   snapshot, file);
+        else
+            warn("configuration snapshot %s is invalid", snapshot);
+    }
+    return config;
+}
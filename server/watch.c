@@ -0,0 +1,174 @@
+/*
+ * Reloading the configuration and watching it for changes.
+ *
+ * When asked to, remctld uses inotify to watch every configuration file and
+ * included directory and every ACL file it has loaded, and asks the kernel to
+ * send it SIGIO when any of them change.  remctld handles SIGIO the same as
+ * SIGHUP, by reloading the configuration, which only parses the files that
+ * have changed.  The watched files are added to after every reload, since
+ * the configuration may now include new files.  Watches on files that are
+ * deleted or replaced go away on their own.
+ *
+ * On platforms without inotify, watching is not supported and only SIGHUP
+ * reloads the configuration.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_INOTIFY_INIT1
+# include <sys/inotify.h>
+#endif
+
+#include <server/internal.h>
+#include <util/messages.h>
+#include <util/vector.h>
+
+/*
+ * The changes to watch for.  Files are often replaced by renaming a new file
+ * over them, which is seen as a change to the attributes (the link count) of
+ * the old file and then its deletion.
+ */
+#ifdef HAVE_INOTIFY_INIT1
+# define WATCH_EVENTS                                                   \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF \
+     | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+#endif
+
+/* The inotify file descriptor, or -1 if we're not watching. */
+static int watch_fd = -1;
+
+
+#ifdef HAVE_INOTIFY_INIT1
+
+/*
+ * Throw away any pending changes.  Called before a reload, since the reload
+ * will see all of them, so that only changes made after this point cause
+ * another reload.
+ */
+static void
+watch_drain(void)
+{
+    char buffer[4096];
+    ssize_t status;
+
+    do
+        status = read(watch_fd, buffer, sizeof(buffer));
+    while (status > 0 || (status < 0 && errno == EINTR));
+    if (status < 0 && errno != EAGAIN)
+        syswarn("cannot read configuration changes");
+}
+
+
+/*
+ * Watch every file and directory that affects the configuration.  Adding a
+ * watch for something that is already watched just updates the watch, so
+ * this is safe to call after every reload.  Failures are reported but
+ * otherwise ignored, since they just mean that a reload will have to be
+ * requested with SIGHUP.
+ */
+static void
+watch_add(const struct config *config)
+{
+    struct vector *paths;
+    size_t i;
+
+    paths = server_config_paths(config);
+    for (i = 0; i < paths->count; i++)
+        if (inotify_add_watch(watch_fd, paths->strings[i], WATCH_EVENTS) < 0)
+            if (errno != ENOENT)
+                syswarn("cannot watch %s for changes", paths->strings[i]);
+    vector_free(paths);
+}
+
+
+/*
+ * Start watching the files and directories of the given configuration for
+ * changes, arranging for SIGIO to be sent to this process when there are
+ * changes to read.  Returns false on failure, reporting an error.
+ */
+bool
+server_watch_init(const struct config *config)
+{
+    int flags;
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) {
+        syswarn("cannot initialize inotify");
+        return false;
+    }
+    flags = fcntl(watch_fd, F_GETFL);
+    if (flags < 0 || fcntl(watch_fd, F_SETOWN, getpid()) < 0
+        || fcntl(watch_fd, F_SETFL, flags | O_ASYNC) < 0) {
+        syswarn("cannot request signals for configuration changes");
+        server_watch_free();
+        return false;
+    }
+    watch_add(config);
+    return true;
+}
+
+#else /* !HAVE_INOTIFY_INIT1 */
+
+/* Without inotify, watching is never enabled, so these do nothing. */
+static void
+watch_drain(void)
+{
+}
+
+static void
+watch_add(const struct config *config UNUSED)
+{
+}
+
+bool
+server_watch_init(const struct config *config UNUSED)
+{
+    warn("watching the configuration is not supported on this platform");
+    return false;
+}
+
+#endif /* !HAVE_INOTIFY_INIT1 */
+
+
+/*
+ * Reload the configuration in place, logging the result and keeping the
+ * previous configuration if the new one can't be loaded.  If we're watching
+ * for changes, discard the pending changes first and then watch anything new
+ * in the configuration.  Returns true if the configuration changed.
+ */
+bool
+server_watch_reload(struct config *config, const char *file)
+{
+    unsigned long generation = config->generation;
+
+    if (watch_fd >= 0)
+        watch_drain();
+    if (!server_config_reload(config, file))
+        warn("cannot reload configuration file %s, keeping previous"
+             " configuration", file);
+    else if (config->generation != generation)
+        notice("reloaded configuration file %s", file);
+    else
+        debug("configuration file %s unchanged", file);
+    if (watch_fd >= 0)
+        watch_add(config);
+    return config->generation != generation;
+}
+
+
+/*
+ * Stop watching for changes.  This is also called by child processes, which
+ * must not read changes meant for the parent.
+ */
+void
+server_watch_free(void)
+{
+    if (watch_fd >= 0)
+        close(watch_fd);
+    watch_fd = -1;
+}
@@ -210,6 +210,188 @@ do_tests(const char *principal, int protocol)
 }
 
 
+/*
+ * Read the next result and check its type and the ID of its command.
+ */
+static void
+check_result(struct remctl *r, enum remctl_output_type type, unsigned long id,
+             const char *name)
+{
+    struct remctl_output *output;
+
+    output = remctl_output(r);
+    if (output == NULL) {
+        ok_block(2, false, "%s", name);
+        return;
+    }
+    is_int(type, output->type, "%s", name);
+    is_int(id, output->id, "...with the right ID");
+}
+
+
+/*
+ * Send several commands without waiting for their results and check that the
+ * results come back in order, each with the ID of its command.
+ */
+static void
+test_pipeline(const char *principal)
+{
+    struct remctl *r;
+    struct iovec command[2];
+    unsigned long ids[3];
+
+    r = remctl_new();
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    ok(remctl_open(r, "localhost", 14373, principal), "pipeline: remctl_open");
+    command[0].iov_base = (char *) "test";
+    command[0].iov_len = 4;
+    command[1].iov_base = (char *) "test";
+    command[1].iov_len = 4;
+    ids[0] = remctl_pipeline(r, command, 2);
+    command[1].iov_base = (char *) "bad-command";
+    command[1].iov_len = 11;
+    ids[1] = remctl_pipeline(r, command, 2);
+    command[1].iov_base = (char *) "test";
+    command[1].iov_len = 4;
+    ids[2] = remctl_pipeline(r, command, 2);
+    ok(ids[0] > 0 && ids[1] > ids[0] && ids[2] > ids[1],
+       "remctl_pipeline returns increasing IDs");
+    is_string("no error", remctl_error(r), "...with no error");
+
+    /* The results of each command come back in turn. */
+    check_result(r, REMCTL_OUT_OUTPUT, ids[0], "first command output");
+    check_result(r, REMCTL_OUT_STATUS, ids[0], "...and status");
+    check_result(r, REMCTL_OUT_ERROR, ids[1], "second command error");
+    check_result(r, REMCTL_OUT_OUTPUT, ids[2], "third command output");
+    check_result(r, REMCTL_OUT_STATUS, ids[2], "...and status");
+    check_result(r, REMCTL_OUT_DONE, 0, "and then done");
+    remctl_close(r);
+}
+
+
+/*
+ * Check that the next result is output of "Okay" followed by an exit status
+ * of 0.
+ */
+static void
+check_okay(struct remctl *r, const char *name)
+{
+    struct remctl_output *output;
+
+    output = remctl_output(r);
+    if (output == NULL) {
+        ok_block(4, false, "%s", name);
+        return;
+    }
+    is_int(REMCTL_OUT_OUTPUT, output->type, "%s", name);
+    ok(output->length == 4 && memcmp(output->data, "Okay", 4) == 0,
+       "...with the right output");
+    output = remctl_output(r);
+    if (output == NULL) {
+        ok_block(2, false, "...and status");
+        return;
+    }
+    is_int(REMCTL_OUT_STATUS, output->type, "...and status");
+    is_int(0, output->status, "...of 0");
+}
+
+
+/*
+ * Run commands as filters, sending their standard input while they run.
+ */
+static void
+test_filter(const char *principal)
+{
+    struct remctl *r;
+    struct remctl_output *output;
+    struct iovec command[3];
+    char *buffer;
+    size_t i;
+    bool okay;
+
+    r = remctl_new();
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    ok(remctl_open(r, "localhost", 14373, principal), "filter: remctl_open");
+    command[0].iov_base = (char *) "test";
+    command[0].iov_len = 4;
+    command[1].iov_base = (char *) "stdin";
+    command[1].iov_len = 5;
+    command[2].iov_base = (char *) "large";
+    command[2].iov_len = 5;
+
+    /* Send 1MB of input in chunks larger and smaller than a token. */
+    ok(remctl_filter(r, command, 3), "remctl_filter");
+    buffer = bmalloc(100 * 1024);
+    memset(buffer, 'A', 100 * 1024);
+    okay = true;
+    for (i = 0; i < 10; i++)
+        if (!remctl_send_input(r, buffer, 100 * 1024))
+            okay = false;
+    if (!remctl_send_input(r, buffer, 1024 * 1024 - 10 * 100 * 1024))
+        okay = false;
+    ok(okay, "remctl_send_input of 1MB");
+    ok(remctl_send_input(r, NULL, 0), "...and end of input");
+    check_okay(r, "filter output");
+    free(buffer);
+
+    /*
+     * A command that exits without reading its input returns its status
+     * before the input ends, and the connection can then be reused.
+     */
+    command[2].iov_base = (char *) "exit";
+    command[2].iov_len = 4;
+    ok(remctl_filter(r, command, 3), "remctl_filter of command that exits");
+    check_okay(r, "filter output before end of input");
+    ok(remctl_send_input(r, "data", 4), "...input is accepted");
+    ok(remctl_send_input(r, NULL, 0), "...and end of input");
+    command[1].iov_base = (char *) "test";
+    command[1].iov_len = 4;
+    ok(remctl_commandv(r, command, 2), "...and next command is sent");
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT,
+       "...with the right output");
+    remctl_close(r);
+}
+
+
+/*
+ * Send a command larger than TOKEN_MAX_DATA after the server has agreed to a
+ * larger token size, once with remctl_pipeline (which waits for the server's
+ * reply to the capabilities sent by remctl_open) and then again with
+ * remctl_commandv on the same connection.
+ */
+static void
+test_large_tokens(const char *principal)
+{
+    struct remctl *r;
+    struct iovec command[4];
+
+    r = remctl_new();
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    ok(remctl_open(r, "localhost", 14373, principal),
+       "large tokens: remctl_open");
+    command[0].iov_base = (char *) "test";
+    command[0].iov_len = 4;
+    command[1].iov_base = (char *) "stdin";
+    command[1].iov_len = 5;
+    command[2].iov_base = (char *) "large";
+    command[2].iov_len = 5;
+    command[3].iov_len = 1024 * 1024;
+    command[3].iov_base = bmalloc(command[3].iov_len);
+    memset(command[3].iov_base, 'A', command[3].iov_len);
+    ok(remctl_pipeline(r, command, 4) > 0, "remctl_pipeline of 1MB command");
+    is_int(CAPABILITIES_ALL, r->capabilities, "...server agreed to features");
+    is_int(TOKEN_MAX_DATA_LARGE, r->token_max, "...and to token size");
+    check_okay(r, "large command output");
+    ok(remctl_commandv(r, command, 4), "remctl_commandv of 1MB command");
+    check_okay(r, "large command output");
+    free(command[3].iov_base);
+    remctl_close(r);
+}
+
 
 int
 main(void)
@@ -228,11 +410,14 @@ main(void)
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
     remctld_start(config, "data/conf-simple", (char *) 0);
 
-    plan(141);
+    plan(186);
 
     /* Run the basic protocol tests. */
     do_tests(config->principal, 1);
     do_tests(config->principal, 2);
+    test_pipeline(config->principal);
+    test_filter(config->principal);
+    test_large_tokens(config->principal);
 
     /*
      * We don't have a way of forcing the simple protocol to use a particular
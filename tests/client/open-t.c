@@ -74,14 +74,15 @@ accept_connection(const char *pidfile, int protocol)
         sysdie("error accepting connection");
 
     /* Now do the context negotiation. */
-    if (token_recv(conn, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+    if (token_recv(conn, NULL, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
         die("cannot recv initial token");
     if (flags != (TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL))
         die("bad flags on initial token");
     wanted_flags = TOKEN_CONTEXT | TOKEN_PROTOCOL;
     context = GSS_C_NO_CONTEXT;
     do {
-        if (token_recv(conn, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+        if (token_recv(conn, NULL, &flags, &recv_tok, 64 * 1024, 0)
+            != TOKEN_OK)
             die("cannot recv subsequent token");
         if (flags != wanted_flags)
             die("bad flags on subsequent token");
@@ -0,0 +1,251 @@
+/*
+ * Small FastCGI backend for testing the fastcgi configuration option.
+ *
+ * Takes the path of a UNIX domain socket to listen on and the path of a PID
+ * file to create once it's listening, and then handles FastCGI requests one
+ * connection at a time until killed.  The behavior for each request is
+ * selected by the second argument of the command (REMCTL_ARG_2):
+ *
+ * hello        Write "hello world" to stdout and exit 0.
+ * env          Write the REMOTE_USER and REMCTL_COMMAND parameters.
+ * args         Write REMCTL_ARGC and then each argument on its own line.
+ * stdin        Write the data received on stdin back to stdout.
+ * stderr       Write "stdout" to stdout, "stderr" to stderr, and exit 2.
+ * status       Exit with the status given on stdin.
+ * close        Close the connection without ending the request.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <sys/un.h>
+
+#include <util/messages.h>
+#include <util/network.h>
+#include <util/xmalloc.h>
+
+/* FastCGI record types. */
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST   3
+#define FCGI_PARAMS        4
+#define FCGI_STDIN         5
+#define FCGI_STDOUT        6
+#define FCGI_STDERR        7
+
+
+/*
+ * Read a record from the connection, returning the type and storing the
+ * content in a newly allocated buffer.  Returns -1 on EOF.
+ */
+static int
+read_record(socket_type fd, char **content, size_t *length)
+{
+    unsigned char header[8];
+    char padding[256];
+
+    if (!network_read(fd, header, sizeof(header), 0))
+        return -1;
+    *length = (header[4] << 8) | header[5];
+    *content = xmalloc(*length + 1);
+    if (*length > 0 && !network_read(fd, *content, *length, 0))
+        sysdie("cannot read record content");
+    (*content)[*length] = '\0';
+    if (header[6] > 0 && !network_read(fd, padding, header[6], 0))
+        sysdie("cannot read record padding");
+    return header[1];
+}
+
+
+/*
+ * Write a record of the given type to the connection.
+ */
+static void
+write_record(socket_type fd, int type, const void *data, size_t length)
+{
+    unsigned char header[8] = { 1, 0, 0, 1, 0, 0, 0, 0 };
+
+    header[1] = type;
+    header[4] = (length >> 8) & 0xff;
+    header[5] = length & 0xff;
+    if (!network_write(fd, header, sizeof(header), 0))
+        sysdie("cannot write record header");
+    if (length > 0 && !network_write(fd, data, length, 0))
+        sysdie("cannot write record content");
+}
+
+
+/*
+ * Write a string to the given stream.
+ */
+static void
+write_string(socket_type fd, int type, const char *string)
+{
+    write_record(fd, type, string, strlen(string));
+}
+
+
+/*
+ * Decode one length from a name-value pair, advancing the pointer.
+ */
+static size_t
+decode_length(const unsigned char **p)
+{
+    size_t length;
+
+    if (**p < 128) {
+        length = **p;
+        *p += 1;
+    } else {
+        length = (((*p)[0] & 0x7f) << 24) | ((*p)[1] << 16) | ((*p)[2] << 8)
+                 | (*p)[3];
+        *p += 4;
+    }
+    return length;
+}
+
+
+/*
+ * Look up a parameter in the encoded parameters, returning a newly allocated
+ * copy of its value or NULL if it wasn't set.
+ */
+static char *
+find_param(const char *params, size_t length, const char *name)
+{
+    const unsigned char *p = (const unsigned char *) params;
+    const unsigned char *end = p + length;
+    size_t nlen, vlen;
+
+    while (p < end) {
+        nlen = decode_length(&p);
+        vlen = decode_length(&p);
+        if (nlen == strlen(name) && memcmp(p, name, nlen) == 0)
+            return xstrndup((const char *) p + nlen, vlen);
+        p += nlen + vlen;
+    }
+    return NULL;
+}
+
+
+/*
+ * Handle a single request on a connection.
+ */
+static void
+handle_request(socket_type fd)
+{
+    char *content, *mode, *value, *name;
+    char *params = NULL;
+    char *input = NULL;
+    size_t length, plength = 0, ilength = 0;
+    unsigned long argc, i;
+    unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    int type;
+
+    /* Read the request. */
+    do {
+        type = read_record(fd, &content, &length);
+        if (type < 0)
+            return;
+        if (type == FCGI_PARAMS) {
+            params = xrealloc(params, plength + length + 1);
+            memcpy(params + plength, content, length);
+            plength += length;
+        } else if (type == FCGI_STDIN) {
+            input = xrealloc(input, ilength + length + 1);
+            memcpy(input + ilength, content, length);
+            ilength += length;
+            input[ilength] = '\0';
+        }
+        free(content);
+    } while (type != FCGI_STDIN || length > 0);
+
+    /* Produce the response. */
+    mode = find_param(params, plength, "REMCTL_ARG_2");
+    if (mode == NULL || strcmp(mode, "hello") == 0)
+        write_string(fd, FCGI_STDOUT, "hello world\n");
+    else if (strcmp(mode, "env") == 0) {
+        value = find_param(params, plength, "REMOTE_USER");
+        write_string(fd, FCGI_STDOUT, value == NULL ? "" : value);
+        write_string(fd, FCGI_STDOUT, "\n");
+        free(value);
+        value = find_param(params, plength, "REMCTL_COMMAND");
+        write_string(fd, FCGI_STDOUT, value == NULL ? "" : value);
+        write_string(fd, FCGI_STDOUT, "\n");
+        free(value);
+    } else if (strcmp(mode, "args") == 0) {
+        value = find_param(params, plength, "REMCTL_ARGC");
+        argc = strtoul(value, NULL, 10);
+        write_string(fd, FCGI_STDOUT, value);
+        write_string(fd, FCGI_STDOUT, "\n");
+        free(value);
+        for (i = 1; i <= argc; i++) {
+            xasprintf(&name, "REMCTL_ARG_%lu", i);
+            value = find_param(params, plength, name);
+            write_string(fd, FCGI_STDOUT, value);
+            write_string(fd, FCGI_STDOUT, "\n");
+            free(value);
+            free(name);
+        }
+    } else if (strcmp(mode, "stdin") == 0)
+        write_record(fd, FCGI_STDOUT, input, ilength);
+    else if (strcmp(mode, "stderr") == 0) {
+        write_string(fd, FCGI_STDOUT, "stdout\n");
+        write_string(fd, FCGI_STDERR, "stderr\n");
+        end[3] = 2;
+    } else if (strcmp(mode, "status") == 0)
+        end[3] = (input == NULL) ? 0 : atoi(input);
+    else if (strcmp(mode, "close") == 0)
+        goto done;
+    write_record(fd, FCGI_STDOUT, NULL, 0);
+    write_record(fd, FCGI_STDERR, NULL, 0);
+    write_record(fd, FCGI_END_REQUEST, end, sizeof(end));
+
+done:
+    free(mode);
+    free(params);
+    free(input);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    socket_type fd, conn;
+    FILE *pidfile;
+
+    if (argc != 3)
+        die("usage: cmd-fastcgi <socket> <pid-file>");
+    if (strlen(argv[1]) >= sizeof(addr.sun_path))
+        die("socket path %s too long", argv[1]);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, argv[1], strlen(argv[1]) + 1);
+    unlink(argv[1]);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET)
+        sysdie("cannot create socket");
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        sysdie("cannot bind to %s", argv[1]);
+    if (listen(fd, 5) < 0)
+        sysdie("cannot listen on %s", argv[1]);
+
+    /* Tell the test we're ready. */
+    pidfile = fopen(argv[2], "w");
+    if (pidfile == NULL)
+        sysdie("cannot create %s", argv[2]);
+    fprintf(pidfile, "%lu\n", (unsigned long) getpid());
+    fclose(pidfile);
+
+    /* Handle one request per connection, forever. */
+    for (;;) {
+        conn = accept(fd, NULL, NULL);
+        if (conn == INVALID_SOCKET)
+            sysdie("cannot accept connection");
+        handle_request(conn);
+        close(conn);
+    }
+    return 0;
+}
@@ -90,7 +90,8 @@ make_connection(int protocol, const char *principal)
         if (major != GSS_S_COMPLETE && major != GSS_S_CONTINUE_NEEDED)
             die("failure initializing context");
         if (major == GSS_S_CONTINUE_NEEDED) {
-            if (token_recv(fd, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+            if (token_recv(fd, NULL, &flags, &recv_tok, 64 * 1024, 0)
+                != TOKEN_OK)
                 sysdie("failure receiving token");
             token_ptr = &recv_tok;
         }
@@ -0,0 +1,176 @@
+/*
+ * Test suite for the SO_REUSEPORT acceptor mode of the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+
+/* How many connections to make when looking for different acceptors. */
+#define CONNECTIONS 12
+
+
+/*
+ * Run the remote process command with the given attribute on a new
+ * connection and return its output without the trailing newline, or NULL if
+ * there was an error.
+ */
+static char *
+test_process(struct kerberos_config *config, const char *attribute)
+{
+    struct remctl *r;
+    struct remctl_output *output;
+    char *value = NULL;
+    const char *command[] = { "test", "process", NULL, NULL };
+
+    r = remctl_new();
+    if (!remctl_open(r, "127.0.0.1", 14373, config->principal)) {
+        diag("remctl error %s", remctl_error(r));
+        remctl_close(r);
+        return NULL;
+    }
+    command[2] = attribute;
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        remctl_close(r);
+        return NULL;
+    }
+    do {
+        output = remctl_output(r);
+        switch (output->type) {
+        case REMCTL_OUT_OUTPUT:
+            free(value);
+            value = bstrndup(output->data, output->length);
+            break;
+        case REMCTL_OUT_STATUS:
+            if (output->status != 0) {
+                diag("test process returned status %d", output->status);
+                free(value);
+                value = NULL;
+            }
+            break;
+        case REMCTL_OUT_ERROR:
+            diag("test process returned error: %.*s", (int) output->length,
+                 output->data);
+            free(value);
+            value = NULL;
+            break;
+        case REMCTL_OUT_DONE:
+            diag("unexpected done token");
+            free(value);
+            value = NULL;
+            break;
+        }
+    } while (output->type == REMCTL_OUT_OUTPUT);
+    remctl_close(r);
+    if (value != NULL && value[0] != '\0'
+        && value[strlen(value) - 1] == '\n')
+        value[strlen(value) - 1] = '\0';
+    return value;
+}
+
+
+/*
+ * Return the CPUs that the current process is allowed to run on, in the
+ * format of /proc/self/status, or NULL if that isn't available.
+ */
+static char *
+allowed_cpus(void)
+{
+    FILE *status;
+    char buffer[BUFSIZ];
+    const char *field = "Cpus_allowed_list:";
+    char *p, *value = NULL;
+
+    status = fopen("/proc/self/status", "r");
+    if (status == NULL)
+        return NULL;
+    while (fgets(buffer, sizeof(buffer), status) != NULL) {
+        if (strncmp(buffer, field, strlen(field)) != 0)
+            continue;
+        p = buffer + strlen(field);
+        p += strspn(p, " \t");
+        p[strcspn(p, "\n")] = '\0';
+        value = bstrdup(p);
+        break;
+    }
+    fclose(status);
+    return value;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct remctl *r, *r2;
+    char *pids[CONNECTIONS];
+    char *expected, *seen;
+    size_t i, j, okay, distinct;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    /* Three acceptors, each with its own sockets and pinned to a CPU. */
+    remctld = remctld_start(config, "data/conf-simple", "-a", "3", "-A",
+                            NULL);
+
+    plan(6);
+
+    /*
+     * Make several connections and ask each command for the PID of the
+     * acceptor that handled it.  The kernel should spread the connections
+     * across more than one acceptor.
+     */
+    okay = 0;
+    distinct = 0;
+    for (i = 0; i < CONNECTIONS; i++) {
+        pids[i] = test_process(config, "acceptor");
+        if (pids[i] == NULL)
+            continue;
+        okay++;
+        for (j = 0; j < i; j++)
+            if (pids[j] != NULL && strcmp(pids[i], pids[j]) == 0)
+                break;
+        if (j == i)
+            distinct++;
+    }
+    is_int(CONNECTIONS, okay, "Commands succeed on all connections");
+    ok(distinct > 1, "... and are handled by several acceptors");
+    for (i = 0; i < CONNECTIONS; i++)
+        free(pids[i]);
+
+    /* Commands run on all the CPUs we can, not just that of the acceptor. */
+    expected = allowed_cpus();
+    if (expected == NULL)
+        skip("no /proc/self/status to check CPU affinity");
+    else {
+        seen = test_process(config, "cpus");
+        is_string(expected, seen, "Commands are not pinned to a single CPU");
+        free(seen);
+        free(expected);
+    }
+
+    /* Two connections can be handled simultaneously. */
+    r = remctl_new();
+    r2 = remctl_new();
+    ok(remctl_open(r, "127.0.0.1", 14373, config->principal),
+       "First simultaneous connection");
+    ok(remctl_open(r2, "127.0.0.1", 14373, config->principal),
+       "Second simultaneous connection");
+    ok(run_test_command(r2) && run_test_command(r),
+       "... commands succeed on both");
+    remctl_close(r);
+    remctl_close(r2);
+
+    process_stop(remctld);
+    return 0;
+}
@@ -15,17 +15,36 @@
 #include <server/internal.h>
 #include <tests/tap/basic.h>
 #include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Write the given contents to an ACL file, replacing any existing contents.
+ */
+static void
+write_acl(const char *path, const char *contents)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+}
 
 
 int
 main(void)
 {
     struct rule rule = {
-        NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0, 0, NULL, NULL, NULL
+        NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, NULL, 0, 0,
+        NULL, NULL, NULL, NULL, 0
     };
     const char *acls[5];
+    char *tmpdir, *path, *newpath;
 
-    plan(70);
+    plan(79);
     if (chdir(getenv("SOURCE")) < 0)
         sysbail("can't chdir to SOURCE");
 
@@ -266,6 +285,15 @@ main(void)
     ok(strncmp(errors, "TEST:0: compilation of regex '*host/.*' failed:",
                strlen("TEST:0: compilation of regex '*host/.*' failed:")) == 0,
        "...with invalid regex error");
+    free(errors);
+    errors = NULL;
+    rule.lineno = 2;
+    ok(!server_config_acl_permit(&rule, "host/bar.org@EXAMPLE.ORG"),
+       "regex invalid regex again");
+    ok(strncmp(errors, "TEST:2: compilation of regex '*host/.*' failed:",
+               strlen("TEST:2: compilation of regex '*host/.*' failed:")) == 0,
+       "...with error for the new location");
+    rule.lineno = 0;
     errors_uncapture();
     free(errors);
     errors = NULL;
@@ -276,7 +304,7 @@ main(void)
     is_string("TEST:0: ACL scheme 'regex' is not supported\n", errors,
               "...with not supported error");
     errors_uncapture();
-    skip_block(5, "regex support not available");
+    skip_block(7, "regex support not available");
     free(errors);
     errors = NULL;
 #endif
@@ -297,5 +325,37 @@ main(void)
     ok(!server_config_acl_permit(&rule, "tilde@EXAMPLE.ORG"),
        "invalid chars 3");
 
+    /* ACL files are cached, but changes to them are noticed. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/acl-cached", tmpdir);
+    basprintf(&newpath, "%s/acl-cached.new", tmpdir);
+    write_acl(path, "one@EXAMPLE.ORG\n");
+    acls[0] = path;
+    acls[1] = NULL;
+    ok(server_config_acl_permit(&rule, "one@EXAMPLE.ORG"), "cached 1");
+    ok(!server_config_acl_permit(&rule, "two@EXAMPLE.ORG"), "cached 2");
+    write_acl(path, "two@EXAMPLE.ORG\nthree@EXAMPLE.ORG\n");
+    ok(server_config_acl_permit(&rule, "two@EXAMPLE.ORG"),
+       "...file rewritten in place");
+    ok(!server_config_acl_permit(&rule, "one@EXAMPLE.ORG"),
+       "...and old contents forgotten");
+    write_acl(newpath, "one@EXAMPLE.ORG\ndeny:two@EXAMPLE.ORG\n");
+    if (rename(newpath, path) < 0)
+        sysbail("cannot rename %s to %s", newpath, path);
+    ok(server_config_acl_permit(&rule, "one@EXAMPLE.ORG"),
+       "...file replaced");
+    ok(!server_config_acl_permit(&rule, "two@EXAMPLE.ORG"),
+       "...and new deny honored");
+    unlink(path);
+    errors_capture();
+    ok(!server_config_acl_permit(&rule, "one@EXAMPLE.ORG"),
+       "...file removed");
+    errors_uncapture();
+    free(errors);
+    errors = NULL;
+    free(newpath);
+    free(path);
+    test_tmpdir_free(tmpdir);
+
     return 0;
 }
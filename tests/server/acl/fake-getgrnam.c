@@ -64,6 +64,23 @@ fake_queue_group(const struct group *gr, int status)
 }
 
 
+
+/*
+ * Interface specific to this fake library to discard all queued returns,
+ * for use when a test may have left some unused.
+ */
+void
+fake_clear_groups(void)
+{
+    struct fake_getgrnam_return *old;
+
+    while (return_queue != NULL) {
+        old = return_queue;
+        return_queue = return_queue->next;
+        free(old);
+    }
+}
+
 /*
  * The fake getgrnam_r function.  Intercept the C library function and, if the
  * name matches, return the top response on the queue and advance the queue.
@@ -29,4 +29,7 @@ BEGIN_DECLS
  */
 void fake_queue_group(const struct group *, int);
 
+/* Discard any queued returns that haven't been used. */
+void fake_clear_groups(void);
+
 #endif /* !TESTS_SERVER_ACL_FAKE_GETGRNAM_H */
@@ -49,6 +49,9 @@ static const struct group goodguys = {
 static const struct group badguys = {
     (char *) "badguys", NULL, 42, (char **) badguys_members
 };
+static const struct group latecomers = {
+    (char *) "latecomers", NULL, 43, (char **) goodguys_members
+};
 
 /*
  * Length of a principal that will be longer than the buffer size we use for
@@ -64,8 +67,8 @@ main(void)
 {
     const char *acls[5];
     const struct rule rule = {
-        (char *) "TEST", 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0, 0, NULL,
-        NULL, (char **) acls
+        (char *) "TEST", 0, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, NULL,
+        0, 0, NULL, NULL, NULL, (char **) acls, 0
     };
 
     plan(2);
@@ -110,15 +113,18 @@ main(void)
     char long_principal[VERY_LONG_PRINCIPAL];
     const char *acls[5];
     const struct rule rule = {
-        (char *) "TEST", 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0, 0, NULL,
-        NULL, (char **) acls
+        (char *) "TEST", 0, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, NULL,
+        0, 0, NULL, NULL, NULL, (char **) acls, 0
     };
 
-    plan(16);
+    plan(22);
 
     /* Use a krb5.conf with a default realm of EXAMPLE.ORG. */
     kerberos_generate_conf("EXAMPLE.ORG");
 
+    /* Look up groups and users for every check until we test caching. */
+    server_config_set_localgroup_ttl(0);
+
     /* Check behavior with empty groups. */
     fake_queue_group(&empty, 0);
     set_passwd("someone", 0);
@@ -217,6 +223,34 @@ main(void)
     ok(!server_config_acl_permit(&rule, "anyoneelse@EXAMPLE.ORG"),
        "User in neither denied nor allowed group");
 
+    /*
+     * With caching, a group is only looked up once, and groups that don't
+     * exist are remembered.  Nothing further is queued for goodguys, so the
+     * second and third checks only succeed if the membership was cached.
+     */
+    server_config_set_localgroup_ttl(60);
+    fake_clear_groups();
+    fake_queue_group(&goodguys, 0);
+    set_passwd("remi", 0);
+    acls[0] = "localgroup:goodguys";
+    acls[1] = NULL;
+    ok(server_config_acl_permit(&rule, "remi@EXAMPLE.ORG"),
+       "User in cached group");
+    ok(server_config_acl_permit(&rule, "remi@EXAMPLE.ORG"),
+       "...and again from the cache");
+    set_passwd("eagle", 0);
+    ok(server_config_acl_permit(&rule, "eagle@EXAMPLE.ORG"),
+       "...and another user from the cache");
+    acls[0] = "localgroup:latecomers";
+    ok(!server_config_acl_permit(&rule, "eagle@EXAMPLE.ORG"),
+       "Nonexistent group");
+    fake_queue_group(&latecomers, 0);
+    ok(!server_config_acl_permit(&rule, "eagle@EXAMPLE.ORG"),
+       "...still nonexistent while cached");
+    server_config_set_localgroup_ttl(0);
+    ok(server_config_acl_permit(&rule, "eagle@EXAMPLE.ORG"),
+       "...and found once the cache is disabled");
+
     /* Clean up. */
     free(errors);
     return 0;
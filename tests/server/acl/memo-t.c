@@ -0,0 +1,115 @@
+/*
+ * Test suite for remembering ACL decisions for the life of a connection.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Write the given principal, or nothing if it is NULL, to an ACL file.
+ */
+static void
+write_acl(const char *path, const char *principal)
+{
+    FILE *acl;
+
+    acl = fopen(path, "w");
+    if (acl == NULL)
+        sysbail("cannot create %s", path);
+    if (principal != NULL)
+        fprintf(acl, "%s\n", principal);
+    if (fclose(acl) == EOF)
+        sysbail("cannot write to %s", path);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct remctl *r, *r2;
+    char *tmpdir, *confpath, *aclpath, *hello;
+    FILE *conf;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    /* Write an ACL file granting access and a configuration using it. */
+    tmpdir = test_tmpdir();
+    basprintf(&aclpath, "%s/acl-memo", tmpdir);
+    basprintf(&confpath, "%s/conf-memo", tmpdir);
+    hello = test_file_path("data/cmd-hello");
+    if (hello == NULL)
+        bail("cannot find data/cmd-hello");
+    write_acl(aclpath, config->principal);
+    conf = fopen(confpath, "w");
+    if (conf == NULL)
+        sysbail("cannot create %s", confpath);
+    fprintf(conf, "test test %s %s\n", hello, aclpath);
+    fclose(conf);
+    remctld = remctld_start(config, "tmp/conf-memo", NULL);
+
+    plan(8);
+
+    /* The first command on a connection checks the ACL. */
+    r = remctl_new();
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot connect: %s", remctl_error(r));
+    ok(run_test_command(r), "Command allowed by ACL");
+
+    /*
+     * Remove the user from the ACL.  The open connection keeps using its
+     * earlier decision, but a new connection sees the change.
+     */
+    write_acl(aclpath, NULL);
+    ok(run_test_command(r), "...still allowed on the same connection");
+    r2 = remctl_new();
+    if (!remctl_open(r2, "localhost", 14373, config->principal))
+        bail("cannot connect: %s", remctl_error(r2));
+    ok(!run_test_command(r2), "...but denied on a new connection");
+    ok(run_test_command(r), "...and still allowed on the first connection");
+    remctl_close(r2);
+    remctl_close(r);
+    process_stop(remctld);
+
+    /*
+     * The same in the event-driven server, where each command runs in its own
+     * child and the decisions have to be passed back to the parent.
+     */
+    write_acl(aclpath, config->principal);
+    remctld = remctld_start(config, "tmp/conf-memo", "-E", NULL);
+    r = remctl_new();
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot connect: %s", remctl_error(r));
+    ok(run_test_command(r), "Command allowed by ACL with -E");
+    write_acl(aclpath, NULL);
+    ok(run_test_command(r), "...still allowed on the same connection");
+    r2 = remctl_new();
+    if (!remctl_open(r2, "localhost", 14373, config->principal))
+        bail("cannot connect: %s", remctl_error(r2));
+    ok(!run_test_command(r2), "...but denied on a new connection");
+    ok(run_test_command(r), "...and still allowed on the first connection");
+    remctl_close(r2);
+    remctl_close(r);
+    process_stop(remctld);
+
+    /* Clean up. */
+    unlink(aclpath);
+    unlink(confpath);
+    free(aclpath);
+    free(confpath);
+    test_file_path_free(hello);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Test suite for capabilities messages in the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/gssapi.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+#include <util/compress.h>
+#include <util/gss-tokens.h>
+#include <util/protocol.h>
+
+/*
+ * A capabilities token offering unknown features, a token data size smaller
+ * than the minimum, and no compression.
+ */
+static const char token[] = {
+    4, 12,
+    0, 0, 0, (char) 0xff,
+    0, 0, 4, 0,
+    0
+};
+
+/* The same token, but missing the compression methods. */
+static const char short_token[] = {
+    4, 12,
+    0, 0, 0, 1,
+    0, 0, 4, 0
+};
+
+
+/*
+ * Read a capabilities reply from the server and check that it has the
+ * expected features, token data size, and compression method.
+ */
+static void
+check_reply(struct remctl *r, unsigned long features, unsigned long size,
+            int method, const char *description)
+{
+    OM_uint32 data, major, minor;
+    int flags, status;
+    gss_buffer_desc tok;
+    const char *p;
+
+    status = token_recv_priv(r->fd, &r->buffer, r->context, &flags, &tok,
+                             1024 * 64, 0, &major, &minor);
+    is_int(TOKEN_OK, status, "%s: received token correctly", description);
+    if (status != TOKEN_OK) {
+        ok_block(5, false, "%s: no token", description);
+        return;
+    }
+    p = tok.value;
+    is_int(1 + 1 + 4 + 4 + 1, tok.length, "...with correct length");
+    if (tok.length != 1 + 1 + 4 + 4 + 1) {
+        ok_block(4, false, "...wrong length");
+        gss_release_buffer(&minor, &tok);
+        return;
+    }
+    ok(p[0] == 4 && p[1] == MESSAGE_CAPABILITIES,
+       "...protocol version 4 capabilities message");
+    memcpy(&data, p + 2, 4);
+    is_int(features, ntohl(data), "...with correct features");
+    memcpy(&data, p + 6, 4);
+    is_int(size, ntohl(data), "...with correct token size");
+    is_int(method, p[10], "...with correct compression method");
+    gss_release_buffer(&minor, &tok);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r;
+    struct remctl_output *output;
+    OM_uint32 major, minor;
+    int status;
+    gss_buffer_desc tok;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", NULL);
+
+    plan(2 + 6 * 2 + 3);
+
+    /* Open the connection to the site, which sends our capabilities. */
+    r = remctl_new();
+    ok(r != NULL, "remctl_new");
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    ok(remctl_open(r, "localhost", 14373, config->principal), "remctl_open");
+
+    /* The server should agree to everything we offered. */
+    check_reply(r, CAPABILITIES_ALL, TOKEN_MAX_DATA_LARGE, COMPRESS_METHODS,
+                "remctl_open");
+    r->capabilities_pending = false;
+
+    /* Unknown features are dropped and the token size is never too small. */
+    tok.length = sizeof(token);
+    tok.value = (char *) token;
+    status = token_send_priv(r->fd, r->context, TOKEN_DATA | TOKEN_PROTOCOL,
+                             &tok, 0, &major, &minor);
+    if (status != TOKEN_OK)
+        bail("cannot send token");
+    check_reply(r, CAPABILITIES_ALL, TOKEN_MAX_DATA, 0, "unknown features");
+
+    /* A malformed capabilities token is rejected. */
+    tok.length = sizeof(short_token);
+    tok.value = (char *) short_token;
+    status = token_send_priv(r->fd, r->context, TOKEN_DATA | TOKEN_PROTOCOL,
+                             &tok, 0, &major, &minor);
+    if (status != TOKEN_OK)
+        bail("cannot send token");
+    r->ready = 1;
+    output = remctl_output(r);
+    ok(output != NULL, "short token: output is not null");
+    if (output == NULL)
+        ok_block(2, false, "...no output");
+    else {
+        is_int(REMCTL_OUT_ERROR, output->type, "...error");
+        is_int(ERROR_BAD_TOKEN, output->error, "...bad token");
+    }
+
+    /* Close things out. */
+    remctl_close(r);
+    return 0;
+}
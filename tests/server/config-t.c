@@ -43,12 +43,36 @@ test_error(const char *file, const char *expected)
 }
 
 
+/*
+ * Test that looking up a command and subcommand finds the expected rule.
+ * Takes the configuration, the command and subcommand, and the position of
+ * the expected rule, or -1 if no rule should be found.
+ */
+static void
+test_find(const struct config *config, const char *command,
+          const char *subcommand, long expected)
+{
+    struct rule *rule;
+    long found = -1;
+    size_t i;
+
+    rule = server_config_find(config, command, subcommand);
+    for (i = 0; i < config->count; i++)
+        if (config->rules[i] == rule)
+            found = (long) i;
+    is_int(expected, found, "find %s %s",
+           command == NULL ? "(null)" : command,
+           subcommand == NULL ? "(null)" : subcommand);
+}
+
+
 int
 main(void)
 {
     struct config *config;
+    unsigned long generation;
 
-    plan(49);
+    plan(79);
     if (chdir(getenv("SOURCE")) < 0)
         sysbail("can't chdir to SOURCE");
 
@@ -70,6 +94,8 @@ main(void)
     is_string("data/cmd-hello", config->rules[1]->program, "program 2");
     is_int(4, config->rules[1]->logmask[0], "logmask 2");
     is_int(0, config->rules[1]->logmask[1], "...and only one logmask");
+    is_string("/run/remctl/test.sock", config->rules[1]->fastcgi,
+              "fastcgi 2");
     is_string("data/acl-nonexistent", config->rules[1]->acls[0], "acl 2 1");
     is_string("data/acl-no-such-file", config->rules[1]->acls[1], "acl 2 2");
     ok(config->rules[1]->acls[2] == NULL, "...and only two acls");
@@ -85,6 +111,11 @@ main(void)
     ok(config->rules[2]->acls[1] == NULL, "...and only one acl");
     is_string("data/cmd-hello", config->rules[2]->summary, "summary 3");
     is_string("data/command-hello", config->rules[2]->help, "help 3");
+    is_int(60, config->rules[2]->timeout, "timeout 3");
+    is_int(0, config->rules[1]->timeout, "...and no timeout for 2");
+    is_int(3, config->rules[2]->max_concurrent, "max_concurrent 3");
+    is_int(3, config->rules[2]->compress, "compress 3");
+    is_int(0, config->rules[1]->compress, "...and no compress for 2");
 
     is_string("foo", config->rules[3]->command, "command 4");
     is_string("ALL", config->rules[3]->subcommand, "subcommand 4");
@@ -94,6 +125,39 @@ main(void)
     is_string("data/acl-simple", config->rules[3]->acls[1], "acl 4 2");
     is_string("data/acl-simple", config->rules[3]->acls[187], "acl 4 188");
     ok(config->rules[3]->acls[188] == NULL, "...and 188 total ACLs");
+
+    /* Command lookup in a configuration without wildcard commands. */
+    test_find(config, "test", "foo", 0);
+    test_find(config, "test", "baz", 2);
+    test_find(config, "test", "quux", -1);
+    test_find(config, "test", NULL, -1);
+    test_find(config, "foo", "anything", 3);
+    test_find(config, "foo", NULL, 3);
+    server_config_free(config);
+
+    /* Command lookup with wildcards, where the first matching rule wins. */
+    config = server_config_load("data/conf-dispatch");
+    ok(config != NULL, "dispatch config loaded");
+    if (config == NULL)
+        bail("server_config_load returned NULL");
+    test_find(config, "foo", "bar", 0);
+    test_find(config, "foo", "baz", 1);
+    test_find(config, "foo", NULL, 1);
+    test_find(config, "bar", "baz", 2);
+    test_find(config, NULL, NULL, 5);
+    test_find(config, "bar", NULL, 6);
+    test_find(config, "bar", "quux", 7);
+    test_find(config, NULL, "other", 7);
+    is_int(8, config->rules[8]->index, "rule index");
+    generation = config->generation;
+    server_config_free(config);
+
+    /* Each load of a configuration gets a new generation. */
+    config = server_config_load("data/conf-dispatch");
+    ok(config != NULL, "dispatch config loaded again");
+    if (config == NULL)
+        bail("server_config_load returned NULL");
+    ok(config->generation != generation, "...with a new generation");
     server_config_free(config);
 
     /* Now test for errors. */
@@ -112,8 +176,15 @@ main(void)
     test_error("data/configs/bad-include-1",
                "data/configs/bad-include-1:1: included file /no/th/ing not"
                " found\n");
+    test_error("data/configs/bad-fastcgi-1",
+               "data/configs/bad-fastcgi-1:1: invalid fastcgi value"
+               " relative/socket\n");
     test_error("data/configs/bad-user-1",
                "data/configs/bad-user-1:1: invalid user value nonexistent\n");
+    test_error("data/configs/bad-timeout-1",
+               "data/configs/bad-timeout-1:1: invalid timeout value soon\n");
+    test_error("data/configs/bad-compress-1",
+               "data/configs/bad-compress-1:1: invalid compress value fast\n");
 
     return 0;
 }
@@ -0,0 +1,79 @@
+/*
+ * Test suite for the event-driven mode of the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+
+
+/*
+ * Run the test command with the simple interface, which doesn't keep the
+ * connection open.
+ */
+static bool
+run_command_simple(struct kerberos_config *config)
+{
+    struct remctl_result *result;
+    const char *command[] = { "test", "test", NULL };
+    bool okay;
+
+    result = remctl("127.0.0.1", 14373, config->principal, command);
+    if (result == NULL)
+        return false;
+    okay = (result->error == NULL && result->status == 0
+            && result->stdout_len == 12
+            && memcmp(result->stdout_buf, "hello world\n", 12) == 0);
+    remctl_result_free(result);
+    return okay;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct remctl *r, *r2;
+    int i;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    remctld = remctld_start(config, "data/conf-simple", "-E", NULL);
+
+    plan(10);
+
+    /*
+     * Run several commands on one connection, which requires the GSS-API
+     * context to be passed back from each child to the parent.
+     */
+    r = remctl_new();
+    ok(remctl_open(r, "127.0.0.1", 14373, config->principal),
+       "Connection for multiple commands");
+    for (i = 0; i < 4; i++)
+        ok(run_test_command(r), "... command %d succeeds", i + 1);
+
+    /* Idle connections don't block other connections. */
+    r2 = remctl_new();
+    ok(remctl_open(r2, "127.0.0.1", 14373, config->principal),
+       "Second simultaneous connection");
+    ok(run_test_command(r2), "... command succeeds");
+    ok(remctl_noop(r2), "... no-op succeeds");
+    ok(run_test_command(r), "... command on first connection still succeeds");
+    remctl_close(r2);
+    remctl_close(r);
+
+    /* A single command with the simple interface. */
+    ok(run_command_simple(config), "Simple interface");
+
+    process_stop(remctld);
+    return 0;
+}
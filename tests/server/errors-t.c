@@ -112,7 +112,7 @@ main(void)
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
     remctld_start(config, "data/conf-simple", NULL);
 
-    plan(4);
+    plan(5);
 
     /* Run the tests. */
     r = remctl_new();
@@ -126,6 +126,8 @@ main(void)
     is_int(ERROR_TOOMANY_ARGS, status, "too many arguments");
     status = test_error(r, NULL);
     is_int(ERROR_UNKNOWN_COMMAND, status, "unknown command");
+    status = test_error(r, "timeout");
+    is_int(ERROR_TIMEOUT, status, "command timeout");
     remctl_close(r);
 
     return 0;
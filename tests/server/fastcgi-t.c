@@ -0,0 +1,160 @@
+/*
+ * Test suite for running commands through a FastCGI backend.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Run the FastCGI test command with the given mode and optional data to pass
+ * on standard input, returning the result.
+ */
+static struct remctl_result *
+run(struct kerberos_config *config, const char *mode, const char *data)
+{
+    struct remctl_result *result;
+    const char *command[] = { "test", "fastcgi", mode, data, NULL };
+
+    result = remctl("localhost", 14373, config->principal, command);
+    if (result == NULL)
+        bail("cannot run remctl command");
+    return result;
+}
+
+
+/*
+ * Check that a result has the given standard output and status and no
+ * error.
+ */
+static void
+check_result(struct remctl_result *result, const char *out, int status,
+             const char *mode)
+{
+    if (result->error != NULL)
+        diag("error: %s", result->error);
+    ok(result->error == NULL && result->stdout_len == strlen(out)
+       && memcmp(result->stdout_buf, out, strlen(out)) == 0,
+       "%s output", mode);
+    is_int(status, result->status, "...and status");
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl_result *result;
+    struct remctl *r;
+    struct remctl_output *output;
+    char *tmpdir, *confpath, *sockpath, *pidpath, *backend, *expected;
+    const char *argv[4];
+    const char *hello[] = { "test", "fastcgi", "hello", NULL };
+    FILE *conf;
+    int i;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    /* Start the backend. */
+    tmpdir = test_tmpdir();
+    basprintf(&sockpath, "%s/fastcgi.sock", tmpdir);
+    basprintf(&pidpath, "%s/fastcgi.pid", tmpdir);
+    backend = test_file_path("data/cmd-fastcgi");
+    if (backend == NULL)
+        bail("cannot find data/cmd-fastcgi");
+    argv[0] = backend;
+    argv[1] = sockpath;
+    argv[2] = pidpath;
+    argv[3] = NULL;
+    process_start(argv, pidpath);
+
+    /* Write out a configuration pointing at the backend and start remctld. */
+    basprintf(&confpath, "%s/conf-fastcgi", tmpdir);
+    conf = fopen(confpath, "w");
+    if (conf == NULL)
+        sysbail("cannot create %s", confpath);
+    fprintf(conf, "test fastcgi /nonexistent fastcgi=%s stdin=3 ANYUSER\n",
+            sockpath);
+    fprintf(conf, "test missing /nonexistent fastcgi=%s/none ANYUSER\n",
+            tmpdir);
+    fclose(conf);
+    remctld_start(config, "tmp/conf-fastcgi", NULL);
+
+    plan(18);
+
+    /* Basic output and status. */
+    result = run(config, "hello", NULL);
+    check_result(result, "hello world\n", 0, "hello");
+    remctl_result_free(result);
+
+    /* The parameters that replace the environment. */
+    basprintf(&expected, "%s\ntest\n", config->principal);
+    result = run(config, "env", NULL);
+    check_result(result, expected, 0, "env");
+    remctl_result_free(result);
+    free(expected);
+
+    /* The arguments, starting with the subcommand. */
+    result = run(config, "args", NULL);
+    check_result(result, "2\nfastcgi\nargs\n", 0, "args");
+    remctl_result_free(result);
+
+    /* Data passed on standard input. */
+    result = run(config, "stdin", "some data");
+    check_result(result, "some data", 0, "stdin");
+    remctl_result_free(result);
+    result = run(config, "status", "7");
+    check_result(result, "", 7, "status");
+    remctl_result_free(result);
+
+    /* Standard error is returned separately. */
+    result = run(config, "stderr", NULL);
+    check_result(result, "stdout\n", 2, "stderr");
+    ok(result->stderr_len == 7
+       && memcmp(result->stderr_buf, "stderr\n", 7) == 0,
+       "...and standard error");
+    remctl_result_free(result);
+
+    /* Several commands on the same connection. */
+    r = remctl_new();
+    ok(remctl_open(r, "localhost", 14373, config->principal), "remctl_open");
+    for (i = 0; i < 2; i++) {
+        remctl_command(r, hello);
+        do {
+            output = remctl_output(r);
+        } while (output != NULL && output->type == REMCTL_OUT_OUTPUT);
+        ok(output != NULL && output->type == REMCTL_OUT_STATUS
+           && output->status == 0, "command %d on one connection", i + 1);
+    }
+    remctl_close(r);
+
+    /* Failures of the backend are internal errors. */
+    result = run(config, "close", NULL);
+    is_string("Internal failure", result->error, "backend closed connection");
+    remctl_result_free(result);
+    hello[1] = "missing";
+    result = remctl("localhost", 14373, config->principal, hello);
+    is_string("Internal failure", result->error, "backend not running");
+    remctl_result_free(result);
+
+    /* Clean up. */
+    unlink(confpath);
+    unlink(sockpath);
+    free(confpath);
+    free(sockpath);
+    free(pidpath);
+    test_file_path_free(backend);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Test suite for limits on the number of commands running at once.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/wait.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+
+
+/*
+ * Fork a child that takes a slot for the given rule and user, tells the
+ * parent over a pipe whether it got one, holds it for the given number of
+ * seconds, and then exits, freeing the slot first if release is set.
+ * Otherwise, that's left to the reclaiming of slots of processes that have
+ * exited, which only happens once the child has been reaped.  Returns the
+ * PID of the child once it has the slot.
+ */
+static pid_t
+hold_slot(const struct rule *rule, const char *user, unsigned int seconds,
+          bool release)
+{
+    int fds[2];
+    pid_t child;
+    long slot;
+    char result;
+
+    if (pipe(fds) < 0)
+        sysbail("cannot create pipe");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        close(fds[0]);
+        server_limit_set_wait(10);
+        result = server_limit_acquire(rule, user, &slot) ? 'y' : 'n';
+        if (write(fds[1], &result, 1) < 1)
+            _exit(1);
+        sleep(seconds);
+        if (release)
+            server_limit_release(slot);
+        _exit(0);
+    }
+    close(fds[1]);
+    if (read(fds[0], &result, 1) < 1 || result != 'y')
+        bail("child could not take a slot");
+    close(fds[0]);
+    return child;
+}
+
+
+/*
+ * Fork a child that waits for a slot for the given rule and user, holding it
+ * for the given number of seconds once it gets one.  Returns once the child
+ * is in the queue, which is assumed to take no more than half a second.
+ */
+static pid_t
+queue_slot(const struct rule *rule, const char *user, unsigned int seconds)
+{
+    pid_t child;
+    long slot;
+    const struct timespec pause = { 0, 500 * 1000 * 1000 };
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server_limit_set_wait(10);
+        if (!server_limit_acquire(rule, user, &slot))
+            _exit(1);
+        sleep(seconds);
+        _exit(0);
+    }
+    nanosleep(&pause, NULL);
+    return child;
+}
+
+
+int
+main(void)
+{
+    struct rule one, two;
+    long slots[3];
+    pid_t holder, waiter;
+    int status;
+    time_t start;
+
+    plan(19);
+
+    /* Set up two rules, one with a limit. */
+    memset(&one, 0, sizeof(one));
+    one.command = (char *) "test";
+    one.subcommand = (char *) "one";
+    one.program = (char *) "/bin/true";
+    one.max_concurrent = 2;
+    two = one;
+    two.subcommand = (char *) "two";
+    two.max_concurrent = 0;
+    server_limit_init();
+
+    /* Commands without limits don't take slots. */
+    ok(server_limit_acquire(&two, "alice", &slots[0]), "No limits");
+    is_int(-1, slots[0], "...and no slot");
+    server_limit_release(slots[0]);
+
+    /* The rule limit applies to all users. */
+    ok(server_limit_acquire(&one, "alice", &slots[0]), "First command");
+    ok(slots[0] >= 0, "...takes a slot");
+    ok(server_limit_acquire(&one, "bob", &slots[1]), "Second command");
+    ok(!server_limit_acquire(&one, "carol", &slots[2]),
+       "Third command is rejected");
+    is_int(-1, slots[2], "...without a slot");
+    server_limit_release(slots[0]);
+    ok(server_limit_acquire(&one, "carol", &slots[2]),
+       "...but may run once another finishes");
+    server_limit_release(slots[1]);
+    server_limit_release(slots[2]);
+
+    /* The per-user limit applies across rules. */
+    server_limit_set_user(1);
+    ok(server_limit_acquire(&two, "alice", &slots[0]), "Per-user limit");
+    ok(!server_limit_acquire(&one, "alice", &slots[1]),
+       "...rejects a second command for the same user");
+    ok(server_limit_acquire(&one, "bob", &slots[1]),
+       "...but not for another user");
+    server_limit_release(slots[0]);
+    server_limit_release(slots[1]);
+    server_limit_set_user(0);
+
+    /* Limits apply across processes. */
+    one.max_concurrent = 1;
+    holder = hold_slot(&one, "alice", 1, true);
+    ok(!server_limit_acquire(&one, "bob", &slots[0]),
+       "Command in another process counts against the limit");
+    server_limit_set_wait(5);
+    start = time(NULL);
+    ok(server_limit_acquire(&one, "bob", &slots[0]),
+       "...and a queued command runs once it finishes");
+    ok(difftime(time(NULL), start) >= 1, "...after waiting for it");
+    server_limit_release(slots[0]);
+    waitpid(holder, &status, 0);
+
+    /*
+     * The queue is first in, first out, and holds no more commands than the
+     * limit.  The holder runs for two seconds and the waiter gets the slot
+     * after it, so we're rejected without waiting.
+     */
+    holder = hold_slot(&one, "alice", 2, false);
+    waiter = queue_slot(&one, "bob", 1);
+    start = time(NULL);
+    ok(!server_limit_acquire(&one, "carol", &slots[0]),
+       "Command is rejected when the queue is full");
+    ok(difftime(time(NULL), start) <= 1, "...without waiting");
+    waitpid(holder, &status, 0);
+    waitpid(waiter, &status, 0);
+    ok(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+       "...and the queued command runs");
+
+    /* Slots of processes that have exited are reclaimed. */
+    server_limit_set_wait(0);
+    ok(server_limit_acquire(&one, "carol", &slots[0]),
+       "Slots of exited processes are reclaimed");
+    server_limit_release(slots[0]);
+
+    /*
+     * A command that is under all of its own limits doesn't wait behind a
+     * command from the same user that is waiting for a different rule.
+     */
+    server_limit_set_user(2);
+    holder = hold_slot(&one, "bob", 2, true);
+    waiter = queue_slot(&one, "alice", 0);
+    ok(server_limit_acquire(&two, "alice", &slots[0]),
+       "Command doesn't wait behind another rule's queue");
+    server_limit_release(slots[0]);
+    waitpid(holder, &status, 0);
+    waitpid(waiter, &status, 0);
+    server_limit_set_user(0);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Test suite for the pre-forked worker mode of the server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct remctl *r, *r2;
+    int i;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    /* Two workers, each replaced after two connections. */
+    remctld = remctld_start(config, "data/conf-simple", "-w", "2", "-c", "2",
+                            NULL);
+
+    plan(15);
+
+    /*
+     * Make enough sequential connections that every worker has to be
+     * replaced at least once, running two commands on each connection.
+     */
+    for (i = 0; i < 6; i++) {
+        r = remctl_new();
+        ok(remctl_open(r, "127.0.0.1", 14373, config->principal),
+           "Connection %d", i + 1);
+        ok(run_test_command(r) && run_test_command(r), "... commands succeed");
+        remctl_close(r);
+    }
+
+    /* Two connections can be handled simultaneously. */
+    r = remctl_new();
+    r2 = remctl_new();
+    ok(remctl_open(r, "127.0.0.1", 14373, config->principal),
+       "First simultaneous connection");
+    ok(remctl_open(r2, "127.0.0.1", 14373, config->principal),
+       "Second simultaneous connection");
+    ok(run_test_command(r2) && run_test_command(r),
+       "... commands succeed on both");
+    remctl_close(r);
+    remctl_close(r2);
+
+    process_stop(remctld);
+    return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Test suite for reloading the server configuration in place.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+#include <util/vector.h>
+
+
+/*
+ * Write the given contents to a file, replacing any existing contents.
+ */
+static void
+write_file(const char *path, const char *contents)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+}
+
+
+/*
+ * Return true if every rule in the configuration knows its own position and
+ * the index finds the rules for each of the given commands.
+ */
+static bool
+consistent(const struct config *config, const char *commands[])
+{
+    size_t i;
+    struct rule *rule;
+
+    for (i = 0; i < config->count; i++)
+        if (config->rules[i]->index != i) {
+            diag("rule %lu has index %lu", (unsigned long) i,
+                 (unsigned long) config->rules[i]->index);
+            return false;
+        }
+    for (i = 0; commands[i] != NULL; i++) {
+        rule = server_config_find(config, commands[i], "foo");
+        if (rule == NULL || strcmp(rule->command, commands[i]) != 0) {
+            diag("cannot find rule for %s", commands[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Return true if the given path is in a vector.
+ */
+static bool
+has_path(const struct vector *paths, const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < paths->count; i++)
+        if (strcmp(paths->strings[i], path) == 0)
+            return true;
+    return false;
+}
+
+
+int
+main(void)
+{
+    struct config *config;
+    struct rule *one, *two;
+    struct vector *paths;
+    unsigned long generation, epoch;
+    char *tmpdir, *conf, *confdir, *path_one, *path_two, *path_three;
+    char *aclpath, *contents;
+    const char *commands2[] = { "main", "one", "two", NULL };
+    const char *commands3[] = { "main", "one", "two", "three", NULL };
+
+    plan(32);
+    if (chdir(getenv("SOURCE")) < 0)
+        sysbail("can't chdir to SOURCE");
+    tmpdir = test_tmpdir();
+
+    /* Build a configuration with an included directory. */
+    basprintf(&conf, "%s/reload.conf", tmpdir);
+    basprintf(&confdir, "%s/reload.d", tmpdir);
+    basprintf(&path_one, "%s/one", confdir);
+    basprintf(&path_two, "%s/two", confdir);
+    basprintf(&path_three, "%s/three", confdir);
+    if (mkdir(confdir, 0755) < 0)
+        sysbail("cannot create %s", confdir);
+    basprintf(&contents, "main ALL /bin/true data/acl-simple\ninclude %s\n",
+              confdir);
+    write_file(conf, contents);
+    free(contents);
+    write_file(path_one, "one ALL /bin/true ANYUSER\n");
+    write_file(path_two, "two ALL /bin/true ANYUSER\n");
+    config = server_config_load(conf);
+    if (config == NULL)
+        bail("cannot load %s", conf);
+    one = server_config_find(config, "one", "foo");
+    two = server_config_find(config, "two", "foo");
+    generation = config->generation;
+
+    /* The paths to watch include every file, the directory, and the ACL. */
+    paths = server_config_paths(config);
+    ok(has_path(paths, conf), "Configuration file is watched");
+    ok(has_path(paths, confdir), "...as is the included directory");
+    ok(has_path(paths, path_one) && has_path(paths, path_two),
+       "...and the included files");
+    ok(has_path(paths, "data/acl-simple"), "...and the ACL file");
+    vector_free(paths);
+
+    /* Reloading without any changes does nothing. */
+    ok(server_config_reload(config, conf), "Reload without changes");
+    is_int(generation, config->generation, "...keeps the generation");
+    ok(server_config_find(config, "one", "foo") == one
+           && server_config_find(config, "two", "foo") == two,
+       "...and the rules");
+
+    /* Change one included file. */
+    write_file(path_two, "two ALL /bin/false ANYUSER\n");
+    ok(server_config_reload(config, conf), "Reload after changing a file");
+    ok(config->generation != generation, "...changes the generation");
+    generation = config->generation;
+    is_int(3, config->count, "...with the same number of rules");
+    ok(server_config_find(config, "one", "foo") == one,
+       "...reusing the rules of the unchanged file");
+    two = server_config_find(config, "two", "foo");
+    ok(two != NULL && strcmp(two->program, "/bin/false") == 0,
+       "...and reading the changed file");
+    ok(consistent(config, commands2), "...with a consistent index");
+
+    /* Add a file to the included directory. */
+    write_file(path_three, "three ALL /bin/true ANYUSER\n");
+    ok(server_config_reload(config, conf), "Reload after adding a file");
+    is_int(4, config->count, "...adds its rules");
+    ok(server_config_find(config, "one", "foo") == one
+           && server_config_find(config, "two", "foo") == two,
+       "...reusing the others");
+    ok(consistent(config, commands3), "...with a consistent index");
+    generation = config->generation;
+
+    /* A bad edit keeps the previous configuration. */
+    write_file(path_one, "one ALL\n");
+    errors_capture();
+    ok(!server_config_reload(config, conf), "Reload with a parse error");
+    errors_uncapture();
+    basprintf(&contents, "%s:1: parse error\n", path_one);
+    is_string(contents, errors, "...reports the error");
+    free(contents);
+    is_int(generation, config->generation, "...keeps the generation");
+    ok(server_config_find(config, "one", "foo") == one,
+       "...and the previous rules");
+    ok(consistent(config, commands3), "...with a consistent index");
+
+    /* Fix the error and remove the added file. */
+    write_file(path_one, "one ALL /bin/echo ANYUSER\n");
+    unlink(path_three);
+    ok(server_config_reload(config, conf), "Reload after fixing the error");
+    is_int(3, config->count, "...removes the deleted file's rules");
+    one = server_config_find(config, "one", "foo");
+    ok(one != NULL && strcmp(one->program, "/bin/echo") == 0,
+       "...and reads the fixed file");
+    ok(consistent(config, commands2), "...with a consistent index");
+
+    /* Removing the configuration file also keeps the configuration. */
+    unlink(conf);
+    errors_capture();
+    ok(!server_config_reload(config, conf),
+       "Reload with a missing configuration file");
+    errors_uncapture();
+    is_int(3, config->count, "...keeps the rules");
+    ok(consistent(config, commands2), "...with a consistent index");
+    server_config_free(config);
+
+    /*
+     * Changing only an ACL file keeps the generation, since the rules are the
+     * same, but changes the ACL epoch so that remembered decisions are
+     * dropped.
+     */
+    basprintf(&aclpath, "%s/reload.acl", tmpdir);
+    write_file(aclpath, "test@EXAMPLE.ORG\n");
+    basprintf(&contents, "main ALL /bin/true %s\n", aclpath);
+    write_file(conf, contents);
+    free(contents);
+    config = server_config_load(conf);
+    if (config == NULL)
+        bail("cannot load %s", conf);
+    generation = config->generation;
+    epoch = server_config_acl_epoch();
+    ok(server_config_reload(config, conf), "Reload with an unchanged ACL");
+    is_int(epoch, server_config_acl_epoch(), "...keeps the ACL epoch");
+    write_file(aclpath, "test@EXAMPLE.ORG\nother@EXAMPLE.ORG\n");
+    server_config_reload(config, conf);
+    ok(generation == config->generation
+           && epoch != server_config_acl_epoch(),
+       "Reload with a changed ACL changes only the ACL epoch");
+
+    /* Clean up. */
+    server_config_free(config);
+    unlink(aclpath);
+    unlink(conf);
+    free(aclpath);
+    unlink(path_one);
+    unlink(path_two);
+    rmdir(confdir);
+    free(path_one);
+    free(path_two);
+    free(path_three);
+    free(confdir);
+    free(conf);
+    free(errors);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Test suite for compiled configuration snapshots.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+#include <util/vector.h>
+
+
+/*
+ * Write the given contents to a file, replacing any existing contents.
+ */
+static void
+write_file(const char *path, const char *contents)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+}
+
+
+/*
+ * Compare two strings that may be NULL.
+ */
+static bool
+same_string(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return (a == NULL && b == NULL);
+    return (strcmp(a, b) == 0);
+}
+
+
+/*
+ * Compare two rules, returning true if they're the same and reporting the
+ * first difference otherwise.
+ */
+static bool
+same_rule(const struct rule *a, const struct rule *b)
+{
+    size_t i;
+
+    if (!same_string(a->file, b->file) || a->lineno != b->lineno) {
+        diag("%s:%d != %s:%d", a->file, a->lineno, b->file, b->lineno);
+        return false;
+    }
+    if (a->line->count != b->line->count) {
+        diag("%s:%d: line length differs", a->file, a->lineno);
+        return false;
+    }
+    for (i = 0; i < a->line->count; i++)
+        if (!same_string(a->line->strings[i], b->line->strings[i])) {
+            diag("%s:%d: word %lu differs", a->file, a->lineno,
+                 (unsigned long) i);
+            return false;
+        }
+    if (!same_string(a->command, b->command)
+        || !same_string(a->subcommand, b->subcommand)
+        || !same_string(a->program, b->program)
+        || !same_string(a->summary, b->summary)
+        || !same_string(a->help, b->help)
+        || !same_string(a->fastcgi, b->fastcgi)
+        || !same_string(a->user, b->user)) {
+        diag("%s:%d: options differ", a->file, a->lineno);
+        return false;
+    }
+    if (a->stdin_arg != b->stdin_arg || a->timeout != b->timeout
+        || a->max_concurrent != b->max_concurrent || a->compress != b->compress
+        || a->uid != b->uid || a->gid != b->gid || a->index != b->index) {
+        diag("%s:%d: settings differ", a->file, a->lineno);
+        return false;
+    }
+    if ((a->logmask == NULL) != (b->logmask == NULL)) {
+        diag("%s:%d: logmask differs", a->file, a->lineno);
+        return false;
+    }
+    for (i = 0; a->logmask != NULL && a->logmask[i] != 0; i++)
+        if (a->logmask[i] != b->logmask[i]) {
+            diag("%s:%d: logmask differs", a->file, a->lineno);
+            return false;
+        }
+    for (i = 0; a->acls[i] != NULL; i++)
+        if (!same_string(a->acls[i], b->acls[i])) {
+            diag("%s:%d: ACL %lu differs", a->file, a->lineno,
+                 (unsigned long) i);
+            return false;
+        }
+    if (b->acls[i] != NULL) {
+        diag("%s:%d: ACLs differ", a->file, a->lineno);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Compare two configurations, returning true if all of their rules are the
+ * same.
+ */
+static bool
+same_config(const struct config *a, const struct config *b)
+{
+    size_t i;
+
+    if (a->count != b->count) {
+        diag("%lu rules != %lu rules", (unsigned long) a->count,
+             (unsigned long) b->count);
+        return false;
+    }
+    for (i = 0; i < a->count; i++)
+        if (!same_rule(a->rules[i], b->rules[i]))
+            return false;
+    return true;
+}
+
+
+int
+main(void)
+{
+    struct config *text, *config;
+    char *tmpdir, *snapshot, *conf, *confdir, *path, *contents, *expected;
+
+    plan(22);
+    if (chdir(getenv("SOURCE")) < 0)
+        sysbail("can't chdir to SOURCE");
+    tmpdir = test_tmpdir();
+    basprintf(&snapshot, "%s/snapshot", tmpdir);
+
+    /* Compile a configuration and load it again from the snapshot. */
+    text = server_config_load("data/conf-test");
+    if (text == NULL)
+        bail("cannot load data/conf-test");
+    ok(server_snapshot_write(text, "data/conf-test", snapshot),
+       "Write snapshot of data/conf-test");
+    server_config_set_snapshot(snapshot);
+    errors_capture();
+    config = server_config_load("data/conf-test");
+    errors_uncapture();
+    ok(config != NULL, "Load snapshot of data/conf-test");
+    is_string(NULL, errors, "...without errors");
+    ok(same_config(text, config), "...with the same rules");
+    is_int(text->nsources, config->nsources, "...and the same sources");
+    ok(server_config_find(config, "foo", "bar") == config->rules[3],
+       "...and the rules are indexed");
+    ok(config->generation != text->generation, "...and a new generation");
+    server_config_free(config);
+
+    /* Using the snapshot for a different configuration file. */
+    errors_capture();
+    config = server_config_load("data/conf-nosummary");
+    errors_uncapture();
+    ok(config != NULL, "Load a different configuration");
+    is_int(1, config->count, "...from the configuration file");
+    basprintf(&expected, "configuration snapshot %s is out of date, reading"
+              " data/conf-nosummary\n", snapshot);
+    is_string(expected, errors, "...with a notice");
+    free(expected);
+    server_config_free(config);
+    server_config_free(text);
+
+    /*
+     * Build a configuration in the temporary directory with an included
+     * directory and a user option, and check that changes to the
+     * configuration file or to the included directory make the snapshot
+     * stale.
+     */
+    basprintf(&conf, "%s/snapshot.conf", tmpdir);
+    basprintf(&confdir, "%s/snapshot.d", tmpdir);
+    basprintf(&path, "%s/one", confdir);
+    if (mkdir(confdir, 0755) < 0)
+        sysbail("cannot create %s", confdir);
+    basprintf(&contents, "include %s\nmain ALL /bin/true user=root ANYUSER\n",
+              confdir);
+    write_file(conf, contents);
+    write_file(path, "one ALL /bin/true stdin=2 timeout=30 max_concurrent=2"
+               " compress=9 princ:a@EXAMPLE.ORG\n");
+    server_config_set_snapshot(NULL);
+    text = server_config_load(conf);
+    if (text == NULL)
+        bail("cannot load %s", conf);
+    is_int(3, text->nsources, "Files and included directory are sources");
+    ok(server_snapshot_write(text, conf, snapshot), "Write snapshot");
+    server_config_set_snapshot(snapshot);
+    errors_capture();
+    config = server_config_load(conf);
+    errors_uncapture();
+    is_string(NULL, errors, "...and load it without errors");
+    ok(config != NULL && same_config(text, config), "...with the same rules");
+    server_config_free(config);
+    server_config_free(text);
+    free(path);
+
+    /* Add a file to the included directory. */
+    basprintf(&path, "%s/two", confdir);
+    write_file(path, "two ALL /bin/true ANYUSER\n");
+    errors_capture();
+    config = server_config_load(conf);
+    errors_uncapture();
+    ok(config != NULL && config->count == 3,
+       "New file in included directory is seen");
+    ok(errors != NULL && strstr(errors, "out of date") != NULL,
+       "...after noticing the snapshot is out of date");
+    server_config_free(config);
+    unlink(path);
+    free(path);
+
+    /* Change the configuration file. */
+    text = server_config_load(conf);
+    server_snapshot_write(text, conf, snapshot);
+    server_config_free(text);
+    free(contents);
+    basprintf(&contents, "include %s\n", confdir);
+    write_file(conf, contents);
+    errors_capture();
+    config = server_config_load(conf);
+    errors_uncapture();
+    ok(config != NULL && config->count == 1,
+       "Change to the configuration file is seen");
+    ok(errors != NULL && strstr(errors, "out of date") != NULL,
+       "...after noticing the snapshot is out of date");
+    server_config_free(config);
+
+    /* An invalid snapshot is reported and ignored. */
+    write_file(snapshot, "remctlC\ngarbage");
+    errors_capture();
+    config = server_config_load(conf);
+    errors_uncapture();
+    ok(config != NULL && config->count == 1, "Invalid snapshot is ignored");
+    basprintf(&expected, "configuration snapshot %s is invalid\n", snapshot);
+    is_string(expected, errors, "...with an error");
+    free(expected);
+    server_config_free(config);
+
+    /* So is a missing one. */
+    unlink(snapshot);
+    errors_capture();
+    config = server_config_load(conf);
+    errors_uncapture();
+    ok(config != NULL && config->count == 1, "Missing snapshot is ignored");
+    ok(errors != NULL
+       && strncmp(errors, "cannot open configuration snapshot", 34) == 0,
+       "...with an error");
+    server_config_free(config);
+
+    /* Clean up. */
+    server_config_set_snapshot(NULL);
+    basprintf(&path, "%s/one", confdir);
+    unlink(path);
+    free(path);
+    rmdir(confdir);
+    unlink(conf);
+    free(contents);
+    free(confdir);
+    free(conf);
+    free(errors);
+    free(snapshot);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
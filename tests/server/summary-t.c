@@ -12,6 +12,8 @@
 #include <portable/system.h>
 #include <portable/uio.h>
 
+#include <time.h>
+
 #include <client/remctl.h>
 #include <tests/tap/basic.h>
 #include <tests/tap/kerberos.h>
@@ -19,6 +21,63 @@
 #include <tests/tap/remctl.h>
 
 
+/* The summaries in data/conf-summary, in configuration order. */
+static const char *const summaries[] = {
+    "one", "two", "three", "fail", "four"
+};
+#define SUMMARY_COUNT (sizeof(summaries) / sizeof(summaries[0]))
+
+
+/*
+ * Run the help command over an already open connection and parse its output
+ * as lines of the summary name and the process ID of the summary program.
+ * Returns the exit status, or -2 on any error.
+ */
+static int
+run_help(struct remctl *r, char names[][16], long pids[], size_t count)
+{
+    const char *command[] = { "help", NULL };
+    struct remctl_output *output;
+    char buffer[BUFSIZ] = "";
+    size_t length = 0;
+    size_t i;
+    char *line;
+
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        return -2;
+    }
+    for (;;) {
+        output = remctl_output(r);
+        if (output == NULL) {
+            diag("remctl error %s", remctl_error(r));
+            return -2;
+        }
+        if (output->type == REMCTL_OUT_STATUS)
+            break;
+        if (output->type != REMCTL_OUT_OUTPUT) {
+            diag("unexpected output type %d", (int) output->type);
+            return -2;
+        }
+        if (output->length >= sizeof(buffer) - length)
+            return -2;
+        memcpy(buffer + length, output->data, output->length);
+        length += output->length;
+        buffer[length] = '\0';
+    }
+    line = buffer;
+    for (i = 0; i < count; i++) {
+        if (sscanf(line, "%15s %ld", names[i], &pids[i]) != 2)
+            return -2;
+        line = strchr(line, '\n');
+        if (line == NULL)
+            return -2;
+        line++;
+    }
+    return output->status;
+}
+
+
 int
 main(void)
 {
@@ -26,11 +85,16 @@ main(void)
     struct remctl_result *result;
     struct process *remctld;
     const char *test[] = { "help", NULL };
+    struct remctl *r;
+    char names[SUMMARY_COUNT][16];
+    long pids[SUMMARY_COUNT], first[SUMMARY_COUNT];
+    time_t start;
+    size_t i;
 
     /* Unless we have Kerberos available, we can't really do anything. */
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
 
-    plan(12);
+    plan(20);
 
     /* Run the tests with summaries. */
     remctld = remctld_start(config, "data/conf-simple", NULL);
@@ -64,5 +128,36 @@ main(void)
     remctl_result_free(result);
     process_stop(remctld);
 
+    /*
+     * Run the tests with several summary programs, each of which takes a
+     * second to run.  They should be run in parallel, their output should be
+     * in configuration order, and successful output should be cached for the
+     * next request on the same connection.
+     */
+    remctld = remctld_start(config, "data/conf-summary", NULL);
+    r = remctl_new();
+    ok(remctl_open(r, "localhost", 14373, config->principal),
+       "Connect for parallel summaries");
+    start = time(NULL);
+    is_int(1, run_help(r, names, pids, SUMMARY_COUNT),
+           "...summary returns the failing status");
+    ok(time(NULL) - start < 4, "...and runs the summaries in parallel");
+    for (i = 0; i < SUMMARY_COUNT; i++)
+        if (strcmp(names[i], summaries[i]) != 0)
+            break;
+    is_int(SUMMARY_COUNT, i, "...and output is in configuration order");
+    memcpy(first, pids, sizeof(pids));
+    is_int(1, run_help(r, names, pids, SUMMARY_COUNT),
+           "Second summary returns the failing status");
+    for (i = 0; i < SUMMARY_COUNT; i++)
+        if (strcmp(names[i], summaries[i]) != 0)
+            break;
+    is_int(SUMMARY_COUNT, i, "...and output is in configuration order");
+    ok(pids[0] == first[0] && pids[1] == first[1] && pids[2] == first[2]
+       && pids[4] == first[4], "...and successful output was cached");
+    ok(pids[3] != first[3], "...but failing output was not");
+    remctl_close(r);
+    process_stop(remctld);
+
     return 0;
 }
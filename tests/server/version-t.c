@@ -60,6 +60,14 @@ main(void)
         bail("remctl_new returned NULL");
     ok(remctl_open(r, "localhost", 14373, config->principal), "remctl_open");
 
+    /* Skip the reply to the capabilities sent by remctl_open. */
+    status = token_recv_priv(r->fd, &r->buffer, r->context, &flags, &tok,
+                             1024 * 64, 0, &major, &minor);
+    if (status != TOKEN_OK)
+        bail("cannot read capabilities reply");
+    gss_release_buffer(&minor, &tok);
+    r->capabilities_pending = false;
+
     /* Send the command token. */
     tok.length = sizeof(token);
     tok.value = (char *) token;
@@ -69,14 +77,14 @@ main(void)
         bail("cannot send token");
 
     /* Accept the remote token. */
-    status = token_recv_priv(r->fd, r->context, &flags, &tok, 1024 * 64, 0,
-                             &major, &minor);
+    status = token_recv_priv(r->fd, &r->buffer, r->context, &flags, &tok,
+                             1024 * 64, 0, &major, &minor);
     is_int(TOKEN_OK, status, "received token correctly");
     is_int(TOKEN_DATA | TOKEN_PROTOCOL, flags, "token had correct flags");
     is_int(3, tok.length, "token had correct length");
     is_int(2, ((char *) tok.value)[0], "protocol version is 2");
     is_int(MESSAGE_VERSION, ((char *) tok.value)[1], "message version code");
-    is_int(3, ((char *) tok.value)[2], "highest supported version is 3");
+    is_int(4, ((char *) tok.value)[2], "highest supported version is 4");
 
     /*
      * Send the token again and get another response to ensure that the server
@@ -87,8 +95,8 @@ main(void)
     is_int(TOKEN_OK, status, "connection is still open");
     gss_release_buffer(&minor, &tok);
     if (status == TOKEN_OK) {
-        status = token_recv_priv(r->fd, r->context, &flags, &tok, 1024 * 64,
-                                 0, &major, &minor);
+        status = token_recv_priv(r->fd, &r->buffer, r->context, &flags,
+                                 &tok, 1024 * 64, 0, &major, &minor);
         is_int(TOKEN_OK, status, "received token correctly");
         gss_release_buffer(&minor, &tok);
     } else {
@@ -33,6 +33,7 @@
 #include <config.h>
 #include <portable/system.h>
 
+#include <client/remctl.h>
 #include <tests/tap/basic.h>
 #include <tests/tap/kerberos.h>
 #include <tests/tap/macros.h>
@@ -150,3 +151,45 @@ remctld_start_fakeroot(struct kerberos_config *krbconf, const char *config,
     va_end(args);
     return process;
 }
+
+
+/*
+ * Run the test test command over an already open connection and check the
+ * output, returning true if it was correct.
+ */
+int
+run_test_command(struct remctl *r)
+{
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+    bool okay = false;
+
+    if (!remctl_command(r, command)) {
+        diag("remctl error %s", remctl_error(r));
+        return false;
+    }
+    do {
+        output = remctl_output(r);
+        if (output == NULL) {
+            diag("remctl error %s", remctl_error(r));
+            return false;
+        }
+        switch (output->type) {
+        case REMCTL_OUT_OUTPUT:
+            okay = (output->length == 12
+                    && memcmp(output->data, "hello world\n", 12) == 0);
+            break;
+        case REMCTL_OUT_STATUS:
+            okay = okay && (output->status == 0);
+            break;
+        case REMCTL_OUT_ERROR:
+            diag("test test returned error: %.*s", (int) output->length,
+                 output->data);
+            return false;
+        case REMCTL_OUT_DONE:
+            diag("unexpected done token");
+            return false;
+        }
+    } while (output->type == REMCTL_OUT_OUTPUT);
+    return okay;
+}
@@ -44,6 +44,9 @@ struct kerberos_config;
 /* Opaque struct with process tracking data. */
 struct process;
 
+/* Defined in <client/remctl.h>. */
+struct remctl;
+
 BEGIN_DECLS
 
 /*
@@ -75,6 +78,15 @@ struct process *remctld_start_fakeroot(struct kerberos_config *,
                                        const char *config, ...)
     __attribute__((__nonnull__(1, 2)));
 
+/*
+ * Run the test test command, which prints "hello world", over an already open
+ * connection.  Returns true if the command succeeded with the right output
+ * and false otherwise, including if it was rejected, reporting the reason
+ * with diag.
+ */
+int run_test_command(struct remctl *)
+    __attribute__((__nonnull__));
+
 END_DECLS
 
 #endif /* !TAP_REMCTL_H */
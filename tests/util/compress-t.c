@@ -0,0 +1,117 @@
+/*
+ * Test suite for compression of command output.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <tests/tap/basic.h>
+#include <util/compress.h>
+
+
+/*
+ * Compress the given string as a single iovec and decompress it again,
+ * checking that the result matches.  Returns the compressed length.
+ */
+static size_t
+round_trip(struct compressor *compressor, struct decompressor *decompressor,
+           const char *string)
+{
+    struct iovec iov;
+    char *compressed, *output;
+    size_t length, size;
+
+    iov.iov_base = (char *) string;
+    iov.iov_len = strlen(string);
+    ok(compressor_run(compressor, &iov, 1, &compressed, &length),
+       "compress %s", string);
+    ok(decompressor_run(decompressor, compressed, length, iov.iov_len,
+                        &output, &size),
+       "...and decompress");
+    is_int(iov.iov_len, size, "...with the right length");
+    ok(memcmp(output, string, size) == 0, "...and the right data");
+    free(compressed);
+    free(output);
+    return length;
+}
+
+
+int
+main(void)
+{
+    struct compressor *compressor;
+    struct decompressor *decompressor;
+    struct iovec iov[3];
+    char *compressed, *output, *data;
+    size_t length, size, first;
+
+#ifndef HAVE_ZSTD
+    skip_all("not built with Zstandard support");
+#endif
+
+    plan(23);
+
+    compressor = compressor_new(3);
+    ok(compressor != NULL, "compressor_new");
+    decompressor = decompressor_new();
+    ok(decompressor != NULL, "decompressor_new");
+    if (compressor == NULL || decompressor == NULL)
+        bail("cannot create compression state");
+
+    /* Repeated output should compress better the second time. */
+    first = round_trip(compressor, decompressor, "hello world hello world");
+    length = round_trip(compressor, decompressor, "hello world hello world");
+    ok(length < first, "later output refers back to earlier output");
+
+    /* Several iovecs are compressed as one piece of output. */
+    iov[0].iov_base = (char *) "foo ";
+    iov[0].iov_len = 4;
+    iov[1].iov_base = (char *) "bar ";
+    iov[1].iov_len = 4;
+    iov[2].iov_base = (char *) "baz";
+    iov[2].iov_len = 3;
+    ok(compressor_run(compressor, iov, 3, &compressed, &length),
+       "compress multiple iovecs");
+    ok(decompressor_run(decompressor, compressed, length, 11, &output, &size),
+       "...and decompress");
+    is_int(11, size, "...with the right length");
+    ok(memcmp(output, "foo bar baz", size) == 0, "...and the right data");
+    free(compressed);
+    free(output);
+
+    /* Output larger than the maximum is rejected. */
+    data = bcalloc(1, 64 * 1024);
+    iov[0].iov_base = data;
+    iov[0].iov_len = 64 * 1024;
+    ok(compressor_run(compressor, iov, 1, &compressed, &length),
+       "compress 64KB of nuls");
+    ok(length < 1024, "...which compresses well");
+    ok(!decompressor_run(decompressor, compressed, length, 64 * 1024 - 1,
+                         &output, &size),
+       "...and decompressing it fails with a lower maximum");
+    free(compressed);
+    free(data);
+
+    /*
+     * After a reset, the decompressor expects a new stream, so use a new
+     * compressor as the server would for a new command.
+     */
+    compressor_free(compressor);
+    compressor = compressor_new(1);
+    decompressor_reset(decompressor);
+    round_trip(compressor, decompressor, "new stream");
+
+    /* Garbage is rejected. */
+    decompressor_reset(decompressor);
+    ok(!decompressor_run(decompressor, "garbage", 7, 1024, &output, &size),
+       "invalid data is rejected");
+
+    compressor_free(compressor);
+    decompressor_free(decompressor);
+    compressor_free(NULL);
+    decompressor_free(NULL);
+    return 0;
+}
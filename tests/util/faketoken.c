@@ -12,6 +12,7 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
 #include <time.h>
 
@@ -19,8 +20,10 @@
 #include <util/tokens.h>
 
 enum token_status fake_token_send(socket_type, int, gss_buffer_t, time_t);
-enum token_status fake_token_recv(socket_type, int *, gss_buffer_t, size_t,
-                                  time_t);
+enum token_status fake_token_sendv(socket_type, int, const struct iovec *,
+                                   size_t, time_t);
+enum token_status fake_token_recv(socket_type, struct token_buffer *, int *,
+                                  gss_buffer_t, size_t, time_t);
 
 /*
  * The token and flags are actually read from or written to these variables.
@@ -54,12 +57,40 @@ fake_token_send(socket_type fd UNUSED, int flags, gss_buffer_t tok,
 }
 
 
+/*
+ * Accept a vectored token write request and store the concatenated data into
+ * the buffer.
+ */
+enum token_status
+fake_token_sendv(socket_type fd UNUSED, int flags, const struct iovec *iov,
+                 size_t count, time_t timeout)
+{
+    size_t length = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (iov[i].iov_len > sizeof(send_buffer) - length)
+            return TOKEN_FAIL_SYSTEM;
+        length += iov[i].iov_len;
+    }
+    if (fail_timeout && timeout > 0)
+        return TOKEN_FAIL_TIMEOUT;
+    send_flags = flags;
+    send_length = 0;
+    for (i = 0; i < count; i++) {
+        memcpy(send_buffer + send_length, iov[i].iov_base, iov[i].iov_len);
+        send_length += iov[i].iov_len;
+    }
+    return TOKEN_OK;
+}
+
+
 /*
  * Receive a token from the stored buffer and return it.
  */
 enum token_status
-fake_token_recv(socket_type fd UNUSED, int *flags, gss_buffer_t tok,
-                size_t max, time_t timeout)
+fake_token_recv(socket_type fd UNUSED, struct token_buffer *buffer UNUSED,
+                int *flags, gss_buffer_t tok, size_t max, time_t timeout)
 {
     if (recv_length > max)
         return TOKEN_FAIL_LARGE;
@@ -105,7 +105,7 @@ main(void)
     memcpy(recv_buffer, send_buffer, send_length);
     recv_length = send_length;
     recv_flags = send_flags;
-    status = token_recv_priv(0, client_ctx, &flags, &client_tok, 1024, 0,
+    status = token_recv_priv(0, NULL, client_ctx, &flags, &client_tok, 1024, 0,
                              &s_stat, &c_min_stat);
     is_int(TOKEN_OK, status, "received the token");
     is_int(5, client_tok.length, "...with the right length");
@@ -126,7 +126,7 @@ main(void)
     recv_length = server_tok.length;
     memcpy(recv_buffer, server_tok.value, server_tok.length);
     gss_release_buffer(&c_min_stat, &server_tok);
-    status = token_recv_priv(0, server_ctx, &flags, &server_tok, 1024, 0,
+    status = token_recv_priv(0, NULL, server_ctx, &flags, &server_tok, 1024, 0,
                              &s_stat, &s_min_stat);
     is_int(TOKEN_OK, status, "received a fake token");
     is_int(5, flags, "...with the right flags");
@@ -150,7 +150,7 @@ main(void)
     memcpy(recv_buffer, send_buffer, send_length);
     recv_length = send_length;
     recv_flags = send_flags;
-    status = token_recv_priv(0, client_ctx, &flags, &client_tok, 1024,0,
+    status = token_recv_priv(0, NULL, client_ctx, &flags, &client_tok, 1024,0,
                              &c_stat, &c_min_stat);
     is_int(TOKEN_OK, status, "received protocol v1 token with MIC");
     is_int(TOKEN_DATA, flags, "...with the right flags");
@@ -175,19 +175,19 @@ main(void)
     status = token_send_priv(0, client_ctx, 3, &server_tok, 1, &s_stat,
                              &c_min_stat);
     is_int(TOKEN_FAIL_TIMEOUT, status, "sending a token with timeout");
-    status = token_recv_priv(0, client_ctx, &flags, &client_tok, 1024, 1,
+    status = token_recv_priv(0, NULL, client_ctx, &flags, &client_tok, 1024, 1,
                              &s_stat, &c_min_stat);
     is_int(TOKEN_FAIL_TIMEOUT, status, "receiving a token with timeout");
     fail_timeout = false;
 
     /* Test receiving too large of a token. */
-    status = token_recv_priv(0, client_ctx, &flags, &client_tok, 4, 0,
+    status = token_recv_priv(0, NULL, client_ctx, &flags, &client_tok, 4, 0,
                              &s_stat, &s_min_stat);
     is_int(TOKEN_FAIL_LARGE, status, "receiving too large of a token");
 
     /* Test receiving a corrupt token. */
     recv_length = 4;
-    status = token_recv_priv(0, client_ctx, &flags, &client_tok, 1024, 0,
+    status = token_recv_priv(0, NULL, client_ctx, &flags, &client_tok, 1024, 0,
                              &s_stat, &s_min_stat);
     is_int(TOKEN_FAIL_GSSAPI, status, "receiving a corrupt token");
 
@@ -33,6 +33,10 @@
 #include <portable/socket.h>
 
 #include <errno.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <signal.h>
 
@@ -428,11 +432,52 @@ test_network_write(void)
 }
 
 
+/*
+ * Test that reads, writes, and waits with timeouts work on file descriptors
+ * too large to be used with select.  Skip the test if our resource limits
+ * don't allow such large file descriptors.
+ */
+static void
+test_high_fd(void)
+{
+    int fds[2];
+    socket_type high;
+    struct rlimit rl;
+    char buffer[4];
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur <= FD_SETSIZE + 1) {
+        skip_block(4, "file descriptor limit too low");
+        return;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        sysbail("cannot create socketpair");
+    high = dup2(fds[0], FD_SETSIZE);
+    if (high == INVALID_SOCKET)
+        sysbail("cannot duplicate socket to %d", FD_SETSIZE);
+    close(fds[0]);
+
+    /* Set an alarm just in case our timeouts don't work. */
+    alarm(10);
+    ok(network_write(high, "one\n", 4, 1), "network_write on high fd");
+    ok(network_read(fds[1], buffer, sizeof(buffer), 1), "...and read back");
+    if (write(fds[1], "two\n", 4) < 4)
+        sysbail("cannot write to socketpair");
+    is_int(high, network_wait_any(&high, 1), "network_wait_any on high fd");
+    ok(network_read(high, buffer, sizeof(buffer), 1)
+       && memcmp(buffer, "two\n", 4) == 0, "network_read on high fd");
+    alarm(0);
+
+    /* Clean up. */
+    close(high);
+    close(fds[1]);
+}
+
+
 int
 main(void)
 {
     /* Set up the plan. */
-    plan(22);
+    plan(26);
 
     /* Test network_client_create. */
     test_create_ipv4(NULL);
@@ -444,5 +489,8 @@ main(void)
     /* Test network_read and network_write. */
     test_network_read();
     test_network_write();
+
+    /* Test that there is no limit on the file descriptor number. */
+    test_high_fd();
     return 0;
 }
@@ -496,11 +496,39 @@ test_any_udp(void)
 }
 
 
+/*
+ * Bind two sockets to the same port with SO_REUSEPORT and check that both can
+ * listen.  This produces three tests.
+ */
+static void
+test_reuseport(void)
+{
+    socket_type fd1, fd2;
+
+    if (!network_bind_set_reuseport(true)) {
+        skip_block(3, "SO_REUSEPORT not supported");
+        return;
+    }
+    fd1 = network_bind_ipv4(SOCK_STREAM, "127.0.0.1", 11119);
+    if (fd1 == INVALID_SOCKET)
+        sysbail("cannot create or bind socket");
+    ok(listen(fd1, 1) == 0, "first SO_REUSEPORT socket listens");
+    fd2 = network_bind_ipv4(SOCK_STREAM, "127.0.0.1", 11119);
+    ok(fd2 != INVALID_SOCKET, "second socket binds the same port");
+    ok(fd2 != INVALID_SOCKET && listen(fd2, 1) == 0,
+       "second SO_REUSEPORT socket listens");
+    network_bind_set_reuseport(false);
+    socket_close(fd1);
+    if (fd2 != INVALID_SOCKET)
+        socket_close(fd2);
+}
+
+
 int
 main(void)
 {
     /* Set up the plan. */
-    plan(42);
+    plan(45);
 
     /* Test network_bind functions. */
     test_ipv4(NULL);
@@ -525,5 +553,8 @@ main(void)
 
     /* Test UDP socket handling and network_wait_any. */
     test_any_udp();
+
+    /* Test sharing a port with SO_REUSEPORT. */
+    test_reuseport();
     return 0;
 }
@@ -12,6 +12,7 @@
 #include <portable/system.h>
 #include <portable/gssapi.h>
 #include <portable/socket.h>
+#include <portable/uio.h>
 
 #include <fcntl.h>
 #ifdef HAVE_SYS_SELECT_H
@@ -131,6 +132,25 @@ send_regular_token(socket_type fd)
 }
 
 
+/*
+ * Send the same token via token_sendv, split across several iovecs including
+ * an empty one, with a timeout so that the non-blocking path is used.
+ */
+static void
+send_vectored_token(socket_type fd)
+{
+    struct iovec iov[3];
+
+    iov[0].iov_base = (char *) "he";
+    iov[0].iov_len = 2;
+    iov[1].iov_base = (char *) "";
+    iov[1].iov_len = 0;
+    iov[2].iov_base = (char *) "llo";
+    iov[2].iov_len = 3;
+    token_sendv(fd, 3, iov, 3, 1);
+}
+
+
 int
 main(void)
 {
@@ -140,10 +160,12 @@ main(void)
     char buffer[20];
     ssize_t length;
     gss_buffer_desc result;
+    struct token_buffer tbuf;
+    char *large;
 
     alarm(20);
 
-    plan(12);
+    plan(23);
     if (chdir(getenv("BUILD")) < 0)
         sysbail("can't chdir to BUILD");
 
@@ -165,6 +187,24 @@ main(void)
         socket_close(client);
     }
 
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server = create_server();
+        send_vectored_token(server);
+        socket_close(server);
+        exit(0);
+    } else {
+        client = create_client();
+        length = read(client, buffer, 12);
+        is_int(10, length, "received vectored token has correct length");
+        ok(memcmp(buffer, token, 10) == 0, "...and correct data");
+        waitpid(child, NULL, 0);
+        socket_close(client);
+    }
+
     unlink("server-ready");
     child = fork();
     if (child < 0)
@@ -176,7 +216,7 @@ main(void)
         exit(0);
     } else {
         client = create_client();
-        status = token_recv(client, &flags, &result, 5, 0);
+        status = token_recv(client, NULL, &flags, &result, 5, 0);
         is_int(TOKEN_OK, status, "received hand-rolled token");
         is_int(3, flags, "...with right flags");
         is_int(5, result.length, "...and right length");
@@ -198,7 +238,7 @@ main(void)
         exit(0);
     } else {
         client = create_client();
-        status = token_recv(client, &flags, &result, 200, 0);
+        status = token_recv(client, NULL, &flags, &result, 200, 0);
         is_int(TOKEN_FAIL_EOF, status, "receive invalid token");
         waitpid(child, NULL, 0);
         socket_close(client);
@@ -216,7 +256,7 @@ main(void)
         exit(0);
     } else {
         client = create_client();
-        status = token_recv(client, &flags, &result, 4, 0);
+        status = token_recv(client, NULL, &flags, &result, 4, 0);
         is_int(TOKEN_FAIL_LARGE, status, "receive too-large token");
         waitpid(child, NULL, 0);
         socket_close(client);
@@ -233,12 +273,62 @@ main(void)
         exit(0);
     } else {
         client = create_client();
-        status = token_recv(client, &flags, &result, 4, 0);
+        status = token_recv(client, NULL, &flags, &result, 4, 0);
         is_int(TOKEN_FAIL_EOF, status, "receive end of file");
         waitpid(child, NULL, 0);
         socket_close(client);
     }
 
+    /*
+     * Send two small tokens followed by one larger than the read buffer in a
+     * single write, and then read them with a buffer.
+     */
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server = create_server();
+        large = bmalloc(5 + 100 * 1024);
+        memcpy(large, token, 5);
+        large[2] = 0x01;
+        large[3] = (char) 0x90;
+        large[4] = 0;
+        memset(large + 5, 'a', 100 * 1024);
+        send_hand_token(server);
+        send_hand_token(server);
+        socket_xwrite(server, large, 5 + 100 * 1024);
+        free(large);
+        socket_close(server);
+        exit(0);
+    } else {
+        memset(&tbuf, 0, sizeof(tbuf));
+        client = create_client();
+        status = token_recv(client, &tbuf, &flags, &result, 5, 0);
+        is_int(TOKEN_OK, status, "received first buffered token");
+        ok(result.length == 5 && memcmp(result.value, "hello", 5) == 0,
+           "...with right data");
+        free(result.value);
+        status = token_recv(client, &tbuf, &flags, &result, 5, 0);
+        is_int(TOKEN_OK, status, "received second buffered token");
+        is_int(3, flags, "...with right flags");
+        ok(result.length == 5 && memcmp(result.value, "hello", 5) == 0,
+           "...and right data");
+        free(result.value);
+        status = token_recv(client, &tbuf, &flags, &result, 200 * 1024, 0);
+        is_int(TOKEN_OK, status, "received token larger than buffer");
+        is_int(100 * 1024, result.length, "...with right length");
+        large = result.value;
+        ok(large[0] == 'a' && large[100 * 1024 - 1] == 'a',
+           "...and right data");
+        free(result.value);
+        status = token_recv(client, &tbuf, &flags, &result, 200, 0);
+        is_int(TOKEN_FAIL_EOF, status, "...and then end of file");
+        token_buffer_free(&tbuf);
+        waitpid(child, NULL, 0);
+        socket_close(client);
+    }
+
     /*
      * Test a timeout on sending a token.  We have to send a large enough
      * token that the network layer doesn't just buffer it.
@@ -276,7 +366,7 @@ main(void)
         exit(0);
     } else {
         client = create_client();
-        status = token_recv(client, &flags, &result, 200, 1);
+        status = token_recv(client, NULL, &flags, &result, 200, 1);
         is_int(TOKEN_FAIL_TIMEOUT, status, "can't receive due to timeout");
         socket_close(client);
         waitpid(child, NULL, 0);
@@ -0,0 +1,282 @@
+/*
+ * Compression of command output.
+ *
+ * Wrappers around the Zstandard streaming API, used to compress command
+ * output sent to the client in protocol version four.  All output for one
+ * command is compressed as a single stream so that later output can refer
+ * back to earlier output, but each piece is flushed as it's compressed so
+ * that the client can return it as soon as it arrives.
+ *
+ * If remctl was built without Zstandard, the constructors always return NULL
+ * and the client and server never agree on compression.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#include <util/compress.h>
+#include <util/macros.h>
+
+#ifdef HAVE_ZSTD
+
+struct compressor {
+    ZSTD_CCtx *ctx;
+};
+
+struct decompressor {
+    ZSTD_DCtx *ctx;
+};
+
+
+/*
+ * Double the size of the buffer for output from the Zstandard library, but
+ * not beyond max.  Returns false if the buffer is already that large or if
+ * memory allocation fails.
+ */
+static bool
+grow_buffer(ZSTD_outBuffer *output, size_t max)
+{
+    size_t size;
+    void *buffer;
+
+    if (output->size >= max)
+        return false;
+    size = (output->size > max / 2) ? max : output->size * 2;
+    buffer = realloc(output->dst, size);
+    if (buffer == NULL)
+        return false;
+    output->dst = buffer;
+    output->size = size;
+    return true;
+}
+
+
+/*
+ * Create a new compressor using the given compression level.  Returns NULL
+ * on failure.
+ */
+struct compressor *
+compressor_new(int level)
+{
+    struct compressor *compressor;
+    size_t status;
+
+    compressor = malloc(sizeof(struct compressor));
+    if (compressor == NULL)
+        return NULL;
+    compressor->ctx = ZSTD_createCCtx();
+    if (compressor->ctx == NULL) {
+        free(compressor);
+        return NULL;
+    }
+    status = ZSTD_CCtx_setParameter(compressor->ctx, ZSTD_c_compressionLevel,
+                                    level);
+    if (ZSTD_isError(status)) {
+        compressor_free(compressor);
+        return NULL;
+    }
+    return compressor;
+}
+
+
+/*
+ * Compress the data in the iovecs, flushing at the end.  The output buffer
+ * starts at the worst-case size for the input, which it should never need
+ * to exceed, but grow it if necessary.  Returns false on failure.
+ */
+bool
+compressor_run(struct compressor *compressor, const struct iovec *data,
+               int count, char **out, size_t *length)
+{
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    ZSTD_EndDirective mode;
+    size_t size = 0;
+    size_t status = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        size += data[i].iov_len;
+    output.size = ZSTD_compressBound(size);
+    output.pos = 0;
+    output.dst = malloc(output.size);
+    if (output.dst == NULL)
+        return false;
+    for (i = 0; i < count; i++) {
+        input.src = data[i].iov_base;
+        input.size = data[i].iov_len;
+        input.pos = 0;
+        mode = (i == count - 1) ? ZSTD_e_flush : ZSTD_e_continue;
+        do {
+            if (output.pos == output.size)
+                if (!grow_buffer(&output, (size_t) -1))
+                    goto fail;
+            status = ZSTD_compressStream2(compressor->ctx, &output, &input,
+                                          mode);
+            if (ZSTD_isError(status))
+                goto fail;
+        } while (input.pos < input.size || (mode == ZSTD_e_flush && status));
+    }
+    *out = output.dst;
+    *length = output.pos;
+    return true;
+
+fail:
+    ZSTD_CCtx_reset(compressor->ctx, ZSTD_reset_session_only);
+    free(output.dst);
+    return false;
+}
+
+
+/*
+ * Free a compressor.
+ */
+void
+compressor_free(struct compressor *compressor)
+{
+    if (compressor == NULL)
+        return;
+    ZSTD_freeCCtx(compressor->ctx);
+    free(compressor);
+}
+
+
+/*
+ * Create a new decompressor.  Returns NULL on failure.
+ */
+struct decompressor *
+decompressor_new(void)
+{
+    struct decompressor *decompressor;
+
+    decompressor = malloc(sizeof(struct decompressor));
+    if (decompressor == NULL)
+        return NULL;
+    decompressor->ctx = ZSTD_createDCtx();
+    if (decompressor->ctx == NULL) {
+        free(decompressor);
+        return NULL;
+    }
+    return decompressor;
+}
+
+
+/*
+ * Decompress some data.  The output buffer is allowed to grow to one more
+ * than the maximum so that we can tell the difference between output that
+ * is exactly the maximum and output that's too large.  Returns false on
+ * failure.
+ */
+bool
+decompressor_run(struct decompressor *decompressor, const void *data,
+                 size_t size, size_t max, char **out, size_t *length)
+{
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    size_t status;
+
+    input.src = data;
+    input.size = size;
+    input.pos = 0;
+    output.size = ZSTD_DStreamOutSize();
+    if (output.size > max + 1)
+        output.size = max + 1;
+    output.pos = 0;
+    output.dst = malloc(output.size);
+    if (output.dst == NULL)
+        return false;
+    do {
+        if (output.pos == output.size)
+            if (!grow_buffer(&output, max + 1))
+                goto fail;
+        status = ZSTD_decompressStream(decompressor->ctx, &output, &input);
+        if (ZSTD_isError(status))
+            goto fail;
+    } while (input.pos < input.size || output.pos == output.size);
+    if (output.pos > max)
+        goto fail;
+    *out = output.dst;
+    *length = output.pos;
+    return true;
+
+fail:
+    free(output.dst);
+    return false;
+}
+
+
+/*
+ * Reset a decompressor to start decompressing a new stream.
+ */
+void
+decompressor_reset(struct decompressor *decompressor)
+{
+    ZSTD_DCtx_reset(decompressor->ctx, ZSTD_reset_session_only);
+}
+
+
+/*
+ * Free a decompressor.
+ */
+void
+decompressor_free(struct decompressor *decompressor)
+{
+    if (decompressor == NULL)
+        return;
+    ZSTD_freeDCtx(decompressor->ctx);
+    free(decompressor);
+}
+
+#else /* !HAVE_ZSTD */
+
+struct compressor *
+compressor_new(int level UNUSED)
+{
+    return NULL;
+}
+
+bool
+compressor_run(struct compressor *compressor UNUSED,
+               const struct iovec *data UNUSED, int count UNUSED,
+               char **out UNUSED, size_t *length UNUSED)
+{
+    return false;
+}
+
+void
+compressor_free(struct compressor *compressor UNUSED)
+{
+}
+
+struct decompressor *
+decompressor_new(void)
+{
+    return NULL;
+}
+
+bool
+decompressor_run(struct decompressor *decompressor UNUSED,
+                 const void *data UNUSED, size_t size UNUSED,
+                 size_t max UNUSED, char **out UNUSED, size_t *length UNUSED)
+{
+    return false;
+}
+
+void
+decompressor_reset(struct decompressor *decompressor UNUSED)
+{
+}
+
+void
+decompressor_free(struct decompressor *decompressor UNUSED)
+{
+}
+
+#endif /* !HAVE_ZSTD */
@@ -0,0 +1,85 @@
+/*
+ * Prototypes for compression of command output.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef UTIL_COMPRESS_H
+#define UTIL_COMPRESS_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+#include <sys/types.h>
+
+/* Forward declarations to avoid unnecessary includes. */
+struct iovec;
+
+/* Opaque state for compressing or decompressing a stream of output. */
+struct compressor;
+struct decompressor;
+
+/*
+ * Compression methods, used as bits when the client and server agree on one.
+ * COMPRESS_METHODS is the set this build supports, which may be empty.
+ */
+#define COMPRESS_ZSTD 0x01
+#ifdef HAVE_ZSTD
+# define COMPRESS_METHODS COMPRESS_ZSTD
+#else
+# define COMPRESS_METHODS 0
+#endif
+
+/* The highest compression level that may be configured. */
+#define COMPRESS_MAX_LEVEL 22
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all util functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Create a new compressor using the given compression level, or return NULL
+ * if that isn't possible, including when built without compression support.
+ */
+struct compressor *compressor_new(int level);
+
+/*
+ * Compress the concatenation of the provided iovecs and flush the result, so
+ * that everything compressed so far can be decompressed from the output.
+ * The output is stored in newly allocated memory in out and its length in
+ * length.  Returns false on failure.
+ */
+bool compressor_run(struct compressor *, const struct iovec *, int count,
+                    char **out, size_t *length);
+
+/* Free a compressor.  Does nothing if passed NULL. */
+void compressor_free(struct compressor *);
+
+/*
+ * Create a new decompressor, or return NULL if that isn't possible, including
+ * when built without compression support.
+ */
+struct decompressor *decompressor_new(void);
+
+/*
+ * Decompress data produced by compressor_run, which may be only part of its
+ * output.  The decompressed data is stored in newly allocated memory in out
+ * and its length in length, and may be empty.  Fails if the data is invalid
+ * or would decompress to more than max octets.  Returns false on failure.
+ */
+bool decompressor_run(struct decompressor *, const void *data, size_t size,
+                      size_t max, char **out, size_t *length);
+
+/* Start decompressing a new stream of output. */
+void decompressor_reset(struct decompressor *);
+
+/* Free a decompressor.  Does nothing if passed NULL. */
+void decompressor_free(struct decompressor *);
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* UTIL_COMPRESS_H */
@@ -19,7 +19,9 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
+#include <errno.h>
 #include <time.h>
 
 #include <util/gss-tokens.h>
@@ -32,9 +34,12 @@
  */
 #if TESTING
 # define token_send fake_token_send
+# define token_sendv fake_token_sendv
 # define token_recv fake_token_recv
 enum token_status token_send(int, int, gss_buffer_t, time_t);
-enum token_status token_recv(int, int *, gss_buffer_t, size_t, time_t);
+enum token_status token_sendv(int, int, const struct iovec *, int, time_t);
+enum token_status token_recv(int, struct token_buffer *, int *, gss_buffer_t,
+                             size_t, time_t);
 #endif
 
 
@@ -46,9 +51,15 @@ enum token_status token_recv(int, int *, gss_buffer_t, size_t, time_t);
  * returned, the major and minor status variables will be set to something
  * useful.
  *
+ * The token may carry up to TOKEN_MAX_DATA_LARGE octets of data.  Callers
+ * are responsible for keeping to the maximum agreed with the other side,
+ * which is TOKEN_MAX_DATA unless a larger size has been negotiated.
+ *
  * As a hack to support remctl v1, look to see if the flags includes
  * TOKEN_SEND_MIC and don't include TOKEN_PROTOCOL.  If so, expect the remote
- * side to reply with a MIC, which we then verify.
+ * side to reply with a MIC, which we then verify.  The MIC is read without a
+ * read buffer, which is safe since a v1 client sends its command before the
+ * server has sent anything else and reads nothing past the MIC.
 */
 enum token_status
 token_send_priv(socket_type fd, gss_ctx_id_t ctx, int flags, gss_buffer_t tok,
@@ -58,7 +69,7 @@ token_send_priv(socket_type fd, gss_ctx_id_t ctx, int flags, gss_buffer_t tok,
     int state, micflags;
     enum token_status status;
 
-    if (tok->length > TOKEN_MAX_DATA)
+    if (tok->length > TOKEN_MAX_DATA_LARGE)
         return TOKEN_FAIL_LARGE;
     *major = gss_wrap(minor, ctx, 1, GSS_C_QOP_DEFAULT, tok, &state, &out);
     if (*major != GSS_S_COMPLETE)
@@ -68,7 +79,7 @@ token_send_priv(socket_type fd, gss_ctx_id_t ctx, int flags, gss_buffer_t tok,
     if (status != TOKEN_OK)
         return status;
     if ((flags & TOKEN_SEND_MIC) && !(flags & TOKEN_PROTOCOL)) {
-        status = token_recv(fd, &micflags, &mic, 10 * 1024, timeout);
+        status = token_recv(fd, NULL, &micflags, &mic, 10 * 1024, timeout);
         if (status != TOKEN_OK)
             return status;
         if (micflags != TOKEN_MIC) {
@@ -87,28 +98,156 @@ token_send_priv(socket_type fd, gss_ctx_id_t ctx, int flags, gss_buffer_t tok,
 
 
 /*
- * Receives and unwraps a data payload token.  Takes the file descriptor,
- * GSS-API context, a pointer into which to storge the flags, a buffer for the
- * message, and a place to put GSS-API major and minor status.  Returns
- * TOKEN_OK on success or one of the TOKEN_FAIL_* statuses on failure.  On
- * success, tok will contain newly allocated memory and should be freed when
- * no longer needed using gss_release_buffer.  On failure, any allocated
- * memory will be freed.
+ * Send a token whose data is gathered from an array of iovecs by copying the
+ * data into one buffer and calling token_send_priv.  Used when the GSS-API
+ * mechanism can't encrypt the data in place.
+ */
+static enum token_status
+sendv_copy(socket_type fd, gss_ctx_id_t ctx, int flags,
+           const struct iovec *data, size_t count, size_t length,
+           time_t timeout, OM_uint32 *major, OM_uint32 *minor)
+{
+    gss_buffer_desc tok;
+    enum token_status status;
+    size_t offset = 0;
+    size_t i;
+
+    tok.length = length;
+    tok.value = malloc(length > 0 ? length : 1);
+    if (tok.value == NULL)
+        return TOKEN_FAIL_SYSTEM;
+    for (i = 0; i < count; i++) {
+        memcpy((char *) tok.value + offset, data[i].iov_base, data[i].iov_len);
+        offset += data[i].iov_len;
+    }
+    status = token_send_priv(fd, ctx, flags, &tok, timeout, major, minor);
+    free(tok.value);
+    return status;
+}
+
+
+#ifdef HAVE_GSS_WRAP_IOV
+/*
+ * Encrypt the data in place with gss_wrap_iov and send it, along with the
+ * header, padding, and trailer allocated by the GSS-API library, with a
+ * single vectored write.  The result on the wire is the same as gss_wrap
+ * would produce.  Returns the same values as token_send_priv, except that
+ * major is set to GSS_S_UNAVAILABLE and TOKEN_FAIL_GSSAPI is returned if the
+ * mechanism doesn't support gss_wrap_iov, in which case the data is
+ * untouched.
+ */
+static enum token_status
+sendv_wrap_iov(socket_type fd, gss_ctx_id_t ctx, int flags,
+               struct iovec *data, size_t count, time_t timeout,
+               OM_uint32 *major, OM_uint32 *minor)
+{
+    gss_iov_buffer_desc *gss_iov = NULL;
+    struct iovec *iov = NULL;
+    enum token_status status = TOKEN_FAIL_SYSTEM;
+    OM_uint32 tmp_minor;
+    size_t i, niov, nsend;
+    int state;
+
+    /* One each for the header, the padding, and the trailer. */
+    niov = count + 3;
+    gss_iov = calloc(niov, sizeof(gss_iov_buffer_desc));
+    iov = calloc(niov, sizeof(struct iovec));
+    if (gss_iov == NULL || iov == NULL)
+        goto done;
+    gss_iov[0].type =
+        GSS_IOV_BUFFER_TYPE_HEADER | GSS_IOV_BUFFER_FLAG_ALLOCATE;
+    for (i = 0; i < count; i++) {
+        gss_iov[i + 1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        gss_iov[i + 1].buffer.value = data[i].iov_base;
+        gss_iov[i + 1].buffer.length = data[i].iov_len;
+    }
+    gss_iov[count + 1].type
+        = GSS_IOV_BUFFER_TYPE_PADDING | GSS_IOV_BUFFER_FLAG_ALLOCATE;
+    gss_iov[count + 2].type
+        = GSS_IOV_BUFFER_TYPE_TRAILER | GSS_IOV_BUFFER_FLAG_ALLOCATE;
+    *major = gss_wrap_iov(minor, ctx, 1, GSS_C_QOP_DEFAULT, &state, gss_iov,
+                          niov);
+    if (*major != GSS_S_COMPLETE) {
+        status = TOKEN_FAIL_GSSAPI;
+        goto done;
+    }
+    for (nsend = 0, i = 0; i < niov; i++) {
+        if (gss_iov[i].buffer.length == 0)
+            continue;
+        iov[nsend].iov_base = gss_iov[i].buffer.value;
+        iov[nsend].iov_len = gss_iov[i].buffer.length;
+        nsend++;
+    }
+    status = token_sendv(fd, flags, iov, nsend, timeout);
+    gss_release_iov_buffer(&tmp_minor, gss_iov, niov);
+
+done:
+    free(gss_iov);
+    free(iov);
+    return status;
+}
+#endif /* HAVE_GSS_WRAP_IOV */
+
+
+/*
+ * Like token_send_priv, but the token data is the concatenation of an array
+ * of iovecs.  Where the GSS-API library supports it, the data is encrypted in
+ * place with gss_wrap_iov and sent without being copied, so the contents of
+ * the buffers are undefined after this call.  Otherwise, falls back on
+ * copying the data and calling token_send_priv.  The remctl v1 MIC hack is
+ * handled by always falling back.
+ */
+enum token_status
+token_sendv_priv(socket_type fd, gss_ctx_id_t ctx, int flags,
+                 struct iovec *data, size_t count, time_t timeout,
+                 OM_uint32 *major, OM_uint32 *minor)
+{
+    size_t length = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (data[i].iov_len > TOKEN_MAX_DATA_LARGE - length)
+            return TOKEN_FAIL_LARGE;
+        length += data[i].iov_len;
+    }
+#ifdef HAVE_GSS_WRAP_IOV
+    if (!(flags & TOKEN_SEND_MIC) || (flags & TOKEN_PROTOCOL)) {
+        enum token_status status;
+
+        status = sendv_wrap_iov(fd, ctx, flags, data, count, timeout, major,
+                                minor);
+        if (status != TOKEN_FAIL_GSSAPI || *major != GSS_S_UNAVAILABLE)
+            return status;
+    }
+#endif
+    return sendv_copy(fd, ctx, flags, data, count, length, timeout, major,
+                      minor);
+}
+
+
+/*
+ * Receives and unwraps a data payload token.  Takes the file descriptor, its
+ * read buffer (which may be NULL), the GSS-API context, a pointer into which
+ * to store the flags, a buffer for the message, and a place to put GSS-API
+ * major and minor status.  Returns TOKEN_OK on success or one of the
+ * TOKEN_FAIL_* statuses on failure.  On success, tok will contain newly
+ * allocated memory and should be freed when no longer needed using
+ * gss_release_buffer.  On failure, any allocated memory will be freed.
  *
  * As a hack to support remctl v1, look to see if the flags includes
  * TOKEN_SEND_MIC and do not include TOKEN_PROTOCOL.  If so, calculate a MIC
  * and send it back.
  */
 enum token_status
-token_recv_priv(socket_type fd, gss_ctx_id_t ctx, int *flags,
-                gss_buffer_t tok, size_t max, time_t timeout,
+token_recv_priv(socket_type fd, struct token_buffer *buffer, gss_ctx_id_t ctx,
+                int *flags, gss_buffer_t tok, size_t max, time_t timeout,
                 OM_uint32 *major, OM_uint32 *minor)
 {
     gss_buffer_desc in, mic;
     int state;
     enum token_status status;
 
-    status = token_recv(fd, flags, &in, max, timeout);
+    status = token_recv(fd, buffer, flags, &in, max, timeout);
     if (status != TOKEN_OK)
         return status;
     *major = gss_unwrap(minor, ctx, &in, tok, &state, NULL);
@@ -18,6 +18,9 @@
 #include <portable/socket.h>
 #include <util/tokens.h>
 
+/* Forward declarations to avoid unnecessary includes. */
+struct iovec;
+
 BEGIN_DECLS
 
 /* Default to a hidden visibility for all util functions. */
@@ -28,14 +31,23 @@ BEGIN_DECLS
  * not use gss_release_buffer to free the token returned by token_recv; this
  * will cause crashes on Windows.  Call free on the value member instead.  On
  * a GSS-API failure, the major and minor status are returned in the final two
- * arguments.
+ * arguments.  The read buffer for token_recv_priv may be NULL, as with
+ * token_recv.
+ *
+ * token_sendv_priv sends a token whose data is the concatenation of the
+ * provided iovecs.  It may encrypt that data in place, so the contents of the
+ * buffers are undefined afterwards.
  */
 enum token_status token_send_priv(socket_type, gss_ctx_id_t, int flags,
                                   gss_buffer_t, time_t, OM_uint32 *,
                                   OM_uint32 *);
-enum token_status token_recv_priv(socket_type, gss_ctx_id_t, int *flags,
-                                  gss_buffer_t, size_t max, time_t,
-                                  OM_uint32 *, OM_uint32 *);
+enum token_status token_sendv_priv(socket_type, gss_ctx_id_t, int flags,
+                                   struct iovec *, size_t count, time_t,
+                                   OM_uint32 *, OM_uint32 *);
+enum token_status token_recv_priv(socket_type, struct token_buffer *,
+                                  gss_ctx_id_t, int *flags, gss_buffer_t,
+                                  size_t max, time_t, OM_uint32 *,
+                                  OM_uint32 *);
 
 /* Undo default visibility change. */
 #pragma GCC visibility pop
@@ -46,10 +46,11 @@
 #include <config.h>
 #include <portable/system.h>
 #include <portable/socket.h>
+#include <portable/uio.h>
 
 #include <errno.h>
-#ifdef HAVE_SYS_SELECT_H
-# include <sys/select.h>
+#ifndef _WIN32
+# include <poll.h>
 #endif
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
@@ -57,6 +58,7 @@
 #include <time.h>
 
 #include <util/fdflag.h>
+#include <util/macros.h>
 #include <util/messages.h>
 #include <util/network.h>
 #include <util/xmalloc.h>
@@ -76,6 +78,11 @@
 # define network_set_reuseaddr(fd)      /* empty */
 #endif
 
+/* If SO_REUSEPORT isn't available, make calls to set_reuseport go away. */
+#ifndef SO_REUSEPORT
+# define network_set_reuseport(fd)      /* empty */
+#endif
+
 /* If IPV6_V6ONLY isn't available, make calls to set_v6only go away. */
 #ifndef IPV6_V6ONLY
 # define network_set_v6only(fd)         /* empty */
@@ -96,6 +103,33 @@
 # define socket_xwrite(fd, b, s)        xwrite((fd), (b), (s))
 #endif
 
+/*
+ * Windows calls poll WSAPoll but otherwise provides the same interface, and
+ * reports a non-blocking socket that isn't ready with a different error.
+ */
+#ifdef _WIN32
+# define poll(fds, n, timeout)          WSAPoll((fds), (n), (timeout))
+# define SOCKET_EAGAIN                  WSAEWOULDBLOCK
+#else
+# define SOCKET_EAGAIN                  EAGAIN
+#endif
+
+/*
+ * Read from a socket without blocking, even if the socket is in blocking
+ * mode.  Where MSG_DONTWAIT isn't available, this is emulated below with a
+ * zero-timeout poll.
+ */
+#ifdef MSG_DONTWAIT
+# define socket_read_nowait(fd, b, s)   recv((fd), (b), (s), MSG_DONTWAIT)
+#endif
+
+/*
+ * The number of listening sockets network_wait_any can handle without
+ * allocating memory.  This covers all normal uses (one socket per address
+ * family or per bind address).
+ */
+#define WAIT_ANY_STATIC 16
+
 /*
  * Windows requires a different errno code for a socket equivalent of EINVAL.
  * Use this macro to set the socket error to EINVAL.
@@ -107,6 +141,15 @@
 #endif
 
 
+/*
+ * Whether to set SO_REUSEPORT on sockets created by the network_bind_*
+ * functions.  Changed with network_bind_set_reuseport.
+ */
+#ifdef SO_REUSEPORT
+static bool bind_reuseport = false;
+#endif
+
+
 /*
  * Set SO_REUSEADDR on a socket if possible (so that something new can listen
  * on the same port immediately if the daemon dies unexpectedly).
@@ -124,6 +167,26 @@ network_set_reuseaddr(socket_type fd)
 #endif
 
 
+/*
+ * Set SO_REUSEPORT on a socket if requested via network_bind_set_reuseport.
+ * This allows several sockets to be bound to the same address and port, with
+ * the kernel distributing incoming connections between them.
+ */
+#ifdef SO_REUSEPORT
+static void
+network_set_reuseport(socket_type fd)
+{
+    int flag = 1;
+    const void *flagaddr = &flag;
+
+    if (!bind_reuseport)
+        return;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, flagaddr, sizeof(flag)) < 0)
+        syswarn("cannot mark bind port shareable");
+}
+#endif
+
+
 /*
  * Set IPV6_V6ONLY on a socket if possible, since the IPv6 behavior is more
  * consistent and easier to understand.
@@ -156,6 +219,27 @@ network_set_freebind(socket_type fd)
 #endif
 
 
+/*
+ * Set whether the network_bind_* functions should set SO_REUSEPORT on the
+ * sockets they create.  Returns false if SO_REUSEPORT isn't supported on this
+ * platform, in which case the setting is ignored.
+ */
+#ifdef SO_REUSEPORT
+bool
+network_bind_set_reuseport(bool flag)
+{
+    bind_reuseport = flag;
+    return true;
+}
+#else
+bool
+network_bind_set_reuseport(bool flag UNUSED)
+{
+    return false;
+}
+#endif
+
+
 /*
  * Create an IPv4 socket and bind it, returning the resulting file descriptor
  * (or INVALID_SOCKET on a failure).
@@ -174,6 +258,7 @@ network_bind_ipv4(int type, const char *address, unsigned short port)
         return INVALID_SOCKET;
     }
     network_set_reuseaddr(fd);
+    network_set_reuseport(fd);
 
     /* Accept "any" or "all" in the bind address to mean 0.0.0.0. */
     if (!strcmp(address, "any") || !strcmp(address, "all"))
@@ -227,6 +312,7 @@ network_bind_ipv6(int type, const char *address, unsigned short port)
         return INVALID_SOCKET;
     }
     network_set_reuseaddr(fd);
+    network_set_reuseport(fd);
 
     /*
      * Restrict the socket to IPv6 only if possible.  The default behavior is
@@ -388,7 +474,7 @@ network_bind_all_free(socket_type *fds)
 /*
  * Given an array of file descriptors and the length of that array (the same
  * data that's returned by network_bind_all), wait for an incoming connection
- * on any of those sockets and return the file descriptor that selects ready
+ * on any of those sockets and return the file descriptor that is ready
  * for read.
  *
  * This is primarily intended for UDP services listening on mutliple file
@@ -401,32 +487,38 @@ network_bind_all_free(socket_type *fds)
  * will be set to EINTR.
  *
  * This is not intended to be a replacement for a full event loop, just some
- * simple shared code for UDP services.
+ * simple shared code for UDP services.  It uses poll, so there is no limit on
+ * the file descriptor numbers, but it rebuilds the poll set on each call;
+ * daemons with many sockets or connections should use a real event loop.
  */
 socket_type
 network_wait_any(socket_type fds[], unsigned int count)
 {
-    fd_set readfds;
-    socket_type maxfd, fd;
+    struct pollfd static_pfds[WAIT_ANY_STATIC];
+    struct pollfd *pfds = static_pfds;
+    socket_type fd = INVALID_SOCKET;
     unsigned int i;
-    int status;
+    int status, oerrno;
 
-    FD_ZERO(&readfds);
-    maxfd = -1;
+    if (count > WAIT_ANY_STATIC)
+        pfds = xcalloc(count, sizeof(struct pollfd));
     for (i = 0; i < count; i++) {
-        FD_SET(fds[i], &readfds);
-        if (fds[i] > maxfd)
-            maxfd = fds[i];
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+    status = poll(pfds, count, -1);
+    if (status > 0)
+        for (i = 0; i < count; i++)
+            if (pfds[i].revents != 0) {
+                fd = fds[i];
+                break;
+            }
+    if (pfds != static_pfds) {
+        oerrno = socket_errno;
+        free(pfds);
+        socket_set_errno(oerrno);
     }
-    status = select(maxfd + 1, &readfds, NULL, NULL, NULL);
-    if (status < 0)
-        return INVALID_SOCKET;
-    fd = INVALID_SOCKET;
-    for (i = 0; i < count; i++)
-        if (FD_ISSET(fds[i], &readfds)) {
-            fd = fds[i];
-            break;
-        }
     return fd;
 }
 
@@ -504,6 +596,114 @@ network_source(socket_type fd, int family, const char *source)
 }
 
 
+/*
+ * Return the current time in milliseconds since some arbitrary point.  Use a
+ * monotonic clock if one is available so that timeouts aren't affected by
+ * changes to the system time.
+ */
+static int64_t
+network_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+#ifdef _WIN32
+    return (int64_t) GetTickCount64();
+#else
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+#endif
+}
+
+
+/*
+ * Convert a timeout in seconds into a deadline in the units returned by
+ * network_now.  A timeout of 0 means no deadline, represented by INT64_MAX.
+ */
+static int64_t
+network_deadline(time_t timeout)
+{
+    if (timeout == 0)
+        return INT64_MAX;
+    return network_now() + (int64_t) timeout * 1000;
+}
+
+
+/*
+ * Wait until the file descriptor is ready for the given poll events or the
+ * deadline passes, waiting forever if the deadline is INT64_MAX.  Retry if
+ * interrupted by a signal, recalculating the time remaining.  Returns true if
+ * the socket is ready (including if it has an error or the other end hung up,
+ * which the next read or write will report) and false on timeout or error,
+ * setting the socket errno.
+ */
+static bool
+network_wait(socket_type fd, short events, int64_t deadline)
+{
+    struct pollfd pfd;
+    int64_t remaining;
+    int status;
+
+    do {
+        if (deadline == INT64_MAX)
+            remaining = -1;
+        else {
+            remaining = deadline - network_now();
+            if (remaining <= 0) {
+                socket_set_errno(ETIMEDOUT);
+                return false;
+            }
+            if (remaining > INT_MAX)
+                remaining = INT_MAX;
+        }
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        status = poll(&pfd, 1, (int) remaining);
+    } while (status < 0 && socket_errno == EINTR);
+    if (status < 0)
+        return false;
+    if (status == 0) {
+        socket_set_errno(ETIMEDOUT);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Emulate a non-blocking read on systems without MSG_DONTWAIT by checking
+ * whether data is available first.
+ */
+#ifndef MSG_DONTWAIT
+static ssize_t
+socket_read_nowait(socket_type fd, void *buffer, size_t size)
+{
+    struct pollfd pfd;
+    int status;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    status = poll(&pfd, 1, 0);
+    if (status < 0)
+        return -1;
+    if (status == 0) {
+        socket_set_errno(SOCKET_EAGAIN);
+        return -1;
+    }
+    return socket_read(fd, buffer, size);
+}
+#endif
+
+
 /*
  * Internal helper function that waits for a non-blocking connect to complete
  * on a socket.  Takes the file descriptor and the timeout.  Returns 0 on a
@@ -515,37 +715,19 @@ connect_wait(socket_type fd, time_t timeout)
 {
     int status, err;
     socklen_t length;
-    struct timeval tv;
-    fd_set set;
 
     /*
-     * Use select to poll the file descriptor.  Loop if interrupted by a
-     * caught signal.  This means we could wait for longer than the timeout
-     * when interrupted, but there's no good way of recovering the elapsed
-     * time that's worth the hassle.
+     * Wait for the socket to become writable, which happens when the connect
+     * either completes or fails, and then retrieve the actual status from the
+     * socket.
      */
-    do {
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        status = select(fd + 1, NULL, &set, NULL, &tv);
-    } while (status < 0 && socket_errno == EINTR);
-
-    /*
-     * If we timed out, set errno appropriately.  If the connection completes,
-     * retrieve the actual status from the socket.
-     */
-    if (status == 0 && !FD_ISSET(fd, &set)) {
-        status = -1;
-        socket_set_errno(ETIMEDOUT);
-    } else if (status > 0 && FD_ISSET(fd, &set)) {
-        length = sizeof(err);
-        status = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &length);
-        if (status == 0) {
-            status = (err == 0) ? 0 : -1;
-            socket_set_errno(err);
-        }
+    if (!network_wait(fd, POLLOUT, network_deadline(timeout)))
+        return -1;
+    length = sizeof(err);
+    status = getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &err, &length);
+    if (status == 0) {
+        status = (err == 0) ? 0 : -1;
+        socket_set_errno(err);
     }
     return status;
 }
@@ -694,17 +876,16 @@ socket_xread(socket_type fd, void *buffer, size_t size)
 
 /*
  * Read the specified number of bytes from the network, enforcing a timeout
- * (in seconds).  We use select to wait for data to become available and then
- * keep reading until either we time out or we've gotten all the data we're
- * looking for.  timeout may be 0 to never time out.  Return true on success
- * and false (setting socket_errno) on failure.
+ * (in seconds) on the whole read.  We first try to read whatever data is
+ * already available without blocking and only wait with poll if there isn't
+ * enough, keeping going until either the monotonic deadline passes or we've
+ * gotten all the data we're looking for.  timeout may be 0 to never time out.
+ * Return true on success and false (setting socket_errno) on failure.
  */
 bool
 network_read(socket_type fd, void *buffer, size_t total, time_t timeout)
 {
-    time_t start, now;
-    fd_set set;
-    struct timeval tv;
+    int64_t deadline;
     size_t got = 0;
     ssize_t status;
 
@@ -712,62 +893,101 @@ network_read(socket_type fd, void *buffer, size_t total, time_t timeout)
     if (timeout == 0)
         return (socket_xread(fd, buffer, total) >= 0);
 
-    /*
-     * The hard way.  We try to apply the timeout on the whole read.  If
-     * either select or read fails with EINTR, restart the loop, and rely on
-     * the overall timeout to limit how long we wait without forward
-     * progress.
-     */
-    start = time(NULL);
-    now = start;
-    do {
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        tv.tv_sec = timeout - (now - start);
-        if (tv.tv_sec < 1)
-            tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        status = select(fd + 1, &set, NULL, NULL, &tv);
-        if (status < 0) {
-            if (socket_errno == EINTR)
-                continue;
-            return false;
+    /* The hard way.  Restart the read if it's interrupted by a signal. */
+    deadline = network_deadline(timeout);
+    while (got < total) {
+        status = socket_read_nowait(fd, (char *) buffer + got, total - got);
+        if (status > 0) {
+            got += status;
+            continue;
         } else if (status == 0) {
-            socket_set_errno(ETIMEDOUT);
+            socket_set_errno(EPIPE);
             return false;
         }
-        status = socket_read(fd, (char *) buffer + got, total - got);
-        if (status < 0) {
-            if (socket_errno == EINTR)
-                continue;
+        if (socket_errno == EINTR)
+            continue;
+        if (socket_errno != SOCKET_EAGAIN)
+            return false;
+        if (!network_wait(fd, POLLIN, deadline))
             return false;
+    }
+    return true;
+}
+
+
+/*
+ * Read at least min and at most max bytes from the network, enforcing a
+ * timeout (in seconds) on the whole read.  This is used to fill a buffer,
+ * taking whatever data is already available beyond the amount that's
+ * immediately needed so that later reads can be satisfied from the buffer.
+ * timeout may be 0 to never time out.  Returns the number of bytes read on
+ * success and -1 (setting socket_errno) on failure.
+ */
+ssize_t
+network_read_some(socket_type fd, void *buffer, size_t min, size_t max,
+                  time_t timeout)
+{
+    int64_t deadline;
+    size_t got = 0;
+    ssize_t status;
+
+    deadline = network_deadline(timeout);
+    while (got < min) {
+        if (timeout == 0)
+            status = socket_read(fd, (char *) buffer + got, max - got);
+        else
+            status = socket_read_nowait(fd, (char *) buffer + got, max - got);
+        if (status > 0) {
+            got += status;
+            continue;
         } else if (status == 0) {
             socket_set_errno(EPIPE);
-            return false;
+            return -1;
         }
-        got += status;
-        if (got == total)
-            return true;
-        now = time(NULL);
-    } while (now - start < timeout);
-    socket_set_errno(ETIMEDOUT);
-    return false;
+        if (socket_errno == EINTR)
+            continue;
+        if (socket_errno != SOCKET_EAGAIN)
+            return -1;
+        if (!network_wait(fd, POLLIN, deadline))
+            return -1;
+    }
+    return (ssize_t) got;
+}
+
+
+/*
+ * Return true if data can be read from a socket without waiting, including
+ * if the other end has closed the connection or there is an error, which
+ * the next read will report.
+ */
+bool
+network_readable(socket_type fd)
+{
+    struct pollfd pfd;
+    int status;
+
+    do {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        status = poll(&pfd, 1, 0);
+    } while (status < 0 && socket_errno == EINTR);
+    return (status > 0);
 }
 
 
 /*
  * Write the specified number of bytes from the network, enforcing a timeout
- * (in seconds).  We use select to wait for the socket to become available and
- * then keep reading until either we time out or we've sent all the data.
- * timeout may be 0 to never time out.  Return true on success and false
- * (setting socket_errno) on failure.
+ * (in seconds) on the whole write.  The socket is put into non-blocking mode
+ * and we write as much as we can, only waiting with poll when the socket
+ * buffer is full, until either the monotonic deadline passes or we've sent
+ * all the data.  timeout may be 0 to never time out.  Return true on success
+ * and false (setting socket_errno) on failure.
  */
 bool
 network_write(socket_type fd, const void *buffer, size_t total, time_t timeout)
 {
-    time_t start, now;
-    fd_set set;
-    struct timeval tv;
+    int64_t deadline;
     size_t sent = 0;
     ssize_t status;
     int err;
@@ -776,50 +996,118 @@ network_write(socket_type fd, const void *buffer, size_t total, time_t timeout)
     if (timeout == 0)
         return (socket_xwrite(fd, buffer, total) >= 0);
 
-    /* The hard way.  We try to apply the timeout on the whole write.  If
-     * either select or read fails with EINTR, restart the loop, and rely on
-     * the overall timeout to limit how long we wait without forward progress.
-     */
+    /* The hard way.  Restart the write if it's interrupted by a signal. */
     fdflag_nonblocking(fd, true);
-    start = time(NULL);
-    now = start;
-    do {
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        tv.tv_sec = timeout - (now - start);
-        if (tv.tv_sec < 1)
-            tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        status = select(fd + 1, NULL, &set, NULL, &tv);
-        if (status < 0) {
-            if (socket_errno == EINTR)
-                continue;
+    deadline = network_deadline(timeout);
+    while (sent < total) {
+        status = socket_write(fd, (const char *) buffer + sent, total - sent);
+        if (status >= 0) {
+            sent += status;
+            continue;
+        }
+        if (socket_errno == EINTR)
+            continue;
+        if (socket_errno != SOCKET_EAGAIN)
             goto fail;
-        } else if (status == 0) {
-            socket_set_errno(ETIMEDOUT);
+        if (!network_wait(fd, POLLOUT, deadline))
             goto fail;
+    }
+    fdflag_nonblocking(fd, false);
+    return true;
+
+fail:
+    err = socket_errno;
+    fdflag_nonblocking(fd, false);
+    socket_set_errno(err);
+    return false;
+}
+
+
+/*
+ * Like network_write, but write the data from an array of iovecs, with the
+ * same timeout handling.  This avoids having to copy data from several
+ * places into one buffer to send it in a single write.  Return true on
+ * success and false (setting socket_errno) on failure.
+ *
+ * Windows has no writev, so there we write each element in turn.
+ */
+#ifdef _WIN32
+bool
+network_writev(socket_type fd, const struct iovec iov[], int iovcnt,
+               time_t timeout)
+{
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        if (!network_write(fd, iov[i].iov_base, iov[i].iov_len, timeout))
+            return false;
+    return true;
+}
+#else
+bool
+network_writev(socket_type fd, const struct iovec iov[], int iovcnt,
+               time_t timeout)
+{
+    struct iovec *tmpiov;
+    int64_t deadline;
+    ssize_t status;
+    int i, err;
+
+    /* If there's no timeout, do this the easy way. */
+    if (timeout == 0)
+        return (xwritev(fd, iov, iovcnt) >= 0);
+
+    /*
+     * The hard way.  We need a copy of the iovecs so that we can adjust them
+     * after partial writes.
+     */
+    if (iovcnt <= 0)
+        return true;
+    tmpiov = calloc(iovcnt, sizeof(struct iovec));
+    if (tmpiov == NULL)
+        return false;
+    memcpy(tmpiov, iov, iovcnt * sizeof(struct iovec));
+    fdflag_nonblocking(fd, true);
+    deadline = network_deadline(timeout);
+    i = 0;
+    while (i < iovcnt) {
+        if (tmpiov[i].iov_len == 0) {
+            i++;
+            continue;
         }
-        status = socket_write(fd, (const char *) buffer + sent, total - sent);
+        status = writev(fd, tmpiov + i, iovcnt - i);
         if (status < 0) {
             if (socket_errno == EINTR)
                 continue;
-            goto fail;
+            if (socket_errno != SOCKET_EAGAIN)
+                goto fail;
+            if (!network_wait(fd, POLLOUT, deadline))
+                goto fail;
+            continue;
         }
-        sent += status;
-        if (sent == total) {
-            fdflag_nonblocking(fd, false);
-            return true;
+
+        /* Skip past the data that was written. */
+        while (i < iovcnt && (size_t) status >= tmpiov[i].iov_len) {
+            status -= tmpiov[i].iov_len;
+            i++;
+        }
+        if (i < iovcnt) {
+            tmpiov[i].iov_base = (char *) tmpiov[i].iov_base + status;
+            tmpiov[i].iov_len -= status;
         }
-        now = time(NULL);
-    } while (now - start < timeout);
-    socket_set_errno(ETIMEDOUT);
+    }
+    free(tmpiov);
+    fdflag_nonblocking(fd, false);
+    return true;
 
 fail:
     err = socket_errno;
+    free(tmpiov);
     fdflag_nonblocking(fd, false);
     socket_set_errno(err);
     return false;
 }
+#endif
 
 
 /*
@@ -38,6 +38,9 @@
 
 #include <sys/types.h>
 
+/* Forward declarations to avoid unnecessary includes. */
+struct iovec;
+
 BEGIN_DECLS
 
 /* Default to a hidden visibility for all util functions. */
@@ -54,6 +57,14 @@ socket_type network_bind_ipv4(int type, const char *addr, unsigned short port)
 socket_type network_bind_ipv6(int type, const char *addr, unsigned short port)
     __attribute__((__nonnull__));
 
+/*
+ * Set whether sockets created by the network_bind_* functions should have
+ * SO_REUSEPORT set, which lets several sockets bind the same address and port
+ * and have the kernel distribute incoming connections among them.  Returns
+ * false if SO_REUSEPORT isn't supported.
+ */
+bool network_bind_set_reuseport(bool);
+
 /*
  * Create and bind sockets of the given type for every local address (normally
  * two, one for IPv4 and one for IPv6, if IPv6 support is enabled).  If IPv6
@@ -137,6 +148,28 @@ bool network_read(socket_type, void *, size_t, time_t)
 bool network_write(socket_type, const void *, size_t, time_t)
     __attribute__((__nonnull__));
 
+/*
+ * Like network_write, but gathers the data to write from an array of iovecs.
+ */
+bool network_writev(socket_type, const struct iovec *, int, time_t)
+    __attribute__((__nonnull__));
+
+/*
+ * Read at least min and at most max bytes from the network, enforcing a
+ * timeout, for filling a buffer with whatever data is available.  Returns the
+ * number of bytes read on success and -1 on failure, with the socket errno
+ * set.
+ */
+ssize_t network_read_some(socket_type, void *, size_t min, size_t max,
+                          time_t)
+    __attribute__((__nonnull__));
+
+/*
+ * Returns true if data (or the end of the connection) can be read from the
+ * socket without waiting.
+ */
+bool network_readable(socket_type);
+
 /*
  * Put an ASCII representation of the address in a sockaddr into the provided
  * buffer, which should hold at least INET6_ADDRSTRLEN characters.
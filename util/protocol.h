@@ -19,6 +19,14 @@
 #define TOKEN_MAX_LENGTH        (1024 * 1024)
 #define TOKEN_MAX_DATA          (64 * 1024)
 
+/*
+ * In protocol version four, the client and server may agree on a larger
+ * maximum data payload for each token, up to TOKEN_MAX_DATA_LARGE.  Tokens
+ * can then be that much longer than TOKEN_MAX_LENGTH after encryption.
+ */
+#define TOKEN_MAX_DATA_LARGE    (4 * 1024 * 1024)
+#define TOKEN_MAX_LENGTH_FOR(d) (TOKEN_MAX_LENGTH + (d) - TOKEN_MAX_DATA)
+
 /*
  * Maximum data payload for a MESSAGE_OUTPUT message, which is TOKEN_MAX_DATA
  * minus the overhead for MESSAGE_OUTPUT labeling.  This is slightly different
@@ -27,17 +35,37 @@
 #define TOKEN_MAX_OUTPUT        (TOKEN_MAX_DATA - 1 - 1 - 1 - 4)
 #define TOKEN_MAX_OUTPUT_V1     (TOKEN_MAX_DATA - 4 - 4)
 
+/*
+ * In protocol version four, command and reply messages carry a request ID
+ * after the message type, leaving that much less room for output.
+ */
+#define TOKEN_MAX_OUTPUT_V4     (TOKEN_MAX_OUTPUT - 4)
+
 /* Message types. */
 enum message_types {
-    MESSAGE_COMMAND = 1,
-    MESSAGE_QUIT    = 2,
-    MESSAGE_OUTPUT  = 3,
-    MESSAGE_STATUS  = 4,
-    MESSAGE_ERROR   = 5,
-    MESSAGE_VERSION = 6,
-    MESSAGE_NOOP    = 7
+    MESSAGE_COMMAND           = 1,
+    MESSAGE_QUIT              = 2,
+    MESSAGE_OUTPUT            = 3,
+    MESSAGE_STATUS            = 4,
+    MESSAGE_ERROR             = 5,
+    MESSAGE_VERSION           = 6,
+    MESSAGE_NOOP              = 7,
+    MESSAGE_COMMAND_STREAM    = 8,    /* Protocol version four only. */
+    MESSAGE_STREAM_DATA       = 9,    /* Protocol version four only. */
+    MESSAGE_STREAM_END        = 10,   /* Protocol version four only. */
+    MESSAGE_OUTPUT_COMPRESSED = 11,   /* Protocol version four only. */
+    MESSAGE_CAPABILITIES      = 12    /* Protocol version four only. */
+};
+
+/* Optional features, agreed on with MESSAGE_CAPABILITIES. */
+enum capabilities {
+    CAPABILITY_REQUEST_ID     = (1 << 0), /* Commands tagged with IDs. */
+    CAPABILITY_FILTER         = (1 << 1)  /* MESSAGE_COMMAND_STREAM. */
 };
 
+/* All of the optional features this implementation supports. */
+#define CAPABILITIES_ALL (CAPABILITY_REQUEST_ID | CAPABILITY_FILTER)
+
 /* Windows uses this for something else. */
 #ifdef _WIN32
 # undef ERROR_BAD_COMMAND
@@ -54,7 +82,9 @@ enum error_codes {
     ERROR_TOOMANY_ARGS       = 7,  /* Argument count exceeds server limit. */
     ERROR_TOOMUCH_DATA       = 8,  /* Argument size exceeds server limit. */
     ERROR_UNEXPECTED_MESSAGE = 9,  /* Message type not valid now. */
-    ERROR_NO_HELP            = 10  /* No help defined for this command. */
+    ERROR_NO_HELP            = 10, /* No help defined for this command. */
+    ERROR_TIMEOUT            = 11, /* Command ran too long and was killed. */
+    ERROR_TOOMANY_RUNNING    = 12  /* Too many commands running at once. */
 };
 
 #endif /* UTIL_PROTOCOL_H */
@@ -17,6 +17,7 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
 #include <errno.h>
 #include <time.h>
@@ -24,7 +25,12 @@
 #include <util/messages.h>
 #include <util/network.h>
 #include <util/tokens.h>
-#include <util/xwrite.h>
+
+/* Size of the read buffer used by token_recv, allocated on first use. */
+#define TOKEN_BUFFER_SIZE (64 * 1024)
+
+/* Size of the token header (the flags and the length). */
+#define TOKEN_HEADER_SIZE (1 + sizeof(OM_uint32))
 
 
 /*
@@ -44,45 +50,181 @@ map_socket_error(int err)
 }
 
 
+/* Number of iovecs token_sendv can handle without allocating memory. */
+#define TOKEN_SENDV_STATIC 8
+
+
+/*
+ * Send a token to a file descriptor, gathering the token data from an array
+ * of iovecs.  The flags (a single byte, even though they're passed in as an
+ * integer) and the length are sent in the same write as the data, without
+ * copying the data.  Returns TOKEN_OK on success and TOKEN_FAIL_SYSTEM,
+ * TOKEN_FAIL_SOCKET, or TOKEN_FAIL_TIMEOUT on an error (including partial
+ * writes).
+ */
+enum token_status
+token_sendv(socket_type fd, int flags, const struct iovec *data,
+            size_t count, time_t timeout)
+{
+    struct iovec static_iov[TOKEN_SENDV_STATIC];
+    struct iovec *iov = static_iov;
+    unsigned char header[TOKEN_HEADER_SIZE];
+    size_t length = 0;
+    OM_uint32 len;
+    bool okay;
+    size_t i;
+
+    /* Build the header from the total length of the data. */
+    for (i = 0; i < count; i++) {
+        if (data[i].iov_len > SIZE_MAX - length) {
+            errno = ENOMEM;
+            return TOKEN_FAIL_SYSTEM;
+        }
+        length += data[i].iov_len;
+    }
+    header[0] = (unsigned char) flags;
+    len = htonl(length);
+    memcpy(header + 1, &len, sizeof(OM_uint32));
+
+    /* Send the header and the data in a single write. */
+    if (count >= TOKEN_SENDV_STATIC) {
+        iov = calloc(count + 1, sizeof(struct iovec));
+        if (iov == NULL)
+            return TOKEN_FAIL_SYSTEM;
+    }
+    iov[0].iov_base = (void *) header;
+    iov[0].iov_len = sizeof(header);
+    if (count > 0)
+        memcpy(iov + 1, data, count * sizeof(struct iovec));
+    okay = network_writev(fd, iov, count + 1, timeout);
+    if (iov != static_iov)
+        free(iov);
+    return okay ? TOKEN_OK : map_socket_error(socket_errno);
+}
+
+
 /*
  * Send a token to a file descriptor.  Takes the file descriptor, the token,
- * and the flags (a single byte, even though they're passed in as an integer)
- * and writes them to the file descriptor.  Returns TOKEN_OK on success and
- * TOKEN_FAIL_SYSTEM, TOKEN_FAIL_SOCKET, or TOKEN_FAIL_TIMEOUT on an error
- * (including partial writes).
+ * and the flags and writes them to the file descriptor.  Returns the same
+ * values as token_sendv.
  */
 enum token_status
 token_send(socket_type fd, int flags, gss_buffer_t tok, time_t timeout)
 {
-    size_t buflen;
-    char *buffer;
-    bool okay;
-    unsigned char char_flags = (unsigned char) flags;
-    OM_uint32 len = htonl(tok->length);
+    struct iovec iov;
 
-    /* Send out the whole message in a single write. */
-    if (tok->length > SIZE_MAX - 1 - sizeof(OM_uint32)) {
-        errno = ENOMEM;
-        return TOKEN_FAIL_SYSTEM;
+    iov.iov_base = tok->value;
+    iov.iov_len = tok->length;
+    return token_sendv(fd, flags, &iov, 1, timeout);
+}
+
+
+/*
+ * Discard any buffered data but keep the allocated memory for reuse.
+ */
+void
+token_buffer_reset(struct token_buffer *buffer)
+{
+    buffer->start = 0;
+    buffer->end = 0;
+}
+
+
+/*
+ * Free the memory used by a buffer, leaving it empty and ready for reuse.
+ */
+void
+token_buffer_free(struct token_buffer *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->start = 0;
+    buffer->end = 0;
+}
+
+
+/*
+ * Ensure that the buffer holds at least the given number of unread bytes,
+ * which must be no more than TOKEN_BUFFER_SIZE, reading as much data as is
+ * available from the socket to do so.  Returns TOKEN_OK or a failure code.
+ */
+static enum token_status
+buffer_fill(socket_type fd, struct token_buffer *buffer, size_t needed,
+            time_t timeout)
+{
+    size_t unread = buffer->end - buffer->start;
+    ssize_t status;
+
+    if (unread >= needed)
+        return TOKEN_OK;
+    if (buffer->data == NULL) {
+        buffer->data = malloc(TOKEN_BUFFER_SIZE);
+        if (buffer->data == NULL)
+            return TOKEN_FAIL_SYSTEM;
+        buffer->size = TOKEN_BUFFER_SIZE;
     }
-    buflen = 1 + sizeof(OM_uint32) + tok->length;
-    buffer = malloc(buflen);
-    if (buffer == NULL)
+    if (buffer->start > 0) {
+        memmove(buffer->data, buffer->data + buffer->start, unread);
+        buffer->start = 0;
+        buffer->end = unread;
+    }
+    status = network_read_some(fd, buffer->data + buffer->end,
+                               needed - unread, buffer->size - buffer->end,
+                               timeout);
+    if (status < 0)
+        return map_socket_error(socket_errno);
+    buffer->end += status;
+    return TOKEN_OK;
+}
+
+
+/*
+ * Receive a token from a file descriptor without buffering.  This does
+ * separate reads for the flags, the length, and the data, so it never reads
+ * past the end of the token.
+ */
+static enum token_status
+token_recv_direct(socket_type fd, int *flags, gss_buffer_t tok, size_t max,
+                  time_t timeout)
+{
+    OM_uint32 len;
+    unsigned char char_flags;
+    int err;
+
+    if (!network_read(fd, &char_flags, 1, timeout))
+        return map_socket_error(socket_errno);
+    *flags = char_flags;
+
+    if (!network_read(fd, &len, sizeof(OM_uint32), timeout))
+        return map_socket_error(socket_errno);
+    tok->length = ntohl(len);
+    if (tok->length > max)
+        return TOKEN_FAIL_LARGE;
+    if (tok->length == 0) {
+        tok->value = NULL;
+        return TOKEN_OK;
+    }
+
+    tok->value = malloc(tok->length);
+    if (tok->value == NULL)
         return TOKEN_FAIL_SYSTEM;
-    memcpy(buffer, &char_flags, 1);
-    memcpy(buffer + 1, &len, sizeof(OM_uint32));
-    memcpy(buffer + 1 + sizeof(OM_uint32), tok->value, tok->length);
-    okay = network_write(fd, buffer, buflen, timeout);
-    free(buffer);
-    return okay ? TOKEN_OK : map_socket_error(socket_errno);
+    if (!network_read(fd, tok->value, tok->length, timeout)) {
+        err = socket_errno;
+        free(tok->value);
+        socket_set_errno(err);
+        return map_socket_error(err);
+    }
+    return TOKEN_OK;
 }
 
 
 /*
- * Receive a token from a file descriptor.  Takes the file descriptor, a
- * buffer into which to store the token, a pointer into which to store the
- * flags, and the maximum token length we're willing to accept.  Returns
- * TOKEN_OK on success.  On failure, returns one of:
+ * Receive a token from a file descriptor.  Takes the file descriptor, the
+ * read buffer for that connection (or NULL), a buffer into which to store the
+ * token, a pointer into which to store the flags, and the maximum token
+ * length we're willing to accept.  Returns TOKEN_OK on success.  On failure,
+ * returns one of:
  *
  *     TOKEN_FAIL_SYSTEM       System call failed, errno set
  *     TOKEN_FAIL_SOCKET       Socket call failed, socket_errno set
@@ -97,23 +239,33 @@ token_send(socket_type fd, int flags, gss_buffer_t tok, time_t timeout)
  * recv_token reads the token flags (a single byte, even though they're stored
  * into an integer, then reads the token length (as a network long), allocates
  * memory to hold the data, and then reads the token data from the file
- * descriptor.  On a successful return, the value member of the token should
- * be freed with free().
+ * descriptor.  With a read buffer, the header and as much of the data as
+ * possible come from the buffer, which is refilled with everything available
+ * on the socket, and only the remainder of a token larger than the buffer is
+ * read directly.  On a successful return, the value member of the token
+ * should be freed with free().
  */
 enum token_status
-token_recv(socket_type fd, int *flags, gss_buffer_t tok, size_t max,
-           time_t timeout)
+token_recv(socket_type fd, struct token_buffer *buffer, int *flags,
+           gss_buffer_t tok, size_t max, time_t timeout)
 {
     OM_uint32 len;
     unsigned char char_flags;
+    size_t unread;
+    enum token_status status;
     int err;
 
-    if (!network_read(fd, &char_flags, 1, timeout))
-        return map_socket_error(socket_errno);
-    *flags = char_flags;
+    if (buffer == NULL)
+        return token_recv_direct(fd, flags, tok, max, timeout);
 
-    if (!network_read(fd, &len, sizeof(OM_uint32), timeout))
-        return map_socket_error(socket_errno);
+    /* Parse the header out of the buffer. */
+    status = buffer_fill(fd, buffer, TOKEN_HEADER_SIZE, timeout);
+    if (status != TOKEN_OK)
+        return status;
+    memcpy(&char_flags, buffer->data + buffer->start, 1);
+    memcpy(&len, buffer->data + buffer->start + 1, sizeof(OM_uint32));
+    buffer->start += TOKEN_HEADER_SIZE;
+    *flags = char_flags;
     tok->length = ntohl(len);
     if (tok->length > max)
         return TOKEN_FAIL_LARGE;
@@ -122,14 +274,34 @@ token_recv(socket_type fd, int *flags, gss_buffer_t tok, size_t max,
         return TOKEN_OK;
     }
 
+    /*
+     * If the whole token isn't already buffered and will fit in the buffer,
+     * fill the buffer.  Otherwise, take what we have and read the rest of the
+     * token directly.
+     */
+    if (tok->length <= TOKEN_BUFFER_SIZE) {
+        status = buffer_fill(fd, buffer, tok->length, timeout);
+        if (status != TOKEN_OK)
+            return status;
+    }
     tok->value = malloc(tok->length);
     if (tok->value == NULL)
         return TOKEN_FAIL_SYSTEM;
-    if (!network_read(fd, tok->value, tok->length, timeout)) {
-        err = socket_errno;
-        free(tok->value);
-        socket_set_errno(err);
-        return map_socket_error(err);
+    unread = buffer->end - buffer->start;
+    if (unread > tok->length)
+        unread = tok->length;
+    memcpy(tok->value, buffer->data + buffer->start, unread);
+    buffer->start += unread;
+    if (buffer->start == buffer->end)
+        token_buffer_reset(buffer);
+    if (unread < tok->length) {
+        if (!network_read(fd, (char *) tok->value + unread,
+                          tok->length - unread, timeout)) {
+            err = socket_errno;
+            free(tok->value);
+            socket_set_errno(err);
+            return map_socket_error(err);
+        }
     }
     return TOKEN_OK;
 }
@@ -18,6 +18,9 @@
 #include <portable/socket.h>
 #include <sys/types.h>
 
+/* Forward declarations to avoid unnecessary includes. */
+struct iovec;
+
 /* Token types and flags. */
 enum token_flags {
     TOKEN_NOOP          = (1 << 0),
@@ -41,6 +44,21 @@ enum token_status {
     TOKEN_FAIL_TIMEOUT = -7     /* Timeout sending or receiving token */
 };
 
+/*
+ * A read buffer for a connection.  token_recv fills this with as much data as
+ * is available from the socket and then returns tokens from it, so several
+ * small tokens can be received with a single read.  Embed one in the
+ * structure for each connection, initialized to all zeroes, and release it
+ * with token_buffer_free.  All reads from that connection must go through
+ * the same buffer.
+ */
+struct token_buffer {
+    char *data;                 /* Buffered data. */
+    size_t size;                /* Allocated size of data. */
+    size_t start;               /* Offset of first unread byte. */
+    size_t end;                 /* Offset just past the last unread byte. */
+};
+
 BEGIN_DECLS
 
 /* Default to a hidden visibility for all util functions. */
@@ -49,12 +67,24 @@ BEGIN_DECLS
 /*
  * Sending and receiving tokens.  Do not use gss_release_buffer to free the
  * token returned by token_recv; this will cause crashes on Windows.  Call
- * free on the value member instead.
+ * free on the value member instead.  The buffer passed to token_recv may be
+ * NULL to read exactly one token from the socket without buffering.
+ * token_sendv sends a single token whose data is the concatenation of the
+ * provided iovecs.
  */
 enum token_status token_send(socket_type, int flags, gss_buffer_t,
                              time_t timeout);
-enum token_status token_recv(socket_type, int *flags, gss_buffer_t,
-                             size_t max, time_t timeout);
+enum token_status token_sendv(socket_type, int flags, const struct iovec *,
+                              size_t count, time_t timeout);
+enum token_status token_recv(socket_type, struct token_buffer *, int *flags,
+                             gss_buffer_t, size_t max, time_t timeout);
+
+/*
+ * Discard any buffered data, for when the connection is closed or replaced,
+ * or discard the data and free the memory used by the buffer.
+ */
+void token_buffer_reset(struct token_buffer *);
+void token_buffer_free(struct token_buffer *);
 
 /* Undo default visibility change. */
 #pragma GCC visibility pop